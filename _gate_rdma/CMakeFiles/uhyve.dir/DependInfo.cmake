@@ -0,0 +1,27 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/main.c" "CMakeFiles/uhyve.dir/main.c.o" "gcc" "CMakeFiles/uhyve.dir/main.c.o.d"
+  "/root/repo/uhyve-aarch64.c" "CMakeFiles/uhyve.dir/uhyve-aarch64.c.o" "gcc" "CMakeFiles/uhyve.dir/uhyve-aarch64.c.o.d"
+  "/root/repo/uhyve-gdb.c" "CMakeFiles/uhyve.dir/uhyve-gdb.c.o" "gcc" "CMakeFiles/uhyve.dir/uhyve-gdb.c.o.d"
+  "/root/repo/uhyve-migration-rdma.c" "CMakeFiles/uhyve.dir/uhyve-migration-rdma.c.o" "gcc" "CMakeFiles/uhyve.dir/uhyve-migration-rdma.c.o.d"
+  "/root/repo/uhyve-migration.c" "CMakeFiles/uhyve.dir/uhyve-migration.c.o" "gcc" "CMakeFiles/uhyve.dir/uhyve-migration.c.o.d"
+  "/root/repo/uhyve-net.c" "CMakeFiles/uhyve.dir/uhyve-net.c.o" "gcc" "CMakeFiles/uhyve.dir/uhyve-net.c.o.d"
+  "/root/repo/uhyve-x86_64.c" "CMakeFiles/uhyve.dir/uhyve-x86_64.c.o" "gcc" "CMakeFiles/uhyve.dir/uhyve-x86_64.c.o.d"
+  "/root/repo/uhyve.c" "CMakeFiles/uhyve.dir/uhyve.c.o" "gcc" "CMakeFiles/uhyve.dir/uhyve.c.o.d"
+  "/root/repo/utils.c" "CMakeFiles/uhyve.dir/utils.c.o" "gcc" "CMakeFiles/uhyve.dir/utils.c.o.d"
+  )
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
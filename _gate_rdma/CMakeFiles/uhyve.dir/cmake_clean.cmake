@@ -0,0 +1,27 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/uhyve.dir/main.c.o"
+  "CMakeFiles/uhyve.dir/main.c.o.d"
+  "CMakeFiles/uhyve.dir/uhyve-aarch64.c.o"
+  "CMakeFiles/uhyve.dir/uhyve-aarch64.c.o.d"
+  "CMakeFiles/uhyve.dir/uhyve-gdb.c.o"
+  "CMakeFiles/uhyve.dir/uhyve-gdb.c.o.d"
+  "CMakeFiles/uhyve.dir/uhyve-migration-rdma.c.o"
+  "CMakeFiles/uhyve.dir/uhyve-migration-rdma.c.o.d"
+  "CMakeFiles/uhyve.dir/uhyve-migration.c.o"
+  "CMakeFiles/uhyve.dir/uhyve-migration.c.o.d"
+  "CMakeFiles/uhyve.dir/uhyve-net.c.o"
+  "CMakeFiles/uhyve.dir/uhyve-net.c.o.d"
+  "CMakeFiles/uhyve.dir/uhyve-x86_64.c.o"
+  "CMakeFiles/uhyve.dir/uhyve-x86_64.c.o.d"
+  "CMakeFiles/uhyve.dir/uhyve.c.o"
+  "CMakeFiles/uhyve.dir/uhyve.c.o.d"
+  "CMakeFiles/uhyve.dir/utils.c.o"
+  "CMakeFiles/uhyve.dir/utils.c.o.d"
+  "uhyve"
+  "uhyve.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang C)
+  include(CMakeFiles/uhyve.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -30,7 +30,6 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <linux/tcp.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <sched.h>
@@ -112,38 +111,202 @@ static int env_init(char *path)
 	return uhyve_init(path);
 }
 
+/* initial and maximal size of the buffers of the syscall channel */
+#define PROXY_BUF_SIZE	(64 * 1024)
+#define PROXY_BUF_MAX	(16 * 1024 * 1024)
+/* larger payloads bypass the buffers */
+#define PROXY_MSG_MAX	(PROXY_BUF_MAX / 2)
+
+/*
+ * Reusable buffer of the syscall channel, the bytes between head and
+ * tail are received but not yet parsed (or not yet sent).
+ */
+typedef struct {
+	char* data;
+	size_t size;
+	size_t head;
+	size_t tail;
+} proxy_buf_t;
+
+/* Makes room for len bytes behind tail */
+static int proxy_reserve(proxy_buf_t* b, size_t len)
+{
+	// move the pending bytes to the front
+	if (b->head) {
+		memmove(b->data, b->data + b->head, b->tail - b->head);
+		b->tail -= b->head;
+		b->head = 0;
+	}
+
+	if (len > PROXY_BUF_MAX - b->tail) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (b->size - b->tail < len) {
+		size_t size = b->size ? b->size : PROXY_BUF_SIZE;
+		char* data;
+
+		while (size - b->tail < len)
+			size = (size > PROXY_BUF_MAX / 2) ? PROXY_BUF_MAX : size * 2;
+
+		data = realloc(b->data, size);
+		if (!data) {
+			fprintf(stderr, "Uhyve: not enough memory\n");
+			return -1;
+		}
+		b->data = data;
+		b->size = size;
+	}
+
+	return 0;
+}
+
+/* Sends the collected replies */
+static int proxy_flush(int s, proxy_buf_t* tx)
+{
+	while (tx->head < tx->tail) {
+		ssize_t sret = write(s, tx->data + tx->head, tx->tail - tx->head);
+		if (sret < 0)
+			return -1;
+		tx->head += sret;
+	}
+
+	tx->head = tx->tail = 0;
+
+	return 0;
+}
+
+/*
+ * Returns the next len bytes of the channel. The pointer is valid
+ * until the next call. Receives as much as possible at once, the
+ * replies are sent before waiting for further requests.
+ */
+static void* proxy_get(int s, proxy_buf_t* rx, proxy_buf_t* tx, size_t len)
+{
+	void* ptr;
+
+	if (rx->tail - rx->head < len) {
+		if (proxy_reserve(rx, len - (rx->tail - rx->head)) < 0)
+			return NULL;
+
+		while (rx->tail - rx->head < len) {
+			ssize_t sret;
+
+			if (proxy_flush(s, tx) < 0)
+				return NULL;
+
+			sret = recv(s, rx->data + rx->tail, rx->size - rx->tail, 0);
+			if (sret == 0)
+				errno = ECONNRESET;
+			if (sret <= 0)
+				return NULL;
+			rx->tail += sret;
+		}
+	}
+
+	ptr = rx->data + rx->head;
+	rx->head += len;
+
+	return ptr;
+}
+
+/*
+ * Unbuffered fallback for payloads larger than PROXY_MSG_MAX, copies
+ * the next len bytes of the channel to dst.
+ */
+static int proxy_get_direct(int s, proxy_buf_t* rx, proxy_buf_t* tx, char* dst, size_t len)
+{
+	size_t j = rx->tail - rx->head;
+
+	if (j > len)
+		j = len;
+	if (j) {
+		memcpy(dst, rx->data + rx->head, j);
+		rx->head += j;
+	}
+
+	if ((j < len) && (proxy_flush(s, tx) < 0))
+		return -1;
+
+	while (j < len) {
+		ssize_t sret = read(s, dst+j, len-j);
+		if (sret == 0)
+			errno = ECONNRESET;
+		if (sret <= 0)
+			return -1;
+		j += sret;
+	}
+
+	return 0;
+}
+
+/* Unbuffered fallback, which sends len bytes behind the pending replies */
+static int proxy_send_direct(int s, proxy_buf_t* tx, const void* data, size_t len)
+{
+	size_t j = 0;
+
+	if (proxy_flush(s, tx) < 0)
+		return -1;
+
+	while (j < len) {
+		ssize_t sret = write(s, (const char*) data + j, len - j);
+		if (sret < 0)
+			return -1;
+		j += sret;
+	}
+
+	return 0;
+}
+
+/* Queues a reply of len bytes, a full buffer is sent first */
+static int proxy_put(int s, proxy_buf_t* tx, const void* data, size_t len)
+{
+	if ((len > PROXY_BUF_MAX - tx->tail) && (proxy_flush(s, tx) < 0))
+		return -1;
+	if (proxy_reserve(tx, len) < 0)
+		return -1;
+
+	memcpy(tx->data + tx->tail, data, len);
+	tx->tail += len;
+
+	return 0;
+}
+
 /*
  * in principle, HermitCore forwards basic system calls to
  * this hypervisor, which mapped these call to Linux system calls.
+ *
+ * The requests are parsed from a reusable receive buffer and the
+ * replies are collected in a send buffer, which is flushed once all
+ * received requests are handled.
  */
 int handle_syscalls(int s)
 {
+	static proxy_buf_t rx, tx;
+	char* buff = NULL;
 	int sysnr;
-	ssize_t sret;
-	size_t j;
+	ssize_t sret = 0;
+	char* msg;
 
 	while(1)
 	{
-		j = 0;
-		while(j < sizeof(sysnr)) {
-			sret = read(s, ((char*)&sysnr)+j, sizeof(sysnr)-j);
-			if (sret < 0)
-				goto out;
-			j += sret;
-		}
+		msg = proxy_get(s, &rx, &tx, sizeof(sysnr));
+		if (!msg)
+			goto out;
+		memcpy(&sysnr, msg, sizeof(sysnr));
 
 		switch(sysnr)
 		{
 		case __HERMIT_exit: {
 			int arg = 0;
 
-			j = 0;
-			while(j < sizeof(arg)) {
-				sret = read(s, ((char*)&arg)+j, sizeof(arg)-j);
-				if (sret < 0)
-					goto out;
-				j += sret;
-			}
+			msg = proxy_get(s, &rx, &tx, sizeof(arg));
+			if (!msg)
+				goto out;
+			memcpy(&arg, msg, sizeof(arg));
+
+			proxy_flush(s, &tx);
 			close(s);
 
 			if (arg == -14)
@@ -153,55 +316,39 @@ int handle_syscalls(int s)
 		}
 		case __HERMIT_write: {
 			int fd;
-			size_t len;
-			char* buff;
+			size_t len, j;
 
-			j = 0;
-			while (j < sizeof(fd)) {
-				sret = read(s, ((char*)&fd)+j, sizeof(fd)-j);
-				if (sret < 0)
+			msg = proxy_get(s, &rx, &tx, sizeof(fd) + sizeof(len));
+			if (!msg)
+				goto out;
+			memcpy(&fd, msg, sizeof(fd));
+			memcpy(&len, msg + sizeof(fd), sizeof(len));
+
+			// the payload is written directly from the receive buffer
+			if (len > PROXY_MSG_MAX) {
+				buff = malloc(len);
+				if (!buff) {
+					fprintf(stderr, "Uhyve: not enough memory\n");
 					goto out;
-				j += sret;
-			}
-
-			j = 0;
-			while (j < sizeof(len)) {
-				sret = read(s, ((char*)&len)+j, sizeof(len)-j);
-				if (sret < 0)
+				}
+				if (proxy_get_direct(s, &rx, &tx, buff, len) < 0)
 					goto out;
-				j += sret;
-			}
-
-			buff = malloc(len);
-			if (!buff) {
-				fprintf(stderr,"Uhyve: not enough memory");
-				return 1;
-			}
-
-			j=0;
-			while(j < len)
-			{
-				sret = read(s, buff+j, len-j);
-				if (sret < 0)
+				msg = buff;
+			} else {
+				msg = proxy_get(s, &rx, &tx, len);
+				if (!msg)
 					goto out;
-				j += sret;
 			}
 
 			if (fd > 2) {
-				sret = write(fd, buff, len);
-				j = 0;
-				while(j < sizeof(sret))
-				{
-					int l = write(s, ((char*)&sret)+j, sizeof(sret)-j);
-					if (l < 0)
-						goto out;
-					j += l;
-				}
+				sret = write(fd, msg, len);
+				if (proxy_put(s, &tx, &sret, sizeof(sret)) < 0)
+					goto out;
 			} else {
 				j = 0;
 				while(j < len)
 				{
-					sret = write(fd, buff+j, len-j);
+					sret = write(fd, msg+j, len-j);
 					if (sret < 0)
 						goto out;
 					j += sret;
@@ -209,198 +356,108 @@ int handle_syscalls(int s)
 			}
 
 			free(buff);
+			buff = NULL;
 			break;
 		}
 		case __HERMIT_open: {
 			size_t len;
-			char* fname;
 			int flags, mode, ret;
 
-			j = 0;
-			while (j < sizeof(len))
-			{
-				sret = read(s, ((char*)&len)+j, sizeof(len)-j);
-				if (sret < 0)
-					goto out;
-				j += sret;
-			}
-
-			fname = malloc(len);
-			if (!fname)
+			msg = proxy_get(s, &rx, &tx, sizeof(len));
+			if (!msg)
 				goto out;
+			memcpy(&len, msg, sizeof(len));
 
-			j = 0;
-			while (j < len)
-			{
-				sret = read(s, fname+j, len-j);
-				if (sret < 0)
-					goto out;
-				j += sret;
-			}
-
-			j = 0;
-			while (j < sizeof(flags))
-			{
-				sret = read(s, ((char*)&flags)+j, sizeof(flags)-j);
-				if (sret < 0)
-					goto out;
-				j += sret;
-			}
+			if (!len || (len > PROXY_MSG_MAX))
+				goto out;
 
-			j = 0;
-			while (j < sizeof(mode))
-			{
-				sret = read(s, ((char*)&mode)+j, sizeof(mode)-j);
-				if (sret < 0)
-					goto out;
-				j += sret;
-			}
+			// file name, flags and mode are parsed at once
+			msg = proxy_get(s, &rx, &tx, len + sizeof(flags) + sizeof(mode));
+			if (!msg)
+				goto out;
+			memcpy(&flags, msg + len, sizeof(flags));
+			memcpy(&mode, msg + len + sizeof(flags), sizeof(mode));
+			msg[len-1] = '\0';
 
 			//printf("flags 0x%x, mode 0x%x\n", flags, mode);
 
-			ret = open(fname, flags, mode);
-			j = 0;
-			while(j < sizeof(ret))
-			{
-				sret = write(s, ((char*)&ret)+j, sizeof(ret)-j);
-				if (sret < 0)
-					goto out;
-				j += sret;
-			}
-
-			free(fname);
+			ret = open(msg, flags, mode);
+			if (proxy_put(s, &tx, &ret, sizeof(ret)) < 0)
+				goto out;
 			break;
 		}
 		case __HERMIT_close: {
 			int fd, ret;
 
-			j = 0;
-			while(j < sizeof(fd))
-			{
-				sret = read(s, ((char*)&fd)+j, sizeof(fd)-j);
-				if (sret < 0)
-					goto out;
-				j += sret;
-			}
+			msg = proxy_get(s, &rx, &tx, sizeof(fd));
+			if (!msg)
+				goto out;
+			memcpy(&fd, msg, sizeof(fd));
 
 			if (fd > 2)
 				ret = close(fd);
 			else
 				ret = 0;
 
-			j = 0;
-			while (j < sizeof(ret))
-			{
-				sret = write(s, ((char*)&ret)+j, sizeof(ret)-j);
-				if (sret < 0)
-					goto out;
-				j += sret;
-			}
+			if (proxy_put(s, &tx, &ret, sizeof(ret)) < 0)
+				goto out;
 			break;
 		}
 		case __HERMIT_read: {
-			int fd, flag;
+			int fd;
 			size_t len;
 			ssize_t sj;
-			char* buff;
 
-			j = 0;
-			while(j < sizeof(fd))
-			{
-				sret = read(s, ((char*)&fd)+j, sizeof(fd)-j);
-				if (sret < 0)
-					goto out;
-				j += sret;
-			}
-
-			j = 0;
-			while(j < sizeof(len))
-			{
-				sret = read(s, ((char*)&len)+j, sizeof(len)-j);
-				if (sret < 0)
-					goto out;
-				j += sret;
-			}
-
-			buff = malloc(len);
-			if (!buff)
+			msg = proxy_get(s, &rx, &tx, sizeof(fd) + sizeof(len));
+			if (!msg)
 				goto out;
+			memcpy(&fd, msg, sizeof(fd));
+			memcpy(&len, msg + sizeof(fd), sizeof(len));
 
-			sj = read(fd, buff, len);
-
-			flag = 0;
-			setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
-
-			j = 0;
-			while (j < sizeof(sj))
-			{
-				sret = write(s, ((char*)&sj)+j, sizeof(sj)-j);
-				if (sret < 0)
+			if (len > PROXY_MSG_MAX) {
+				buff = malloc(len);
+				if (!buff) {
+					fprintf(stderr, "Uhyve: not enough memory\n");
 					goto out;
-				j += sret;
-			}
-
-			if (sj > 0)
-			{
-				size_t i = 0;
+				}
 
-				while (i < sj)
-				{
-					sret = write(s, buff+i, sj-i);
-					if (sret < 0)
-						goto out;
+				sj = read(fd, buff, len);
+				if (proxy_send_direct(s, &tx, &sj, sizeof(sj)) < 0)
+					goto out;
+				if ((sj > 0) && (proxy_send_direct(s, &tx, buff, sj) < 0))
+					goto out;
 
-					i += sret;
-				}
+				free(buff);
+				buff = NULL;
+				break;
 			}
 
-			flag = 1;
-			setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int));
+			// the file is read directly behind the length of the reply
+			if ((sizeof(sj) + len > PROXY_BUF_MAX - tx.tail) && (proxy_flush(s, &tx) < 0))
+				goto out;
+			if (proxy_reserve(&tx, sizeof(sj) + len) < 0)
+				goto out;
 
-			free(buff);
+			sj = read(fd, tx.data + tx.tail + sizeof(sj), len);
+			memcpy(tx.data + tx.tail, &sj, sizeof(sj));
+			tx.tail += sizeof(sj) + (sj > 0 ? sj : 0);
 			break;
 		}
 		case __HERMIT_lseek: {
 			int fd, whence;
 			off_t offset;
 
-			j = 0;
-			while (j < sizeof(fd))
-			{
-				sret = read(s, ((char*)&fd)+j, sizeof(fd)-j);
-				if (sret < 0)
-					goto out;
-				j += sret;
-			}
-
-			j = 0;
-			while (j < sizeof(offset))
-			{
-				sret = read(s, ((char*)&offset)+j, sizeof(offset)-j);
-				if (sret < 0)
-					goto out;
-				j += sret;
-			}
-
-			j = 0;
-			while (j < sizeof(whence))
-			{
-				sret = read(s, ((char*)&whence)+j, sizeof(whence)-j);
-				if (sret < 0)
-					goto out;
-				j += sret;
-			}
+			msg = proxy_get(s, &rx, &tx, sizeof(fd) + sizeof(offset) + sizeof(whence));
+			if (!msg)
+				goto out;
+			memcpy(&fd, msg, sizeof(fd));
+			memcpy(&offset, msg + sizeof(fd), sizeof(offset));
+			memcpy(&whence, msg + sizeof(fd) + sizeof(offset), sizeof(whence));
 
 			offset = lseek(fd, offset, whence);
 
-			j = 0;
-			while (j < sizeof(offset))
-			{
-				sret = write(s, ((char*)&offset)+j, sizeof(offset)-j);
-				if (sret < 0)
-					goto out;
-				j += sret;
-			}
+			if (proxy_put(s, &tx, &offset, sizeof(offset)) < 0)
+				goto out;
 			break;
 		}
 		default:
@@ -413,6 +470,7 @@ int handle_syscalls(int s)
 
 out:
 	perror("Uhyve -- communication error");
+	free(buff);
 
 	return 1;
 }
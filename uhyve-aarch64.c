@@ -29,6 +29,7 @@
 
 #define _GNU_SOURCE
 
+#include <assert.h>
 #include <elf.h>
 #include <err.h>
 #include <errno.h>
@@ -55,9 +56,17 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include "uhyve-aio.h"
+#include "uhyve-checkpoint.h"
 #include "uhyve-common.h"
+#include "uhyve-dirty-log.h"
+#include "uhyve-mem.h"
+#include "uhyve-migration.h"
+#include "uhyve-stats.h"
 #include "uhyve.h"
 
+#define MAX_FNAME		256
+
 #define GUEST_OFFSET		0x0
 
 #define GIC_SPI_IRQ_BASE	32
@@ -67,6 +76,19 @@
 #define GICD_SIZE		0x10000ULL
 #define GICC_SIZE		0x20000ULL
 
+/* register offsets of the distributor and the CPU interface of a GICv2 */
+#define GICD_REGS_SIZE		0x1000
+#define GICC_REGS_SIZE		0x100
+#define GICD_ICENABLER		0x180
+#define GICD_ISPENDR		0x200
+#define GICD_ICPENDR		0x280
+#define GICD_ISACTIVER		0x300
+#define GICD_ICACTIVER		0x380
+#define GICD_IPRIORITYR		0x400
+#define GICD_SGIR		0xF00
+#define GICD_CPENDSGIR		0xF10
+#define GICD_SPENDSGIR		0xF20
+
 #define KVM_GAP_SIZE		(GIC_SIZE)
 #define KVM_GAP_START		GICD_BASE
 
@@ -97,9 +119,15 @@ static uint64_t static_mem_size = 0;
 static uint64_t static_mem_start = 0;
 
 extern size_t guest_size;
+extern pthread_barrier_t barrier;
+extern pthread_barrier_t migration_barrier;
+extern pthread_t* vcpu_threads;
 extern uint64_t elf_entry;
 extern uint8_t* klog;
 extern bool verbose;
+extern bool full_checkpoint;
+extern uint32_t no_checkpoint;
+extern uint32_t chk_base;
 extern uint32_t ncores;
 extern uint8_t* guest_mem;
 extern size_t guest_size;
@@ -109,6 +137,10 @@ extern __thread struct kvm_run *run;
 extern __thread int vcpufd;
 extern __thread uint32_t cpuid;
 
+extern vcpu_state_t *vcpu_thread_states;
+extern mem_mappings_t mem_mappings;
+extern mem_mappings_t guest_physical_memory;
+
 /* Walk the guest page table to translate a guest virtual into a guest physical
  * address. This works only for 4KB granule and 4KB pages */
 uint64_t aarch64_virt_to_phys(uint64_t vaddr) {
@@ -189,6 +221,17 @@ void virt_to_phys(
 	virt_to_phys_for_table(virtual_address, physical_address, physical_address_page_end, pl0, 3);
 }
 
+void virt_to_phys_flush(void)
+{
+	/* translations are not cached on aarch64 */
+}
+
+void walk_guest_mappings(uint64_t root, void (*handler)(uint64_t virt, uint64_t phys, uint64_t size, void* arg), void* arg)
+{
+	/* the page tables are not walked, the guest memory is reported as identity mapped */
+	handler(0, 0, guest_size, arg);
+}
+
 void print_registers(void)
 {
 	struct kvm_one_reg reg;
@@ -232,7 +275,611 @@ void print_registers(void)
 }
 
 
-vcpu_state_t read_cpu_state()
+static void init_vcpu(void)
+{
+	struct kvm_vcpu_init vcpu_init = {
+		.features = 0,
+	};
+	struct kvm_vcpu_init preferred_init;
+
+	if (!ioctl(vmfd, KVM_ARM_PREFERRED_TARGET, &preferred_init)) {
+		if ((preferred_init.target == KVM_ARM_TARGET_CORTEX_A57) ||
+		    (preferred_init.target == KVM_ARM_TARGET_CORTEX_A53)) {
+			vcpu_init.target = preferred_init.target;
+		} else {
+			vcpu_init.target = KVM_ARM_TARGET_GENERIC_V8;
+		}
+	} else {
+		vcpu_init.target = KVM_ARM_TARGET_GENERIC_V8;
+	}
+
+	kvm_ioctl(vcpufd, KVM_ARM_VCPU_INIT, &vcpu_init);
+}
+
+/* the vGIC is initialized once, after all vCPUs are created */
+static pthread_once_t vgic_once = PTHREAD_ONCE_INIT;
+
+static void init_vgic(void)
+{
+	if (gic_fd <= 0)
+		return;
+
+	int lines = 1;
+	uint32_t nr_irqs = lines * 32 + GIC_SPI_IRQ_BASE;
+	struct kvm_device_attr nr_irqs_attr = {
+		.group	= KVM_DEV_ARM_VGIC_GRP_NR_IRQS,
+		.addr	= (uint64_t)&nr_irqs,
+	};
+	struct kvm_device_attr vgic_init_attr = {
+		.group	= KVM_DEV_ARM_VGIC_GRP_CTRL,
+		.attr	= KVM_DEV_ARM_VGIC_CTRL_INIT,
+	};
+
+	kvm_ioctl(gic_fd, KVM_SET_DEVICE_ATTR, &nr_irqs_attr);
+	kvm_ioctl(gic_fd, KVM_SET_DEVICE_ATTR, &vgic_init_attr);
+}
+
+#ifdef __AARCH64_CHECKPOINT__
+/* Returns the size of a register in bytes */
+static inline size_t reg_size(uint64_t id)
+{
+	return 1UL << ((id & KVM_REG_SIZE_MASK) >> KVM_REG_SIZE_SHIFT);
+}
+
+/* Returns the list of registers, which KVM is able to save for the vCPU */
+static struct kvm_reg_list* get_reg_list(void)
+{
+	struct kvm_reg_list probe = { .n = 0 };
+
+	// the first call fails with E2BIG and returns the number of registers
+	if ((ioctl(vcpufd, KVM_GET_REG_LIST, &probe) == -1) && (errno != E2BIG))
+		err(1, "KVM: ioctl KVM_GET_REG_LIST failed");
+
+	struct kvm_reg_list* list = (struct kvm_reg_list*) malloc(sizeof(struct kvm_reg_list) + probe.n * sizeof(uint64_t));
+	if (!list)
+		err(1, "Not enough memory");
+
+	list->n = probe.n;
+	kvm_ioctl(vcpufd, KVM_GET_REG_LIST, list);
+
+	return list;
+}
+
+/* Returns true for the distributor registers, which a restore has to skip */
+static bool vgic_dist_skipped(uint32_t offset)
+{
+	// a new vGIC starts cleared, the clear registers would reset the set ones
+	if ((offset >= GICD_ICENABLER) && (offset < GICD_ISPENDR))
+		return true;
+	if ((offset >= GICD_ICPENDR) && (offset < GICD_ISACTIVER))
+		return true;
+	if ((offset >= GICD_ICACTIVER) && (offset < GICD_IPRIORITYR))
+		return true;
+	if ((offset >= GICD_CPENDSGIR) && (offset < GICD_SPENDSGIR))
+		return true;
+
+	// a write to GICD_SGIR raises a software generated interrupt
+	return offset == GICD_SGIR;
+}
+
+/* Accesses a vGIC register with the banked view of the calling vCPU */
+static int vgic_access(uint32_t group, uint32_t offset, uint32_t* value, bool write)
+{
+	struct kvm_device_attr attr = {
+		.group	= group,
+		.attr	= ((uint64_t) cpuid << KVM_DEV_ARM_VGIC_CPUID_SHIFT) | offset,
+		.addr	= (uint64_t) value,
+	};
+
+	return ioctl(gic_fd, write ? KVM_SET_DEVICE_ATTR : KVM_GET_DEVICE_ATTR, &attr);
+}
+
+static void save_vgic_state(vcpu_state_t* state)
+{
+	state->nvgic_regs = 0;
+	if (gic_fd <= 0)
+		return;
+
+	// KVM rejects the offsets, which the vGIC does not implement
+	for(uint32_t offset = 0; offset < GICD_REGS_SIZE; offset += sizeof(uint32_t)) {
+		vgic_reg_t* reg = state->vgic_regs + state->nvgic_regs;
+
+		if (vgic_dist_skipped(offset))
+			continue;
+
+		reg->group = KVM_DEV_ARM_VGIC_GRP_DIST_REGS;
+		reg->offset = offset;
+		if (vgic_access(reg->group, reg->offset, &reg->value, false) == 0)
+			state->nvgic_regs++;
+	}
+
+	for(uint32_t offset = 0; offset < GICC_REGS_SIZE; offset += sizeof(uint32_t)) {
+		vgic_reg_t* reg = state->vgic_regs + state->nvgic_regs;
+
+		reg->group = KVM_DEV_ARM_VGIC_GRP_CPU_REGS;
+		reg->offset = offset;
+		if (vgic_access(reg->group, reg->offset, &reg->value, false) == 0)
+			state->nvgic_regs++;
+	}
+}
+
+static void restore_vgic_state(const vcpu_state_t* state)
+{
+	if (gic_fd <= 0)
+		return;
+
+	// in reverse order, the control registers enable the vGIC at last
+	for(uint32_t i = state->nvgic_regs; i > 0; i--) {
+		vgic_reg_t reg = state->vgic_regs[i-1];
+
+		if (vgic_access(reg.group, reg.offset, &reg.value, true) < 0)
+			fprintf(stderr, "[WARNING] Unable to restore vGIC register 0x%x (group %u) of vCPU %u - %d (%s)\n",
+				reg.offset, reg.group, cpuid, errno, strerror(errno));
+	}
+}
+
+vcpu_state_t read_cpu_state(void)
+{
+	vcpu_state_t cpu_state;
+	char fname[MAX_FNAME];
+	snprintf(fname, MAX_FNAME, "checkpoint/chk%u_core%u.dat", no_checkpoint, cpuid);
+
+	FILE* f = fopen(fname, "r");
+	if (f == NULL)
+		err(1, "fopen: unable to open file");
+
+	if (fread(&cpu_state, sizeof(cpu_state), 1, f) != 1)
+		err(1, "fread failed\n");
+
+	fclose(f);
+
+	return cpu_state;
+}
+
+void restore_cpu_state(vcpu_state_t cpu_state)
+{
+	init_vcpu();
+	pthread_once(&vgic_once, init_vgic);
+
+	for(uint32_t i = 0; i < cpu_state.nregs; i++) {
+		struct kvm_one_reg reg = {
+			.id = cpu_state.regs[i].id,
+			.addr = (uint64_t) cpu_state.regs[i].data,
+		};
+
+		// e.g. the invariant ID registers differ between the hosts
+		if (ioctl(vcpufd, KVM_SET_ONE_REG, &reg) == -1)
+			fprintf(stderr, "[WARNING] Unable to restore register 0x%llx of vCPU %u - %d (%s)\n",
+				reg.id, cpuid, errno, strerror(errno));
+	}
+
+	kvm_ioctl(vcpufd, KVM_SET_MP_STATE, &cpu_state.mp_state);
+	restore_vgic_state(&cpu_state);
+}
+
+vcpu_state_t save_cpu_state(void)
+{
+	vcpu_state_t cpu_state;
+	struct kvm_reg_list* list = get_reg_list();
+
+	memset(&cpu_state, 0x00, sizeof(cpu_state));
+
+	/* the list includes the timer registers, e.g. KVM_REG_ARM_TIMER_CNT */
+	for(uint64_t i = 0; i < list->n; i++) {
+		vcpu_reg_t* reg = cpu_state.regs + cpu_state.nregs;
+
+		// SVE is not enabled by init_vcpu()
+		if (reg_size(list->reg[i]) > sizeof(reg->data))
+			continue;
+		if (cpu_state.nregs >= MAX_VCPU_REGS)
+			err(1, "vCPU %u has more than %d registers", cpuid, MAX_VCPU_REGS);
+
+		struct kvm_one_reg one_reg = {
+			.id = list->reg[i],
+			.addr = (uint64_t) reg->data,
+		};
+		kvm_ioctl(vcpufd, KVM_GET_ONE_REG, &one_reg);
+
+		reg->id = list->reg[i];
+		cpu_state.nregs++;
+	}
+	free(list);
+
+	kvm_ioctl(vcpufd, KVM_GET_MP_STATE, &cpu_state.mp_state);
+	save_vgic_state(&cpu_state);
+
+	return cpu_state;
+}
+
+void write_cpu_state(void)
+{
+	vcpu_state_t cpu_state = save_cpu_state();
+	char fname[MAX_FNAME];
+	snprintf(fname, MAX_FNAME, "checkpoint/chk%u_core%u.dat", no_checkpoint, cpuid);
+
+	FILE* f = fopen(fname, "w");
+	if (f == NULL) {
+		err(1, "fopen: unable to open file\n");
+	}
+
+	if (fwrite(&cpu_state, sizeof(cpu_state), 1, f) != 1)
+		err(1, "fwrite failed\n");
+
+	fclose(f);
+}
+
+/* The entry of a page is its guest-physical address */
+size_t determine_dest_offset(size_t src_addr)
+{
+	return src_addr & PAGE_MASK;
+}
+
+/*
+ * The page tables of the guest are not scanned on aarch64, without
+ * KVM's dirty log all pages are reported.
+ */
+static void scan_guest_mem(void (*save_page)(void*, size_t, void*, size_t))
+{
+	for(uint64_t gpa = 0; gpa < guest_size; gpa += PAGE_SIZE)
+		save_page(&gpa, sizeof(gpa), guest_mem + gpa, PAGE_SIZE);
+}
+
+void determine_dirty_pages(void (*save_page_handler)(void*, size_t, void*, size_t))
+{
+	if (dirty_log_enabled())
+		dirty_log_scan(save_page_handler);
+	else
+		scan_guest_mem(save_page_handler);
+}
+
+/* Without the dirty log, each checkpoint contains all pages */
+static inline bool chk_full(void)
+{
+	return full_checkpoint || !dirty_log_enabled();
+}
+
+/* Returns the destination of a page in a checkpoint file */
+static void* chk_locate_page(uint8_t* mem, uint64_t entry, size_t* page_size)
+{
+	*page_size = PAGE_SIZE;
+
+	return mem + determine_dest_offset(entry);
+}
+
+static void write_chk_config(uint32_t no)
+{
+	// update configuration file, a restart sees either the old or the new one
+	FILE *f = fopen("checkpoint/chk_config.tmp", "w");
+	if (f == NULL) {
+		err(1, "fopen: unable to open file");
+	}
+
+	fprintf(f, "number of cores: %u\n", ncores);
+	fprintf(f, "memory size: 0x%zx\n", guest_size);
+	fprintf(f, "checkpoint number: %u\n", no);
+	fprintf(f, "entry point: 0x%zx\n", elf_entry);
+	if (chk_full())
+		fprintf(f, "full checkpoint: 1");
+	else
+		fprintf(f, "full checkpoint: 0");
+	fprintf(f, "\nbase checkpoint: %u", chk_base);
+
+	fflush(f);
+	fsync(fileno(f));
+	fclose(f);
+
+	if (rename("checkpoint/chk_config.tmp", "checkpoint/chk_config.txt") < 0)
+		err(1, "rename: unable to update checkpoint configuration");
+}
+
+void timer_handler(int signum)
+{
+	struct stat st = {0};
+	char fname[MAX_FNAME];
+	struct timeval begin, end;
+
+	// all pages of a lazy restore have to be present
+	chk_restore_wait();
+
+	if (verbose)
+		gettimeofday(&begin, NULL);
+	uint64_t begin_ns = stats_now();
+
+	if (stat("checkpoint", &st) == -1)
+		mkdir("checkpoint", 0700);
+
+	// the engine must not write into the guest memory, while it is captured
+	uhyve_aio_quiesce();
+	for(size_t i = 0; i < ncores; i++)
+		if (vcpu_threads[i] != pthread_self())
+			pthread_kill(vcpu_threads[i], SIGTHRCHKP);
+
+	pthread_barrier_wait(&barrier);
+
+	write_cpu_state();
+
+	snprintf(fname, MAX_FNAME, "checkpoint/chk%u_mem.dat", no_checkpoint);
+
+	// the virtual counter is saved with the timer registers of the vCPUs
+	struct kvm_clock_data clock = {};
+	// a full checkpoint has to be self-contained
+	if (chk_full())
+		chk_dedup_reset();
+	chk_writer_open(fname, no_checkpoint, &clock);
+	if (chk_full())
+		scan_guest_mem(chk_write_page);
+	else
+		dirty_log_scan(chk_write_page);
+	chk_writer_flush();
+
+	// all pages are captured => the vCPUs are able to continue
+	pthread_barrier_wait(&barrier);
+	uhyve_aio_resume();
+	stats_phase(STATS_PHASE_CHECKPOINT_STOP, stats_now() - begin_ns);
+
+	chk_writer_close();
+	write_chk_config(no_checkpoint);
+
+	if (verbose) {
+		gettimeofday(&end, NULL);
+		size_t msec = (end.tv_sec - begin.tv_sec) * 1000;
+		msec += (end.tv_usec - begin.tv_usec) / 1000;
+		fprintf(stderr, "Create checkpoint %u in %zd ms\n", no_checkpoint, msec);
+	}
+	stats_phase(STATS_PHASE_CHECKPOINT, stats_now() - begin_ns);
+
+	no_checkpoint++;
+}
+
+int load_checkpoint(uint8_t* mem, char* path)
+{
+	struct timeval begin, end;
+	int ret;
+
+	if (verbose)
+		gettimeofday(&begin, NULL);
+	uint64_t begin_ns = stats_now();
+
+	/*
+	 * An incremental checkpoint contains the pages, which the guest has
+	 * dirtied. The kernel image is written by uhyve and has to be loaded.
+	 */
+	if (!full_checkpoint) {
+		ret = load_kernel(mem, path);
+		if (ret)
+			return ret;
+	}
+
+	if (!mboot)
+		mboot = mem+elf_entry-GUEST_OFFSET;
+	if (!klog)
+		klog = mboot+0x1000;
+
+	/*
+	 * Only the newest copy of a page is read. Without the dirty log and
+	 * with anonymous memory, the pages are able to be loaded lazily.
+	 */
+	bool lazy = false;
+	if (!dirty_log_enabled() && (mem_backing() == MEM_BACKING_ANONYMOUS)) {
+		const char* str = getenv("HERMIT_LAZY_RESTORE");
+		lazy = str && (strcmp(str, "0") != 0);
+	}
+
+	uint32_t first = full_checkpoint ? no_checkpoint : chk_base;
+	struct kvm_clock_data clock;
+	ret = chk_restore(mem, guest_size, first, no_checkpoint, lazy, chk_locate_page, &clock);
+	if (ret < 0)
+		err(1, "Unable to restore checkpoint %u", no_checkpoint);
+	if (ret > 0) {
+		fprintf(stderr, "[ERROR] Checkpoint %u has no index\n", no_checkpoint);
+		return -1;
+	}
+
+	if (verbose) {
+		gettimeofday(&end, NULL);
+		size_t msec = (end.tv_sec - begin.tv_sec) * 1000;
+		msec += (end.tv_usec - begin.tv_usec) / 1000;
+		fprintf(stderr, "Load checkpoint %u in %zd ms\n", no_checkpoint, msec);
+	}
+	stats_phase(STATS_PHASE_RESTORE, stats_now() - begin_ns);
+
+	return 0;
+}
+
+/**
+ * \brief Fills mem_mappings with the guest-physical memory, which has no gaps
+ */
+static void determine_guest_physical_memory_regions(mem_mappings_t *mem_mappings)
+{
+	mem_mappings->count = 1;
+	mem_mappings->mem_chunks = (mem_chunk_t*)malloc(sizeof(mem_chunk_t));
+	mem_mappings->mem_chunks[0].ptr = 0;
+	mem_mappings->mem_chunks[0].size = guest_size;
+}
+
+static void convert_to_host_virt(mem_mappings_t *mem_mappings)
+{
+	fprintf(stderr, "[INFO] We have %zu memory chunks\n", mem_mappings->count);
+	for (size_t i=0; i<mem_mappings->count; ++i) {
+		uint8_t *cur_ptr = mem_mappings->mem_chunks[i].ptr;
+		mem_mappings->mem_chunks[i].ptr = (uint8_t*)(guest_mem+(size_t)cur_ptr);
+	}
+}
+
+void* migration_handler(void* arg)
+{
+	sigset_t *signal_mask = (sigset_t *)arg;
+	int res = 0;
+	size_t i = 0;
+	int sig_caught;
+
+	/* wait for a migration request and connect to the migration server*/
+	while (1) {
+		sigwait(signal_mask, &sig_caught);
+
+		if (connect_to_server() < 0) {
+			fprintf(stderr, "[ERROR] Could not connect to the "
+					"destination. Abort!\n");
+		} else {
+			break;
+		}
+	}
+
+	chk_restore_wait();
+
+	/* send metadata */
+	migration_metadata_t metadata = {
+		ncores,
+		guest_size,
+		0, /* no_checkpoint */
+		elf_entry,
+		full_checkpoint};
+
+	res = send_data(&metadata, sizeof(migration_metadata_t));
+	fprintf(stderr, "Metadata sent! (%d bytes)\n", res);
+
+	/* determine guest-physical and guest-allocated memory regions */
+	determine_guest_allocations();
+	determine_guest_physical_memory_regions(&guest_physical_memory);
+
+	/* send to the destination */
+	send_mem_regions(guest_physical_memory, mem_mappings);
+
+	/* we can now determine host-local VAs */
+	convert_to_host_virt(&guest_physical_memory);
+	convert_to_host_virt(&mem_mappings);
+
+	/* pre-copy phase */
+	uint64_t begin_ns = stats_now();
+	precopy_phase(guest_physical_memory, mem_mappings);
+	stats_phase(STATS_PHASE_PRECOPY, stats_now() - begin_ns);
+
+	/* synchronize VCPU threads */
+	begin_ns = stats_now();
+	assert(vcpu_thread_states == NULL);
+	vcpu_thread_states = (vcpu_state_t*)calloc(ncores, sizeof(vcpu_state_t));
+	// the guest continues with the completed requests at the destination
+	uhyve_aio_quiesce();
+	for(i = 0; i < ncores; i++)
+		pthread_kill(vcpu_threads[i], SIGTHRMIG);
+	pthread_barrier_wait(&migration_barrier);
+
+	/* send the final dump */
+	stop_and_copy_phase();
+	stats_phase(STATS_PHASE_STOP_AND_COPY, stats_now() - begin_ns);
+	fprintf(stderr, "Memory sent! (Guest size: %zu bytes)\n", guest_size);
+
+	/* free mem_mappings and guest_physical_memory info */
+	free(mem_mappings.mem_chunks);
+	mem_mappings.count = 0;
+	free(guest_physical_memory.mem_chunks);
+	guest_physical_memory.count = 0;
+
+	/* send CPU state (including the virtual counter) and cleanup */
+	res = send_data(vcpu_thread_states, sizeof(vcpu_state_t)*ncores);
+	fprintf(stderr, "CPU state sent! (%d bytes)\n", res);
+	free(vcpu_thread_states);
+	vcpu_thread_states = NULL;
+
+	/* serve the remaining pages while the destination is running */
+	if (is_postcopy())
+		postcopy_phase();
+
+	/* close socket */
+	close_migration_channel();
+
+	exit(EXIT_SUCCESS);
+}
+
+void load_migration_data(uint8_t* mem)
+{
+	int res = 0;
+
+	if (!mboot)
+		mboot = mem+elf_entry-GUEST_OFFSET;
+	if (!klog)
+		klog = mboot+0x1000;
+
+	/* get memory chunk info from source and convert to host-virt */
+	recv_mem_regions(&mem_mappings);
+	convert_to_host_virt(&mem_mappings);
+
+	/* receive the guest-physical memory */
+	recv_guest_mem(mem_mappings);
+
+	/* cleanup memory mappings info */
+	free(mem_mappings.mem_chunks);
+	mem_mappings.mem_chunks = NULL;
+	mem_mappings.count = 0;
+
+	/* receive cpu state */
+	assert(vcpu_thread_states == NULL);
+	vcpu_thread_states = (vcpu_state_t*)calloc(ncores, sizeof(vcpu_state_t));
+	res = recv_data(vcpu_thread_states, sizeof(vcpu_state_t)*ncores);
+	fprintf(stderr, "CPU states received! (%d bytes)\n", res);
+
+	/* the missing pages are fetched on demand */
+	if (is_postcopy())
+		start_postcopy();
+}
+
+void wait_for_incomming_migration(migration_metadata_t *metadata, uint16_t listen_portno)
+{
+	int res = 0;
+
+	wait_for_client(listen_portno);
+
+	/* receive metadata state */
+	res = recv_data(metadata, sizeof(migration_metadata_t));
+	fprintf(stderr, "Metadata received! (%d bytes)\n", res);
+	fprintf(stderr, "NCORES = %u; GUEST_SIZE = %zu; NO_CHKPOINT = %u; ELF_ENTRY = 0x%lx; FULL_CHKPT = %d\n",
+			metadata->ncores, metadata->guest_size, metadata->no_checkpoint, metadata->elf_entry, metadata->full_checkpoint);
+}
+
+/* determine guests memory mappings based on its free list
+ *
+ * The memory mappings are stored in terms of guest-physical pointers
+ */
+void determine_mem_mappings(free_list_t *free_list)
+{
+	/* determine list length */
+	size_t free_list_length = 0;
+	free_list_t *cur = free_list;
+	for (free_list_length=0; (size_t)cur != (size_t)guest_mem; ++free_list_length) {
+		cur = virt_to_phys_with_offset(cur->next);
+	}
+
+	/* +1: allocation behind the last free region */
+	mem_mappings.mem_chunks = (mem_chunk_t*)malloc((free_list_length+1)*sizeof(mem_chunk_t));
+	mem_mappings.count = 0;
+
+	/* allocation prior to first free region, which covers the kernel */
+	mem_mappings.mem_chunks[0].ptr = (uint8_t*)0;
+	mem_mappings.mem_chunks[0].size = free_list->start;
+	mem_mappings.count++;
+
+	/* iterate the free list */
+	cur = free_list;
+	free_list_t *next = virt_to_phys_with_offset(cur->next);
+	while ((uint8_t*)next != guest_mem) {
+		mem_mappings.mem_chunks[mem_mappings.count].ptr = (uint8_t*)cur->end;
+		mem_mappings.mem_chunks[mem_mappings.count].size = next->start - cur->end;
+		mem_mappings.count++;
+
+		cur = next;
+		next = virt_to_phys_with_offset(cur->next);
+	}
+
+	/* allocation behind last free region */
+	if (guest_size > cur->end) {
+		mem_mappings.mem_chunks[mem_mappings.count].ptr = (uint8_t*)cur->end;
+		mem_mappings.mem_chunks[mem_mappings.count].size = guest_size - cur->end;
+		mem_mappings.count++;
+	}
+}
+#else
+/* checkpointing and migration are experimental, see ENABLE_AARCH64_CHECKPOINT */
+vcpu_state_t read_cpu_state(void)
 {
 	err(1, "Migration is currently not supported!");
 }
@@ -257,12 +904,21 @@ vcpu_state_t save_cpu_state(void)
 	err(1, "Checkpointing is currently not supported!");
 }
 
-
 void write_cpu_state(void)
 {
 	err(1, "Checkpointing is currently not supported!");
 }
 
+size_t determine_dest_offset(size_t src_addr)
+{
+	err(1, "Migration is currently not supported!");
+}
+
+void determine_dirty_pages(void (*save_page_handler)(void*, size_t, void*, size_t))
+{
+	err(1, "Migration is currently not supported!");
+}
+
 int load_checkpoint(uint8_t* mem, char* path)
 {
 	err(1, "Checkpointing is currently not supported!");
@@ -270,38 +926,35 @@ int load_checkpoint(uint8_t* mem, char* path)
 
 void load_migration_data(uint8_t* mem)
 {
-	err(1, "Checkpointing is currently not supported!");
+	err(1, "Migration is currently not supported!");
 }
 
 void wait_for_incomming_migration(migration_metadata_t *metadata, uint16_t listen_portno)
 {
-	err(1, "Checkpointing is currently not supported!");
+	err(1, "Migration is currently not supported!");
 }
 
-void determine_mem_mappings(alloc_list_t *alloc_list)
+void determine_mem_mappings(free_list_t *free_list)
 {
 	err(1, "Currently, uhyve does not dermine the memory mappings for aachr64!");
 }
+#endif
 
-void init_cpu_state(uint64_t elf_entry)
+size_t report_free_range(size_t start, size_t end)
 {
-	struct kvm_vcpu_init vcpu_init = {
-                .features = 0,
-        };
-        struct kvm_vcpu_init preferred_init;
+	if (end > guest_size)
+		end = guest_size;
+	if (start >= end)
+		return 0;
 
-	if (!ioctl(vmfd, KVM_ARM_PREFERRED_TARGET, &preferred_init)) {
-		if ((preferred_init.target == KVM_ARM_TARGET_CORTEX_A57) ||
-		    (preferred_init.target == KVM_ARM_TARGET_CORTEX_A53)) {
-			vcpu_init.target = preferred_init.target;
-		} else {
-			vcpu_init.target = KVM_ARM_TARGET_GENERIC_V8;
-		}
-        } else {
-                vcpu_init.target = KVM_ARM_TARGET_GENERIC_V8;
-        }
+	mem_discard(guest_mem + start, end - start);
 
-        kvm_ioctl(vcpufd, KVM_ARM_VCPU_INIT, &vcpu_init);
+	return end - start;
+}
+
+void init_cpu_state(uint64_t elf_entry)
+{
+	init_vcpu();
 
 	// be sure that the multiprocessor is runable
 	struct kvm_mp_state mp_state = { KVM_MP_STATE_RUNNABLE };
@@ -337,21 +990,7 @@ void init_cpu_state(uint64_t elf_entry)
 	reg.id	= ARM64_CORE_REG(regs.pc);
 	kvm_ioctl(vcpufd, KVM_SET_ONE_REG, &reg);
 
-	if (gic_fd > 0) {
-		int lines = 1;
-		uint32_t nr_irqs = lines * 32 + GIC_SPI_IRQ_BASE;
-		struct kvm_device_attr nr_irqs_attr = {
-			.group	= KVM_DEV_ARM_VGIC_GRP_NR_IRQS,
-			.addr	= (uint64_t)&nr_irqs,
-		};
-		struct kvm_device_attr vgic_init_attr = {
-			.group	= KVM_DEV_ARM_VGIC_GRP_CTRL,
-			.attr	= KVM_DEV_ARM_VGIC_CTRL_INIT,
-		};
-
-		kvm_ioctl(gic_fd, KVM_SET_DEVICE_ATTR, &nr_irqs_attr);
-		kvm_ioctl(gic_fd, KVM_SET_DEVICE_ATTR, &vgic_init_attr);
-	}
+	pthread_once(&vgic_once, init_vgic);
 
 	// only one core is able to enter startup code
 	// => the wait for the predecessor core
@@ -360,6 +999,26 @@ void init_cpu_state(uint64_t elf_entry)
 	*((volatile uint32_t*) (mboot + 0x130)) = cpuid;
 }
 
+bool open_snapshot(void)
+{
+	return false;
+}
+
+int load_snapshot(uint8_t* mem)
+{
+	err(1, "Snapshots are currently not supported!");
+}
+
+void create_snapshot(void)
+{
+	err(1, "Snapshots are currently not supported!");
+}
+
+void create_coredump(const char* fname)
+{
+	fprintf(stderr, "[WARNING] Core dumps are currently not supported!\n");
+}
+
 /* Return 1 if guest fiqs are enabled, 0 if the aren't */
 int get_fiq_status(void) {
 	struct kvm_one_reg reg;
@@ -402,9 +1061,8 @@ void unmask_fiqs(void) {
 
 void init_kvm_arch(void)
 {
-	guest_mem = mmap(NULL, guest_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (guest_mem == MAP_FAILED)
-		err(1, "mmap failed");
+	guest_mem = mem_map_guest(guest_size, -1);
+	mem_place_guest(guest_mem, guest_size, 0, 0);
 
 	const char* merge = getenv("HERMIT_MERGEABLE");
 	if (merge && (strcmp(merge, "0") != 0)) {
@@ -443,13 +1101,10 @@ void init_kvm_arch(void)
 		.guest_phys_addr = PAGE_SIZE,
 		.memory_size = guest_size - PAGE_SIZE,
 		.userspace_addr = (uint64_t) guest_mem + PAGE_SIZE,
- #ifdef USE_DIRTY_LOG
-		.flags = KVM_MEM_LOG_DIRTY_PAGES,
- #else
- 		.flags = 0,
- #endif
+		.flags = dirty_log_flags(),
 	};
 	kvm_ioctl(vmfd, KVM_SET_USER_MEMORY_REGION, &kvm_region);
+	dirty_log_add_slot(&kvm_region);
 
 #if 0
 	/* Create interrupt controller GICv2 */
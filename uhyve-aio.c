@@ -0,0 +1,699 @@
+/*
+ * Copyright (c) 2018, RWTH Aachen University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The engine translates the guest buffer of a read/write hypercall into
+ * host spans (one per physically contiguous region) and submits them as a
+ * chain of linked SQEs. A dedicated thread reaps the completions and
+ * reports the result through the completion handler, so that the vCPU is
+ * able to return to the guest immediately.
+ *
+ * Requests on the same file descriptor are kept in order, because most of
+ * them operate on the current file position. Other requests on a file
+ * descriptor (e.g. lseek or close) are queued behind its pending I/O and
+ * are processed synchronously, once they reach the head of the queue.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "uhyve-common.h"
+#include "uhyve.h"
+#include "uhyve-syscalls.h"
+#include "uhyve-aio.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+
+#define AIO_QUEUE_DEPTH		256
+#define AIO_MAX_SPANS		64
+#define AIO_MAX_FDS		1024
+#define AIO_MAX_SPAN_SIZE	(1UL << 30)
+
+extern uint8_t* guest_mem;
+
+typedef struct aio_request {
+	uint64_t user_data;
+	uint64_t port;
+	size_t args;		// guest-physical address of the argument struct
+	int fd;
+	// buffer in the guest-virtual address space
+	size_t buf;
+	size_t len;
+	// -1 => current file position
+	off_t offset;
+	// host spans, one SQE per span
+	unsigned nr_spans;
+	struct iovec spans[AIO_MAX_SPANS];
+	// too many spans => process the request synchronously
+	bool sync;
+	// not supported by the engine => processed by aio_sync_handler
+	bool deferred;
+	unsigned pending;
+	int64_t done;
+	int error;
+	struct aio_request* next;
+} aio_request_t;
+
+typedef struct {
+	aio_request_t* head;
+	aio_request_t* tail;
+} aio_fd_queue_t;
+
+static struct {
+	int fd;
+	unsigned* sq_head;
+	unsigned* sq_tail;
+	unsigned* sq_mask;
+	unsigned* sq_array;
+	unsigned* cq_head;
+	unsigned* cq_tail;
+	unsigned* cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+	unsigned cq_entries;
+	unsigned inflight;
+} ring = { .fd = -1 };
+
+static bool aio_enabled = false;
+static aio_complete_handler_t aio_complete = NULL;
+static aio_sync_handler_t aio_sync_handler = NULL;
+static aio_fd_queue_t aio_fds[AIO_MAX_FDS];
+static pthread_mutex_t aio_lock = PTHREAD_MUTEX_INITIALIZER;
+/* signaled, whenever a file queue becomes empty */
+static pthread_cond_t aio_idle = PTHREAD_COND_INITIALIZER;
+/* signaled, when the engine accepts new requests again */
+static pthread_cond_t aio_resumed = PTHREAD_COND_INITIALIZER;
+/* number of requests in all file queues */
+static unsigned aio_queued = 0;
+/* nesting level of uhyve_aio_quiesce() */
+static unsigned aio_quiesced = 0;
+static pthread_t aio_thread;
+
+static inline int io_uring_setup(unsigned entries, struct io_uring_params* p)
+{
+	return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+	return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline bool is_read(const aio_request_t* req)
+{
+	return (req->port == UHYVE_PORT_READ) || (req->port == UHYVE_PORT_PREAD);
+}
+
+/* Splits the guest buffer into host spans and merges adjacent ones */
+static void aio_build_spans(aio_request_t* req)
+{
+	size_t pos = 0;
+
+	req->nr_spans = 0;
+	while (pos < req->len) {
+		size_t physical_address, physical_address_end;
+
+		virt_to_phys(req->buf + pos, &physical_address, &physical_address_end);
+		if (physical_address_end <= physical_address) {
+			req->error = EFAULT;
+			return;
+		}
+
+		size_t step = physical_address_end - physical_address;
+		if (step > req->len - pos)
+			step = req->len - pos;
+
+		struct iovec* last = req->nr_spans ? &req->spans[req->nr_spans-1] : NULL;
+		uint8_t* host = guest_mem + physical_address;
+		if (last && ((uint8_t*) last->iov_base + last->iov_len == host)
+		    && (last->iov_len + step <= AIO_MAX_SPAN_SIZE)) {
+			last->iov_len += step;
+		} else if (req->nr_spans < AIO_MAX_SPANS) {
+			req->spans[req->nr_spans].iov_base = host;
+			req->spans[req->nr_spans].iov_len = step;
+			req->nr_spans++;
+		} else {
+			req->sync = true;
+			return;
+		}
+
+		pos += step;
+	}
+}
+
+/* Fallback path, which is also used for requests with too many spans */
+static void aio_execute_sync(aio_request_t* req)
+{
+	size_t pos = 0;
+
+	while (pos < req->len) {
+		size_t physical_address, physical_address_end;
+
+		virt_to_phys(req->buf + pos, &physical_address, &physical_address_end);
+		if (physical_address_end <= physical_address) {
+			req->error = EFAULT;
+			break;
+		}
+
+		size_t step = physical_address_end - physical_address;
+		if (step > req->len - pos)
+			step = req->len - pos;
+
+		ssize_t ret;
+		if (req->offset >= 0) {
+			if (is_read(req))
+				ret = pread(req->fd, guest_mem + physical_address, step, req->offset + pos);
+			else
+				ret = pwrite(req->fd, guest_mem + physical_address, step, req->offset + pos);
+		} else if (is_read(req)) {
+			ret = read(req->fd, guest_mem + physical_address, step);
+		} else {
+			ret = write(req->fd, guest_mem + physical_address, step);
+		}
+
+		if (ret < 0) {
+			req->error = errno;
+			break;
+		}
+
+		pos += ret;
+		if ((size_t) ret < step)
+			break;
+	}
+
+	req->done = pos;
+}
+
+/* Writes the result into the argument struct and notifies the guest */
+static void aio_finish(aio_request_t* req)
+{
+	int64_t ret = req->done;
+
+	// the handler has already updated the argument struct
+	if (req->deferred) {
+		aio_complete(req->user_data, ret);
+		return;
+	}
+
+	if (!req->done && req->error)
+		ret = -1;
+
+	switch (req->port) {
+	case UHYVE_PORT_READ:
+		((uhyve_read_t*) (guest_mem+req->args))->ret = ret;
+		break;
+	case UHYVE_PORT_WRITE:
+		((uhyve_write_t*) (guest_mem+req->args))->len = ret;
+		break;
+	case UHYVE_PORT_PREAD:
+		((uhyve_pread_t*) (guest_mem+req->args))->ret = ret;
+		break;
+	case UHYVE_PORT_PWRITE:
+		((uhyve_pwrite_t*) (guest_mem+req->args))->ret = ret;
+		break;
+	}
+
+	aio_complete(req->user_data, ret);
+}
+
+/* Queues the SQE chain of a request, aio_lock has to be held */
+static void aio_start(aio_request_t* req)
+{
+	unsigned tail = *ring.sq_tail;
+	unsigned submitted = 0;
+	uint64_t offset = req->offset;
+
+	for(unsigned i = 0; i < req->nr_spans; i++, tail++) {
+		const unsigned idx = tail & *ring.sq_mask;
+		struct io_uring_sqe* sqe = &ring.sqes[idx];
+
+		memset(sqe, 0x00, sizeof(*sqe));
+		sqe->opcode = is_read(req) ? IORING_OP_READ : IORING_OP_WRITE;
+		sqe->fd = req->fd;
+		sqe->addr = (uint64_t) (size_t) req->spans[i].iov_base;
+		sqe->len = req->spans[i].iov_len;
+		sqe->off = offset;
+		sqe->flags = (i+1 < req->nr_spans) ? IOSQE_IO_LINK : 0;
+		sqe->user_data = (uint64_t) (size_t) req;
+		ring.sq_array[idx] = idx;
+
+		if (req->offset >= 0)
+			offset += req->spans[i].iov_len;
+	}
+
+	req->pending = req->nr_spans;
+	ring.inflight += req->nr_spans;
+	__atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+	while (submitted < req->nr_spans) {
+		int ret = io_uring_enter(ring.fd, req->nr_spans - submitted, 0, 0);
+
+		if (ret < 0) {
+			if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY))
+				continue;
+			err(1, "io_uring_enter failed");
+		}
+		submitted += ret;
+	}
+}
+
+static inline bool aio_has_capacity(const aio_request_t* req)
+{
+	return ring.inflight + req->nr_spans <= ring.cq_entries;
+}
+
+/* Removes the head of a file queue, aio_lock has to be held */
+static void aio_pop(aio_fd_queue_t* queue)
+{
+	aio_request_t* req = queue->head;
+
+	queue->head = req->next;
+	aio_queued--;
+	if (!queue->head) {
+		queue->tail = NULL;
+		pthread_cond_broadcast(&aio_idle);
+	}
+	free(req);
+}
+
+/*
+ * Removes a finished request from its file queue and starts its successors.
+ * aio_lock has to be held. It is released, while a successor is processed
+ * synchronously. Meanwhile, new requests are only appended to the queue.
+ */
+static void aio_retire(aio_request_t* req)
+{
+	aio_fd_queue_t* queue = &aio_fds[req->fd];
+
+	aio_finish(req);
+	aio_pop(queue);
+
+	while ((req = queue->head) != NULL) {
+		if (!req->deferred && !req->sync && !req->error && aio_has_capacity(req)) {
+			aio_start(req);
+			break;
+		}
+
+		if (!req->error) {
+			pthread_mutex_unlock(&aio_lock);
+			if (req->deferred)
+				req->done = aio_sync_handler(req->port, req->args);
+			else
+				aio_execute_sync(req);
+			pthread_mutex_lock(&aio_lock);
+		}
+		aio_finish(req);
+		aio_pop(queue);
+	}
+}
+
+static void* aio_completion_thread(void* arg)
+{
+	while (1) {
+		if (io_uring_enter(ring.fd, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "io_uring_enter failed");
+		}
+
+		pthread_mutex_lock(&aio_lock);
+
+		unsigned head = *ring.cq_head;
+		while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+			aio_request_t* req = (aio_request_t*) (size_t) cqe->user_data;
+
+			if (cqe->res > 0)
+				req->done += cqe->res;
+			else if ((cqe->res < 0) && !req->error)
+				req->error = -cqe->res;
+
+			head++;
+			__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+			ring.inflight--;
+
+			if (--req->pending == 0)
+				aio_retire(req);
+		}
+
+		pthread_mutex_unlock(&aio_lock);
+	}
+
+	return NULL;
+}
+
+int uhyve_aio_init(aio_complete_handler_t complete, aio_sync_handler_t sync)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	uint8_t *sq_ptr, *cq_ptr;
+
+	memset(&p, 0x00, sizeof(p));
+	ring.fd = io_uring_setup(AIO_QUEUE_DEPTH, &p);
+	if (ring.fd < 0) {
+		fprintf(stderr, "[WARNING] Unable to set up io_uring - %d (%s)\n",
+			errno, strerror(errno));
+		return -1;
+	}
+
+	if (!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		fprintf(stderr, "[WARNING] io_uring does not support the current file position\n");
+		goto out;
+	}
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cq_size > sq_size)
+			sq_size = cq_size;
+		cq_size = sq_size;
+	}
+
+	sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring.fd, IORING_OFF_SQ_RING);
+	if (sq_ptr == MAP_FAILED)
+		goto out;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		cq_ptr = sq_ptr;
+	} else {
+		cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring.fd, IORING_OFF_CQ_RING);
+		if (cq_ptr == MAP_FAILED)
+			goto out;
+	}
+
+	ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED)
+		goto out;
+
+	ring.sq_head = (unsigned*) (sq_ptr + p.sq_off.head);
+	ring.sq_tail = (unsigned*) (sq_ptr + p.sq_off.tail);
+	ring.sq_mask = (unsigned*) (sq_ptr + p.sq_off.ring_mask);
+	ring.sq_array = (unsigned*) (sq_ptr + p.sq_off.array);
+	ring.cq_head = (unsigned*) (cq_ptr + p.cq_off.head);
+	ring.cq_tail = (unsigned*) (cq_ptr + p.cq_off.tail);
+	ring.cq_mask = (unsigned*) (cq_ptr + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe*) (cq_ptr + p.cq_off.cqes);
+	ring.cq_entries = p.cq_entries;
+
+	aio_complete = complete;
+	aio_sync_handler = sync;
+
+	if (create_helper_thread(&aio_thread, aio_completion_thread, NULL))
+		err(1, "unable to create thread");
+
+	aio_enabled = true;
+
+	return 0;
+
+out:
+	fprintf(stderr, "[WARNING] Unable to map the io_uring queues - %d (%s)\n",
+		errno, strerror(errno));
+	close(ring.fd);
+	ring.fd = -1;
+
+	return -1;
+}
+
+bool uhyve_aio_enabled(void)
+{
+	return aio_enabled;
+}
+
+/* Returns the file descriptor of a hypercall or -1 */
+static int aio_hcall_fd(uint64_t port, size_t args)
+{
+	switch (port) {
+	case UHYVE_PORT_READ:
+		return ((uhyve_read_t*) (guest_mem+args))->fd;
+	case UHYVE_PORT_WRITE:
+		return ((uhyve_write_t*) (guest_mem+args))->fd;
+	case UHYVE_PORT_PREAD:
+		return ((uhyve_pread_t*) (guest_mem+args))->fd;
+	case UHYVE_PORT_PWRITE:
+		return ((uhyve_pwrite_t*) (guest_mem+args))->fd;
+	case UHYVE_PORT_LSEEK:
+		return ((uhyve_lseek_t*) (guest_mem+args))->fd;
+	case UHYVE_PORT_CLOSE:
+		return ((uhyve_close_t*) (guest_mem+args))->fd;
+	case UHYVE_PORT_READV:
+		return ((uhyve_readv_t*) (guest_mem+args))->fd;
+	case UHYVE_PORT_WRITEV:
+		return ((uhyve_writev_t*) (guest_mem+args))->fd;
+	default:
+		return -1;
+	}
+}
+
+/* Queues a request, which the engine does not support, behind the pending I/O */
+static int aio_defer(uint64_t port, size_t args, uint64_t user_data)
+{
+	int fd = aio_hcall_fd(port, args);
+	aio_request_t* req;
+
+	if ((fd < 0) || (fd >= AIO_MAX_FDS))
+		return -1;
+
+	pthread_mutex_lock(&aio_lock);
+	while (aio_quiesced)
+		pthread_cond_wait(&aio_resumed, &aio_lock);
+
+	// nothing to wait for => the caller processes it synchronously
+	if (!aio_fds[fd].head) {
+		pthread_mutex_unlock(&aio_lock);
+		return -1;
+	}
+
+	req = (aio_request_t*) calloc(1, sizeof(aio_request_t));
+	if (!req) {
+		pthread_mutex_unlock(&aio_lock);
+		uhyve_aio_drain(port, args);
+		return -1;
+	}
+
+	req->user_data = user_data;
+	req->port = port;
+	req->args = args;
+	req->fd = fd;
+	req->deferred = true;
+	aio_fds[fd].tail->next = req;
+	aio_fds[fd].tail = req;
+	aio_queued++;
+
+	pthread_mutex_unlock(&aio_lock);
+
+	return 0;
+}
+
+void uhyve_aio_drain(uint64_t port, size_t args)
+{
+	int fd;
+
+	if (!aio_enabled)
+		return;
+
+	fd = aio_hcall_fd(port, args);
+	if ((fd < 0) || (fd >= AIO_MAX_FDS))
+		return;
+
+	pthread_mutex_lock(&aio_lock);
+	while (aio_fds[fd].head)
+		pthread_cond_wait(&aio_idle, &aio_lock);
+	pthread_mutex_unlock(&aio_lock);
+}
+
+int uhyve_aio_submit(uint64_t port, size_t args, uint64_t user_data)
+{
+	aio_request_t* req;
+	aio_fd_queue_t* queue;
+	int fd;
+
+	if (!aio_enabled)
+		return -1;
+
+	switch (port) {
+	case UHYVE_PORT_READ: {
+			uhyve_read_t* uhyve_read = (uhyve_read_t*) (guest_mem+args);
+
+			fd = uhyve_read->fd;
+			if ((fd < 0) || (fd >= AIO_MAX_FDS))
+				return -1;
+			req = (aio_request_t*) calloc(1, sizeof(aio_request_t));
+			if (!req)
+				return -1;
+			req->buf = (size_t) uhyve_read->buf;
+			req->len = uhyve_read->len;
+			req->offset = -1;
+			break;
+		}
+	case UHYVE_PORT_WRITE: {
+			uhyve_write_t* uhyve_write = (uhyve_write_t*) (guest_mem+args);
+
+			fd = uhyve_write->fd;
+			if ((fd < 0) || (fd >= AIO_MAX_FDS))
+				return -1;
+			req = (aio_request_t*) calloc(1, sizeof(aio_request_t));
+			if (!req)
+				return -1;
+			req->buf = (size_t) uhyve_write->buf;
+			req->len = uhyve_write->len;
+			req->offset = -1;
+			break;
+		}
+	case UHYVE_PORT_PREAD: {
+			uhyve_pread_t* uhyve_pread = (uhyve_pread_t*) (guest_mem+args);
+
+			fd = uhyve_pread->fd;
+			if ((fd < 0) || (fd >= AIO_MAX_FDS) || (uhyve_pread->offset < 0))
+				return -1;
+			req = (aio_request_t*) calloc(1, sizeof(aio_request_t));
+			if (!req)
+				return -1;
+			req->buf = (size_t) uhyve_pread->buf;
+			req->len = uhyve_pread->len;
+			req->offset = uhyve_pread->offset;
+			break;
+		}
+	case UHYVE_PORT_PWRITE: {
+			uhyve_pwrite_t* uhyve_pwrite = (uhyve_pwrite_t*) (guest_mem+args);
+
+			fd = uhyve_pwrite->fd;
+			if ((fd < 0) || (fd >= AIO_MAX_FDS) || (uhyve_pwrite->offset < 0))
+				return -1;
+			req = (aio_request_t*) calloc(1, sizeof(aio_request_t));
+			if (!req)
+				return -1;
+			req->buf = (size_t) uhyve_pwrite->buf;
+			req->len = uhyve_pwrite->len;
+			req->offset = uhyve_pwrite->offset;
+			break;
+		}
+	default:
+		return aio_defer(port, args, user_data);
+	}
+
+	req->user_data = user_data;
+	req->port = port;
+	req->args = args;
+	req->fd = fd;
+	aio_build_spans(req);
+
+	pthread_mutex_lock(&aio_lock);
+	while (aio_quiesced)
+		pthread_cond_wait(&aio_resumed, &aio_lock);
+
+	queue = &aio_fds[fd];
+	if (queue->head) {
+		// wait for the previous requests on this file
+		queue->tail->next = req;
+		queue->tail = req;
+		aio_queued++;
+	} else if (req->sync || req->error || !req->nr_spans || !aio_has_capacity(req)) {
+		// nothing to wait for => the caller processes it synchronously
+		pthread_mutex_unlock(&aio_lock);
+		free(req);
+		return -1;
+	} else {
+		queue->head = queue->tail = req;
+		aio_queued++;
+		aio_start(req);
+	}
+
+	pthread_mutex_unlock(&aio_lock);
+
+	return 0;
+}
+
+void uhyve_aio_quiesce(void)
+{
+	if (!aio_enabled)
+		return;
+
+	pthread_mutex_lock(&aio_lock);
+	aio_quiesced++;
+	while (aio_queued)
+		pthread_cond_wait(&aio_idle, &aio_lock);
+	pthread_mutex_unlock(&aio_lock);
+}
+
+void uhyve_aio_resume(void)
+{
+	if (!aio_enabled)
+		return;
+
+	pthread_mutex_lock(&aio_lock);
+	if (aio_quiesced && (--aio_quiesced == 0))
+		pthread_cond_broadcast(&aio_resumed);
+	pthread_mutex_unlock(&aio_lock);
+}
+
+#else
+
+int uhyve_aio_init(aio_complete_handler_t complete, aio_sync_handler_t sync)
+{
+	fprintf(stderr, "[WARNING] uhyve is built without io_uring support\n");
+
+	return -1;
+}
+
+bool uhyve_aio_enabled(void)
+{
+	return false;
+}
+
+int uhyve_aio_submit(uint64_t port, size_t args, uint64_t user_data)
+{
+	return -1;
+}
+
+void uhyve_aio_drain(uint64_t port, size_t args)
+{
+}
+
+void uhyve_aio_quiesce(void)
+{
+}
+
+void uhyve_aio_resume(void)
+{
+}
+
+#endif
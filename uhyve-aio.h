@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2018, RWTH Aachen University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file tools/uhyve-aio.h
+ * @brief Asynchronous I/O engine for file hypercalls (io_uring)
+ */
+
+#ifndef __UHYVE_AIO_H__
+#define __UHYVE_AIO_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/* callback to report the completion of a request to the guest */
+typedef void (*aio_complete_handler_t)(uint64_t user_data, int64_t ret);
+
+/* callback to process a hypercall synchronously, returns its result */
+typedef int64_t (*aio_sync_handler_t)(uint64_t port, size_t args);
+
+/**
+ * \brief Sets up the io_uring instance and its completion thread
+ *
+ * \param complete handler, which is called for each completed request
+ * \param sync handler, which processes the requests queued behind I/O
+ *
+ * Returns 0 on success and -1 if the host does not support the engine.
+ */
+int uhyve_aio_init(aio_complete_handler_t complete, aio_sync_handler_t sync);
+
+/**
+ * \brief Returns true if the asynchronous engine is available
+ */
+bool uhyve_aio_enabled(void);
+
+/**
+ * \brief Hands a file hypercall over to the engine
+ *
+ * \param port the hypercall port (e.g. UHYVE_PORT_READ)
+ * \param args guest-physical address of the argument struct
+ * \param user_data passed unmodified to the completion handler
+ *
+ * The argument struct is updated once the request has finished, so the
+ * guest must not reuse it before it sees the completion. Other requests on
+ * a file descriptor with pending I/O are queued behind it and processed by
+ * the sync handler. Returns 0 if the request has been queued and -1 if the
+ * caller has to process it synchronously.
+ */
+int uhyve_aio_submit(uint64_t port, size_t args, uint64_t user_data);
+
+/**
+ * \brief Waits for the pending requests on the file descriptor of a hypercall
+ *
+ * Required before a hypercall, which bypasses the engine, is processed.
+ */
+void uhyve_aio_drain(uint64_t port, size_t args);
+
+/**
+ * \brief Waits until no request is pending on any file descriptor
+ *
+ * Required before the state of the guest is captured. New submissions
+ * block until uhyve_aio_resume() is called. Calls are able to be nested.
+ */
+void uhyve_aio_quiesce(void);
+
+/**
+ * \brief Accepts new requests after uhyve_aio_quiesce()
+ */
+void uhyve_aio_resume(void);
+
+#endif
@@ -0,0 +1,956 @@
+/*
+ * Copyright (c) 2018, RWTH Aachen University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Benchmarks of the hypervisor paths, which the guest does not see
+ * directly. Each result is printed as a single JSON object per line on
+ * stdout, diagnostics go to stderr.
+ *
+ *   hypercall   round-trip time of an I/O exit per port. A minimal guest
+ *               executes "out" in a loop and marks begin and end by writes
+ *               to a pipe, the host takes the time between both marks.
+ *   ring        throughput of a shared_queue_t between a producer and a
+ *               consumer thread, the slots are copied as by uhyve-net.c
+ *   checkpoint  write and restore throughput of the checkpoint format
+ *               versus guest size and ratio of dirty pages
+ *   migration   bandwidth of the pre-copy phase and downtime of the
+ *               stop-and-copy phase of a live-migration by the migration
+ *               transport versus streams, zero-copy and compression
+ *               (loopback)
+ *
+ * The restore reads from the page cache, hence the numbers describe the
+ * checkpoint format and not the storage.
+ */
+
+#define _GNU_SOURCE
+
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <linux/kvm.h>
+
+#include "uhyve.h"
+#include "uhyve-common.h"
+#include "uhyve-syscalls.h"
+#include "uhyve-net.h"
+#include "uhyve-checkpoint.h"
+#include "uhyve-migration.h"
+#include "uhyve-stats.h"
+
+#define BENCH_PAGE_SIZE		4096
+#define BENCH_MAX_VALUES	16
+
+/* layout of the benchmark guest */
+#define GUEST_BASE		0x800000
+#define GUEST_IMAGE_SIZE	0x8000
+#define GUEST_CODE		0x100
+#define GUEST_MARK		0x1000	// uhyve_write_t of a mark
+#define GUEST_EXIT_CODE		0x1100
+#define GUEST_ARGS		0x1200	// arguments of the measured port
+#define GUEST_BUF		0x2000
+#define GUEST_MEM		"32M"
+
+/* host file descriptors, which the guest uses */
+#define MARK_FD			100
+#define NULL_FD			101
+#define ZERO_FD			102
+
+#define MIG_BENCH_END		UINT64_MAX
+
+#define BENCH_PARTS		4
+
+bool verbose = false;
+
+static unsigned iterations = 100000;
+static uint64_t ring_frames = 1000000;
+static uint64_t sizes[BENCH_MAX_VALUES] = { 64UL << 20, 256UL << 20 };
+static unsigned nsizes = 2;
+static double ratios[BENCH_MAX_VALUES] = { 0.01, 0.1, 0.5, 1.0 };
+static unsigned nratios = 4;
+static uint16_t mig_port = MIGRATION_PORT + 1;
+static char workdir[] = "/tmp/uhyve-bench-XXXXXX";
+
+static uint64_t parse_size(const char* str)
+{
+	char* end;
+	uint64_t size = strtoull(str, &end, 0);
+
+	switch (*end) {
+	case 'G':
+	case 'g':
+		size <<= 10;
+	case 'M':
+	case 'm':
+		size <<= 10;
+	case 'K':
+	case 'k':
+		size <<= 10;
+	default:
+		break;
+	}
+
+	return size;
+}
+
+static unsigned parse_sizes(char* str, uint64_t* values)
+{
+	unsigned n = 0;
+
+	for(char* tok = strtok(str, ","); tok && (n < BENCH_MAX_VALUES); tok = strtok(NULL, ","))
+		values[n++] = parse_size(tok) & ~(uint64_t)(BENCH_PAGE_SIZE-1);
+
+	return n;
+}
+
+static unsigned parse_ratios(char* str, double* values)
+{
+	unsigned n = 0;
+
+	for(char* tok = strtok(str, ","); tok && (n < BENCH_MAX_VALUES); tok = strtok(NULL, ","))
+		values[n++] = strtod(tok, NULL);
+
+	return n;
+}
+
+/* deterministic pseudo-random numbers, identical in all runs */
+static inline uint64_t xorshift(uint64_t* state)
+{
+	uint64_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+
+	return *state = x;
+}
+
+static inline double rate_mib(uint64_t bytes, uint64_t ns)
+{
+	return ns ? ((double) bytes / (1 << 20)) / ((double) ns / 1e9) : 0.0;
+}
+
+static uint8_t* alloc_mem(size_t size)
+{
+	uint8_t* mem = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED)
+		err(1, "unable to allocate %zu bytes", size);
+
+	return mem;
+}
+
+static void fill_random(uint8_t* mem, size_t size, uint64_t seed)
+{
+	uint64_t* p = (uint64_t*) mem;
+
+	for(size_t i = 0; i < size / sizeof(uint64_t); i++)
+		p[i] = xorshift(&seed);
+}
+
+/* selects the same pages for every run with the same size and ratio */
+static size_t select_dirty(size_t pages, double ratio, uint64_t* pfns)
+{
+	uint64_t state = 0x9E3779B97F4A7C15ULL;
+	uint64_t threshold = (ratio >= 1.0) ? UINT64_MAX : (uint64_t) (ratio * (double) UINT64_MAX);
+	size_t count = 0;
+
+	for(size_t i = 0; i < pages; i++) {
+		if (xorshift(&state) <= threshold)
+			pfns[count++] = i;
+	}
+
+	return count;
+}
+
+/*
+ * hypercall latency
+ */
+
+typedef struct {
+	const char* name;
+	uint16_t port;
+	bool args;	// the port expects a pointer to GUEST_ARGS
+} bench_port_t;
+
+static const bench_port_t bench_ports[] = {
+	{ "UART", UHYVE_UART_PORT, false },
+	{ "WRITE", UHYVE_PORT_WRITE, true },
+	{ "READ", UHYVE_PORT_READ, true },
+	{ "LSEEK", UHYVE_PORT_LSEEK, true },
+	{ "PWRITE", UHYVE_PORT_PWRITE, true },
+	{ "HCALL_DOORBELL", UHYVE_PORT_HCALL_DOORBELL, false },
+};
+
+static uint8_t* emit_out(uint8_t* p, uint16_t port, uint32_t arg)
+{
+	*p++ = 0x66; *p++ = 0xBA;		// mov dx, port
+	memcpy(p, &port, sizeof(port)); p += sizeof(port);
+	*p++ = 0xB8;				// mov eax, arg
+	memcpy(p, &arg, sizeof(arg)); p += sizeof(arg);
+	*p++ = 0xEF;				// out dx, eax
+
+	return p;
+}
+
+static uint8_t* emit_loop(uint8_t* p, uint16_t port, uint32_t arg, uint32_t count)
+{
+	*p++ = 0x66; *p++ = 0xBA;		// mov dx, port
+	memcpy(p, &port, sizeof(port)); p += sizeof(port);
+	*p++ = 0xB8;				// mov eax, arg
+	memcpy(p, &arg, sizeof(arg)); p += sizeof(arg);
+	*p++ = 0xB9;				// mov ecx, count
+	memcpy(p, &count, sizeof(count)); p += sizeof(count);
+	*p++ = 0xEF;				// 1: out dx, eax
+	*p++ = 0xFF; *p++ = 0xC9;		// dec ecx
+	*p++ = 0x75; *p++ = 0xFB;		// jnz 1b
+
+	return p;
+}
+
+static void init_port_args(uint8_t* image, uint16_t port)
+{
+	uint8_t* args = image + GUEST_ARGS;
+	const char* buf = (const char*) (GUEST_BASE + GUEST_BUF);
+
+	switch (port) {
+	case UHYVE_PORT_WRITE:
+		*(uhyve_write_t*) args = (uhyve_write_t) { NULL_FD, buf, 1 };
+		break;
+	case UHYVE_PORT_READ:
+		*(uhyve_read_t*) args = (uhyve_read_t) { ZERO_FD, (char*) buf, 1, 0 };
+		break;
+	case UHYVE_PORT_LSEEK:
+		*(uhyve_lseek_t*) args = (uhyve_lseek_t) { NULL_FD, 0, SEEK_SET };
+		break;
+	case UHYVE_PORT_PWRITE:
+		*(uhyve_pwrite_t*) args = (uhyve_pwrite_t) { NULL_FD, buf, 1, 0, 0 };
+		break;
+	default:
+		break;
+	}
+}
+
+/* writes a HermitCore image, which calls the port "count" times */
+static void write_guest(const char* path, const bench_port_t* bp, uint32_t count)
+{
+	static uint8_t image[GUEST_IMAGE_SIZE];
+	Elf64_Ehdr ehdr;
+	Elf64_Phdr phdr;
+
+	memset(image, 0x00, sizeof(image));
+	*(uhyve_write_t*) (image + GUEST_MARK) = (uhyve_write_t) {
+		MARK_FD, (const char*) (GUEST_BASE + GUEST_BUF), 1 };
+	init_port_args(image, bp->port);
+
+	uint8_t* p = image + GUEST_CODE;
+	p = emit_out(p, UHYVE_PORT_WRITE, GUEST_BASE + GUEST_MARK);
+	p = emit_loop(p, bp->port, bp->args ? GUEST_BASE + GUEST_ARGS : 0, count);
+	p = emit_out(p, UHYVE_PORT_WRITE, GUEST_BASE + GUEST_MARK);
+	p = emit_out(p, UHYVE_PORT_EXIT, GUEST_BASE + GUEST_EXIT_CODE);
+	*p++ = 0xEB; *p++ = 0xFE;		// jmp .
+
+	memset(&ehdr, 0x00, sizeof(ehdr));
+	memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+	ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr.e_ident[EI_OSABI] = HERMIT_ELFOSABI;
+	ehdr.e_type = ET_EXEC;
+	ehdr.e_machine = EM_X86_64;
+	ehdr.e_version = EV_CURRENT;
+	ehdr.e_entry = GUEST_BASE + GUEST_CODE;
+	ehdr.e_phoff = sizeof(ehdr);
+	ehdr.e_ehsize = sizeof(ehdr);
+	ehdr.e_phentsize = sizeof(phdr);
+	ehdr.e_phnum = 1;
+
+	memset(&phdr, 0x00, sizeof(phdr));
+	phdr.p_type = PT_LOAD;
+	phdr.p_flags = PF_R|PF_W|PF_X;
+	phdr.p_offset = BENCH_PAGE_SIZE;
+	phdr.p_vaddr = phdr.p_paddr = GUEST_BASE;
+	phdr.p_filesz = phdr.p_memsz = sizeof(image);
+	phdr.p_align = BENCH_PAGE_SIZE;
+
+	int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0755);
+	if (fd < 0)
+		err(1, "unable to create %s", path);
+	if ((pwrite(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr))
+	    || (pwrite(fd, &phdr, sizeof(phdr), sizeof(ehdr)) != sizeof(phdr))
+	    || (pwrite(fd, image, sizeof(image), phdr.p_offset) != sizeof(image)))
+		err(1, "unable to write %s", path);
+	close(fd);
+}
+
+static void open_guest_fd(const char* path, int flags, int target)
+{
+	int fd = open(path, flags);
+	if (fd < 0)
+		err(1, "unable to open %s", path);
+	if (dup2(fd, target) < 0)
+		err(1, "dup2");
+	close(fd);
+}
+
+static void run_guest(char* path, int mark_fd)
+{
+	static const char* boot_vars[] = {
+		"HERMIT_MIGRATION_SERVER", "HERMIT_SNAPSHOT", "HERMIT_CHECKPOINT",
+		"HERMIT_MIGRATION_SUPPORT", "HERMIT_DEBUG", "HERMIT_NETIF",
+		"HERMIT_FREE_PAGE_REPORTING", "HERMIT_STATS",
+	};
+	char* argv[] = { "uhyve-bench", path, NULL };
+
+	for(size_t i = 0; i < sizeof(boot_vars)/sizeof(boot_vars[0]); i++)
+		unsetenv(boot_vars[i]);
+	setenv("HERMIT_MEM", GUEST_MEM, 1);
+	setenv("HERMIT_CPUS", "1", 1);
+
+	if (dup2(mark_fd, MARK_FD) < 0)
+		err(1, "dup2");
+	close(mark_fd);
+	open_guest_fd("/dev/null", O_RDWR, NULL_FD);
+	open_guest_fd("/dev/zero", O_RDONLY, ZERO_FD);
+	open_guest_fd("/dev/null", O_WRONLY, STDOUT_FILENO);
+
+	if (uhyve_init(path) < 0)
+		exit(EXIT_FAILURE);
+	exit(uhyve_loop(2, argv));
+}
+
+static void bench_hypercall(void)
+{
+	char path[sizeof(workdir) + 16];
+
+	snprintf(path, sizeof(path), "%s/guest", workdir);
+
+	for(size_t i = 0; i < sizeof(bench_ports)/sizeof(bench_ports[0]); i++) {
+		const bench_port_t* bp = bench_ports + i;
+		int fds[2];
+		uint64_t t[2] = { 0, 0 };
+		int status;
+		char c;
+
+		write_guest(path, bp, iterations);
+
+		if (pipe(fds) < 0)
+			err(1, "pipe");
+
+		pid_t pid = fork();
+		if (pid < 0)
+			err(1, "fork");
+		if (pid == 0) {
+			close(fds[0]);
+			run_guest(path, fds[1]);
+		}
+		close(fds[1]);
+
+		int marks;
+		for(marks = 0; marks < 2; marks++) {
+			if (read(fds[0], &c, 1) != 1)
+				break;
+			t[marks] = stats_now();
+		}
+		close(fds[0]);
+		waitpid(pid, &status, 0);
+
+		if ((marks < 2) || !WIFEXITED(status) || WEXITSTATUS(status)) {
+			fprintf(stderr, "[ERROR] Benchmark guest for port %s failed\n", bp->name);
+			printf("{\"bench\":\"hypercall\",\"port\":\"%s\",\"status\":\"failed\"}\n", bp->name);
+			continue;
+		}
+
+		printf("{\"bench\":\"hypercall\",\"port\":\"%s\",\"port_no\":%u,"
+			"\"iterations\":%u,\"ns_per_op\":%.1f}\n",
+			bp->name, bp->port, iterations, (double) (t[1] - t[0]) / iterations);
+		fflush(stdout);
+	}
+
+	unlink(path);
+}
+
+/*
+ * ring throughput
+ */
+
+typedef struct {
+	shared_queue_t* queue;
+	uint16_t frame_size;
+	uint64_t frames;
+} bench_ring_t;
+
+static void* ring_producer(void* arg)
+{
+	bench_ring_t* ring = (bench_ring_t*) arg;
+	shared_queue_t* q = ring->queue;
+	uint8_t frame[UHYVE_NET_MTU+34];
+
+	memset(frame, 0xA5, sizeof(frame));
+
+	for(uint64_t i = 0; i < ring->frames; i++) {
+		uint64_t written = atomic_uint64_read(&q->written);
+
+		while (written - atomic_uint64_read(&q->read) >= UHYVE_QUEUE_SIZE)
+			sched_yield();
+
+		queue_inner_t* slot = q->inner + (written % UHYVE_QUEUE_SIZE);
+		memcpy(slot->data, frame, ring->frame_size);
+		slot->len = ring->frame_size;
+		atomic_uint64_inc(&q->written);
+	}
+
+	return NULL;
+}
+
+static void* ring_consumer(void* arg)
+{
+	bench_ring_t* ring = (bench_ring_t*) arg;
+	shared_queue_t* q = ring->queue;
+	uint8_t frame[UHYVE_NET_MTU+34];
+	uint64_t bytes = 0;
+
+	for(uint64_t i = 0; i < ring->frames; i++) {
+		uint64_t read = atomic_uint64_read(&q->read);
+
+		while (atomic_uint64_read(&q->written) == read)
+			sched_yield();
+
+		queue_inner_t* slot = q->inner + (read % UHYVE_QUEUE_SIZE);
+		memcpy(frame, slot->data, slot->len);
+		bytes += slot->len;
+		atomic_uint64_inc(&q->read);
+	}
+
+	if (bytes != ring->frames * ring->frame_size)
+		errx(1, "ring benchmark lost frames");
+
+	return NULL;
+}
+
+static void bench_ring(void)
+{
+	static const uint16_t frame_sizes[] = { 64, 512, UHYVE_NET_MTU };
+	shared_queue_t* q;
+
+	if (posix_memalign((void**) &q, 64, SHAREDQUEUE_SIZE(UHYVE_QUEUE_SIZE)))
+		errx(1, "unable to allocate the shared queue");
+
+	for(size_t i = 0; i < sizeof(frame_sizes)/sizeof(frame_sizes[0]); i++) {
+		bench_ring_t ring = { q, frame_sizes[i], ring_frames };
+		pthread_t producer, consumer;
+
+		memset(q, 0x00, SHAREDQUEUE_SIZE(UHYVE_QUEUE_SIZE));
+
+		uint64_t begin = stats_now();
+		if (pthread_create(&consumer, NULL, ring_consumer, &ring)
+		    || pthread_create(&producer, NULL, ring_producer, &ring))
+			errx(1, "unable to create the ring threads");
+		pthread_join(producer, NULL);
+		pthread_join(consumer, NULL);
+		uint64_t ns = stats_now() - begin;
+
+		printf("{\"bench\":\"ring\",\"slots\":%u,\"frame_bytes\":%u,\"frames\":%lu,"
+			"\"mpps\":%.3f,\"gbit_s\":%.3f}\n",
+			UHYVE_QUEUE_SIZE, ring.frame_size, ring.frames,
+			(double) ring.frames / ns * 1e3,
+			(double) ring.frames * ring.frame_size * 8 / ns);
+		fflush(stdout);
+	}
+
+	free(q);
+}
+
+/*
+ * checkpoint throughput
+ */
+
+typedef struct {
+	uint8_t* mem;
+	uint64_t* pfns;
+	size_t count;
+	unsigned threads;
+	unsigned index;
+} bench_chk_t;
+
+static void* chk_thread(void* arg)
+{
+	bench_chk_t* chk = (bench_chk_t*) arg;
+
+	for(size_t i = chk->index; i < chk->count; i += chk->threads) {
+		uint64_t entry = (chk->pfns[i] * BENCH_PAGE_SIZE) | 0x1;	// present
+
+		chk_write_page(&entry, sizeof(entry), chk->mem + chk->pfns[i] * BENCH_PAGE_SIZE, BENCH_PAGE_SIZE);
+	}
+	chk_writer_flush();
+
+	return NULL;
+}
+
+static void* bench_locate(uint8_t* mem, uint64_t entry, size_t* page_size)
+{
+	*page_size = BENCH_PAGE_SIZE;
+
+	return mem + (entry & ~(uint64_t)(BENCH_PAGE_SIZE-1));
+}
+
+static void bench_checkpoint(void)
+{
+	const char* fname = "checkpoint/chk0_mem.dat";
+	unsigned threads = chk_threads();
+	pthread_t tids[threads];
+	bench_chk_t args[threads];
+	struct kvm_clock_data clock;
+	struct stat st;
+
+	if ((mkdir("checkpoint", 0755) < 0) && (errno != EEXIST))
+		err(1, "unable to create the checkpoint directory");
+
+	for(unsigned s = 0; s < nsizes; s++) {
+		size_t pages = sizes[s] / BENCH_PAGE_SIZE;
+		uint8_t* mem = alloc_mem(sizes[s]);
+		uint8_t* copy = alloc_mem(sizes[s]);
+		uint64_t* pfns = (uint64_t*) malloc(pages * sizeof(uint64_t));
+		if (!pfns)
+			err(1, "Not enough memory");
+
+		guest_size = sizes[s];
+		fill_random(mem, sizes[s], sizes[s]);
+
+		for(unsigned r = 0; r < nratios; r++) {
+			size_t count = select_dirty(pages, ratios[r], pfns);
+
+			// otherwise, the pages of the previous run are deduplicated
+			chk_dedup_reset();
+			memset(&clock, 0x00, sizeof(clock));
+
+			uint64_t begin = stats_now();
+			chk_writer_open(fname, 0, &clock);
+			for(unsigned t = 0; t < threads; t++) {
+				args[t] = (bench_chk_t) { mem, pfns, count, threads, t };
+				if (pthread_create(tids+t, NULL, chk_thread, args+t))
+					errx(1, "unable to create the checkpoint threads");
+			}
+			for(unsigned t = 0; t < threads; t++)
+				pthread_join(tids[t], NULL);
+			chk_writer_close();
+			uint64_t write_ns = stats_now() - begin;
+
+			if (stat(fname, &st) < 0)
+				err(1, "stat %s", fname);
+
+			madvise(copy, sizes[s], MADV_DONTNEED);
+			begin = stats_now();
+			int ret = chk_restore(copy, sizes[s], 0, 0, false, bench_locate, &clock);
+			uint64_t restore_ns = stats_now() - begin;
+
+			bool valid = (ret == 0);
+			for(size_t i = 0; valid && (i < count); i++) {
+				size_t off = pfns[i] * BENCH_PAGE_SIZE;
+				valid = (memcmp(mem + off, copy + off, BENCH_PAGE_SIZE) == 0);
+			}
+			if (!valid)
+				fprintf(stderr, "[ERROR] Restored checkpoint differs from the guest memory\n");
+
+			printf("{\"bench\":\"checkpoint\",\"guest_bytes\":%lu,\"dirty_ratio\":%.3f,"
+				"\"pages\":%zu,\"threads\":%u,\"file_bytes\":%lu,"
+				"\"write_ns\":%lu,\"write_mib_s\":%.1f,"
+				"\"restore_ns\":%lu,\"restore_mib_s\":%.1f,\"valid\":%s}\n",
+				sizes[s], ratios[r], count, threads, (uint64_t) st.st_size,
+				write_ns, rate_mib(count * BENCH_PAGE_SIZE, write_ns),
+				restore_ns, rate_mib(count * BENCH_PAGE_SIZE, restore_ns),
+				valid ? "true" : "false");
+			fflush(stdout);
+		}
+
+		unlink(fname);
+		free(pfns);
+		munmap(copy, sizes[s]);
+		munmap(mem, sizes[s]);
+	}
+
+	rmdir("checkpoint");
+}
+
+/*
+ * migration bandwidth and downtime
+ *
+ * The benchmark drives the migration transport of uhyve (TCP or RDMA)
+ * between the process and a forked destination. The source memory is
+ * identity mapped by 4 KiB pages, so that determine_dirty_pages() finds
+ * the pages, whose dirty bit the benchmark sets after the pre-copy phase.
+ *
+ * Each configuration of the transport uses its own connection (and port),
+ * which carries one migration per guest size and ratio. A migration starts
+ * with the guest size, the destination acknowledges the received memory
+ * with a single byte followed by a digest of the memory behind the page
+ * tables. A size of MIG_BENCH_END terminates the connection.
+ */
+
+#define BENCH_PML4		0x10000		// see BOOT_PML4
+#define BENCH_PG_PRESENT	(1UL << 0)
+#define BENCH_PG_RW		(1UL << 1)
+#define BENCH_PG_ACCESSED	(1UL << 5)
+#define BENCH_PG_DIRTY		(1UL << 6)
+#define BENCH_PG_ENTRIES	512
+
+typedef struct {
+	uint32_t streams;
+	bool zerocopy;
+	bool compress;
+} bench_mig_config_t;
+
+static const bench_mig_config_t mig_configs[] = {
+#ifdef __RDMA_MIGRATION__
+	{ 1, false, false },
+#else
+	{ 1, false, false },
+	{ 4, false, false },
+	{ 4, true, false },
+	{ 4, false, true },
+#endif
+};
+
+#ifdef __RDMA_MIGRATION__
+#define MIG_BENCH_TRANSPORT	"rdma"
+#else
+#define MIG_BENCH_TRANSPORT	"tcp"
+#endif
+
+#define MIG_BENCH_CONFIGS	(sizeof(mig_configs) / sizeof(mig_configs[0]))
+
+/* number of the page tables of an identity mapping of the guest */
+static void count_page_tables(size_t size, size_t* pgds, size_t* pgts)
+{
+	size_t pages = size / BENCH_PAGE_SIZE;
+
+	*pgts = (pages + BENCH_PG_ENTRIES - 1) / BENCH_PG_ENTRIES;
+	*pgds = (*pgts + BENCH_PG_ENTRIES - 1) / BENCH_PG_ENTRIES;
+}
+
+/* returns the first byte of the guest memory behind the page tables */
+static size_t page_tables_end(size_t size)
+{
+	size_t pgds, pgts;
+
+	count_page_tables(size, &pgds, &pgts);
+
+	return BENCH_PML4 + (2 + pgds + pgts) * BENCH_PAGE_SIZE;
+}
+
+/* maps the memory by 4 KiB pages, the tables start at BENCH_PML4 */
+static uint64_t* build_page_tables(uint8_t* mem, size_t size)
+{
+	size_t pgds, pgts;
+	size_t end = page_tables_end(size);
+
+	if (end >= size)
+		errx(1, "%zu bytes are too small for the migration benchmark", size);
+
+	count_page_tables(size, &pgds, &pgts);
+	memset(mem + BENCH_PML4, 0x00, end - BENCH_PML4);
+
+	uint64_t* pml4 = (uint64_t*) (mem + BENCH_PML4);
+	uint64_t* pdpt = pml4 + BENCH_PG_ENTRIES;
+	uint64_t* pgd = pdpt + BENCH_PG_ENTRIES;
+	uint64_t* pgt = pgd + pgds * BENCH_PG_ENTRIES;
+
+	pml4[0] = ((uint64_t) pdpt - (uint64_t) mem) | BENCH_PG_PRESENT | BENCH_PG_RW;
+	for(size_t i = 0; i < pgds; i++)
+		pdpt[i] = ((uint64_t) (pgd + i * BENCH_PG_ENTRIES) - (uint64_t) mem) | BENCH_PG_PRESENT | BENCH_PG_RW;
+	for(size_t i = 0; i < pgts; i++)
+		pgd[i] = ((uint64_t) (pgt + i * BENCH_PG_ENTRIES) - (uint64_t) mem) | BENCH_PG_PRESENT | BENCH_PG_RW;
+	for(size_t i = 0; i < size / BENCH_PAGE_SIZE; i++)
+		pgt[i] = (i * BENCH_PAGE_SIZE) | BENCH_PG_PRESENT | BENCH_PG_RW;
+
+	return pgt;
+}
+
+/* FNV-1a over 64 bit words */
+static uint64_t digest(const uint8_t* mem, size_t size)
+{
+	const uint64_t* p = (const uint64_t*) mem;
+	uint64_t hash = 0xCBF29CE484222325ULL;
+
+	for(size_t i = 0; i < size / sizeof(uint64_t); i++)
+		hash = (hash ^ p[i]) * 0x100000001B3ULL;
+
+	return hash;
+}
+
+/* the transports pass host-virtual addresses of the guest memory */
+static void convert_regions(mem_mappings_t* regions)
+{
+	for(size_t i = 0; i < regions->count; i++)
+		regions->mem_chunks[i].ptr = guest_mem + (size_t) regions->mem_chunks[i].ptr;
+}
+
+static void mig_receiver(void)
+{
+	mem_mappings_t regions;
+	uint64_t size, hash;
+	uint8_t ack = 1;
+
+	// keep the migration parameters out of the results
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+
+	for(size_t c = 0; c < MIG_BENCH_CONFIGS; c++) {
+		wait_for_client(mig_port + c);
+
+		while (true) {
+			recv_data(&size, sizeof(size));
+			if (size == MIG_BENCH_END)
+				break;
+
+			guest_mem = alloc_mem(size);
+			guest_size = size;
+
+			recv_mem_regions(&regions);
+			convert_regions(&regions);
+			recv_guest_mem(regions);
+			free(regions.mem_chunks);
+			send_data(&ack, sizeof(ack));
+
+			// the page tables differ by their accessed and dirty bits
+			size_t data = page_tables_end(size);
+			hash = digest(guest_mem + data, size - data);
+			send_data(&hash, sizeof(hash));
+
+			munmap(guest_mem, size);
+			guest_mem = NULL;
+		}
+
+		close_migration_channel();
+	}
+
+	exit(EXIT_SUCCESS);
+}
+
+static bool mig_connect(uint16_t port)
+{
+	int tries;
+
+	set_migration_target("127.0.0.1", port);
+	fflush(stdout);
+	int out = dup(STDOUT_FILENO);
+	dup2(STDERR_FILENO, STDOUT_FILENO);
+	for(tries = 0; tries < 50; tries++) {
+		usleep(100000);
+		if (connect_to_server() == 0)
+			break;
+	}
+	fflush(stdout);
+	dup2(out, STDOUT_FILENO);
+	close(out);
+
+	return tries < 50;
+}
+
+/* migrates the guest memory once, the ratio of pages is dirty during the stop */
+static void mig_run(const bench_mig_config_t* config, uint8_t* mem, uint64_t* pgt, size_t size,
+	double ratio, uint64_t* pfns)
+{
+	size_t data = page_tables_end(size);
+	mem_chunk_t chunk = { .size = size, .ptr = NULL };
+	mem_mappings_t regions = { &chunk, 1 };
+	uint64_t hash;
+	uint8_t ack;
+
+	send_data(&size, sizeof(size));
+	send_mem_regions(regions, regions);
+	chunk.ptr = mem;
+
+	uint64_t begin = stats_now();
+	precopy_phase(regions, regions);
+	uint64_t precopy_ns = stats_now() - begin;
+
+	// the guest modifies the pages before its vCPUs are stopped
+	size_t count = select_dirty((size - data) / BENCH_PAGE_SIZE, ratio, pfns);
+	for(size_t i = 0; i < count; i++) {
+		size_t pfn = pfns[i] + data / BENCH_PAGE_SIZE;
+
+		(*(uint64_t*) (mem + pfn * BENCH_PAGE_SIZE))++;
+		pgt[pfn] |= BENCH_PG_ACCESSED | BENCH_PG_DIRTY;
+	}
+
+	begin = stats_now();
+	stop_and_copy_phase();
+	recv_data(&ack, sizeof(ack));
+	uint64_t downtime_ns = stats_now() - begin;
+
+	recv_data(&hash, sizeof(hash));
+	bool valid = (hash == digest(mem + data, size - data));
+	if (!valid)
+		fprintf(stderr, "[ERROR] Migrated memory differs from the guest memory\n");
+
+	printf("{\"bench\":\"migration\",\"transport\":\"%s\",\"streams\":%u,"
+		"\"zerocopy\":%s,\"compress\":%s,\"guest_bytes\":%lu,"
+		"\"dirty_ratio\":%.3f,\"pages\":%zu,"
+		"\"precopy_ns\":%lu,\"precopy_mib_s\":%.1f,"
+		"\"downtime_ms\":%.3f,\"stop_and_copy_mib_s\":%.1f,\"valid\":%s}\n",
+		MIG_BENCH_TRANSPORT, config->streams,
+		config->zerocopy ? "true" : "false", config->compress ? "true" : "false",
+		(uint64_t) size, ratio, count,
+		precopy_ns, rate_mib(size, precopy_ns),
+		(double) downtime_ns / 1e6, rate_mib(count * BENCH_PAGE_SIZE, downtime_ns),
+		valid ? "true" : "false");
+	fflush(stdout);
+}
+
+static void bench_migration(void)
+{
+	uint64_t end = MIG_BENCH_END;
+	int status;
+
+	pid_t pid = fork();
+	if (pid < 0)
+		err(1, "fork");
+	if (pid == 0)
+		mig_receiver();
+
+	for(size_t c = 0; c < MIG_BENCH_CONFIGS; c++) {
+		const bench_mig_config_t* config = mig_configs + c;
+
+		mig_params.type = MIG_TYPE_LIVE;
+		mig_params.streams = config->streams;
+		mig_params.zerocopy = config->zerocopy;
+		mig_params.compress = config->compress;
+
+		if (!mig_connect(mig_port + c)) {
+			kill(pid, SIGTERM);
+			waitpid(pid, &status, 0);
+			errx(1, "unable to connect to the migration benchmark receiver");
+		}
+
+		for(unsigned s = 0; s < nsizes; s++) {
+			size_t pages = sizes[s] / BENCH_PAGE_SIZE;
+			uint8_t* mem = alloc_mem(sizes[s]);
+			uint64_t* pfns = (uint64_t*) malloc(pages * sizeof(uint64_t));
+			if (!pfns)
+				err(1, "Not enough memory");
+
+			fill_random(mem, sizes[s], sizes[s]);
+			uint64_t* pgt = build_page_tables(mem, sizes[s]);
+			guest_mem = mem;
+			guest_size = sizes[s];
+
+			for(unsigned r = 0; r < nratios; r++)
+				mig_run(config, mem, pgt, sizes[s], ratios[r], pfns);
+
+			guest_mem = NULL;
+			free(pfns);
+			munmap(mem, sizes[s]);
+		}
+
+		send_data(&end, sizeof(end));
+		close_migration_channel();
+	}
+
+	waitpid(pid, &status, 0);
+}
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "usage: %s [-i iterations] [-n frames] [-s sizes] [-r ratios] [-p port] "
+		"[hypercall|ring|checkpoint|migration]...\n", name);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv)
+{
+	static const char* parts[BENCH_PARTS] = { "hypercall", "ring", "checkpoint", "migration" };
+	static void (*benches[BENCH_PARTS])(void) = { bench_hypercall, bench_ring, bench_checkpoint, bench_migration };
+	bool selected[BENCH_PARTS] = { false };
+	int opt;
+
+	while ((opt = getopt(argc, argv, "i:n:s:r:p:")) != -1) {
+		switch (opt) {
+		case 'i':
+			iterations = (unsigned) strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			ring_frames = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			nsizes = parse_sizes(optarg, sizes);
+			break;
+		case 'r':
+			nratios = parse_ratios(optarg, ratios);
+			break;
+		case 'p':
+			mig_port = (uint16_t) atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!iterations || !ring_frames || !nsizes || !nratios)
+		usage(argv[0]);
+
+	if (optind == argc) {
+		for(size_t i = 0; i < BENCH_PARTS; i++)
+			selected[i] = true;
+	}
+	for(int i = optind; i < argc; i++) {
+		size_t j;
+		for(j = 0; j < BENCH_PARTS; j++) {
+			if (strcmp(argv[i], parts[j]) == 0)
+				break;
+		}
+		if (j == BENCH_PARTS)
+			usage(argv[0]);
+		selected[j] = true;
+	}
+
+	if (!mkdtemp(workdir))
+		err(1, "unable to create a working directory");
+	if (chdir(workdir) < 0)
+		err(1, "chdir %s", workdir);
+
+	for(size_t i = 0; i < BENCH_PARTS; i++) {
+		if (selected[i])
+			benches[i]();
+	}
+
+	if (chdir("/") == 0)
+		rmdir(workdir);
+
+	return 0;
+}
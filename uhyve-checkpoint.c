@@ -0,0 +1,1207 @@
+/*
+ * Copyright (c) 2018, RWTH Aachen University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Each thread, which saves pages, owns a buffer of CHK_EXTENT_SIZE bytes.
+ * A full buffer reserves its file range by an atomic increment of the end
+ * of file and is written by a single pwrite(). Therefore, the threads
+ * never wait for each other. If possible, the file is opened with
+ * O_DIRECT, so that the pages do not pollute the page cache of the host.
+ *
+ * Before a page is copied into the buffer, it is checked for zeros, looked
+ * up in the dedup table and, if this does not help, compressed. This
+ * happens in the thread, which saves the page, i.e. in parallel. Pages are
+ * registered in the dedup table when their buffer has been written, because
+ * only then the file offset is known.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_LINUX_USERFAULTFD_H
+#include <linux/userfaultfd.h>
+#endif
+
+#ifdef HAVE_LZ4_H
+#include <lz4.h>
+#endif
+
+#include "uhyve-checkpoint.h"
+#include "uhyve-common.h"
+
+#define MAX_FNAME		256
+
+/* records start at 8 byte boundaries */
+#define CHK_ALIGN(x)		(((x) + 7) & ~((size_t) 7))
+
+/* the dedup table is split into stripes, which have their own lock */
+#define CHK_DEDUP_STRIPES	64
+#define CHK_DEDUP_MAX_SLOTS	(1UL << 21)
+#define CHK_DEDUP_PROBES	16
+
+#define HASH_P1			0x9E3779B185EBCA87ULL
+#define HASH_P2			0xC2B2AE3D27D4EB4FULL
+#define HASH_P3			0x165667B19E3779F9ULL
+
+extern size_t guest_size;
+
+typedef struct {
+	uint64_t hash[2];
+	uint32_t size;		// 0 => unused slot
+	uint32_t chk_no;
+	uint64_t offset;
+} chk_dedup_entry_t;
+
+/* records of the current buffer, which have to be added to the dedup table */
+typedef struct {
+	uint64_t hash[2];
+	uint32_t size;
+	uint32_t pos;
+} chk_pending_t;
+
+typedef struct {
+	uint8_t* data;
+	size_t fill;
+	chk_pending_t* pending;
+	size_t pending_count;
+	size_t pending_max;
+	chk_index_entry_t* index;	// offsets are relative to the buffer
+	size_t index_count;
+	size_t index_max;
+	uint8_t* verify;		// 2 * CHK_MAX_PAGE_SIZE bytes to compare dedup candidates
+} chk_buffer_t;
+
+static int chk_fd = -1;
+static uint32_t chk_no = 0;
+static volatile uint64_t chk_file_end = CHK_HEADER_SIZE;
+static chk_header_t chk_header;
+#ifdef HAVE_LZ4_H
+static bool chk_compress = false;
+#endif
+static bool chk_dedup = false;
+
+/* index of the file, which is written behind the last record */
+static chk_index_entry_t* chk_index = NULL;
+static size_t chk_index_count = 0;
+static size_t chk_index_max = 0;
+static pthread_mutex_t chk_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the current file for reading, older files are opened on demand */
+static int chk_read_fd = -1;
+
+static chk_dedup_entry_t* dedup_table = NULL;
+static size_t dedup_stripe_slots = 0;
+static pthread_mutex_t dedup_locks[CHK_DEDUP_STRIPES];
+
+static __thread chk_buffer_t chk_buffer = { NULL, 0, NULL, 0, 0, NULL, 0, 0, NULL };
+
+unsigned chk_threads(void)
+{
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+	const char* str = getenv("HERMIT_CHECKPOINT_THREADS");
+	if (str)
+		threads = atoi(str);
+
+	if (threads < 1)
+		threads = 1;
+	if (threads > CHK_MAX_THREADS)
+		threads = CHK_MAX_THREADS;
+
+	return (unsigned) threads;
+}
+
+static inline bool env_enabled(const char* name, bool def)
+{
+	const char* str = getenv(name);
+
+	if (!str)
+		return def;
+
+	return strcmp(str, "0") != 0;
+}
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+	return rotl64(acc + input * HASH_P2, 31) * HASH_P1;
+}
+
+static inline uint64_t hash_avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= HASH_P2;
+	h ^= h >> 29;
+	h *= HASH_P3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+/* 128 bit content hash of a page, the size is a multiple of 32 bytes */
+static void chk_hash(const void* page, size_t size, uint64_t hash[2])
+{
+	const uint64_t* p = (const uint64_t*) page;
+	uint64_t v1 = HASH_P1 + HASH_P2;
+	uint64_t v2 = HASH_P2;
+	uint64_t v3 = 0;
+	uint64_t v4 = -HASH_P1;
+
+	for(size_t i = 0; i < size / sizeof(uint64_t); i += 4) {
+		v1 = hash_round(v1, p[i]);
+		v2 = hash_round(v2, p[i+1]);
+		v3 = hash_round(v3, p[i+2]);
+		v4 = hash_round(v4, p[i+3]);
+	}
+
+	hash[0] = hash_avalanche(rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18) + size);
+	hash[1] = hash_avalanche((rotl64(v1, 29) ^ rotl64(v3, 43)) * HASH_P1 + (rotl64(v2, 37) ^ rotl64(v4, 53)) * HASH_P3);
+}
+
+static bool chk_page_is_zero(const void* page, size_t size)
+{
+	const uint64_t* p = (const uint64_t*) page;
+
+	for(size_t i = 0; i < size / sizeof(uint64_t); i++) {
+		if (p[i])
+			return false;
+	}
+
+	return true;
+}
+
+/* Decodes the payload (RAW or LZ4) in buf into dest */
+static int chk_decode(uint32_t type, const uint8_t* buf, uint32_t len, void* dest, size_t page_size)
+{
+	switch(type) {
+	case CHK_RECORD_RAW:
+		if (len != page_size)
+			return -1;
+		memcpy(dest, buf, page_size);
+		return 0;
+#ifdef HAVE_LZ4_H
+	case CHK_RECORD_LZ4:
+		if (LZ4_decompress_safe((const char*) buf, (char*) dest, len, page_size) != (int) page_size)
+			return -1;
+		return 0;
+#endif
+	default:
+		fprintf(stderr, "[ERROR] Unsupported checkpoint record %u\n", type);
+		return -1;
+	}
+}
+
+/* file descriptors of checkpoint/chk<n>_mem.dat, which are opened on demand */
+typedef struct {
+	int* fds;
+	uint32_t count;
+	pthread_mutex_t lock;
+} chk_files_t;
+
+static int chk_file(chk_files_t* files, uint32_t no)
+{
+	int fd;
+
+	pthread_mutex_lock(&files->lock);
+
+	if (no >= files->count) {
+		int* fds = (int*) realloc(files->fds, (no + 1) * sizeof(int));
+		if (!fds) {
+			pthread_mutex_unlock(&files->lock);
+			return -1;
+		}
+		for(uint32_t i = files->count; i <= no; i++)
+			fds[i] = -1;
+		files->fds = fds;
+		files->count = no + 1;
+	}
+
+	if (files->fds[no] < 0) {
+		char fname[MAX_FNAME];
+
+		snprintf(fname, MAX_FNAME, "checkpoint/chk%u_mem.dat", no);
+		files->fds[no] = open(fname, O_RDONLY);
+		if (files->fds[no] < 0)
+			fprintf(stderr, "[ERROR] Unable to open %s - %d (%s)\n", fname, errno, strerror(errno));
+	}
+	fd = files->fds[no];
+
+	pthread_mutex_unlock(&files->lock);
+
+	return fd;
+}
+
+static void chk_files_close(chk_files_t* files)
+{
+	for(uint32_t i = 0; i < files->count; i++) {
+		if (files->fds[i] >= 0)
+			close(files->fds[i]);
+	}
+	free(files->fds);
+	files->fds = NULL;
+	files->count = 0;
+}
+
+/* older checkpoint files, which dedup candidates reference */
+static chk_files_t dedup_files = { NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+static void dedup_init(void)
+{
+	size_t slots = CHK_DEDUP_STRIPES;
+
+	while ((slots < CHK_DEDUP_MAX_SLOTS) && (slots < 2 * (guest_size >> 12)))
+		slots <<= 1;
+
+	dedup_table = (chk_dedup_entry_t*) calloc(slots, sizeof(chk_dedup_entry_t));
+	if (!dedup_table) {
+		fprintf(stderr, "[WARNING] Unable to allocate the dedup table, disable dedup\n");
+		chk_dedup = false;
+		return;
+	}
+
+	dedup_stripe_slots = slots / CHK_DEDUP_STRIPES;
+	for(size_t i = 0; i < CHK_DEDUP_STRIPES; i++)
+		pthread_mutex_init(&dedup_locks[i], NULL);
+}
+
+/*
+ * Searches the table for the hash. If it is not found and "insert" is
+ * true, the slot is filled with ref. Returns true if the hash is found.
+ */
+static bool dedup_access(const uint64_t hash[2], uint32_t size, chk_ref_t* ref, bool insert)
+{
+	size_t stripe = hash[1] % CHK_DEDUP_STRIPES;
+	chk_dedup_entry_t* base = dedup_table + stripe * dedup_stripe_slots;
+	bool found = false;
+
+	pthread_mutex_lock(&dedup_locks[stripe]);
+
+	for(size_t i = 0; i < CHK_DEDUP_PROBES; i++) {
+		chk_dedup_entry_t* e = base + ((hash[0] + i) & (dedup_stripe_slots - 1));
+
+		if (!e->size) {
+			if (insert) {
+				e->hash[0] = hash[0];
+				e->hash[1] = hash[1];
+				e->size = size;
+				e->chk_no = ref->chk_no;
+				e->offset = ref->offset;
+			}
+			break;
+		}
+
+		if ((e->hash[0] == hash[0]) && (e->hash[1] == hash[1]) && (e->size == size)) {
+			if (!insert) {
+				ref->chk_no = e->chk_no;
+				ref->offset = e->offset;
+			}
+			found = true;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&dedup_locks[stripe]);
+
+	return found;
+}
+
+/* Returns true if the record of ref has the same content as the page */
+static bool dedup_verify(chk_buffer_t* b, const chk_ref_t* ref, const void* page, size_t page_size)
+{
+	int fd = (ref->chk_no == chk_no) ? chk_read_fd : chk_file(&dedup_files, ref->chk_no);
+	chk_record_t rec;
+
+	if (fd < 0)
+		return false;
+
+	if (!b->verify) {
+		b->verify = (uint8_t*) malloc(2 * CHK_MAX_PAGE_SIZE);
+		if (!b->verify)
+			return false;
+	}
+
+	if ((pread(fd, &rec, sizeof(rec), ref->offset) != sizeof(rec)) || (rec.len > CHK_MAX_PAGE_SIZE))
+		return false;
+	if ((rec.type != CHK_RECORD_RAW) && (rec.type != CHK_RECORD_LZ4))
+		return false;
+	if (pread(fd, b->verify, rec.len, ref->offset + sizeof(rec)) != rec.len)
+		return false;
+
+	if (rec.type == CHK_RECORD_RAW)
+		return (rec.len == page_size) && !memcmp(b->verify, page, page_size);
+
+	uint8_t* dest = b->verify + CHK_MAX_PAGE_SIZE;
+	return (chk_decode(rec.type, b->verify, rec.len, dest, page_size) == 0) && !memcmp(dest, page, page_size);
+}
+
+void chk_writer_open(const char* fname, uint32_t no, const struct kvm_clock_data* clock)
+{
+	chk_fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC|O_DIRECT, 0666);
+	if ((chk_fd < 0) && (errno == EINVAL)) {
+		// the file system does not support O_DIRECT (e.g. tmpfs)
+		chk_fd = open(fname, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+	}
+	if (chk_fd < 0)
+		err(1, "open: unable to open file %s", fname);
+	chk_read_fd = open(fname, O_RDONLY);
+
+#ifdef HAVE_LZ4_H
+	chk_compress = env_enabled("HERMIT_CHECKPOINT_COMPRESS", true);
+#endif
+	chk_dedup = env_enabled("HERMIT_CHECKPOINT_DEDUP", true);
+	if (chk_dedup && !dedup_table)
+		dedup_init();
+
+	memset(&chk_header, 0x00, sizeof(chk_header));
+	memcpy(chk_header.magic, CHK_MAGIC, sizeof(chk_header.magic));
+	chk_header.version = CHK_VERSION;
+	chk_header.extent_size = CHK_EXTENT_SIZE;
+	chk_header.clock = *clock;
+
+	chk_no = no;
+	chk_file_end = CHK_HEADER_SIZE;
+	chk_index_count = 0;
+}
+
+static void chk_pwrite(const uint8_t* buf, size_t len, uint64_t offset)
+{
+	while (len > 0) {
+		ssize_t ret = pwrite(chk_fd, buf, len, offset);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "pwrite failed");
+		}
+
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+}
+
+static void chk_buffer_write(chk_buffer_t* b)
+{
+	if (!b->fill)
+		return;
+
+	// pad the block, O_DIRECT requires aligned sizes
+	size_t len = (b->fill + CHK_BLOCK_SIZE - 1) & ~(CHK_BLOCK_SIZE - 1);
+	if (len > b->fill) {
+		uint64_t padding = CHK_ENTRY_PADDING;
+
+		memcpy(b->data + b->fill, &padding, sizeof(padding));
+		memset(b->data + b->fill + sizeof(padding), 0x00, len - b->fill - sizeof(padding));
+	}
+
+	uint64_t offset = __sync_fetch_and_add(&chk_file_end, len);
+	chk_pwrite(b->data, len, offset);
+
+	// append the records to the index of the file
+	pthread_mutex_lock(&chk_index_lock);
+	if (chk_index_count + b->index_count > chk_index_max) {
+		size_t max = chk_index_max ? chk_index_max : 4096;
+
+		while (max < chk_index_count + b->index_count)
+			max *= 2;
+		chk_index = (chk_index_entry_t*) realloc(chk_index, max * sizeof(chk_index_entry_t));
+		if (!chk_index)
+			err(1, "unable to allocate checkpoint index");
+		chk_index_max = max;
+	}
+	for(size_t i = 0; i < b->index_count; i++) {
+		chk_index[chk_index_count].entry = b->index[i].entry;
+		chk_index[chk_index_count].offset = offset + b->index[i].offset;
+		chk_index_count++;
+	}
+	pthread_mutex_unlock(&chk_index_lock);
+	b->index_count = 0;
+
+	// now, the pages are able to serve as reference
+	for(size_t i = 0; i < b->pending_count; i++) {
+		chk_ref_t ref = { .chk_no = chk_no, .offset = offset + b->pending[i].pos };
+
+		dedup_access(b->pending[i].hash, b->pending[i].size, &ref, true);
+	}
+
+	b->pending_count = 0;
+	b->fill = 0;
+}
+
+void chk_writer_flush(void)
+{
+	chk_buffer_t* b = &chk_buffer;
+
+	if (!b->data)
+		return;
+
+	chk_buffer_write(b);
+	free(b->data);
+	free(b->pending);
+	free(b->index);
+	free(b->verify);
+	memset(b, 0x00, sizeof(*b));
+}
+
+static void chk_add_pending(chk_buffer_t* b, const uint64_t hash[2], uint32_t size, size_t pos)
+{
+	if (b->pending_count >= b->pending_max) {
+		size_t max = b->pending_max ? 2 * b->pending_max : 1024;
+		chk_pending_t* pending = (chk_pending_t*) realloc(b->pending, max * sizeof(chk_pending_t));
+
+		// without memory, the page is just not available for dedup
+		if (!pending)
+			return;
+
+		b->pending = pending;
+		b->pending_max = max;
+	}
+
+	b->pending[b->pending_count].hash[0] = hash[0];
+	b->pending[b->pending_count].hash[1] = hash[1];
+	b->pending[b->pending_count].size = size;
+	b->pending[b->pending_count].pos = pos;
+	b->pending_count++;
+}
+
+void chk_write_page(void* entry, size_t entry_size, void* page, size_t page_size)
+{
+	chk_buffer_t* b = &chk_buffer;
+	chk_record_t* rec;
+	uint64_t hash[2];
+
+	if (!b->data) {
+		if (posix_memalign((void**) &b->data, CHK_BLOCK_SIZE, CHK_EXTENT_SIZE))
+			err(1, "unable to allocate checkpoint buffer");
+		b->fill = 0;
+	}
+
+	// reserve space for the padding entry, too
+	if (b->fill + sizeof(chk_record_t) + CHK_ALIGN(page_size) + sizeof(uint64_t) > CHK_EXTENT_SIZE)
+		chk_buffer_write(b);
+
+	if (b->index_count >= b->index_max) {
+		size_t max = b->index_max ? 2 * b->index_max : 1024;
+
+		b->index = (chk_index_entry_t*) realloc(b->index, max * sizeof(chk_index_entry_t));
+		if (!b->index)
+			err(1, "unable to allocate checkpoint index");
+		b->index_max = max;
+	}
+
+	rec = (chk_record_t*) (b->data + b->fill);
+	rec->entry = 0;
+	memcpy(&rec->entry, entry, entry_size);
+
+	b->index[b->index_count].entry = rec->entry;
+	b->index[b->index_count].offset = b->fill;
+	b->index_count++;
+
+	if (chk_page_is_zero(page, page_size)) {
+		rec->type = CHK_RECORD_ZERO;
+		rec->len = 0;
+		goto out;
+	}
+
+	if (chk_dedup) {
+		chk_ref_t ref;
+
+		// the hash only selects a candidate, the content has to match
+		chk_hash(page, page_size, hash);
+		if (dedup_access(hash, page_size, &ref, false) && dedup_verify(b, &ref, page, page_size)) {
+			rec->type = CHK_RECORD_DUP;
+			rec->len = sizeof(ref);
+			memcpy(rec + 1, &ref, sizeof(ref));
+			goto out;
+		}
+	}
+
+	rec->type = CHK_RECORD_RAW;
+	rec->len = page_size;
+
+#ifdef HAVE_LZ4_H
+	if (chk_compress) {
+		// store the compressed page only if it saves at least 1/8
+		int ret = LZ4_compress_default((const char*) page, (char*) (rec + 1),
+				page_size, page_size - page_size / 8);
+
+		if (ret > 0) {
+			rec->type = CHK_RECORD_LZ4;
+			rec->len = ret;
+		}
+	}
+#endif
+
+	if (rec->type == CHK_RECORD_RAW)
+		memcpy(rec + 1, page, page_size);
+
+	if (chk_dedup)
+		chk_add_pending(b, hash, page_size, b->fill);
+
+out:
+	b->fill += sizeof(chk_record_t) + CHK_ALIGN(rec->len);
+}
+
+void chk_writer_close(void)
+{
+	uint8_t* block;
+
+	// the index follows the last block
+	if (chk_index_count) {
+		size_t len = chk_index_count * sizeof(chk_index_entry_t);
+		size_t aligned = (len + CHK_BLOCK_SIZE - 1) & ~(CHK_BLOCK_SIZE - 1);
+
+		if (posix_memalign((void**) &block, CHK_BLOCK_SIZE, aligned))
+			err(1, "unable to allocate checkpoint index");
+		memcpy(block, chk_index, len);
+		memset(block + len, 0x00, aligned - len);
+
+		chk_header.index_offset = chk_file_end;
+		chk_header.index_count = chk_index_count;
+		chk_pwrite(block, aligned, chk_file_end);
+		chk_file_end += aligned;
+		free(block);
+	}
+
+	if (posix_memalign((void**) &block, CHK_BLOCK_SIZE, CHK_HEADER_SIZE))
+		err(1, "unable to allocate checkpoint header");
+
+	memset(block, 0x00, CHK_HEADER_SIZE);
+	memcpy(block, &chk_header, sizeof(chk_header));
+	chk_pwrite(block, CHK_HEADER_SIZE, 0);
+	free(block);
+
+	close(chk_fd);
+	chk_fd = -1;
+	if (chk_read_fd >= 0)
+		close(chk_read_fd);
+	chk_read_fd = -1;
+}
+
+void chk_dedup_reset(void)
+{
+	if (!dedup_table)
+		return;
+
+	for(size_t i = 0; i < CHK_DEDUP_STRIPES; i++)
+		pthread_mutex_lock(&dedup_locks[i]);
+
+	memset(dedup_table, 0x00, CHK_DEDUP_STRIPES * dedup_stripe_slots * sizeof(chk_dedup_entry_t));
+
+	for(size_t i = 0; i < CHK_DEDUP_STRIPES; i++)
+		pthread_mutex_unlock(&dedup_locks[i]);
+
+	// the files may be removed
+	pthread_mutex_lock(&dedup_files.lock);
+	chk_files_close(&dedup_files);
+	pthread_mutex_unlock(&dedup_files.lock);
+}
+
+bool chk_read_header(FILE* f, chk_header_t* header)
+{
+	long pos = ftell(f);
+
+	if ((fread(header, sizeof(*header), 1, f) == 1)
+	    && (memcmp(header->magic, CHK_MAGIC, sizeof(header->magic)) == 0)
+	    && (header->version >= CHK_VERSION_BLOCKS) && (header->version <= CHK_VERSION)) {
+		fseek(f, CHK_HEADER_SIZE, SEEK_SET);
+		return true;
+	}
+
+	fseek(f, pos, SEEK_SET);
+	return false;
+}
+
+/*
+ * Restores the page of the record at "offset" of checkpoint "no". scratch
+ * has to provide CHK_MAX_PAGE_SIZE bytes.
+ */
+static int chk_read_record(chk_files_t* files, uint32_t no, uint64_t offset, void* dest, size_t page_size, uint8_t* scratch, bool follow)
+{
+	int fd = chk_file(files, no);
+	chk_record_t rec;
+
+	if (fd < 0)
+		return -1;
+	if (pread(fd, &rec, sizeof(rec), offset) != sizeof(rec))
+		return -1;
+	if (rec.len > CHK_MAX_PAGE_SIZE)
+		return -1;
+
+	if (rec.type == CHK_RECORD_ZERO) {
+		memset(dest, 0x00, page_size);
+		return 0;
+	}
+
+	if (rec.type == CHK_RECORD_DUP) {
+		chk_ref_t ref;
+
+		// a reference always points to the original record
+		if (!follow || (rec.len != sizeof(ref)))
+			return -1;
+		if (pread(fd, &ref, sizeof(ref), offset + sizeof(rec)) != sizeof(ref))
+			return -1;
+
+		return chk_read_record(files, ref.chk_no, ref.offset, dest, page_size, scratch, false);
+	}
+
+	if (pread(fd, scratch, rec.len, offset + sizeof(rec)) != rec.len)
+		return -1;
+
+	return chk_decode(rec.type, scratch, rec.len, dest, page_size);
+}
+
+int chk_load_records(FILE* f, const chk_header_t* header, uint8_t* mem,
+	void* (*locate)(uint8_t* mem, uint64_t entry, size_t* page_size))
+{
+	chk_files_t files = { NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+	uint8_t* scratch;
+	uint64_t entry;
+	int ret = 0;
+
+	scratch = (uint8_t*) malloc(CHK_MAX_PAGE_SIZE);
+	if (!scratch)
+		return -1;
+
+	while (fread(&entry, sizeof(entry), 1, f) == 1) {
+		chk_record_t rec;
+		size_t page_size;
+
+		if (entry == CHK_ENTRY_PADDING) {
+			// skip to the next block
+			long pos = ftell(f);
+			fseek(f, (pos + CHK_BLOCK_SIZE - 1) & ~((long) CHK_BLOCK_SIZE - 1), SEEK_SET);
+			continue;
+		}
+
+		// the records end at the index
+		if (header->index_count && ((uint64_t) ftell(f) > header->index_offset))
+			break;
+
+		void* dest = locate(mem, entry, &page_size);
+
+		if (header->version == CHK_VERSION_BLOCKS) {
+			// version 2 stores only raw pages
+			if (fread(dest, page_size, 1, f) != 1)
+				goto error;
+			continue;
+		}
+
+		if (fread(&rec.type, sizeof(rec) - sizeof(rec.entry), 1, f) != 1)
+			goto error;
+		if (rec.len > CHK_MAX_PAGE_SIZE)
+			goto error;
+
+		if (rec.type == CHK_RECORD_ZERO) {
+			memset(dest, 0x00, page_size);
+		} else if (rec.type == CHK_RECORD_DUP) {
+			chk_ref_t ref;
+
+			if ((rec.len != sizeof(ref)) || (fread(&ref, sizeof(ref), 1, f) != 1))
+				goto error;
+			if (chk_read_record(&files, ref.chk_no, ref.offset, dest, page_size, scratch, false) < 0)
+				goto error;
+		} else if (rec.type == CHK_RECORD_RAW) {
+			if ((rec.len != page_size) || (fread(dest, page_size, 1, f) != 1))
+				goto error;
+		} else {
+			if ((rec.len && (fread(scratch, rec.len, 1, f) != 1))
+			    || (chk_decode(rec.type, scratch, rec.len, dest, page_size) < 0))
+				goto error;
+		}
+
+		if (CHK_ALIGN(rec.len) > rec.len)
+			fseek(f, CHK_ALIGN(rec.len) - rec.len, SEEK_CUR);
+	}
+
+	goto out;
+
+error:
+	fprintf(stderr, "[ERROR] Unable to read checkpoint record 0x%zx\n", (size_t) entry);
+	ret = -1;
+
+out:
+	chk_files_close(&files);
+	free(scratch);
+
+	return ret;
+}
+
+//------------------------------------ INDEXED RESTORE ---------------------------------------//
+
+/* newest copy of a page */
+typedef struct {
+	uint8_t* dest;
+	uint32_t size;		// 0 => unused slot
+	uint32_t chk_no;
+	uint64_t offset;
+	uint64_t entry;
+} chk_page_t;
+
+typedef struct {
+	chk_page_t* slots;
+	size_t mask;
+	chk_page_t** order;	// pages sorted by checkpoint and file offset
+	size_t count;
+} chk_page_map_t;
+
+static chk_page_map_t page_map = { NULL, 0, NULL, 0 };
+static chk_files_t restore_files = { NULL, 0, PTHREAD_MUTEX_INITIALIZER };
+
+/* state of the lazy restore */
+static int uffd = -1;
+static uint8_t* lazy_mem = NULL;
+static size_t lazy_size = 0;
+static volatile bool lazy_done = true;
+static pthread_t lazy_fault_thread;
+static pthread_t lazy_prefetch_thread;
+
+static inline size_t page_map_hash(const uint8_t* dest, uint32_t size)
+{
+	uint64_t key = (uint64_t) dest ^ size;
+
+	return hash_avalanche(key * HASH_P1);
+}
+
+static chk_page_t* page_map_find(uint8_t* dest, uint32_t size, bool insert)
+{
+	for(size_t i = page_map_hash(dest, size);; i++) {
+		chk_page_t* p = page_map.slots + (i & page_map.mask);
+
+		if (!p->size) {
+			if (!insert)
+				return NULL;
+			p->dest = dest;
+			p->size = size;
+			return p;
+		}
+
+		if ((p->dest == dest) && (p->size == size))
+			return p;
+	}
+}
+
+static int page_cmp(const void* a, const void* b)
+{
+	const chk_page_t* p = *(const chk_page_t**) a;
+	const chk_page_t* q = *(const chk_page_t**) b;
+
+	if (p->chk_no != q->chk_no)
+		return p->chk_no < q->chk_no ? -1 : 1;
+	if (p->offset != q->offset)
+		return p->offset < q->offset ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Reads the indices of the checkpoints first ... last and keeps the newest
+ * copy of each page. Returns 1 if one of the files has no index.
+ */
+static int page_map_build(uint8_t* mem, uint32_t first, uint32_t last,
+	void* (*locate)(uint8_t* mem, uint64_t entry, size_t* page_size), struct kvm_clock_data* clock)
+{
+	chk_index_entry_t* index[last - first + 1];
+	size_t counts[last - first + 1];
+	size_t total = 0, slots = 1;
+	int ret = 0;
+
+	memset(index, 0x00, sizeof(index));
+
+	for(uint32_t i = first; i <= last; i++) {
+		int fd = chk_file(&restore_files, i);
+		chk_header_t header;
+
+		if ((fd < 0) || (pread(fd, &header, sizeof(header), 0) != sizeof(header))) {
+			ret = -1;
+			goto out;
+		}
+
+		if ((memcmp(header.magic, CHK_MAGIC, sizeof(header.magic)) != 0)
+		    || (header.version != CHK_VERSION) || !header.index_count) {
+			ret = 1;
+			goto out;
+		}
+
+		size_t len = header.index_count * sizeof(chk_index_entry_t);
+		index[i - first] = (chk_index_entry_t*) malloc(len);
+		if (!index[i - first] || (pread(fd, index[i - first], len, header.index_offset) != (ssize_t) len)) {
+			ret = -1;
+			goto out;
+		}
+
+		counts[i - first] = header.index_count;
+		total += header.index_count;
+		*clock = header.clock;
+	}
+
+	while (slots < 2 * total)
+		slots <<= 1;
+
+	page_map.slots = (chk_page_t*) calloc(slots, sizeof(chk_page_t));
+	page_map.order = (chk_page_t**) malloc(total * sizeof(chk_page_t*));
+	if (!page_map.slots || !page_map.order) {
+		ret = -1;
+		goto out;
+	}
+	page_map.mask = slots - 1;
+	page_map.count = 0;
+
+	for(uint32_t i = first; i <= last; i++) {
+		for(size_t j = 0; j < counts[i - first]; j++) {
+			size_t page_size;
+			uint8_t* dest = (uint8_t*) locate(mem, index[i - first][j].entry, &page_size);
+			chk_page_t* p = page_map_find(dest, page_size, true);
+
+			if (!p->offset && !p->chk_no)
+				page_map.order[page_map.count++] = p;
+			p->chk_no = i;
+			p->offset = index[i - first][j].offset;
+			p->entry = index[i - first][j].entry;
+		}
+	}
+
+	qsort(page_map.order, page_map.count, sizeof(chk_page_t*), page_cmp);
+
+out:
+	for(uint32_t i = first; i <= last; i++)
+		free(index[i - first]);
+
+	return ret;
+}
+
+static void page_map_free(void)
+{
+	free(page_map.slots);
+	free(page_map.order);
+	memset(&page_map, 0x00, sizeof(page_map));
+}
+
+/* Returns the newest copy, which covers the 4 KiB page at addr */
+static chk_page_t* page_map_resolve(uint8_t* addr)
+{
+	uint8_t* base = (uint8_t*) ((uint64_t) addr & ~((uint64_t) CHK_MAX_PAGE_SIZE - 1));
+	chk_page_t* small = page_map_find(addr, CHK_MIN_PAGE_SIZE, false);
+	chk_page_t* large = page_map_find(base, CHK_MAX_PAGE_SIZE, false);
+
+	if (small && large)
+		return small->chk_no >= large->chk_no ? small : large;
+
+	return small ? small : large;
+}
+
+#ifdef HAVE_LINUX_USERFAULTFD_H
+/* Copies len bytes from src to the missing pages at dest, pages, which are already present are skipped */
+static void lazy_copy(uint8_t* dest, const uint8_t* src, size_t len)
+{
+	struct uffdio_copy copy = {
+		.dst = (uint64_t) dest,
+		.src = (uint64_t) src,
+		.len = len,
+		.mode = 0
+	};
+
+	if ((ioctl(uffd, UFFDIO_COPY, &copy) == 0) || (errno != EEXIST) || (len == CHK_MIN_PAGE_SIZE))
+		return;
+
+	// some pages are already present => copy the others one by one
+	for(size_t off = 0; off < len; off += CHK_MIN_PAGE_SIZE) {
+		copy.dst = (uint64_t) dest + off;
+		copy.src = (uint64_t) src + off;
+		copy.len = CHK_MIN_PAGE_SIZE;
+		copy.copy = 0;
+		ioctl(uffd, UFFDIO_COPY, &copy);
+	}
+}
+
+/* Fills all pages, for which p is the newest copy */
+static void lazy_fill(chk_page_t* p, uint8_t* scratch, uint8_t* page)
+{
+	if (chk_read_record(&restore_files, p->chk_no, p->offset, page, p->size, scratch, true) < 0) {
+		fprintf(stderr, "[ERROR] Unable to restore page %p of checkpoint %u\n", p->dest, p->chk_no);
+		return;
+	}
+
+	if (p->size == CHK_MIN_PAGE_SIZE) {
+		lazy_copy(p->dest, page, p->size);
+		return;
+	}
+
+	// newer 4 KiB copies supersede parts of a large page
+	size_t run = 0;
+	for(size_t off = 0; off < p->size; off += CHK_MIN_PAGE_SIZE) {
+		if (page_map_resolve(p->dest + off) == p) {
+			run += CHK_MIN_PAGE_SIZE;
+			continue;
+		}
+		if (run)
+			lazy_copy(p->dest + off - run, page + off - run, run);
+		run = 0;
+	}
+	if (run)
+		lazy_copy(p->dest + p->size - run, page + p->size - run, run);
+}
+
+static void* lazy_fault_handler(void* arg)
+{
+	struct pollfd pfd = { .fd = uffd, .events = POLLIN };
+	uint8_t* scratch = (uint8_t*) malloc(CHK_MAX_PAGE_SIZE);
+	uint8_t* page = (uint8_t*) malloc(CHK_MAX_PAGE_SIZE);
+
+	if (!scratch || !page)
+		err(1, "unable to allocate memory");
+
+	while (!lazy_done) {
+		struct uffd_msg msg;
+
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		if (read(uffd, &msg, sizeof(msg)) != sizeof(msg))
+			continue;
+		if (msg.event != UFFD_EVENT_PAGEFAULT)
+			continue;
+
+		uint8_t* addr = (uint8_t*) (msg.arg.pagefault.address & ~((uint64_t) CHK_MIN_PAGE_SIZE - 1));
+		chk_page_t* p = page_map_resolve(addr);
+
+		if (p) {
+			lazy_fill(p, scratch, page);
+		} else {
+			// the page is not part of the checkpoint
+			struct uffdio_zeropage zero = {
+				.range = { .start = (uint64_t) addr, .len = CHK_MIN_PAGE_SIZE },
+				.mode = 0
+			};
+
+			ioctl(uffd, UFFDIO_ZEROPAGE, &zero);
+		}
+	}
+
+	free(scratch);
+	free(page);
+
+	return NULL;
+}
+
+/* Loads all pages in background, the last checkpoints first because they contain the hot pages */
+static void* lazy_prefetch(void* arg)
+{
+	struct uffdio_range range = { .start = (uint64_t) lazy_mem, .len = lazy_size };
+	uint8_t* scratch = (uint8_t*) malloc(CHK_MAX_PAGE_SIZE);
+	uint8_t* page = (uint8_t*) malloc(CHK_MAX_PAGE_SIZE);
+
+	if (!scratch || !page)
+		err(1, "unable to allocate memory");
+
+	for(size_t i = page_map.count; i > 0; i--)
+		lazy_fill(page_map.order[i - 1], scratch, page);
+
+	// all pages of the checkpoint are present => the kernel handles the remaining faults
+	if (ioctl(uffd, UFFDIO_UNREGISTER, &range) < 0)
+		fprintf(stderr, "[WARNING] Unable to unregister userfaultfd - %d (%s)\n", errno, strerror(errno));
+
+	lazy_done = true;
+	pthread_join(lazy_fault_thread, NULL);
+
+	close(uffd);
+	uffd = -1;
+	chk_files_close(&restore_files);
+	page_map_free();
+	free(scratch);
+	free(page);
+
+	return NULL;
+}
+
+static int lazy_start(uint8_t* mem, size_t size)
+{
+	struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+	struct uffdio_register reg = {
+		.range = { .start = (uint64_t) mem, .len = size },
+		.mode = UFFDIO_REGISTER_MODE_MISSING
+	};
+
+	uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (uffd < 0)
+		goto error;
+
+	if ((ioctl(uffd, UFFDIO_API, &api) < 0) || (ioctl(uffd, UFFDIO_REGISTER, &reg) < 0)) {
+		close(uffd);
+		uffd = -1;
+		goto error;
+	}
+
+	lazy_mem = mem;
+	lazy_size = size;
+	lazy_done = false;
+
+	if (create_helper_thread(&lazy_fault_thread, lazy_fault_handler, NULL))
+		err(1, "unable to create thread");
+	if (create_helper_thread(&lazy_prefetch_thread, lazy_prefetch, NULL))
+		err(1, "unable to create thread");
+
+	return 0;
+
+error:
+	fprintf(stderr, "[WARNING] Unable to use userfaultfd, restore eagerly - %d (%s)\n", errno, strerror(errno));
+	return -1;
+}
+#else
+static int lazy_start(uint8_t* mem, size_t size)
+{
+	return -1;
+}
+#endif
+
+int chk_restore(uint8_t* mem, size_t size, uint32_t first, uint32_t last, bool lazy,
+	void* (*locate)(uint8_t* mem, uint64_t entry, size_t* page_size), struct kvm_clock_data* clock)
+{
+	uint8_t* scratch;
+	int ret;
+
+	ret = page_map_build(mem, first, last, locate, clock);
+	if (ret) {
+		chk_files_close(&restore_files);
+		page_map_free();
+		return ret;
+	}
+
+	if (lazy && (lazy_start(mem, size) == 0))
+		return 0;
+
+	scratch = (uint8_t*) malloc(CHK_MAX_PAGE_SIZE);
+	if (!scratch)
+		return -1;
+
+	// older copies are already dropped, the order solves overlapping pages
+	for(size_t i = 0; i < page_map.count; i++) {
+		chk_page_t* p = page_map.order[i];
+
+		if (chk_read_record(&restore_files, p->chk_no, p->offset, p->dest, p->size, scratch, true) < 0) {
+			fprintf(stderr, "[ERROR] Unable to restore page %p of checkpoint %u\n", p->dest, p->chk_no);
+			ret = -1;
+			break;
+		}
+	}
+
+	free(scratch);
+	chk_files_close(&restore_files);
+	page_map_free();
+
+	return ret;
+}
+
+void chk_restore_wait(void)
+{
+	if (lazy_done)
+		return;
+
+	pthread_join(lazy_prefetch_thread, NULL);
+}
+
+int chk_compact(uint32_t first, uint32_t last,
+	void* (*locate)(uint8_t* mem, uint64_t entry, size_t* page_size))
+{
+	char fname[MAX_FNAME], tmp[MAX_FNAME];
+	struct kvm_clock_data clock;
+	uint8_t* scratch;
+	uint8_t* page;
+	int fd, ret;
+
+	// the pages are not touched, only their addresses are required
+	ret = page_map_build(NULL, first, last, locate, &clock);
+	if (ret)
+		goto out;
+
+	scratch = (uint8_t*) malloc(CHK_MAX_PAGE_SIZE);
+	page = (uint8_t*) malloc(CHK_MAX_PAGE_SIZE);
+	if (!scratch || !page)
+		err(1, "unable to allocate memory");
+
+	// references of the merged file point to itself
+	chk_dedup_reset();
+
+	snprintf(fname, MAX_FNAME, "checkpoint/chk%u_mem.dat", last);
+	snprintf(tmp, MAX_FNAME, "checkpoint/chk%u_mem.tmp", last);
+	chk_writer_open(tmp, last, &clock);
+
+	// keep the order of the chain, newer small pages overwrite parts of older large pages
+	for(size_t i = 0; i < page_map.count; i++) {
+		chk_page_t* p = page_map.order[i];
+
+		if (chk_read_record(&restore_files, p->chk_no, p->offset, page, p->size, scratch, true) < 0) {
+			fprintf(stderr, "[ERROR] Unable to read page %p of checkpoint %u\n", p->dest, p->chk_no);
+			ret = -1;
+			break;
+		}
+		chk_write_page(&p->entry, sizeof(p->entry), page, p->size);
+	}
+
+	chk_writer_flush();
+	chk_writer_close();
+	free(scratch);
+	free(page);
+
+	if (ret) {
+		unlink(tmp);
+		goto out;
+	}
+
+	// the file has to be complete, before it replaces the incremental checkpoint
+	fd = open(tmp, O_RDONLY);
+	if ((fd < 0) || (fsync(fd) < 0) || (rename(tmp, fname) < 0)) {
+		fprintf(stderr, "[ERROR] Unable to replace %s - %d (%s)\n", fname, errno, strerror(errno));
+		unlink(tmp);
+		ret = -1;
+	}
+	if (fd >= 0)
+		close(fd);
+
+	// the table refers to the removed file
+	if (ret)
+		chk_dedup_reset();
+
+out:
+	chk_files_close(&restore_files);
+	page_map_free();
+
+	return ret;
+}
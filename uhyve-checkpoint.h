@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2018, RWTH Aachen University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file tools/uhyve-checkpoint.h
+ * @brief Checkpoint file format and parallel checkpoint writer
+ */
+
+#ifndef __UHYVE_CHECKPOINT_H__
+#define __UHYVE_CHECKPOINT_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/kvm.h>
+
+/*
+ * Layout of checkpoint/chk<n>_mem.dat (version 3)
+ *
+ * The file starts with a chk_header_t, which is padded to CHK_HEADER_SIZE.
+ * It is followed by records of type chk_record_t, each starting at an
+ * 8 byte boundary. Each writer thread collects the records in its own
+ * buffer of CHK_EXTENT_SIZE bytes and appends it as one block to the file.
+ * A block is padded to CHK_BLOCK_SIZE by an entry CHK_ENTRY_PADDING, i.e.
+ * the reader has to skip to the next block boundary.
+ *
+ * An index of all records (chk_index_entry_t) follows the last block,
+ * its position is stored in the header.
+ *
+ * Version 2 stores the records { page table entry (8 byte), page } and
+ * older checkpoints start directly with the struct kvm_clock_data.
+ */
+#define CHK_MAGIC		"UHYVECHK"
+#define CHK_VERSION		3
+#define CHK_VERSION_BLOCKS	2
+#define CHK_HEADER_SIZE		4096
+#define CHK_BLOCK_SIZE		4096
+#define CHK_EXTENT_SIZE		(8UL << 20)
+#define CHK_ENTRY_PADDING	UINT64_MAX
+#define CHK_MIN_PAGE_SIZE	4096
+#define CHK_MAX_PAGE_SIZE	(2UL << 20)
+
+/* types of a record */
+#define CHK_RECORD_RAW		0	// the page itself
+#define CHK_RECORD_ZERO		1	// no payload, the page is zero
+#define CHK_RECORD_LZ4		2	// the page compressed by LZ4
+#define CHK_RECORD_DUP		3	// chk_ref_t to a RAW or LZ4 record with the same content
+
+/* upper limit of HERMIT_CHECKPOINT_THREADS */
+#define CHK_MAX_THREADS		64
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t extent_size;
+	struct kvm_clock_data clock;
+	uint64_t index_offset;	// array of chk_index_entry_t
+	uint64_t index_count;	// 0 => no index
+} __attribute__((packed)) chk_header_t;
+
+/* maps a page table entry to the file offset of its record */
+typedef struct {
+	uint64_t entry;
+	uint64_t offset;
+} __attribute__((packed)) chk_index_entry_t;
+
+typedef struct {
+	uint64_t entry;		// page table entry
+	uint32_t type;		// CHK_RECORD_*
+	uint32_t len;		// bytes of the payload
+} __attribute__((packed)) chk_record_t;
+
+/* position of a record in checkpoint/chk<chk_no>_mem.dat */
+typedef struct {
+	uint32_t chk_no;
+	uint32_t reserved;
+	uint64_t offset;
+} __attribute__((packed)) chk_ref_t;
+
+/**
+ * \brief Returns the number of threads, which write a checkpoint
+ *
+ * Configured by HERMIT_CHECKPOINT_THREADS, the default is the number
+ * of online CPUs.
+ */
+unsigned chk_threads(void);
+
+/**
+ * \brief Creates a checkpoint file and prepares the writer
+ *
+ * \param fname path of the file
+ * \param no number of the checkpoint
+ * \param clock kvm clock, which is stored in the header
+ *
+ * HERMIT_CHECKPOINT_COMPRESS=0 disables the compression (if uhyve is built
+ * with LZ4) and HERMIT_CHECKPOINT_DEDUP=0 the deduplication of pages.
+ */
+void chk_writer_open(const char* fname, uint32_t no, const struct kvm_clock_data* clock);
+
+/**
+ * \brief Appends a record to the buffer of the calling thread
+ *
+ * Has the signature of the save_page handler of determine_dirty_pages()
+ * and may be called by several threads at the same time.
+ */
+void chk_write_page(void* entry, size_t entry_size, void* page, size_t page_size);
+
+/**
+ * \brief Writes the remaining records of the calling thread to the file
+ *
+ * Releases the buffer of the thread, too.
+ */
+void chk_writer_flush(void);
+
+/**
+ * \brief Writes the header and closes the file
+ *
+ * All threads have to call chk_writer_flush() before.
+ */
+void chk_writer_close(void);
+
+/**
+ * \brief Forgets all pages, which are known for deduplication
+ *
+ * Required if older checkpoint files are removed. A full checkpoint
+ * calls it as well, so that all references point into its own file.
+ */
+void chk_dedup_reset(void);
+
+/**
+ * \brief Reads the header of a checkpoint file
+ *
+ * Returns true for a file of version CHK_VERSION_BLOCKS to CHK_VERSION,
+ * the file position is then the first record. Otherwise the file position
+ * is unchanged and the file uses the old layout.
+ */
+bool chk_read_header(FILE* f, chk_header_t* header);
+
+/**
+ * \brief Restores the pages of a version 2 (or later) checkpoint file
+ *
+ * \param f file, positioned behind the header
+ * \param header header of the file
+ * \param mem passed to locate
+ * \param locate returns the host address and the size of the page, which
+ *        is described by a page table entry
+ */
+int chk_load_records(FILE* f, const chk_header_t* header, uint8_t* mem,
+	void* (*locate)(uint8_t* mem, uint64_t entry, size_t* page_size));
+
+/**
+ * \brief Restores the checkpoints first ... last by their indices
+ *
+ * \param mem guest memory
+ * \param size size of the guest memory
+ * \param lazy restore the pages on demand by userfaultfd
+ * \param locate see chk_load_records()
+ * \param clock receives the clock of the last checkpoint
+ *
+ * Only the newest copy of each page is read. With "lazy", a fault
+ * handler fills the pages on first access and a prefetch thread loads the
+ * remaining ones in background, the newest checkpoints first. Returns 0
+ * on success, 1 if a file has no index and -1 on errors.
+ */
+int chk_restore(uint8_t* mem, size_t size, uint32_t first, uint32_t last, bool lazy,
+	void* (*locate)(uint8_t* mem, uint64_t entry, size_t* page_size), struct kvm_clock_data* clock);
+
+/**
+ * \brief Waits until a lazy restore has loaded all pages
+ */
+void chk_restore_wait(void);
+
+/**
+ * \brief Merges the checkpoints first ... last into checkpoint "last"
+ *
+ * The newest copy of each page is written to a temporary file, which
+ * replaces checkpoint/chk<last>_mem.dat afterwards. Older checkpoints
+ * are no longer required to restore "last" and are able to be removed.
+ * Uses the writer, i.e. no checkpoint may be written in parallel.
+ * Returns 0 on success, 1 if a file has no index and -1 on errors.
+ */
+int chk_compact(uint32_t first, uint32_t last,
+	void* (*locate)(uint8_t* mem, uint64_t entry, size_t* page_size));
+
+#endif
@@ -35,6 +35,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #define HERMIT_ELFOSABI	0xFF
 
@@ -51,5 +52,7 @@ int uhyve_loop(int argc, char **argv);
 // define some helper functions
 uint32_t get_cpufreq(void);
 ssize_t pread_in_full(int fd, void *buf, size_t count, off_t offset);
+ssize_t pwrite_in_full(int fd, const void *buf, size_t count, off_t offset);
+int create_helper_thread(pthread_t *thread, void *(*start)(void *), void *arg);
 
 #endif
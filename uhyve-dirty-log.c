@@ -0,0 +1,401 @@
+/*
+ * Copyright (c) 2018, RWTH Aachen University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * All backends report the dirty pages as a bitmap per memory slot, which
+ * is walked word by word. Empty words are skipped in groups and the set
+ * bits of a word are found with ctz, so that a sparse dirty set costs
+ * little more than a read of the bitmap.
+ *
+ * The manual backend write-protects the slot in chunks with
+ * KVM_CLEAR_DIRTY_LOG right before the pages of the chunk are reported,
+ * instead of the whole slot within KVM_GET_DIRTY_LOG. The ring backend
+ * collects the entries of all vCPU rings into a pending bitmap, which is
+ * also filled by the vCPU threads when a ring runs full.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "uhyve.h"
+#include "uhyve-dirty-log.h"
+
+#define DIRTY_LOG_MAX_SLOTS	4
+/* number of entries of each vCPU ring */
+#define DIRTY_RING_ENTRIES	4096
+/* pages, which are write-protected at once by the manual backend */
+#define DIRTY_CLEAR_CHUNK	(1UL << 15)
+/* words of the bitmap, which are tested at once for dirty pages */
+#define DIRTY_SKIP_WORDS	4
+
+#define BITS_PER_LONG		(8 * sizeof(unsigned long))
+
+extern uint8_t* guest_mem;
+extern bool verbose;
+
+typedef struct dirty_slot {
+	uint32_t slot;
+	uint64_t guest_phys_addr;
+	uint64_t pages;
+	size_t words;
+	// result of KVM_GET_DIRTY_LOG or pending pages of the ring backend
+	unsigned long* bitmap;
+} dirty_slot_t;
+
+#ifndef KVM_CAP_DIRTY_LOG_RING
+/* headers of older kernels, the ring backend is never enabled */
+struct kvm_dirty_gfn {
+	uint32_t flags;
+	uint32_t slot;
+	uint64_t offset;
+};
+#define KVM_DIRTY_GFN_F_DIRTY	1
+#define KVM_DIRTY_GFN_F_RESET	2
+#define KVM_DIRTY_LOG_PAGE_OFFSET 0
+#endif
+
+typedef struct dirty_ring {
+	struct kvm_dirty_gfn* gfns;
+	uint32_t fetch;
+	pthread_mutex_t lock;
+} dirty_ring_t;
+
+static const char* mode_names[] = {"page tables", "bitmap", "manual", "ring"};
+
+static dirty_log_mode_t mode = DIRTY_LOG_NONE;
+static int dirty_vmfd = -1;
+static size_t page_size = 0;
+static dirty_slot_t slots[DIRTY_LOG_MAX_SLOTS];
+static uint32_t slot_count = 0;
+static dirty_ring_t* rings = NULL;
+static uint32_t ring_count = 0;
+static uint32_t ring_entries = 0;
+
+static bool enable_ring(int vmfd)
+{
+#ifdef KVM_CAP_DIRTY_LOG_RING
+	int cap = KVM_CAP_DIRTY_LOG_RING;
+#ifndef __x86_64__
+	// other architectures require the ordered variant
+	cap = KVM_CAP_DIRTY_LOG_RING_ACQ_REL;
+#endif
+	int max_size = ioctl(vmfd, KVM_CHECK_EXTENSION, cap);
+	if (max_size <= 0)
+		return false;
+
+	uint64_t size = DIRTY_RING_ENTRIES * sizeof(struct kvm_dirty_gfn);
+	if (size > (uint64_t) max_size)
+		size = max_size;
+
+	struct kvm_enable_cap enable = {
+		.cap = cap,
+		.args[0] = size,
+	};
+	if (ioctl(vmfd, KVM_ENABLE_CAP, &enable) < 0)
+		return false;
+
+	ring_entries = size / sizeof(struct kvm_dirty_gfn);
+	return true;
+#else
+	return false;
+#endif
+}
+
+static bool enable_manual(int vmfd)
+{
+#ifdef KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2
+	if (ioctl(vmfd, KVM_CHECK_EXTENSION, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2) <= 0)
+		return false;
+
+	// a new slot starts with an empty bitmap as with KVM_GET_DIRTY_LOG
+	struct kvm_enable_cap enable = {
+		.cap = KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2,
+		.args[0] = KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE,
+	};
+
+	return ioctl(vmfd, KVM_ENABLE_CAP, &enable) == 0;
+#else
+	return false;
+#endif
+}
+
+void dirty_log_init(int vmfd, uint32_t ncpus)
+{
+	const char* str = getenv("HERMIT_DIRTY_LOG");
+
+	dirty_vmfd = vmfd;
+	page_size = sysconf(_SC_PAGESIZE);
+
+	if (!str || (strcmp(str, "0") == 0))
+		mode = DIRTY_LOG_NONE;
+	else if (strcmp(str, "bitmap") == 0)
+		mode = DIRTY_LOG_BITMAP;
+	else if (strcmp(str, "manual") == 0)
+		mode = DIRTY_LOG_MANUAL;
+	else if ((strcmp(str, "ring") == 0) || (strcmp(str, "1") == 0))
+		mode = DIRTY_LOG_RING;
+	else {
+		fprintf(stderr, "[WARNING] Unknown dirty log \"%s\", use the page tables\n", str);
+		mode = DIRTY_LOG_NONE;
+	}
+
+	if ((mode == DIRTY_LOG_RING) && !enable_ring(vmfd)) {
+		if (strcmp(str, "1") != 0)
+			fprintf(stderr, "[WARNING] KVM does not support dirty rings - %d (%s)\n", errno, strerror(errno));
+		mode = DIRTY_LOG_MANUAL;
+	}
+
+	if ((mode == DIRTY_LOG_MANUAL) && !enable_manual(vmfd)) {
+		if (strcmp(str, "1") != 0)
+			fprintf(stderr, "[WARNING] KVM does not support the manual dirty log protection - %d (%s)\n", errno, strerror(errno));
+		mode = DIRTY_LOG_BITMAP;
+	}
+
+	if (mode == DIRTY_LOG_RING) {
+		rings = (dirty_ring_t*) calloc(ncpus, sizeof(dirty_ring_t));
+		if (!rings)
+			err(1, "Not enough memory");
+		ring_count = ncpus;
+
+		for(uint32_t i = 0; i < ncpus; i++)
+			pthread_mutex_init(&rings[i].lock, NULL);
+	}
+
+	if (verbose && (mode != DIRTY_LOG_NONE))
+		fprintf(stderr, "Uhyve tracks dirty pages with KVM's dirty log (%s)\n", mode_names[mode]);
+}
+
+dirty_log_mode_t dirty_log_mode(void)
+{
+	return mode;
+}
+
+uint32_t dirty_log_flags(void)
+{
+	return (mode != DIRTY_LOG_NONE) ? KVM_MEM_LOG_DIRTY_PAGES : 0;
+}
+
+void dirty_log_add_slot(const struct kvm_userspace_memory_region* region)
+{
+	if (mode == DIRTY_LOG_NONE)
+		return;
+
+	if (slot_count >= DIRTY_LOG_MAX_SLOTS)
+		errx(1, "Too many memory slots for the dirty log");
+
+	dirty_slot_t* s = slots + slot_count;
+	s->slot = region->slot;
+	s->guest_phys_addr = region->guest_phys_addr;
+	s->pages = region->memory_size / page_size;
+	s->words = (s->pages + BITS_PER_LONG - 1) / BITS_PER_LONG;
+	s->bitmap = (unsigned long*) calloc(s->words, sizeof(unsigned long));
+	if (!s->bitmap)
+		err(1, "Not enough memory");
+
+	slot_count++;
+}
+
+void dirty_log_init_vcpu(int vcpufd, uint32_t cpuid)
+{
+	if ((mode != DIRTY_LOG_RING) || (cpuid >= ring_count))
+		return;
+
+	void* gfns = mmap(NULL, ring_entries * sizeof(struct kvm_dirty_gfn),
+			PROT_READ | PROT_WRITE, MAP_SHARED, vcpufd,
+			KVM_DIRTY_LOG_PAGE_OFFSET * page_size);
+	if (gfns == MAP_FAILED)
+		err(1, "KVM: unable to map the dirty ring of vCPU %u", cpuid);
+
+	rings[cpuid].gfns = (struct kvm_dirty_gfn*) gfns;
+	rings[cpuid].fetch = 0;
+}
+
+/* Moves the entries of a ring into the bitmaps, returns the number of entries */
+static uint32_t harvest_ring(dirty_ring_t* ring)
+{
+	uint32_t count = 0;
+
+	if (!ring->gfns)
+		return 0;
+
+	pthread_mutex_lock(&ring->lock);
+	while (1) {
+		struct kvm_dirty_gfn* gfn = ring->gfns + (ring->fetch % ring_entries);
+
+		if (!(__atomic_load_n(&gfn->flags, __ATOMIC_ACQUIRE) & KVM_DIRTY_GFN_F_DIRTY))
+			break;
+
+		// the upper 16 bits contain the address space
+		uint32_t slot = gfn->slot & 0xFFFF;
+		for(uint32_t i = 0; i < slot_count; i++) {
+			if ((slots[i].slot == slot) && (gfn->offset < slots[i].pages)) {
+				__atomic_fetch_or(slots[i].bitmap + gfn->offset / BITS_PER_LONG,
+					1UL << (gfn->offset % BITS_PER_LONG), __ATOMIC_RELAXED);
+				break;
+			}
+		}
+
+		__atomic_store_n(&gfn->flags, KVM_DIRTY_GFN_F_RESET, __ATOMIC_RELEASE);
+		ring->fetch++;
+		count++;
+	}
+	pthread_mutex_unlock(&ring->lock);
+
+	return count;
+}
+
+void dirty_log_ring_full(uint32_t cpuid)
+{
+	if ((mode != DIRTY_LOG_RING) || (cpuid >= ring_count))
+		return;
+
+#ifdef KVM_RESET_DIRTY_RINGS
+	if (harvest_ring(rings + cpuid))
+		kvm_ioctl(dirty_vmfd, KVM_RESET_DIRTY_RINGS, NULL);
+#endif
+}
+
+/* Reports the pages of the words [first, last) and clears them if requested */
+static void walk_bitmap(dirty_slot_t* s, size_t first, size_t last, bool consume,
+			void (*save_page)(void*, size_t, void*, size_t))
+{
+	unsigned long* bitmap = s->bitmap;
+
+	for(size_t i = first; i < last; i++) {
+		// skip empty parts of the bitmap
+		if (!(i % DIRTY_SKIP_WORDS) && (i + DIRTY_SKIP_WORDS <= last)) {
+			unsigned long any = 0;
+			for(size_t j = 0; j < DIRTY_SKIP_WORDS; j++)
+				any |= bitmap[i+j];
+			if (!any) {
+				i += DIRTY_SKIP_WORDS - 1;
+				continue;
+			}
+		}
+
+		unsigned long value = consume ? __atomic_exchange_n(bitmap + i, 0, __ATOMIC_RELAXED) : bitmap[i];
+		while (value) {
+			size_t bit = __builtin_ctzl(value);
+			size_t addr = s->guest_phys_addr + (i * BITS_PER_LONG + bit) * page_size;
+
+			save_page(&addr, sizeof(size_t), (void*) (guest_mem + addr), page_size);
+			value &= value - 1;
+		}
+	}
+}
+
+static void get_dirty_log(dirty_slot_t* s)
+{
+	struct kvm_dirty_log dlog;
+
+	// be sure that all paddings are zero
+	memset(&dlog, 0x00, sizeof(dlog));
+	dlog.slot = s->slot;
+	dlog.dirty_bitmap = s->bitmap;
+
+	memset(s->bitmap, 0x00, s->words * sizeof(unsigned long));
+	kvm_ioctl(dirty_vmfd, KVM_GET_DIRTY_LOG, &dlog);
+}
+
+static void scan_manual(dirty_slot_t* s, void (*save_page)(void*, size_t, void*, size_t))
+{
+	get_dirty_log(s);
+
+	for(uint64_t first = 0; first < s->pages; first += DIRTY_CLEAR_CHUNK) {
+		size_t first_word = first / BITS_PER_LONG;
+		size_t last_word;
+		uint64_t num_pages = s->pages - first;
+
+		if (num_pages > DIRTY_CLEAR_CHUNK)
+			num_pages = DIRTY_CLEAR_CHUNK;
+		last_word = (first + num_pages + BITS_PER_LONG - 1) / BITS_PER_LONG;
+
+		size_t i;
+		for(i = first_word; (i < last_word) && !s->bitmap[i]; i++)
+			;
+		if (i == last_word)
+			continue;
+
+#ifdef KVM_CLEAR_DIRTY_LOG
+		// write-protect the pages again before they are read
+		struct kvm_clear_dirty_log clear = {
+			.slot = s->slot,
+			.num_pages = num_pages,
+			.first_page = first,
+			.dirty_bitmap = s->bitmap + first_word,
+		};
+		kvm_ioctl(dirty_vmfd, KVM_CLEAR_DIRTY_LOG, &clear);
+#endif
+
+		walk_bitmap(s, first_word, last_word, false, save_page);
+	}
+}
+
+void dirty_log_scan(void (*save_page)(void*, size_t, void*, size_t))
+{
+	uint32_t harvested = 0;
+
+	switch (mode) {
+	case DIRTY_LOG_BITMAP:
+		for(uint32_t i = 0; i < slot_count; i++) {
+			get_dirty_log(slots + i);
+			walk_bitmap(slots + i, 0, slots[i].words, false, save_page);
+		}
+		break;
+
+	case DIRTY_LOG_MANUAL:
+		for(uint32_t i = 0; i < slot_count; i++)
+			scan_manual(slots + i, save_page);
+		break;
+
+	case DIRTY_LOG_RING:
+		for(uint32_t i = 0; i < ring_count; i++)
+			harvested += harvest_ring(rings + i);
+#ifdef KVM_RESET_DIRTY_RINGS
+		if (harvested)
+			kvm_ioctl(dirty_vmfd, KVM_RESET_DIRTY_RINGS, NULL);
+#endif
+
+		for(uint32_t i = 0; i < slot_count; i++)
+			walk_bitmap(slots + i, 0, slots[i].words, true, save_page);
+		break;
+
+	default:
+		errx(1, "dirty log is not enabled");
+	}
+}
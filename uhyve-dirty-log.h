@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2018, RWTH Aachen University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file tools/uhyve-dirty-log.h
+ * @brief Dirty page tracking with KVM's dirty log
+ */
+
+#ifndef __UHYVE_DIRTY_LOG_H__
+#define __UHYVE_DIRTY_LOG_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <linux/kvm.h>
+
+typedef enum {
+	DIRTY_LOG_NONE = 0,	// dirty pages are determined by the guest page tables
+	DIRTY_LOG_BITMAP,	// KVM_GET_DIRTY_LOG, write-protects the slot on each call
+	DIRTY_LOG_MANUAL,	// KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2 and KVM_CLEAR_DIRTY_LOG
+	DIRTY_LOG_RING,		// per-vCPU rings of KVM_CAP_DIRTY_LOG_RING
+} dirty_log_mode_t;
+
+/**
+ * \brief Selects and enables the dirty log backend
+ *
+ * \param vmfd file descriptor of the virtual machine
+ * \param ncpus number of vCPUs of the virtual machine
+ *
+ * The backend is selected by HERMIT_DIRTY_LOG ("ring", "manual", "bitmap"
+ * or "1" for the best one available). Unsupported backends fall back to
+ * the next simpler one. Has to be called before the memory slots and the
+ * vCPUs are created.
+ */
+void dirty_log_init(int vmfd, uint32_t ncpus);
+
+/**
+ * \brief Returns the selected backend
+ */
+dirty_log_mode_t dirty_log_mode(void);
+
+/**
+ * \brief Returns true if the dirty pages are tracked by KVM
+ */
+static inline bool dirty_log_enabled(void)
+{
+	return dirty_log_mode() != DIRTY_LOG_NONE;
+}
+
+/**
+ * \brief Returns the flags of a memory slot, which is tracked by KVM
+ */
+uint32_t dirty_log_flags(void);
+
+/**
+ * \brief Registers a memory slot after KVM_SET_USER_MEMORY_REGION
+ */
+void dirty_log_add_slot(const struct kvm_userspace_memory_region* region);
+
+/**
+ * \brief Maps the dirty ring of a vCPU after KVM_CREATE_VCPU
+ */
+void dirty_log_init_vcpu(int vcpufd, uint32_t cpuid);
+
+/**
+ * \brief Harvests the dirty ring of a vCPU on KVM_EXIT_DIRTY_RING_FULL
+ */
+void dirty_log_ring_full(uint32_t cpuid);
+
+/**
+ * \brief Calls save_page for each page, which is dirtied since the last call
+ *
+ * The handler has the signature of determine_dirty_pages() and receives
+ * the guest-physical address of the page as entry. The pages are reported
+ * in ascending order within a memory slot.
+ */
+void dirty_log_scan(void (*save_page)(void*, size_t, void*, size_t));
+
+#endif
@@ -30,6 +30,7 @@
 
 #define _GNU_SOURCE
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -97,9 +98,24 @@ static int portno = 1234;	/* Default port number */
 static const char hexchars[] = "0123456789abcdef";
 
 #define BUFMAX                         4096
-static char in_buffer[BUFMAX];
+/* Maximum packet size, which is announced to the debugger. */
+#define GDB_PACKET_SIZE                (256 * 1024)
+/* Size of the send and receive buffers of the socket. */
+#define GDB_IO_SIZE                    (64 * 1024)
+/* Guest memory is translated page by page. */
+#define GDB_PAGE_SIZE                  4096
+
+static char in_buffer[GDB_PACKET_SIZE + 1];
+static char out_buffer[GDB_PACKET_SIZE + 1];
+static unsigned char mem_buffer[GDB_PACKET_SIZE];
 static unsigned char registers[BUFMAX];
 
+static char tx_buffer[GDB_IO_SIZE];
+static size_t tx_len = 0;
+static unsigned char rx_buffer[GDB_IO_SIZE];
+static size_t rx_pos = 0;
+static size_t rx_len = 0;
+
 /* uhyve variables */
 extern size_t guest_size;
 extern uint8_t *guest_mem;
@@ -113,6 +129,11 @@ void *uhyve_checked_gpa_p(uint64_t gpa, size_t sz, uint8_t * chk_guest_mem,
 
 extern uint64_t aarch64_virt_to_phys(uint64_t vaddr);
 
+static inline size_t min(size_t a, size_t b)
+{
+	return (a < b) ? a : b;
+}
+
 static int hex(unsigned char ch)
 {
 	if ((ch >= 'a') && (ch <= 'f'))
@@ -162,6 +183,71 @@ static unsigned char *hex2mem(const char *buf, unsigned char *mem, size_t count)
 	return mem;
 }
 
+/*
+ * Escapes the (count) bytes of memory pointed to by mem for a binary packet.
+ * Returns the number of chars put in buf, at most 2 * count.
+ */
+static size_t mem2bin(const unsigned char *mem, char *buf, size_t count)
+{
+	size_t i, len = 0;
+	unsigned char ch;
+
+	for (i = 0; i < count; i++) {
+		ch = *mem++;
+		if ((ch == '#') || (ch == '$') || (ch == '}') || (ch == '*')) {
+			buf[len++] = '}';
+			buf[len++] = ch ^ 0x20;
+		} else {
+			buf[len++] = ch;
+		}
+	}
+	return len;
+}
+
+/*
+ * Converts the (len) escaped chars of a binary packet into memory.
+ * Returns the number of bytes written to mem.
+ */
+static size_t bin2mem(const char *buf, size_t len, unsigned char *mem)
+{
+	size_t i, count = 0;
+
+	for (i = 0; i < len; i++) {
+		if ((buf[i] == '}') && (i + 1 < len))
+			mem[count++] = buf[++i] ^ 0x20;
+		else
+			mem[count++] = buf[i];
+	}
+	return count;
+}
+
+/*
+ * Copies (len) bytes between the guest-virtual address addr and buf.
+ * Returns the number of bytes, which are accessible from addr on.
+ */
+static size_t guest_mem_access(int vcpufd, uint64_t addr, unsigned char *buf,
+	size_t len, bool write)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		uint64_t phys_addr;
+		size_t chunk = min(len - done, GDB_PAGE_SIZE - ((addr + done) & (GDB_PAGE_SIZE - 1)));
+
+		if (uhyve_gdb_guest_virt_to_phys(vcpufd, addr + done, &phys_addr)
+		    || (phys_addr + chunk > guest_size))
+			break;
+
+		if (write)
+			memcpy(guest_mem + phys_addr, buf + done, chunk);
+		else
+			memcpy(buf + done, guest_mem + phys_addr, chunk);
+		done += chunk;
+	}
+
+	return done;
+}
+
 static int wait_for_connect(void)
 {
 	int listen_socket_fd;
@@ -226,18 +312,53 @@ static int wait_for_connect(void)
 	return 0;
 }
 
+/* Sends the buffered characters with as few system calls as possible. */
+static int flush_chars(void)
+{
+	size_t sent = 0;
+
+	while (sent < tx_len) {
+		ssize_t ret = send(socket_fd, tx_buffer + sent, tx_len - sent, 0);
+		if ((ret < 0) && (errno == EINTR))
+			continue;
+		if (ret < 0) {
+			tx_len = 0;
+			return -1;
+		}
+		sent += ret;
+	}
+	tx_len = 0;
+
+	return 0;
+}
+
 static inline int send_char(char ch)
 {
-	/* TCP is already buffering, so no need to buffer here as well. */
-	return send(socket_fd, &ch, 1, 0);
+	if ((tx_len == sizeof(tx_buffer)) && (flush_chars() == -1))
+		return -1;
+
+	tx_buffer[tx_len++] = ch;
+	return 0;
 }
 
-static char recv_char(void)
+/*
+ * Returns the next character from the debugger or -1. Buffered characters
+ * are sent before we wait for the debugger.
+ */
+static int recv_char(void)
 {
-	unsigned char ch;
-	int ret;
+	ssize_t ret;
+
+	if (rx_pos < rx_len)
+		return rx_buffer[rx_pos++];
+
+	if (flush_chars() == -1)
+		return -1;
+
+	do {
+		ret = recv(socket_fd, rx_buffer, sizeof(rx_buffer), 0);
+	} while ((ret < 0) && (errno == EINTR));
 
-	ret = recv(socket_fd, &ch, 1, 0);
 	if (ret < 0) {
 		return -1;
 	} else if (ret == 0) {
@@ -246,27 +367,26 @@ static char recv_char(void)
 		close(socket_fd);
 		socket_fd = -1;
 		return -1;
-	} else {
-		assert(ret == 1);
 	}
 
-	/* All GDB remote packets are encoded in ASCII. */
-	assert(isascii(ch));
+	rx_pos = 1;
+	rx_len = ret;
 
-	return (char)ch;
+	return rx_buffer[0];
 }
 
 /*
  * Scan for the sequence $<data>#<checksum>
- * Returns a null terminated string.
+ * Returns a null terminated string and its length, which differs from
+ * strlen() for binary packets.
  */
-static char *recv_packet(void)
+static char *recv_packet(size_t *len)
 {
 	char *buffer = &in_buffer[0];
 	unsigned char checksum;
 	unsigned char xmitcsum;
-	char ch;
-	int count;
+	int ch;
+	size_t count;
 
 	while (1) {
 		/* wait around for the start character, ignore all other characters */
@@ -283,7 +403,7 @@ static char *recv_packet(void)
 		count = 0;
 
 		/* now, read until a # or end of buffer is found */
-		while (count < BUFMAX - 1) {
+		while (count < GDB_PACKET_SIZE) {
 			ch = recv_char();
 			if (ch == -1)
 				return NULL;
@@ -312,7 +432,7 @@ static char *recv_packet(void)
 				warnx("Failed checksum from GDB. "
 				      "My count = 0x%x, sent=0x%x. buf=%s",
 				      checksum, xmitcsum, buffer);
-				if (send_char('-') == -1)
+				if ((send_char('-') == -1) || (flush_chars() == -1))
 					/* Unsuccessful reply to a failed checksum */
 					err(1,
 					    "GDB: Could not send an ACK to the debugger.");
@@ -327,10 +447,18 @@ static char *recv_packet(void)
 					send_char(buffer[0]);
 					send_char(buffer[1]);
 
-					return &buffer[3];
+					*len = count - 3;
+					buffer = &buffer[3];
+				} else {
+					*len = count;
 				}
 
-				return &buffer[0];
+				/* The debugger must not wait for the ACK of a long command. */
+				if (flush_chars() == -1)
+					err(1,
+					    "GDB: Could not send an ACK to the debugger.");
+
+				return buffer;
 			}
 		}
 	}
@@ -340,11 +468,10 @@ static char *recv_packet(void)
  * Send packet of the form $<packet info>#<checksum> without waiting for an ACK
  * from the debugger. Only send_response
  */
-static void send_packet_no_ack(char *buffer)
+static void send_packet_no_ack(const char *buffer, size_t len)
 {
 	unsigned char checksum;
-	int count;
-	char ch;
+	size_t count;
 
 	/*
 	 * We ignore all send_char errors as we either: (1) care about sending our
@@ -355,31 +482,28 @@ static void send_packet_no_ack(char *buffer)
 
 	send_char('$');
 	checksum = 0;
-	count = 0;
-
-	ch = buffer[count];
-	while (ch) {
-		send_char(ch);
-		checksum += ch;
-		count += 1;
-		ch = buffer[count];
+
+	for (count = 0; count < len; count++) {
+		send_char(buffer[count]);
+		checksum += buffer[count];
 	}
 
 	send_char('#');
 	send_char(hexchars[checksum >> 4]);
 	send_char(hexchars[checksum % 16]);
+	flush_chars();
 }
 
 /*
  * Send a packet and wait for a successful ACK of '+' from the debugger.
  * An ACK of '-' means that we have to resend.
  */
-static void send_packet(char *buffer)
+static void send_packet_len(const char *buffer, size_t len)
 {
-	char ch;
+	int ch;
 
 	for (;;) {
-		send_packet_no_ack(buffer);
+		send_packet_no_ack(buffer, len);
 		ch = recv_char();
 		if (ch == -1)
 			return;
@@ -388,6 +512,11 @@ static void send_packet(char *buffer)
 	}
 }
 
+static void send_packet(const char *buffer)
+{
+	send_packet_len(buffer, strlen(buffer));
+}
+
 #define send_error_msg()   do { send_packet(GDB_ERROR_MSG); } while (0)
 
 #define send_not_supported_msg()   do { send_packet(""); } while (0)
@@ -411,40 +540,146 @@ static void send_response(char code, int sigval, bool wait_for_ack)
 	if (wait_for_ack)
 		send_packet(obuf);
 	else
-		send_packet_no_ack(obuf);
+		send_packet_no_ack(obuf, strlen(obuf));
 }
 
-static void gdb_handle_query(char* packet)
+typedef struct {
+	FILE *f;
+	uint64_t start;
+	uint64_t size;
+} memory_map_t;
+
+static void memory_map_region(memory_map_t *map)
+{
+	if (map->size)
+		fprintf(map->f, "<memory type=\"ram\" start=\"0x%" PRIx64 "\" length=\"0x%" PRIx64 "\"/>",
+			map->start, map->size);
+}
+
+static void memory_map_add(uint64_t virt, uint64_t phys, uint64_t size, void *arg)
+{
+	memory_map_t *map = (memory_map_t *)arg;
+
+	/* the debugger does not care about the physical layout */
+	if (map->size && (map->start + map->size == virt)) {
+		map->size += size;
+		return;
+	}
+
+	memory_map_region(map);
+	map->start = virt;
+	map->size = size;
+}
+
+/*
+ * Reply to qXfer:memory-map:read. The map describes the mapped part of the
+ * virtual address space and is created again, if GDB reads it from the
+ * beginning.
+ */
+static void send_memory_map(int vcpufd, size_t offset, size_t length)
+{
+	static char *xml = NULL;
+	static size_t xml_len = 0;
+
+	if ((offset == 0) || !xml) {
+		memory_map_t map = { NULL, 0, 0 };
+		uint64_t root = 0;
+
+#ifndef __aarch64__
+		/* the page tables, which the stopped vCPU uses */
+		struct kvm_sregs sregs;
+
+		kvm_ioctl(vcpufd, KVM_GET_SREGS, &sregs);
+		root = sregs.cr3;
+#endif
+
+		free(xml);
+		xml = NULL;
+		map.f = open_memstream(&xml, &xml_len);
+		if (!map.f) {
+			send_error_msg();
+			return;
+		}
+
+		fprintf(map.f, "<?xml version=\"1.0\"?>\n"
+			"<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\" "
+			"\"http://sourceware.org/gdb/gdb-memory-map.dtd\">\n<memory-map>");
+		walk_guest_mappings(root, memory_map_add, &map);
+		memory_map_region(&map);
+		fprintf(map.f, "</memory-map>\n");
+		fclose(map.f);
+	}
+
+	if (offset >= xml_len) {
+		send_packet("l");
+		return;
+	}
+
+	length = min(min(length, xml_len - offset), (GDB_PACKET_SIZE - 1) / 2);
+	out_buffer[0] = (offset + length < xml_len) ? 'm' : 'l';
+	send_packet_len(out_buffer, 1 + mem2bin((unsigned char *)xml + offset, out_buffer + 1, length));
+}
+
+/* Commands of "monitor", qRcmd,<command as hex> */
+static void gdb_handle_monitor(const char *hex_cmd)
+{
+	char cmd[BUFMAX];
+	size_t len = strlen(hex_cmd) / 2;
+
+	if (len >= sizeof(cmd)) {
+		send_error_msg();
+		return;
+	}
+	hex2mem(hex_cmd, (unsigned char *)cmd, len);
+	cmd[len] = '\0';
+
+	if ((strcmp(cmd, "coredump") == 0) || (strncmp(cmd, "coredump ", 9) == 0)) {
+		/* HERMIT_COREDUMP is the default file */
+		const char *fname = (len > 9) ? cmd + 9 : getenv("HERMIT_COREDUMP");
+
+		create_coredump(fname ? fname : "hermit.core");
+		send_okay_msg();
+	} else {
+		send_not_supported_msg();
+	}
+}
+
+static void gdb_handle_query(int vcpufd, char* packet)
 {
 	static uint64_t thread_counter = 0;
 	char obuf[BUFMAX];
+	size_t offset, length;
 
-	if (ncores > 1) {
-		if (strcmp(packet, "qfThreadInfo") == 0) {
+	if (strncmp(packet, "qSupported", 10) == 0) {
+		snprintf(obuf, sizeof(obuf), "PacketSize=%x;qXfer:memory-map:read+;binary-upload+",
+			GDB_PACKET_SIZE);
+		send_packet(obuf);
+	} else if (sscanf(packet, "qXfer:memory-map:read::%zx,%zx", &offset, &length) == 2) {
+		send_memory_map(vcpufd, offset, length);
+	} else if (strncmp(packet, "qRcmd,", 6) == 0) {
+		gdb_handle_monitor(packet + 6);
+	} else if ((ncores > 1) && (strcmp(packet, "qfThreadInfo") == 0)) {
+		thread_counter++;
+		snprintf(obuf, sizeof(obuf), "m%lx", thread_counter);
+		send_packet(obuf);
+	} else if ((ncores > 1) && (strcmp(packet, "qsThreadInfo") == 0)) {
+		if (thread_counter < ncores) {
 			thread_counter++;
 			snprintf(obuf, sizeof(obuf), "m%lx", thread_counter);
-			send_packet(obuf);
-		} else if (strcmp(packet, "qsThreadInfo") == 0) {
-			if (thread_counter < ncores) {
-				thread_counter++;
-				snprintf(obuf, sizeof(obuf), "m%lx", thread_counter);
-			} else {
-				thread_counter = 0;
-				snprintf(obuf, sizeof(obuf), "l");
-			}
-			send_packet(obuf);
+		} else {
+			thread_counter = 0;
+			snprintf(obuf, sizeof(obuf), "l");
 		}
-
-		return;
+		send_packet(obuf);
+	} else {
+		send_not_supported_msg();
 	}
-
-	send_not_supported_msg();
 }
 
 static void gdb_handle_exception(int vcpufd, int sigval)
 {
 	char *packet;
-	char obuf[BUFMAX];
+	size_t packet_len;
 
 	/* Notify the debugger of our last signal */
 	send_response('S', sigval, true);
@@ -453,9 +688,9 @@ static void gdb_handle_exception(int vcpufd, int sigval)
 		uint64_t addr = 0, result;
 		gdb_breakpoint_type type;
 		size_t len;
-		int command, ret;
+		int command, ret, offset = 0;
 
-		packet = recv_packet();
+		packet = recv_packet(&packet_len);
 		if (packet == NULL)
 			/* Without a packet with instructions with what to do next there is
 			 * really nothing we can do to recover. So, dying. */
@@ -515,13 +750,31 @@ static void gdb_handle_exception(int vcpufd, int sigval)
 				/* translate addr into guest phys first. it is
 				 * needed if the address falls into the non directly mapped
 				 * part of the virtual address space (ex: heap/stack) */
-				uint64_t phys_addr;
+				len = min(len, GDB_PACKET_SIZE / 2);
+				result = guest_mem_access(vcpufd, addr, mem_buffer, len, false);
+				if (len && !result) {
+					send_error_msg();
+				} else {
+					mem2hex(mem_buffer, out_buffer, result);
+					send_packet(out_buffer);
+				}
+				break;	/* Wait for another command. */
+			}
 
-				if (uhyve_gdb_guest_virt_to_phys(vcpufd, addr, &phys_addr)) {
+		case 'x':
+			{
+				/* Read memory content as binary data */
+				if (sscanf(packet, "x%" PRIx64 ",%zx", &addr, &len) != 2) {
+					send_error_msg();
+					break;
+				}
+				len = min(len, (GDB_PACKET_SIZE - 1) / 2);
+				result = guest_mem_access(vcpufd, addr, mem_buffer, len, false);
+				if (len && !result) {
 					send_error_msg();
 				} else {
-					mem2hex(guest_mem + phys_addr, obuf, len);
-					send_packet(obuf);
+					out_buffer[0] = 'b';
+					send_packet_len(out_buffer, 1 + mem2bin(mem_buffer, out_buffer + 1, result));
 				}
 				break;	/* Wait for another command. */
 			}
@@ -529,22 +782,35 @@ static void gdb_handle_exception(int vcpufd, int sigval)
 		case 'M':
 			{
 				/* Write memory content */
-				uint64_t phys_addr;
-
-				assert(strlen(packet) <= sizeof(obuf));
-				if (sscanf(packet, "M%" PRIx64 ",%zx:%s", &addr, &len, obuf) != 3) {
+				if ((sscanf(packet, "M%" PRIx64 ",%zx:%n", &addr, &len, &offset) != 2)
+				    || !offset || (len > sizeof(mem_buffer))
+				    || (packet_len - offset < 2 * len)) {
 					send_error_msg();
 					break;
 				}
 
-				/* translate to guest physical address first */
-				if (uhyve_gdb_guest_virt_to_phys(vcpufd, addr, &phys_addr)) {
+				hex2mem(packet + offset, mem_buffer, len);
+				if (guest_mem_access(vcpufd, addr, mem_buffer, len, true) != len)
 					send_error_msg();
-				} else {
-					hex2mem(obuf, guest_mem + phys_addr,
-						len);
+				else
 					send_okay_msg();
+				break;	/* Wait for another command. */
+			}
+
+		case 'X':
+			{
+				/* Write binary memory content */
+				if ((sscanf(packet, "X%" PRIx64 ",%zx:%n", &addr, &len, &offset) != 2)
+				    || !offset || (len > sizeof(mem_buffer))
+				    || (bin2mem(packet + offset, packet_len - offset, mem_buffer) != len)) {
+					send_error_msg();
+					break;
 				}
+
+				if (guest_mem_access(vcpufd, addr, mem_buffer, len, true) != len)
+					send_error_msg();
+				else
+					send_okay_msg();
 				break;	/* Wait for another command. */
 			}
 
@@ -555,8 +821,8 @@ static void gdb_handle_exception(int vcpufd, int sigval)
 				if (uhyve_gdb_read_registers(vcpufd, registers, &len) == -1) {
 					send_error_msg();
 				} else {
-					mem2hex(registers, obuf, len);
-					send_packet(obuf);
+					mem2hex(registers, out_buffer, len);
+					send_packet(out_buffer);
 				}
 				break;	/* Wait for another command. */
 			}
@@ -624,7 +890,7 @@ static void gdb_handle_exception(int vcpufd, int sigval)
 
 		case 'q':
 			{
-				gdb_handle_query(packet);
+				gdb_handle_query(vcpufd, packet);
 				break;
 			}
 
@@ -1113,12 +1379,18 @@ int uhyve_gdb_guest_virt_to_phys(int vcpufd, const uint64_t virt, uint64_t * phy
 #ifdef __aarch64__
 	*phys = aarch64_virt_to_phys(virt);
 #else
-	struct kvm_translation kt;
+	struct kvm_sregs sregs;
+	size_t physical_address, physical_address_end;
+
+	/* the page tables of the vCPU's CR3, cached like the hypercall paths */
+	if (ioctl(vcpufd, KVM_GET_SREGS, &sregs) < 0)
+		return -1;
 
-	kt.linear_address = virt;
-	kvm_ioctl(vcpufd, KVM_TRANSLATE, &kt);
+	virt_to_phys_root(sregs.cr3, virt, &physical_address, &physical_address_end);
+	if (physical_address_end <= physical_address)
+		return -1;
 
-	*phys = kt.physical_address;
+	*phys = physical_address;
 #endif
 	return 0;
 }
@@ -0,0 +1,532 @@
+/*
+ * Copyright (c) 2018, RWTH Aachen University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The guest memory is either private anonymous memory or a memfd, which
+ * may reside on hugetlbfs. A memfd is shared with forked processes and
+ * cannot be populated by a userfaultfd in units of 4 KiB pages, hence
+ * lazy restores and post-copy migrations keep anonymous memory.
+ *
+ * MPOL_BIND with several nodes allocates on the node of the faulting
+ * thread. Hence, the prefault threads run on the CPUs of the vCPUs and
+ * pages faulted in by a vCPU land on its node as well.
+ *
+ * Free ranges, which the guest reports, are discarded and marked in a
+ * bitmap. Before a checkpoint, the marks of pages, which the guest has
+ * touched since, are removed: /proc/self/pagemap reports them as present
+ * or swapped. The remaining pages are free and need not be saved. Pages,
+ * which are merely not resident, are always saved, since they may be
+ * swapped out or be evicted from the page cache of a snapshot.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <linux/mempolicy.h>
+
+#include "uhyve-common.h"
+#include "uhyve-mem.h"
+
+#define MEM_MAX_CPUS		CPU_SETSIZE
+#define MEM_MAX_NODES		1024
+/* alignment of the prefault ranges, the size of a transparent huge page */
+#define MEM_PREFAULT_ALIGN	(2UL << 20)
+
+#define BITS_PER_LONG		(8 * sizeof(unsigned long))
+
+#ifndef MFD_HUGETLB
+#define MFD_HUGETLB		0x0004U
+#endif
+#ifndef MFD_HUGE_SHIFT
+#define MFD_HUGE_SHIFT		26
+#endif
+#ifndef MFD_HUGE_2MB
+#define MFD_HUGE_2MB		(21U << MFD_HUGE_SHIFT)
+#endif
+#ifndef MFD_HUGE_1GB
+#define MFD_HUGE_1GB		(30U << MFD_HUGE_SHIFT)
+#endif
+
+extern uint32_t ncores;
+extern bool verbose;
+
+typedef struct prefault_range {
+	pthread_t thread;
+	uint32_t cpuid;
+	uint8_t* start;
+	size_t size;
+	uint8_t* hole_start;
+	uint8_t* hole_end;
+} prefault_range_t;
+
+static const char* backing_names[] = {"anonymous memory", "memfd", "hugetlbfs memfd", "copy-on-write file"};
+
+static mem_backing_t backing = MEM_BACKING_ANONYMOUS;
+static size_t page_size = 4096;
+static size_t huge_size = 2UL << 20;
+static bool prefault = false;
+static int mem_fd = -1;
+static size_t map_size = 0;
+static int cpus[MEM_MAX_CPUS];
+static int cpu_count = 0;
+static cpu_set_t initial_cpus;
+static unsigned long nodes[MEM_MAX_NODES / BITS_PER_LONG];
+static int node_count = 0;
+static int free_advice = MADV_DONTNEED;
+/* pages of the guest memory, which are discarded and not touched since */
+static uint8_t* guest_base = NULL;
+static unsigned long* discarded = NULL;
+static size_t discarded_pages = 0;
+static int pagemap_fd = -1;
+
+/* flags of /proc/self/pagemap */
+#define PAGEMAP_SWAPPED		(1ULL << 62)
+#define PAGEMAP_PRESENT		(1ULL << 63)
+
+/* Parses a list like "0-3,8" into values, returns their number or -1 */
+static int parse_list(const char* str, int* values, int max_values, int limit)
+{
+	int count = 0;
+
+	while (*str) {
+		char* end;
+		long first = strtol(str, &end, 10);
+		long last = first;
+
+		if (end == str)
+			return -1;
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str)
+				return -1;
+		}
+		if ((first < 0) || (last < first) || (last >= limit))
+			return -1;
+		for(long i = first; i <= last; i++) {
+			if (count >= max_values)
+				return -1;
+			values[count++] = (int) i;
+		}
+
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		str = end;
+	}
+
+	return count;
+}
+
+/* Returns the NUMA node of a host CPU or -1 */
+static int cpu_node(int cpu)
+{
+	char dname[64];
+	int node = -1;
+
+	snprintf(dname, sizeof(dname), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR* dir = opendir(dname);
+	if (!dir)
+		return -1;
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL) {
+		if (sscanf(entry->d_name, "node%d", &node) == 1)
+			break;
+		node = -1;
+	}
+	closedir(dir);
+
+	return node;
+}
+
+static void add_node(int node)
+{
+	if ((node < 0) || (node >= MEM_MAX_NODES))
+		return;
+
+	if (!(nodes[node / BITS_PER_LONG] & (1UL << (node % BITS_PER_LONG)))) {
+		nodes[node / BITS_PER_LONG] |= 1UL << (node % BITS_PER_LONG);
+		node_count++;
+	}
+}
+
+void mem_init(bool userfault)
+{
+	const char* str = getenv("HERMIT_MEM_BACKING");
+	if (str && (strcmp(str, "anonymous") != 0) && (strcmp(str, "0") != 0)) {
+		if (strcmp(str, "memfd") == 0) {
+			backing = MEM_BACKING_MEMFD;
+		} else if ((strcmp(str, "hugetlb") == 0) || (strcmp(str, "hugetlb-2M") == 0)) {
+			backing = MEM_BACKING_HUGETLB;
+			huge_size = 2UL << 20;
+		} else if (strcmp(str, "hugetlb-1G") == 0) {
+			backing = MEM_BACKING_HUGETLB;
+			huge_size = 1UL << 30;
+		} else {
+			fprintf(stderr, "[WARNING] Unknown memory backing %s, use anonymous memory\n", str);
+		}
+	}
+
+	if (userfault && (backing != MEM_BACKING_ANONYMOUS)) {
+		fprintf(stderr, "[WARNING] The userfaultfd requires anonymous guest memory\n");
+		backing = MEM_BACKING_ANONYMOUS;
+	}
+
+	page_size = (size_t) sysconf(_SC_PAGESIZE);
+
+	if (sched_getaffinity(0, sizeof(initial_cpus), &initial_cpus) < 0)
+		CPU_ZERO(&initial_cpus);
+
+	str = getenv("HERMIT_CPU_AFFINITY");
+	if (str) {
+		cpu_count = parse_list(str, cpus, MEM_MAX_CPUS, MEM_MAX_CPUS);
+		if (cpu_count < 0) {
+			fprintf(stderr, "[WARNING] Invalid CPU list %s, the VCPUs are not pinned\n", str);
+			cpu_count = 0;
+		}
+	}
+
+	str = getenv("HERMIT_NUMA_NODES");
+	if (str) {
+		int values[MEM_MAX_NODES];
+		int count = parse_list(str, values, MEM_MAX_NODES, MEM_MAX_NODES);
+
+		if (count < 0)
+			fprintf(stderr, "[WARNING] Invalid node list %s, the guest memory is not bound\n", str);
+		for(int i = 0; i < count; i++)
+			add_node(values[i]);
+	} else {
+		for(int i = 0; i < cpu_count; i++)
+			add_node(cpu_node(cpus[i]));
+	}
+
+	str = getenv("HERMIT_PREFAULT");
+	prefault = str && (strcmp(str, "0") != 0);
+
+	str = getenv("HERMIT_FREE_PAGE_ADVICE");
+	if (str && (strcmp(str, "free") == 0))
+		free_advice = MADV_FREE;
+
+	if (verbose) {
+		fprintf(stderr, "Uhyve backs the guest memory with %s", backing_names[backing]);
+		if (cpu_count)
+			fprintf(stderr, ", pins the VCPUs to %d host CPUs", cpu_count);
+		if (node_count)
+			fprintf(stderr, ", binds it to %d NUMA nodes", node_count);
+		fprintf(stderr, "\n");
+	}
+}
+
+mem_backing_t mem_backing(void)
+{
+	return backing;
+}
+
+uint8_t* mem_map_guest(size_t size, int fd)
+{
+	uint8_t* mem;
+
+	map_size = size;
+	if (fd >= 0) {
+		backing = MEM_BACKING_FILE;
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	} else if (backing == MEM_BACKING_ANONYMOUS) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	} else {
+		unsigned int flags = MFD_CLOEXEC;
+
+		if (backing == MEM_BACKING_HUGETLB) {
+			flags |= MFD_HUGETLB | ((huge_size == (1UL << 30)) ? MFD_HUGE_1GB : MFD_HUGE_2MB);
+			map_size = (size + huge_size - 1) & ~(huge_size - 1);
+		}
+
+		mem_fd = memfd_create("hermit-guest", flags);
+		if (mem_fd < 0)
+			err(1, "Unable to create the memfd of the guest memory");
+		if (ftruncate(mem_fd, map_size) < 0)
+			err(1, "ftruncate failed");
+
+		mem = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, mem_fd, 0);
+		if ((mem == MAP_FAILED) && (backing == MEM_BACKING_HUGETLB))
+			err(1, "Unable to map %zu huge pages of %zu KiB (see /proc/sys/vm/nr_hugepages)",
+				map_size / huge_size, huge_size >> 10);
+	}
+
+	if (mem == MAP_FAILED)
+		err(1, "mmap failed");
+
+	guest_base = mem;
+	discarded_pages = (size + page_size - 1) / page_size;
+	discarded = (unsigned long*) calloc((discarded_pages + BITS_PER_LONG - 1) / BITS_PER_LONG, sizeof(unsigned long));
+	if (!discarded)
+		err(1, "Not enough memory");
+
+	return mem;
+}
+
+/* Populates a range of the guest memory */
+static void prefault_pages(uint8_t* start, size_t size)
+{
+	if (size == 0)
+		return;
+
+#if defined(MADV_POPULATE_READ) && defined(MADV_POPULATE_WRITE)
+	// a write would copy each page of a copy-on-write mapping
+	int advice = (backing == MEM_BACKING_FILE) ? MADV_POPULATE_READ : MADV_POPULATE_WRITE;
+	if (madvise(start, size, advice) == 0)
+		return;
+#endif
+
+	// older kernels, touch each page
+	size_t step = (backing == MEM_BACKING_HUGETLB) ? huge_size : page_size;
+	for(size_t off = 0; off < size; off += step) {
+		volatile uint8_t* p = start + off;
+
+		if (backing == MEM_BACKING_FILE)
+			(void) *p;
+		else
+			*p = *p;
+	}
+}
+
+static void* prefault_thread(void* arg)
+{
+	prefault_range_t* range = (prefault_range_t*) arg;
+	uint8_t* end = range->start + range->size;
+
+	mem_pin_vcpu(range->cpuid);
+
+	if (range->hole_start < end && range->hole_end > range->start) {
+		if (range->hole_start > range->start)
+			prefault_pages(range->start, range->hole_start - range->start);
+		if (range->hole_end < end)
+			prefault_pages(range->hole_end, end - range->hole_end);
+	} else {
+		prefault_pages(range->start, range->size);
+	}
+
+	return NULL;
+}
+
+void mem_place_guest(uint8_t* mem, size_t size, size_t hole_start, size_t hole_end)
+{
+	if (mem_fd >= 0) {
+		// releases the huge pages, which are reserved for the hole
+		size_t align = (backing == MEM_BACKING_HUGETLB) ? huge_size : page_size;
+		size_t start = (hole_start + align - 1) & ~(align - 1);
+		size_t end = hole_end & ~(align - 1);
+
+		if ((end > start) && (fallocate(mem_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start) < 0))
+			fprintf(stderr, "[WARNING] Unable to release the memory hole - %d (%s)\n", errno, strerror(errno));
+
+		close(mem_fd);
+		mem_fd = -1;
+	}
+
+	if (node_count && (syscall(SYS_mbind, mem, map_size, MPOL_BIND, nodes, MEM_MAX_NODES, MPOL_MF_MOVE) < 0))
+		fprintf(stderr, "[WARNING] Unable to bind the guest memory to the NUMA nodes - %d (%s)\n", errno, strerror(errno));
+
+	if (!prefault)
+		return;
+
+	struct timeval begin, end;
+	if (verbose)
+		gettimeofday(&begin, NULL);
+
+	uint32_t threads = ncores ? ncores : 1;
+	size_t align = (backing == MEM_BACKING_HUGETLB) ? huge_size : MEM_PREFAULT_ALIGN;
+	size_t slice = ((size / threads) + align - 1) & ~(align - 1);
+	prefault_range_t* ranges = (prefault_range_t*) calloc(threads, sizeof(prefault_range_t));
+	if (!ranges)
+		err(1, "Not enough memory");
+
+	for(uint32_t i = 0; i < threads; i++) {
+		size_t start = (size_t) i * slice;
+
+		ranges[i].cpuid = i;
+		ranges[i].start = mem + (start < size ? start : size);
+		ranges[i].size = start < size ? (size - start < slice ? size - start : slice) : 0;
+		ranges[i].hole_start = mem + hole_start;
+		ranges[i].hole_end = mem + hole_end;
+		if (create_helper_thread(&ranges[i].thread, prefault_thread, &ranges[i]))
+			err(1, "unable to create thread");
+	}
+
+	for(uint32_t i = 0; i < threads; i++)
+		pthread_join(ranges[i].thread, NULL);
+	free(ranges);
+
+	if (verbose) {
+		gettimeofday(&end, NULL);
+		size_t msec = (end.tv_sec - begin.tv_sec) * 1000;
+		msec += (end.tv_usec - begin.tv_usec) / 1000;
+		fprintf(stderr, "Prefault of the guest memory with %u threads takes %zd ms\n", threads, msec);
+	}
+}
+
+void mem_discard(uint8_t* start, size_t size)
+{
+	size_t align = (backing == MEM_BACKING_HUGETLB) ? huge_size : page_size;
+	uintptr_t first = ((uintptr_t) start + align - 1) & ~(align - 1);
+	uintptr_t last = ((uintptr_t) start + size) & ~(align - 1);
+
+	if (last <= first)
+		return;
+
+	int advice;
+	switch (backing) {
+	case MEM_BACKING_MEMFD:
+	case MEM_BACKING_HUGETLB:
+		advice = MADV_REMOVE;
+		break;
+	case MEM_BACKING_FILE:
+		// MADV_FREE does not apply to file mappings
+		advice = MADV_DONTNEED;
+		break;
+	default:
+		advice = free_advice;
+		break;
+	}
+
+	if (madvise((void*) first, last - first, advice) < 0) {
+		fprintf(stderr, "[WARNING] Unable to discard free guest memory - %d (%s)\n", errno, strerror(errno));
+		return;
+	}
+
+	if (!discarded || (first < (uintptr_t) guest_base))
+		return;
+
+	size_t last_page = (last - (uintptr_t) guest_base) / page_size;
+	if (last_page > discarded_pages)
+		last_page = discarded_pages;
+
+	for(size_t i = (first - (uintptr_t) guest_base) / page_size; i < last_page; i++)
+		__atomic_fetch_or(discarded + i / BITS_PER_LONG, 1UL << (i % BITS_PER_LONG), __ATOMIC_RELAXED);
+}
+
+void mem_update_discarded(void)
+{
+	uint64_t entries[BITS_PER_LONG];
+
+	if (!discarded)
+		return;
+
+	if (pagemap_fd < 0) {
+		pagemap_fd = open("/proc/self/pagemap", O_RDONLY | O_CLOEXEC);
+		if (pagemap_fd < 0) {
+			// without the page map, touched pages cannot be told apart
+			fprintf(stderr, "[WARNING] Unable to open the page map, free pages are saved - %d (%s)\n", errno, strerror(errno));
+			free(discarded);
+			discarded = NULL;
+			return;
+		}
+	}
+
+	for(size_t i = 0; i < (discarded_pages + BITS_PER_LONG - 1) / BITS_PER_LONG; i++) {
+		unsigned long value = __atomic_load_n(discarded + i, __ATOMIC_RELAXED);
+		uintptr_t addr = (uintptr_t) guest_base + i * BITS_PER_LONG * page_size;
+		size_t count = BITS_PER_LONG;
+
+		if (!value)
+			continue;
+
+		if ((i + 1) * BITS_PER_LONG > discarded_pages)
+			count = discarded_pages - i * BITS_PER_LONG;
+
+		if (pread(pagemap_fd, entries, count * sizeof(uint64_t), (addr / page_size) * sizeof(uint64_t)) != (ssize_t) (count * sizeof(uint64_t))) {
+			// the pages are treated as touched
+			__atomic_store_n(discarded + i, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		unsigned long touched = 0;
+		for(unsigned long bits = value; bits; bits &= bits - 1) {
+			size_t bit = __builtin_ctzl(bits);
+
+			if (entries[bit] & (PAGEMAP_PRESENT | PAGEMAP_SWAPPED))
+				touched |= 1UL << bit;
+		}
+
+		if (touched)
+			__atomic_fetch_and(discarded + i, ~touched, __ATOMIC_RELAXED);
+	}
+}
+
+bool mem_discarded(const uint8_t* start, size_t size)
+{
+	if (!discarded || (start < guest_base))
+		return false;
+
+	size_t first = (start - guest_base) / page_size;
+	size_t last = (start + size - guest_base + page_size - 1) / page_size;
+
+	if (last > discarded_pages)
+		return false;
+
+	for(size_t i = first; i < last; i++)
+		if (!(__atomic_load_n(discarded + i / BITS_PER_LONG, __ATOMIC_RELAXED) & (1UL << (i % BITS_PER_LONG))))
+			return false;
+
+	return true;
+}
+
+void mem_pin_vcpu(uint32_t cpuid)
+{
+	if (!cpu_count)
+		return;
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpus[cpuid % cpu_count], &set);
+
+	int ret = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (ret)
+		fprintf(stderr, "[WARNING] Unable to pin VCPU %u to CPU %d - %d (%s)\n", cpuid, cpus[cpuid % cpu_count], ret, strerror(ret));
+}
+
+void mem_unpin_thread(void)
+{
+	if (!cpu_count || !CPU_COUNT(&initial_cpus))
+		return;
+
+	pthread_setaffinity_np(pthread_self(), sizeof(initial_cpus), &initial_cpus);
+}
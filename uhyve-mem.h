@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2018, RWTH Aachen University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file tools/uhyve-mem.h
+ * @brief Backing and NUMA placement of the guest memory
+ */
+
+#ifndef __UHYVE_MEM_H__
+#define __UHYVE_MEM_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+typedef enum {
+	MEM_BACKING_ANONYMOUS = 0,	// private anonymous memory, optionally THP
+	MEM_BACKING_MEMFD,		// shared memory of a memfd
+	MEM_BACKING_HUGETLB,		// shared memory of a memfd on hugetlbfs
+	MEM_BACKING_FILE,		// copy-on-write mapping of a file
+} mem_backing_t;
+
+/**
+ * \brief Reads the memory and affinity settings
+ *
+ * \param userfault true if the guest memory is populated by a userfaultfd
+ *
+ * The backing is selected by HERMIT_MEM_BACKING ("anonymous", "memfd",
+ * "hugetlb", "hugetlb-2M" or "hugetlb-1G"). HERMIT_CPU_AFFINITY pins the
+ * vCPUs round-robin to a list of host CPUs (e.g. "0-3,8"). HERMIT_NUMA_NODES
+ * binds the guest memory to a list of nodes, which defaults to the nodes
+ * of the pinned CPUs. HERMIT_PREFAULT=1 touches the guest memory in
+ * parallel before the start. A userfaultfd requires anonymous memory.
+ */
+void mem_init(bool userfault);
+
+/**
+ * \brief Returns the backing of the guest memory
+ */
+mem_backing_t mem_backing(void);
+
+/**
+ * \brief Returns true if the guest memory is not copied by fork()
+ */
+static inline bool mem_shared(void)
+{
+	return (mem_backing() == MEM_BACKING_MEMFD) || (mem_backing() == MEM_BACKING_HUGETLB);
+}
+
+/**
+ * \brief Maps the guest memory
+ *
+ * \param size size of the guest memory including holes
+ * \param fd file, which is mapped copy-on-write, or -1
+ */
+uint8_t* mem_map_guest(size_t size, int fd);
+
+/**
+ * \brief Binds the guest memory to the NUMA nodes and prefaults it
+ *
+ * \param mem start of the guest memory
+ * \param size size of the guest memory including the hole
+ * \param hole_start start of an inaccessible hole, which is skipped
+ * \param hole_end end of the hole
+ *
+ * The memory is split into one range per vCPU, which is touched by a
+ * thread on the host CPU of the vCPU. Thereby, each range is allocated on
+ * the node of its vCPU.
+ */
+void mem_place_guest(uint8_t* mem, size_t size, size_t hole_start, size_t hole_end);
+
+/**
+ * \brief Returns a free range of the guest memory to the host
+ *
+ * The range is shrunk to whole pages. Anonymous memory is released with
+ * MADV_DONTNEED or, with HERMIT_FREE_PAGE_ADVICE=free, with MADV_FREE.
+ * Memory of a memfd is removed from the file. Afterwards, the range reads
+ * as zero or as the content of a copy-on-write file.
+ */
+void mem_discard(uint8_t* start, size_t size);
+
+/**
+ * \brief Forgets the discarded pages, which the guest has touched since
+ *
+ * A page counts as touched, if the page map reports it as present or
+ * swapped.
+ */
+void mem_update_discarded(void);
+
+/**
+ * \brief Returns true if all pages of a range are discarded and untouched
+ *
+ * The result is valid as of the last call of mem_update_discarded().
+ */
+bool mem_discarded(const uint8_t* start, size_t size);
+
+/**
+ * \brief Pins the calling thread to the host CPU of a vCPU
+ */
+void mem_pin_vcpu(uint32_t cpuid);
+
+/**
+ * \brief Restores the initial affinity of the calling thread
+ *
+ * Threads inherit the affinity of their creator, helper threads of a
+ * pinned vCPU have to call it to run on all CPUs.
+ */
+void mem_unpin_thread(void);
+
+#endif
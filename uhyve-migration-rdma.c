@@ -45,9 +45,6 @@
 
 #ifdef __RDMA_MIGRATION__
 
-#define MIG_ITERS 		(4)
-
-#define IB_CQ_ENTRIES 		(1)
 #define IB_MAX_INLINE_DATA 	(0)
 #define IB_MAX_DEST_RD_ATOMIC 	(1)
 #define IB_MIN_RNR_TIMER 	(1)
@@ -57,6 +54,9 @@
 #define IB_MAX_RECV_WR 		(1)
 #define IB_MAX_SEND_SGE 	(1)
 #define IB_MAX_RECV_SGE 	(1)
+#define IB_SIGNAL_INTERVAL 	(64) 	/* request a CQE for every n-th WR */
+#define IB_MAX_SIGNALED_WR 	(IB_MAX_SEND_WR/IB_SIGNAL_INTERVAL)
+#define IB_CQ_ENTRIES 		(IB_MAX_SIGNALED_WR+IB_MAX_RECV_WR)
 
 typedef enum ib_wr_ids {
 	IB_WR_NO_ID = 0,
@@ -65,12 +65,11 @@ typedef enum ib_wr_ids {
 	IB_WR_BASE_ID
 } ib_wr_ids_t;
 
-uint64_t cur_wr_id = IB_WR_BASE_ID;
-
 typedef struct qp_info {
-	uint32_t qpn;
+	uint32_t qp_cnt;
+	uint32_t qpn[MIG_MAX_STREAMS];
+	uint32_t psn[MIG_MAX_STREAMS];
 	uint16_t lid;
-	uint16_t psn;
 	uint32_t *keys;
 	uint64_t addr;
 } qp_info_t;
@@ -81,21 +80,28 @@ typedef struct com_hndl {
 	struct ibv_port_attr  		port_attr; 	/* port attributes */
 	struct ibv_pd 			*pd;  		/* protection domain */
 	struct ibv_mr 			**mrs; 		/* memory regions */
-	struct ibv_cq 			*cq;  		/* completion queue */
-	struct ibv_qp 			*qp;  		/* queue pair */
-	struct ibv_comp_channel		*comp_chan;  	/* comp. event channel */
+	struct ibv_cq 			*cq[MIG_MAX_STREAMS]; /* completion queues */
+	struct ibv_qp 			*qp[MIG_MAX_STREAMS]; /* queue pairs */
+	size_t 				pending[MIG_MAX_STREAMS]; /* signaled WRs without CQE */
+	struct ibv_comp_channel		*comp_chan;  	/* comp. event channel of cq[0] */
 	qp_info_t 			loc_qp_info;
 	qp_info_t 			rem_qp_info;
 	uint8_t 			used_port; 	/* port of the IB device */
 	uint8_t 			*buf; 		/* the guest memory (with potential gaps!) */
 	size_t 				mr_cnt; 	/* number of memory regions */
+	size_t 				qp_cnt; 	/* number of queue pairs */
 } com_hndl_t;
 
 
 static com_hndl_t com_hndl;
+
+/* the send list is an arena of WRs and SGEs that is reused across rounds */
 static struct ibv_send_wr *send_list = NULL;
-static struct ibv_send_wr *send_list_last = NULL;
+static struct ibv_sge *send_sges = NULL;
+static size_t send_list_capacity = 0;
 static size_t send_list_length = 0;
+static size_t send_list_pages = 0;
+static size_t send_list_bytes = 0;
 
 /**
  * \brief Prints info of a send_wr
@@ -105,26 +111,18 @@ static size_t send_list_length = 0;
 static inline
 void print_send_wr_info(uint64_t id)
 {
-	struct ibv_send_wr *search_wr = send_list;
-
-	/* find send_wr with id */
-	while(search_wr) {
-		if (search_wr->wr_id == id) {
-			fprintf(stderr, "[INFO] WR_ID: %llu; LADDR: 0x%llx; RADDR: 0x%llx; SIZE: %llu\n",
-					search_wr->wr_id,
-					search_wr->sg_list->addr,
-					search_wr->wr.rdma.remote_addr,
-					search_wr->sg_list->length);
-
-			break;
-		}
-
-		search_wr = search_wr->next;
-	}
-
-	if (search_wr == NULL) {
+	if ((id < IB_WR_BASE_ID) || (id - IB_WR_BASE_ID >= send_list_length)) {
 		fprintf(stderr, "[ERROR] Could not find send_wr with ID %llu\n", id);
+		return;
 	}
+
+	struct ibv_send_wr *search_wr = &send_list[id - IB_WR_BASE_ID];
+	struct ibv_sge *search_sge = &send_sges[id - IB_WR_BASE_ID];
+	fprintf(stderr, "[INFO] WR_ID: %llu; LADDR: 0x%llx; RADDR: 0x%llx; SIZE: %llu\n",
+			search_wr->wr_id,
+			search_sge->addr,
+			search_wr->wr.rdma.remote_addr,
+			search_sge->length);
 }
 
 
@@ -299,66 +297,76 @@ init_com_hndl(mem_mappings_t mem_mappings, bool sender)
 		exit(EXIT_FAILURE);
 	}
 
-	/* create the completion queue */
-	if ((com_hndl.cq = ibv_create_cq(com_hndl.ctx,
-		    			       IB_CQ_ENTRIES,
-		    			       NULL,
-					       com_hndl.comp_chan,
-					       0)) == NULL) {
-		fprintf(stderr,
-			"[ERROR] Could not create the completion queue "
-			"- %d (%s). Abort!\n",
-			errno,
-			strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+	/* create one completion queue and one queue pair per stream; only the
+	 * first CQ reports events since it receives the final notification
+	 */
+	com_hndl.qp_cnt = mig_params.streams;
+	for (i=0; i<com_hndl.qp_cnt; ++i) {
+		if ((com_hndl.cq[i] = ibv_create_cq(com_hndl.ctx,
+			    			       IB_CQ_ENTRIES,
+			    			       NULL,
+						       (i == 0) ? com_hndl.comp_chan : NULL,
+						       0)) == NULL) {
+			fprintf(stderr,
+				"[ERROR] Could not create the completion queue #%d "
+				"- %d (%s). Abort!\n",
+				i,
+				errno,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
 
-	/* create send and recv queue pair  and initialize it */
-	struct ibv_qp_init_attr init_attr = {
-		.send_cq = com_hndl.cq,
-		.recv_cq = com_hndl.cq,
-		.cap 	 = {
-			.max_send_wr  		= IB_MAX_SEND_WR,
-			.max_recv_wr  		= IB_MAX_RECV_WR,
-			.max_send_sge 		= IB_MAX_SEND_SGE,
-			.max_recv_sge 		= IB_MAX_RECV_SGE,
-			.max_inline_data 	= IB_MAX_INLINE_DATA
-		},
-		.qp_type = IBV_QPT_RC,
-		.sq_sig_all = 0 /* we do not want a CQE for each WR */
-	};
-	if ((com_hndl.qp = ibv_create_qp(com_hndl.pd, &init_attr)) == NULL) {
-		fprintf(stderr,
-			"[ERROR] Could not create the queue pair "
-			"- %d (%s). Abort!\n",
-			errno,
-			strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+		/* create send and recv queue pair  and initialize it */
+		struct ibv_qp_init_attr init_attr = {
+			.send_cq = com_hndl.cq[i],
+			.recv_cq = com_hndl.cq[i],
+			.cap 	 = {
+				.max_send_wr  		= IB_MAX_SEND_WR,
+				.max_recv_wr  		= IB_MAX_RECV_WR,
+				.max_send_sge 		= IB_MAX_SEND_SGE,
+				.max_recv_sge 		= IB_MAX_RECV_SGE,
+				.max_inline_data 	= IB_MAX_INLINE_DATA
+			},
+			.qp_type = IBV_QPT_RC,
+			.sq_sig_all = 0 /* we do not want a CQE for each WR */
+		};
+		if ((com_hndl.qp[i] = ibv_create_qp(com_hndl.pd, &init_attr)) == NULL) {
+			fprintf(stderr,
+				"[ERROR] Could not create the queue pair #%d "
+				"- %d (%s). Abort!\n",
+				i,
+				errno,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
 
-	struct ibv_qp_attr attr = {
-		.qp_state   		= IBV_QPS_INIT,
-		.pkey_index 		= 0,
-		.port_num 		= com_hndl.used_port,
-		.qp_access_flags 	= (IBV_ACCESS_REMOTE_WRITE)
-	};
-	if (ibv_modify_qp(com_hndl.qp,
-			  &attr,
-			  IBV_QP_STATE |
-			  IBV_QP_PKEY_INDEX |
-			  IBV_QP_PORT |
-			  IBV_QP_ACCESS_FLAGS) < 0) {
-		fprintf(stderr,
-			"[ERROR] Could not set QP into init state "
-			"- %d (%s). Abort!\n",
-			errno,
-			strerror(errno));
-		exit(EXIT_FAILURE);
+		struct ibv_qp_attr attr = {
+			.qp_state   		= IBV_QPS_INIT,
+			.pkey_index 		= 0,
+			.port_num 		= com_hndl.used_port,
+			.qp_access_flags 	= (IBV_ACCESS_REMOTE_WRITE)
+		};
+		if (ibv_modify_qp(com_hndl.qp[i],
+				  &attr,
+				  IBV_QP_STATE |
+				  IBV_QP_PKEY_INDEX |
+				  IBV_QP_PORT |
+				  IBV_QP_ACCESS_FLAGS) < 0) {
+			fprintf(stderr,
+				"[ERROR] Could not set QP #%d into init state "
+				"- %d (%s). Abort!\n",
+				i,
+				errno,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		/* fill in local qp_info */
+		com_hndl.loc_qp_info.qpn[i] 	= com_hndl.qp[i]->qp_num;
+		com_hndl.loc_qp_info.psn[i] 	= lrand48() & 0xffffff;
 	}
 
-	/* fill in local qp_info */
-	com_hndl.loc_qp_info.qpn 	= com_hndl.qp->qp_num;
-	com_hndl.loc_qp_info.psn 	= lrand48() & 0xffffff;
+	com_hndl.loc_qp_info.qp_cnt 	= com_hndl.qp_cnt;
 	com_hndl.loc_qp_info.addr 	= (uint64_t)com_hndl.buf;
 	com_hndl.loc_qp_info.lid 	= com_hndl.port_attr.lid;
 
@@ -376,22 +384,27 @@ init_com_hndl(mem_mappings_t mem_mappings, bool sender)
 static void
 destroy_com_hndl(void)
 {
-	if (ibv_destroy_qp(com_hndl.qp) < 0) {
-		fprintf(stderr,
-			"[ERROR] Could not destroy the queue pair "
-			"- %d (%s). Abort!\n",
-			errno,
-			strerror(errno));
-		exit(EXIT_FAILURE);
-	}
+	int i = 0;
+	for (i=0; i<com_hndl.qp_cnt; ++i) {
+		if (ibv_destroy_qp(com_hndl.qp[i]) < 0) {
+			fprintf(stderr,
+				"[ERROR] Could not destroy the queue pair #%d "
+				"- %d (%s). Abort!\n",
+				i,
+				errno,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
 
-	if (ibv_destroy_cq(com_hndl.cq) < 0) {
-		fprintf(stderr,
-			"[ERROR] Could not deallocate the protection domain "
-			"- %d (%s). Abort!\n",
-			errno,
-			strerror(errno));
-		exit(EXIT_FAILURE);
+		if (ibv_destroy_cq(com_hndl.cq[i]) < 0) {
+			fprintf(stderr,
+				"[ERROR] Could not destroy the completion queue #%d "
+				"- %d (%s). Abort!\n",
+				i,
+				errno,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	if (ibv_destroy_comp_channel(com_hndl.comp_chan) < 0) {
@@ -403,7 +416,6 @@ destroy_com_hndl(void)
 		exit(EXIT_FAILURE);
 	}
 
-	int i = 0;
 	for (i=0; i<com_hndl.mr_cnt; ++i) {
 		if (ibv_dereg_mr(com_hndl.mrs[i]) < 0) {
 			fprintf(stderr,
@@ -439,10 +451,15 @@ destroy_com_hndl(void)
 	free(com_hndl.loc_qp_info.keys);
 	free(com_hndl.rem_qp_info.keys);
 	free(com_hndl.mrs);
+	free(send_list);
+	free(send_sges);
 
 	com_hndl.loc_qp_info.keys = NULL;
 	com_hndl.rem_qp_info.keys = NULL;
 	com_hndl.mrs = NULL;
+	send_list = NULL;
+	send_sges = NULL;
+	send_list_capacity = 0;
 }
 
 /**
@@ -450,63 +467,69 @@ destroy_com_hndl(void)
  *
  * \param com_hndl the structure containing all communication relevant infos
  *
- * This function performs the actual connection setup between the two QPs.
+ * This function performs the actual connection setup between the two sides.
+ * The i-th local QP is connected to the i-th QP of the remote side.
  */
 static void
 con_com_buf(void) {
-	/* transistion to ready-to-receive state */
-	struct ibv_qp_attr qp_attr = {
-		.qp_state 		= IBV_QPS_RTR,
-		.path_mtu 		= IBV_MTU_2048,
-		.dest_qp_num 		= com_hndl.rem_qp_info.qpn,
-		.rq_psn			= com_hndl.rem_qp_info.psn,
-		.max_dest_rd_atomic	= IB_MAX_DEST_RD_ATOMIC,
-		.min_rnr_timer		= IB_MIN_RNR_TIMER,
-		.ah_attr 		= {
-			.is_global 	= 0,
-			.sl 		= 0,
-			.src_path_bits 	= 0,
-			.dlid 		= com_hndl.rem_qp_info.lid,
-			.port_num 	= com_hndl.used_port,
+	size_t i = 0;
+	for (i=0; i<com_hndl.qp_cnt; ++i) {
+		/* transistion to ready-to-receive state */
+		struct ibv_qp_attr qp_attr = {
+			.qp_state 		= IBV_QPS_RTR,
+			.path_mtu 		= IBV_MTU_2048,
+			.dest_qp_num 		= com_hndl.rem_qp_info.qpn[i],
+			.rq_psn			= com_hndl.rem_qp_info.psn[i],
+			.max_dest_rd_atomic	= IB_MAX_DEST_RD_ATOMIC,
+			.min_rnr_timer		= IB_MIN_RNR_TIMER,
+			.ah_attr 		= {
+				.is_global 	= 0,
+				.sl 		= 0,
+				.src_path_bits 	= 0,
+				.dlid 		= com_hndl.rem_qp_info.lid,
+				.port_num 	= com_hndl.used_port,
+			}
+		};
+		if (ibv_modify_qp(com_hndl.qp[i],
+				  &qp_attr,
+				  IBV_QP_STATE |
+				  IBV_QP_PATH_MTU |
+				  IBV_QP_DEST_QPN |
+				  IBV_QP_RQ_PSN |
+				  IBV_QP_MAX_DEST_RD_ATOMIC |
+				  IBV_QP_MIN_RNR_TIMER |
+				  IBV_QP_AV)) {
+			fprintf(stderr,
+				"[ERROR] Could not put QP #%zu into RTR state"
+				"- %d (%s). Abort!\n",
+				i,
+				errno,
+				strerror(errno));
+			exit(errno);
 		}
-	};
-	if (ibv_modify_qp(com_hndl.qp,
-			  &qp_attr,
-			  IBV_QP_STATE |
-			  IBV_QP_PATH_MTU |
-			  IBV_QP_DEST_QPN |
-			  IBV_QP_RQ_PSN |
-			  IBV_QP_MAX_DEST_RD_ATOMIC |
-			  IBV_QP_MIN_RNR_TIMER |
-			  IBV_QP_AV)) {
-		fprintf(stderr,
-			"[ERROR] Could not put QP into RTR state"
-			"- %d (%s). Abort!\n",
-			errno,
-			strerror(errno));
-		exit(errno);
-	}
 
-	/* transistion to ready-to-send state */
-	qp_attr.qp_state    	= IBV_QPS_RTS;
-	qp_attr.timeout	    	= 14;
-	qp_attr.retry_cnt   	= 7;
-	qp_attr.rnr_retry   	= 7; /* infinite retrys on RNR NACK */
-	qp_attr.sq_psn	    	= com_hndl.loc_qp_info.psn;
-	qp_attr.max_rd_atomic 	= 1;
-	if (ibv_modify_qp(com_hndl.qp, &qp_attr,
-			  IBV_QP_STATE              |
-			  IBV_QP_TIMEOUT            |
-			  IBV_QP_RETRY_CNT          |
-			  IBV_QP_RNR_RETRY          |
-			  IBV_QP_SQ_PSN             |
-			  IBV_QP_MAX_QP_RD_ATOMIC)) {
-		fprintf(stderr,
-			"[ERROR] Could not put QP into RTS state"
-			"- %d (%s). Abort!\n",
-			errno,
-			strerror(errno));
-		exit(errno);
+		/* transistion to ready-to-send state */
+		qp_attr.qp_state    	= IBV_QPS_RTS;
+		qp_attr.timeout	    	= 14;
+		qp_attr.retry_cnt   	= 7;
+		qp_attr.rnr_retry   	= 7; /* infinite retrys on RNR NACK */
+		qp_attr.sq_psn	    	= com_hndl.loc_qp_info.psn[i];
+		qp_attr.max_rd_atomic 	= 1;
+		if (ibv_modify_qp(com_hndl.qp[i], &qp_attr,
+				  IBV_QP_STATE              |
+				  IBV_QP_TIMEOUT            |
+				  IBV_QP_RETRY_CNT          |
+				  IBV_QP_RNR_RETRY          |
+				  IBV_QP_SQ_PSN             |
+				  IBV_QP_MAX_QP_RD_ATOMIC)) {
+			fprintf(stderr,
+				"[ERROR] Could not put QP #%zu into RTS state"
+				"- %d (%s). Abort!\n",
+				i,
+				errno,
+				strerror(errno));
+			exit(errno);
+		}
 	}
 }
 
@@ -609,22 +632,37 @@ exchange_qp_info(bool server)
 		res = recv_data(com_hndl.rem_qp_info.keys, keys_size);
 	}
 
-	fprintf(stderr, "[INFO] loc_qp_info (QPN: %lu; LID: %lu; PSN: %lu; ADDR: 0x%x ",
-			com_hndl.loc_qp_info.qpn,
+	/* both sides have to agree on the number of streams */
+	if (com_hndl.rem_qp_info.qp_cnt != com_hndl.loc_qp_info.qp_cnt) {
+		fprintf(stderr,
+			"[ERROR] The remote side uses %u instead of %u QPs. Abort!\n",
+			com_hndl.rem_qp_info.qp_cnt,
+			com_hndl.loc_qp_info.qp_cnt);
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(stderr, "[INFO] loc_qp_info (LID: %lu; ADDR: 0x%x ",
 			com_hndl.loc_qp_info.lid,
-			com_hndl.loc_qp_info.psn,
 			com_hndl.loc_qp_info.addr);
 	int i = 0;
+	for (i=0; i<com_hndl.qp_cnt; ++i) {
+		fprintf(stderr, "QPN[%d]: %lu; PSN[%d]: %lu; ",
+				i, com_hndl.loc_qp_info.qpn[i],
+				i, com_hndl.loc_qp_info.psn[i]);
+	}
 	for (i=0; i<com_hndl.mr_cnt; ++i) {
 		fprintf(stderr, "KEY[%d]: %lu; ", i, com_hndl.loc_qp_info.keys[i]);
 	}
 	printf("\b\b)\n");
 
-	fprintf(stderr, "[INFO] rem_qp_info (QPN: %lu; LID: %lu; PSN: %lu; ADDR: 0x%x ",
-			com_hndl.rem_qp_info.qpn,
+	fprintf(stderr, "[INFO] rem_qp_info (LID: %lu; ADDR: 0x%x ",
 			com_hndl.rem_qp_info.lid,
-			com_hndl.rem_qp_info.psn,
 			com_hndl.rem_qp_info.addr);
+	for (i=0; i<com_hndl.qp_cnt; ++i) {
+		fprintf(stderr, "QPN[%d]: %lu; PSN[%d]: %lu; ",
+				i, com_hndl.rem_qp_info.qpn[i],
+				i, com_hndl.rem_qp_info.psn[i]);
+	}
 	for (i=0; i<com_hndl.mr_cnt; ++i) {
 		fprintf(stderr, "KEY[%d]: %lu; ", i, com_hndl.rem_qp_info.keys[i]);
 	}
@@ -634,46 +672,45 @@ exchange_qp_info(bool server)
 /**
  * \brief Prepares the an 'ibv_send_wr'
  *
- * This function prepares an 'ibv_send_wr' structure that is prepared for the
- * transmission of a single memory page using the IBV_WR_RDMA_WRITE verb.
+ * This function takes the next 'ibv_send_wr' structure from the send list
+ * arena and prepares it for the transmission of a memory range using the
+ * IBV_WR_RDMA_WRITE verb. The arena only grows and is reused in the next
+ * rounds; the 'sg_list' and 'next' pointers are set by process_send_list()
+ * since the arena may be moved by a resize.
  */
 static inline struct ibv_send_wr *
 prepare_send_list_elem(void)
 {
-	/* create work request */
-	struct ibv_send_wr *send_wr =  (struct ibv_send_wr*)calloc(1, sizeof(struct ibv_send_wr));
-	struct ibv_sge *sge =  (struct ibv_sge*)calloc(1, sizeof(struct ibv_sge));
+	/* enlarge the arena if necessary */
+	if (send_list_length == send_list_capacity) {
+		size_t capacity = send_list_capacity ? 2*send_list_capacity : IB_MAX_SEND_WR;
+
+		send_list = (struct ibv_send_wr*)realloc(send_list, capacity*sizeof(struct ibv_send_wr));
+		send_sges = (struct ibv_sge*)realloc(send_sges, capacity*sizeof(struct ibv_sge));
+		if ((send_list == NULL) || (send_sges == NULL)) {
+			fprintf(stderr,
+				"[ERROR] Could not allocate %zu send WRs "
+				"- %d (%s). Abort!\n",
+				capacity,
+				errno,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		send_list_capacity = capacity;
+	}
+
+	struct ibv_send_wr *send_wr = &send_list[send_list_length];
+	memset(send_wr, 0, sizeof(struct ibv_send_wr));
+	memset(&send_sges[send_list_length], 0, sizeof(struct ibv_sge));
 
 	/* basic work request configuration */
-	send_wr->next  	 	= NULL;
-	send_wr->sg_list 	= sge;
 	send_wr->num_sge 	= 1;
-	send_wr->wr_id  	= ++cur_wr_id;
+	send_wr->wr_id  	= IB_WR_BASE_ID + send_list_length;
 	send_wr->opcode 	= IBV_WR_RDMA_WRITE;
 
-	return send_wr;
-
-}
+	send_list_length++;
 
-/**
- * \brief Appends an 'ibv_send_wr' to the send_list
- *
- * \param send_wr WR to be appended to the send_list
- */
-static inline void
-append_to_send_list(struct ibv_send_wr *send_wr)
-{
-	if (send_list == NULL) {
-		send_list = send_list_last = send_wr;
-	} else {
-		send_list_last->next = send_wr;
-		send_list_last = send_list_last->next;
-	}
-
-	/* we have to request a CQE if max_send_wr is reached to avoid overflows */
-	if ((++send_list_length%IB_MAX_SEND_WR) == 0) {
-		send_list_last->send_flags 	= IBV_SEND_SIGNALED;
-	}
+	return send_wr;
 }
 
 /**
@@ -684,27 +721,18 @@ append_to_send_list(struct ibv_send_wr *send_wr)
  * \param page the buffer to be send in this WR
  * \param page_size the size of the buffer
  *
- * This function creates an 'ibv_send_wr' structure and appends this to the
- * global send_list. It sets the source/destination information and sets the
- * IBV_SEND_SIGNALED flag as appropriate.
+ * This function appends the page to the global send_list. Pages that are
+ * contiguous on both sides and reside in the same MR are merged into the
+ * last WR as long as it does not exceed the maximum message size.
  */
 static void
 create_send_list_entry (void *addr, size_t addr_size, void *page, size_t page_size)
 {
-	/* create work request */
-	struct ibv_send_wr *send_wr =  prepare_send_list_elem();
-
-	/* configure source buffer */
+	/* determine source MR */
 	int i = 0;
 	for (i=0; i<com_hndl.mr_cnt; ++i) {
 		if (((uint64_t)page >= (uint64_t)com_hndl.mrs[i]->addr) &&
 		    ((uint64_t)page < ((uint64_t)com_hndl.mrs[i]->addr + (uint64_t)com_hndl.mrs[i]->length))) {
-			send_wr->sg_list->addr 		= (uintptr_t)page;
-			send_wr->sg_list->length 	= page_size;
-			send_wr->sg_list->lkey 		= com_hndl.mrs[i]->lkey;
-
-			send_wr->wr.rdma.rkey 		= com_hndl.rem_qp_info.keys[i];
-
 			/* prefetch MR */
 			if (mig_params.use_odp && mig_params.prefetch) {
 				struct ibv_exp_prefetch_attr prefetch_attr = {
@@ -735,89 +763,190 @@ create_send_list_entry (void *addr, size_t addr_size, void *page, size_t page_si
 		return;
 	}
 
-	/* configure destination buffer */
+	/* determine destination buffer */
+	uint64_t remote_addr = com_hndl.rem_qp_info.addr;
 	if (addr) {
-		send_wr->wr.rdma.remote_addr 	= com_hndl.rem_qp_info.addr + determine_dest_offset(*(size_t*)addr);
-	} else {
-		send_wr->wr.rdma.remote_addr 	= com_hndl.rem_qp_info.addr;
+		remote_addr += determine_dest_offset(*(size_t*)addr);
+	}
+
+	send_list_pages++;
+	send_list_bytes += page_size;
+
+	/* coalesce with the last WR if possible */
+	if (send_list_length > 0) {
+		struct ibv_send_wr *last_wr = &send_list[send_list_length-1];
+		struct ibv_sge *last_sge = &send_sges[send_list_length-1];
+
+		if ((last_sge->lkey == com_hndl.mrs[i]->lkey) &&
+		    (last_sge->addr + last_sge->length == (uintptr_t)page) &&
+		    (last_wr->wr.rdma.remote_addr + last_sge->length == remote_addr) &&
+		    (last_sge->length + page_size <= com_hndl.port_attr.max_msg_sz)) {
+			last_sge->length += page_size;
+			return;
+		}
 	}
 
-	/* apped work request to send list */
-	append_to_send_list(send_wr);
+	/* create work request */
+	struct ibv_send_wr *send_wr = prepare_send_list_elem();
+	struct ibv_sge *sge = &send_sges[send_list_length-1];
+
+	sge->addr 			= (uintptr_t)page;
+	sge->length 			= page_size;
+	sge->lkey 			= com_hndl.mrs[i]->lkey;
+
+	send_wr->wr.rdma.rkey 		= com_hndl.rem_qp_info.keys[i];
+	send_wr->wr.rdma.remote_addr 	= remote_addr;
 }
 
 /**
- * \brief Frees the send list
+ * \brief Resets the send list
+ *
+ * The arena is kept for the next round and freed in destroy_com_hndl().
  */
 static inline
 void cleanup_send_list(void)
 {
-	struct ibv_send_wr *cur_send_wr = send_list;
-	struct ibv_send_wr *tmp_send_wr = NULL;
-	while (cur_send_wr != NULL) {
-		free(cur_send_wr->sg_list);
-		tmp_send_wr = cur_send_wr;
-		cur_send_wr = cur_send_wr->next;
-		free(tmp_send_wr);
-	}
 	send_list_length = 0;
+	send_list_pages = 0;
+	send_list_bytes = 0;
+}
+
+/**
+ * \brief Waits for the next CQE of a QP
+ *
+ * \param qp the index of the QP
+ *
+ * Returns the ID of the completed WR. Since the WRs of a QP are processed in
+ * order, the CQE of a signaled WR implies the completion of all unsignaled
+ * WRs posted before.
+ */
+static uint64_t
+wait_for_cqe(size_t qp)
+{
+	struct ibv_wc wc;
+	int res = 0;
+	do {
+		if ((res = ibv_poll_cq(com_hndl.cq[qp], 1, &wc)) < 0) {
+			fprintf(stderr,
+				"[ERROR] Could not poll on CQ - %d (%s). Abort!\n",
+				errno,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	} while (res < 1);
+
+	if (wc.status != IBV_WC_SUCCESS) {
+		fprintf(stderr,
+		    "[ERROR] WR failed status %s (%d) for wr_id %llu\n",
+		    ibv_wc_status_str(wc.status),
+		    wc.status,
+		    wc.wr_id);
+
+		print_send_wr_info(wc.wr_id);
+	}
+	com_hndl.pending[qp]--;
+
+	return wc.wr_id;
 }
 
 /*
  * \brief Processes the send list by passing the send_wrs to the HCA
+ *
+ * The send list is posted in chunks of IB_SIGNAL_INTERVAL WRs that are
+ * distributed round-robin across the QPs. Only the last WR of a chunk
+ * requests a CQE, which limits the number of outstanding WRs per QP. The
+ * function returns after all WRs have been completed.
  */
 static inline
 void process_send_list(void)
 {
-	/* we have to call ibv_post_send() as long as 'send_list' contains elements  */
-	struct ibv_wc wc;
-	struct ibv_send_wr *remaining_send_wr = NULL;
-	do {
+	size_t cur_wr = 0, qp = 0;
+	while (cur_wr < send_list_length) {
+		size_t chunk_len = send_list_length - cur_wr;
+		if (chunk_len > IB_SIGNAL_INTERVAL)
+			chunk_len = IB_SIGNAL_INTERVAL;
+
+		/* wait for send WRs if the send queue is full */
+		while (com_hndl.pending[qp] >= IB_MAX_SIGNALED_WR) {
+			wait_for_cqe(qp);
+		}
+
+		/* link the chunk */
+		size_t i = 0;
+		for (i=cur_wr; i<cur_wr+chunk_len; ++i) {
+			send_list[i].sg_list 	= &send_sges[i];
+			send_list[i].next 	= &send_list[i+1];
+			send_list[i].send_flags = 0;
+		}
+		send_list[i-1].next 		= NULL;
+		send_list[i-1].send_flags 	= IBV_SEND_SIGNALED;
+
 		/* send data */
-		remaining_send_wr = NULL;
-		if (ibv_post_send(com_hndl.qp, send_list, &remaining_send_wr) && (errno != ENOMEM)) {
+		struct ibv_send_wr *bad_wr = NULL;
+		if (ibv_post_send(com_hndl.qp[qp], &send_list[cur_wr], &bad_wr)) {
 			fprintf(stderr,
 				"[ERROR] Could not post send - %d (%s). Abort!\n",
 				errno,
 				strerror(errno));
 			exit(EXIT_FAILURE);
 		}
+		com_hndl.pending[qp]++;
 
-		/* wait for send WRs if CQ is full */
-		int res = 0;
-		do {
-			if ((res = ibv_poll_cq(com_hndl.cq, 1, &wc)) < 0) {
-				fprintf(stderr,
-					"[ERROR] Could not poll on CQ - %d (%s). Abort!\n",
-					errno,
-					strerror(errno));
-				exit(EXIT_FAILURE);
-			}
-		} while (res < 1);
-		if (wc.status != IBV_WC_SUCCESS) {
-			fprintf(stderr,
-			    "[ERROR] WR failed status %s (%d) for wr_id %llu\n",
-			    ibv_wc_status_str(wc.status),
-			    wc.status,
-			    wc.wr_id);
+		cur_wr += chunk_len;
+		qp = (qp+1) % com_hndl.qp_cnt;
+	}
 
-			print_send_wr_info(wc.wr_id);
+	/* wait for the remaining WRs of all QPs */
+	for (qp=0; qp<com_hndl.qp_cnt; ++qp) {
+		while (com_hndl.pending[qp] > 0) {
+			wait_for_cqe(qp);
 		}
-		send_list = remaining_send_wr;
-	} while (remaining_send_wr);
+	}
 
+	/* reset send list */
+	cleanup_send_list();
+}
 
-	/* ensure that we receive the CQE for the last page */
-	if (wc.wr_id != IB_WR_WRITE_LAST_PAGE_ID) {
+/*
+ * \brief Informs the destination that all memory has been written
+ *
+ * This function has to be called after process_send_list() has returned so
+ * that the data of all QPs has been placed at the destination. The
+ * notification is a zero-byte write with immediate data on the first QP that
+ * triggers a solicited event on the remote side.
+ */
+static void
+send_last_wr(void)
+{
+	struct ibv_send_wr last_wr = {
+		.wr_id 		= IB_WR_WRITE_LAST_PAGE_ID,
+		.next 		= NULL,
+		.sg_list 	= NULL,
+		.num_sge 	= 0,
+		.opcode 	= IBV_WR_RDMA_WRITE_WITH_IMM,
+		.send_flags 	= IBV_SEND_SIGNALED | IBV_SEND_SOLICITED,
+		.imm_data 	= htonl(0x1),
+	};
+	last_wr.wr.rdma.remote_addr 	= com_hndl.rem_qp_info.addr;
+	last_wr.wr.rdma.rkey 		= com_hndl.rem_qp_info.keys[0];
+
+	struct ibv_send_wr *bad_wr = NULL;
+	if (ibv_post_send(com_hndl.qp[0], &last_wr, &bad_wr)) {
 		fprintf(stderr,
-		    "[ERROR] WR failed status %s (%d) for wr_id %d\n",
-		    ibv_wc_status_str(wc.status),
-		    wc.status,
-		    (int)wc.wr_id);
+			"[ERROR] Could not post send - %d (%s). Abort!\n",
+			errno,
+			strerror(errno));
+		exit(EXIT_FAILURE);
 	}
+	com_hndl.pending[0]++;
 
-	/* free send list */
-	cleanup_send_list();
+	/* ensure that we receive the CQE for the last page */
+	uint64_t wr_id = wait_for_cqe(0);
+	if (wr_id != IB_WR_WRITE_LAST_PAGE_ID) {
+		fprintf(stderr,
+		    "[ERROR] Unexpected CQE for wr_id %d\n",
+		    (int)wr_id);
+	}
 }
 
 /**
@@ -855,19 +984,6 @@ void enqueue_all_mrs(void)
 	}
 }
 
-/**
- * \brief A simple termination criterion for the live-migration
- */
-static inline
-bool termination_criterion(void)
-{
-	/* use a simple counter */
-	static uint32_t mig_round = 0;
-
-	return (mig_round++ == MIG_ITERS)? true : false;
-}
-
-
 /**
  * \brief The pre-copy phase of the live-migration
  *
@@ -902,7 +1018,11 @@ void precopy_phase(mem_mappings_t guest_mem, mem_mappings_t mem_mappings)
 	con_com_buf();
 
 	/* perform pre-copy iterations */
-	while (!(mig_params.type == MIG_TYPE_COLD) && !termination_criterion()) {
+	uint32_t mig_round = 0;
+	while (!(mig_params.type == MIG_TYPE_COLD)) {
+		struct timeval begin;
+		gettimeofday(&begin, NULL);
+
 		/* iterate guest page tables
 		 * -> ignore migration mode
 		 * -> enforce INCREMENTAL dumps
@@ -911,12 +1031,16 @@ void precopy_phase(mem_mappings_t guest_mem, mem_mappings_t mem_mappings)
 
 		/* is there anything to send? */
 		if (send_list_length != 0) {
-			/* we want a CQE for the last WR */
-			send_list_last->wr_id 		= IB_WR_WRITE_LAST_PAGE_ID;
-			send_list_last->send_flags 	= IBV_SEND_SIGNALED;
+			size_t pages = send_list_pages;
+			size_t bytes = send_list_bytes;
 
 			process_send_list();
+
+			/* measure bandwidth and dirty rate of this round */
+			if (precopy_round_done(mig_round++, pages, bytes, &begin))
+				break;
 		} else {
+			vcpu_throttle(0);
 			break;
 		}
 
@@ -960,19 +1084,9 @@ void stop_and_copy_phase(void)
 		exit(EXIT_FAILURE);
 	}
 
-	/* create a dumy WR request if there is nothing to be sent */
-	if (send_list_length == 0) {
-		struct ibv_send_wr *send_wr =  prepare_send_list_elem();
-		append_to_send_list(send_wr);
-	}
-
-	/* we have to wait for the last WR before informing dest */
-	send_list_last->wr_id 		= IB_WR_WRITE_LAST_PAGE_ID;
-	send_list_last->opcode 		= IBV_WR_RDMA_WRITE_WITH_IMM;
-	send_list_last->send_flags 	= IBV_SEND_SIGNALED | IBV_SEND_SOLICITED;
-	send_list_last->imm_data 	= htonl(0x1);
-
+	/* we have to wait for all WRs before informing dest */
 	process_send_list();
+	send_last_wr();
 
 	/* free IB-related resources */
 	destroy_com_hndl();
@@ -1001,7 +1115,7 @@ void recv_guest_mem(mem_mappings_t mem_mappings)
 	con_com_buf();
 
 	/* request notification on the event channel */
-	if (ibv_req_notify_cq(com_hndl.cq, 1) < 0) {
+	if (ibv_req_notify_cq(com_hndl.cq[0], 1) < 0) {
 		fprintf(stderr,
 			"[ERROR] Could request notify for completion queue "
 			"- %d (%s). Abort!\n",
@@ -1028,7 +1142,7 @@ void recv_guest_mem(mem_mappings_t mem_mappings)
 	recv_wr.sg_list    = &sg;
 	recv_wr.num_sge    = 1;
 
-	if (ibv_post_recv(com_hndl.qp, &recv_wr, &bad_wr) < 0) {
+	if (ibv_post_recv(com_hndl.qp[0], &recv_wr, &bad_wr) < 0) {
 	    	fprintf(stderr,
 			"[ERROR] Could post recv - %d (%s). Abort!\n",
 			errno,
@@ -1047,11 +1161,25 @@ void recv_guest_mem(mem_mappings_t mem_mappings)
 	}
 
 	/* acknowledge the event */
-	ibv_ack_cq_events(com_hndl.cq, 1);
+	ibv_ack_cq_events(com_hndl.cq[0], 1);
 
 	/* free IB-related resources */
 	destroy_com_hndl();
 
 	fprintf(stderr, "Guest memory received!\n");
 }
+
+/**
+ * \brief Post-copy is not supported via RDMA
+ *
+ * Both ends reject post-copy migrations, when the parameters are set.
+ */
+void postcopy_phase(void)
+{
+}
+
+void start_postcopy(void)
+{
+	close_migration_channel();
+}
 #endif /* __RDMA_MIGRATION__ */
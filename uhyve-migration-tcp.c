@@ -31,67 +31,1115 @@
 #include <stdlib.h>
 #include <arpa/inet.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/errqueue.h>
+#include <linux/userfaultfd.h>
 
+#ifdef HAVE_LZ4_H
+#include <lz4.h>
+#endif
 
+
+#include "uhyve-common.h"
 #include "uhyve-migration.h"
 #include "uhyve.h"
 
 
 #ifndef __RDMA_MIGRATION__
 
+/* frames, which are sent at once */
+#define MIG_BATCH_SIZE 		(64)
+/* pending frames per stream */
+#define MIG_QUEUE_SIZE 		(4096)
+/* memory is distributed in units of 2 MiB across the streams */
+#define MIG_STRIPE_SIZE 	(2UL << 20)
+/* smaller frames are copied, zero-copy does not pay off */
+#define MIG_ZEROCOPY_MIN 	(16UL << 10)
+/* buffer for compressed frames of a batch */
+#define MIG_COMPRESS_BUF_SIZE 	(4UL << 20)
+
 extern mem_mappings_t mem_mappings;
 
 static mem_mappings_t mappings_to_be_transferred = {NULL, 0};
 
+/*
+ * The guest memory is sent as a stream of frames on each connection.
+ * Each frame consists of a mig_frame_t and the memory at the
+ * guest-physical address, which is LZ4 compressed if len < size. A frame
+ * with size 0 terminates the stream.
+ *
+ * A stripe of MIG_STRIPE_SIZE bytes is always sent on the same
+ * connection. Hence, the frames of a page arrive in order, and the
+ * receiver may apply the connections independently.
+ */
+typedef struct _mig_frame {
+	uint64_t gpa;
+	uint32_t size;
+	uint32_t len;
+} mig_frame_t;
+
+typedef struct _mig_item {
+	uint64_t gpa;
+	uint8_t *ptr;
+	size_t size;
+} mig_item_t;
+
+typedef struct _mig_stream {
+	int sock;
+	pthread_t thread;
+
+	/* frames enqueued by the migration thread */
+	mig_item_t *items;
+	size_t head, tail;
+	bool done;
+	bool sending;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+
+	/* state of the sender */
+	bool zerocopy;
+	uint64_t zc_sent;
+	uint64_t zc_done;
+	uint8_t *compress_buf;
+	size_t bytes;
+} mig_stream_t;
+
+static mig_stream_t streams[MIG_MAX_STREAMS];
+static uint32_t stream_count = 0;
+
+static size_t round_pages = 0;
+static size_t round_bytes = 0;
+
+/*
+ * Post-copy: the source announces the ranges, which the destination does
+ * not have yet, and stops its VCPUs. The destination starts immediately,
+ * userfaultfd reports accesses to missing pages, which are requested on
+ * the migration channel. In parallel, the source pushes all ranges on
+ * new streams.
+ */
+#define MIG_POST_PAGE_SIZE 	(4096UL)
+#define MIG_POST_DONE 		(UINT64_MAX)
+
+typedef struct _mig_range {
+	uint64_t gpa;
+	uint64_t size;
+} mig_range_t;
+
+/* ranges, which are sent after the stop */
+static mig_range_t *post_ranges = NULL;
+static size_t post_range_count = 0;
+static size_t post_range_max = 0;
+
+/* state of the destination */
+static int post_uffd = -1;
+static uint64_t *post_pending = NULL;		// bitmap of missing 4 KiB pages
+static uint64_t *post_migrated = NULL;		// pages, which are sent after the start
+static uint64_t *post_requested = NULL;
+static volatile size_t post_pending_count = 0;
+static volatile bool post_done = false;
+static pthread_mutex_t post_sock_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * \brief Receives exactly length bytes from a socket
+ */
+static void recv_stream(int sock, void *buffer, size_t length)
+{
+	size_t bytes_received = 0;
+	while (bytes_received < length) {
+		ssize_t res = recv(sock,
+				   (uint8_t*)buffer+bytes_received,
+				   length-bytes_received,
+				   MSG_WAITALL);
+
+		if ((res < 0) && (errno == EINTR))
+			continue;
+		if (res <= 0) {
+			fprintf(stderr, "[ERROR] Could not receive guest memory "
+					"- %d (%s). Abort!\n",
+					errno, res ? strerror(errno) : "connection closed");
+			exit(EXIT_FAILURE);
+		}
+		bytes_received += res;
+	}
+}
+
+/**
+ * \brief Collects the completions of zero-copy transmissions
+ *
+ * \param wait block until all transmissions are completed
+ */
+static void reap_zerocopy(mig_stream_t *stream, bool wait)
+{
+	while (stream->zc_done < stream->zc_sent) {
+		char control[128];
+		struct msghdr msg = { .msg_control = control, .msg_controllen = sizeof(control) };
+
+		if (recvmsg(stream->sock, &msg, MSG_ERRQUEUE | (wait ? 0 : MSG_DONTWAIT)) < 0) {
+			if ((errno == EAGAIN) && wait) {
+				struct pollfd pfd = { .fd = stream->sock, .events = 0 };
+				poll(&pfd, 1, 100);
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		struct cmsghdr *cm;
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+			struct sock_extended_err *serr = (struct sock_extended_err*) CMSG_DATA(cm);
+
+			if ((serr->ee_errno == 0) && (serr->ee_origin == SO_EE_ORIGIN_ZEROCOPY))
+				stream->zc_done += serr->ee_data - serr->ee_info + 1;
+		}
+	}
+}
+
+/**
+ * \brief Sends a message completely
+ */
+static void send_msg(mig_stream_t *stream, struct msghdr *msg, int flags)
+{
+	while (msg->msg_iovlen) {
+		ssize_t res = sendmsg(stream->sock, msg, flags);
+
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == ENOBUFS) && (flags & MSG_ZEROCOPY)) {
+				/* too many pending transmissions */
+				reap_zerocopy(stream, true);
+				continue;
+			}
+			fprintf(stderr, "[ERROR] Could not send guest memory "
+					"- %d (%s). Abort!\n", errno, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+
+		if (flags & MSG_ZEROCOPY)
+			stream->zc_sent++;
+		stream->bytes += res;
+
+		/* skip the sent parts */
+		while (msg->msg_iovlen && ((size_t) res >= msg->msg_iov->iov_len)) {
+			res -= msg->msg_iov->iov_len;
+			msg->msg_iov++;
+			msg->msg_iovlen--;
+		}
+		if (msg->msg_iovlen) {
+			msg->msg_iov->iov_base = (uint8_t*) msg->msg_iov->iov_base + res;
+			msg->msg_iov->iov_len -= res;
+		}
+	}
+}
+
+/**
+ * \brief Sends a batch of frames
+ *
+ * Small and compressed frames are copied by a single system call, large
+ * frames are sent by MSG_ZEROCOPY if supported.
+ */
+static void send_batch(mig_stream_t *stream, mig_item_t *items, size_t count)
+{
+	mig_frame_t frames[MIG_BATCH_SIZE];
+	struct iovec iov[2*MIG_BATCH_SIZE];
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 0 };
+#ifdef HAVE_LZ4_H
+	size_t compressed = 0;
+#endif
+	size_t i;
+
+	for (i=0; i<count; ++i) {
+		mig_item_t *item = items + i;
+
+		frames[i].gpa = item->gpa;
+		frames[i].size = item->size;
+		frames[i].len = item->size;
+		iov[msg.msg_iovlen].iov_base = &frames[i];
+		iov[msg.msg_iovlen].iov_len = sizeof(mig_frame_t);
+		msg.msg_iovlen++;
+
+#ifdef HAVE_LZ4_H
+		if (stream->compress_buf) {
+			int len = LZ4_compress_default((const char*) item->ptr,
+					(char*) stream->compress_buf + compressed,
+					item->size, MIG_COMPRESS_BUF_SIZE - compressed);
+
+			/* keep only worthwhile results */
+			if ((len > 0) && ((size_t) len < item->size - item->size / 8)) {
+				frames[i].len = len;
+				iov[msg.msg_iovlen].iov_base = stream->compress_buf + compressed;
+				iov[msg.msg_iovlen].iov_len = len;
+				msg.msg_iovlen++;
+				compressed += len;
+
+				if (compressed + LZ4_compressBound(MIG_STRIPE_SIZE) > MIG_COMPRESS_BUF_SIZE) {
+					send_msg(stream, &msg, 0);
+					msg.msg_iov = iov;
+					msg.msg_iovlen = 0;
+					compressed = 0;
+				}
+				continue;
+			}
+		}
+#endif
+
+		if (stream->zerocopy && (item->size >= MIG_ZEROCOPY_MIN)) {
+			/* the header is copied, the memory is sent from the guest */
+			send_msg(stream, &msg, MSG_MORE);
+
+			struct iovec zc_iov = { .iov_base = item->ptr, .iov_len = item->size };
+			struct msghdr zc_msg = { .msg_iov = &zc_iov, .msg_iovlen = 1 };
+			send_msg(stream, &zc_msg, MSG_ZEROCOPY);
+			reap_zerocopy(stream, false);
+
+			msg.msg_iov = iov;
+			msg.msg_iovlen = 0;
+#ifdef HAVE_LZ4_H
+			compressed = 0;
+#endif
+			continue;
+		}
+
+		iov[msg.msg_iovlen].iov_base = item->ptr;
+		iov[msg.msg_iovlen].iov_len = item->size;
+		msg.msg_iovlen++;
+	}
+
+	send_msg(stream, &msg, 0);
+}
+
+/**
+ * \brief Sender thread of a stream
+ */
+static void *stream_sender(void *arg)
+{
+	mig_stream_t *stream = (mig_stream_t*) arg;
+	mig_item_t batch[MIG_BATCH_SIZE];
+
+	pthread_mutex_lock(&stream->lock);
+	while (1) {
+		size_t count = 0;
+
+		stream->sending = false;
+		pthread_cond_broadcast(&stream->not_full);
+		while ((stream->head == stream->tail) && !stream->done)
+			pthread_cond_wait(&stream->not_empty, &stream->lock);
+		while ((stream->tail != stream->head) && (count < MIG_BATCH_SIZE)) {
+			batch[count++] = stream->items[stream->tail % MIG_QUEUE_SIZE];
+			stream->tail++;
+		}
+
+		if (count == 0)
+			break;
+
+		stream->sending = true;
+		pthread_mutex_unlock(&stream->lock);
+
+		send_batch(stream, batch, count);
+
+		pthread_mutex_lock(&stream->lock);
+	}
+	pthread_mutex_unlock(&stream->lock);
+
+	/* terminate the stream */
+	mig_frame_t end_frame = {0, 0, 0};
+	struct iovec iov = { .iov_base = &end_frame, .iov_len = sizeof(end_frame) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	send_msg(stream, &msg, 0);
+
+	reap_zerocopy(stream, true);
+
+	return NULL;
+}
+
+/**
+ * \brief Opens the connections and starts their sender threads
+ *
+ * The first stream uses the migration channel.
+ */
+static void open_streams(void)
+{
+	uint32_t i;
+
+	if (stream_count)
+		return;
+
+#ifndef HAVE_LZ4_H
+	if (mig_params.compress)
+		fprintf(stderr, "[WARNING] LZ4 is not available. The guest "
+				"memory is sent uncompressed!\n");
+#endif
+
+	for (i=0; i<mig_params.streams; ++i) {
+		mig_stream_t *stream = streams + i;
+
+		memset(stream, 0, sizeof(*stream));
+		/* with post-copy, the migration channel serves page requests */
+		stream->sock = (i || is_postcopy()) ? connect_migration_stream() : get_migration_socket();
+		if (stream->sock < 0) {
+			fprintf(stderr, "[ERROR] Could not open migration stream %u. Abort!\n", i);
+			exit(EXIT_FAILURE);
+		}
+
+		stream->items = (mig_item_t*) malloc(MIG_QUEUE_SIZE*sizeof(mig_item_t));
+		if (stream->items == NULL) {
+			fprintf(stderr, "[ERROR] Could not allocate migration queue. Abort!\n");
+			exit(EXIT_FAILURE);
+		}
+		pthread_mutex_init(&stream->lock, NULL);
+		pthread_cond_init(&stream->not_empty, NULL);
+		pthread_cond_init(&stream->not_full, NULL);
+
+		if (mig_params.zerocopy) {
+			int one = 1;
+			if (setsockopt(stream->sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) {
+				stream->zerocopy = true;
+			} else {
+				fprintf(stderr, "[WARNING] MSG_ZEROCOPY not supported "
+						"- %d (%s). Fallback to copying!\n",
+						errno, strerror(errno));
+			}
+		}
+
+#ifdef HAVE_LZ4_H
+		if (mig_params.compress) {
+			stream->compress_buf = (uint8_t*) malloc(MIG_COMPRESS_BUF_SIZE);
+			if (stream->compress_buf == NULL) {
+				fprintf(stderr, "[ERROR] Could not allocate compression buffer. Abort!\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+#endif
+
+		if (create_helper_thread(&stream->thread, stream_sender, stream)) {
+			fprintf(stderr, "[ERROR] Could not create migration thread. Abort!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	stream_count = mig_params.streams;
+}
+
+/**
+ * \brief Waits until the streams have sent all pending frames
+ *
+ * Returns the number of bytes sent on all streams so far.
+ */
+static size_t drain_streams(void)
+{
+	size_t bytes = 0;
+	uint32_t i;
+
+	for (i=0; i<stream_count; ++i) {
+		mig_stream_t *stream = streams + i;
+
+		pthread_mutex_lock(&stream->lock);
+		while ((stream->head != stream->tail) || stream->sending)
+			pthread_cond_wait(&stream->not_full, &stream->lock);
+		bytes += stream->bytes;
+		pthread_mutex_unlock(&stream->lock);
+	}
+
+	return bytes;
+}
+
+/**
+ * \brief Terminates the streams and waits until all frames are sent
+ */
+static void close_streams(void)
+{
+	size_t bytes = 0;
+	uint32_t i;
+
+	for (i=0; i<stream_count; ++i) {
+		mig_stream_t *stream = streams + i;
+
+		pthread_mutex_lock(&stream->lock);
+		stream->done = true;
+		pthread_cond_signal(&stream->not_empty);
+		pthread_mutex_unlock(&stream->lock);
+	}
+
+	for (i=0; i<stream_count; ++i) {
+		mig_stream_t *stream = streams + i;
+
+		pthread_join(stream->thread, NULL);
+		bytes += stream->bytes;
+
+		if (i)
+			close(stream->sock);
+		free(stream->items);
+		free(stream->compress_buf);
+	}
+
+	fprintf(stderr, "[INFO] %zu bytes sent on %u stream(s)\n", bytes, stream_count);
+	stream_count = 0;
+}
+
+/**
+ * \brief Appends memory to the streams
+ *
+ * \param gpa guest-physical address of the memory
+ * \param ptr host-virtual address of the memory
+ * \param size the size of the memory region
+ */
+static void send_frame(uint64_t gpa, uint8_t *ptr, size_t size)
+{
+	while (size) {
+		size_t len = MIG_STRIPE_SIZE - (gpa % MIG_STRIPE_SIZE);
+		if (len > size)
+			len = size;
+
+		mig_stream_t *stream = streams + ((gpa / MIG_STRIPE_SIZE) % stream_count);
+
+		pthread_mutex_lock(&stream->lock);
+		while (stream->head - stream->tail >= MIG_QUEUE_SIZE)
+			pthread_cond_wait(&stream->not_full, &stream->lock);
+		stream->items[stream->head % MIG_QUEUE_SIZE] = (mig_item_t) { gpa, ptr, len };
+		if (stream->head++ == stream->tail)
+			pthread_cond_signal(&stream->not_empty);
+		pthread_mutex_unlock(&stream->lock);
+
+		gpa += len;
+		ptr += len;
+		size -= len;
+	}
+}
+
+/**
+ * \brief Sends a dirty page, see determine_dirty_pages()
+ */
+static void send_page(void *entry, size_t entry_size, void *page, size_t page_size)
+{
+	send_frame((uint64_t)page - (uint64_t)guest_mem, page, page_size);
+
+	round_pages++;
+	round_bytes += page_size;
+}
+
+/**
+ * \brief Ignores a dirty page, used to reset the dirty state
+ */
+static void skip_page(void *entry, size_t entry_size, void *page, size_t page_size)
+{
+}
+
+/**
+ * \brief Adds a range to the post-copy ranges
+ */
+static void add_post_range(uint64_t gpa, uint64_t size)
+{
+	/* merge with the previous range */
+	if (post_range_count && (post_ranges[post_range_count-1].gpa
+	    + post_ranges[post_range_count-1].size == gpa)) {
+		post_ranges[post_range_count-1].size += size;
+		return;
+	}
+
+	if (post_range_count == post_range_max) {
+		post_range_max = post_range_max ? 2*post_range_max : 4096;
+		post_ranges = (mig_range_t*) realloc(post_ranges, post_range_max*sizeof(mig_range_t));
+		if (post_ranges == NULL) {
+			fprintf(stderr, "[ERROR] Could not allocate post-copy ranges. Abort!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	post_ranges[post_range_count].gpa = gpa;
+	post_ranges[post_range_count].size = size;
+	post_range_count++;
+}
+
+/**
+ * \brief Remembers a dirty page for the post-copy phase
+ */
+static void defer_page(void *entry, size_t entry_size, void *page, size_t page_size)
+{
+	add_post_range((uint64_t)page - (uint64_t)guest_mem, page_size);
+
+	round_pages++;
+	round_bytes += page_size;
+}
+
+/**
+ * \brief Sends the given memory regions completely
+ */
+static void send_mappings(mem_mappings_t mappings)
+{
+	size_t i = 0;
+	for (i=0; i<mappings.count; ++i) {
+		send_frame((uint64_t)mappings.mem_chunks[i].ptr - (uint64_t)guest_mem,
+			   mappings.mem_chunks[i].ptr,
+			   mappings.mem_chunks[i].size);
+	}
+}
+
+/**
+ * \brief The pre-copy phase of the live-migration
+ *
+ * \param guest_mem the guest physical memory
+ * \param mem_mappings the mapped memory regions
+ *
+ * The first round transfers the guest memory completely while the guest
+ * is running. Each further round transfers the pages, which have been
+ * modified in the meantime, until precopy_round_done() predicts a short
+ * enough downtime. A pure post-copy migration skips this phase.
+ */
 void precopy_phase(mem_mappings_t guest_mem, mem_mappings_t mem_mappings)
 {
-	/* TODO: implement live-migration */
-	if (mig_params.type == MIG_TYPE_LIVE) {
-		fprintf(stderr, "[WARNING] Live-migration currently not "
-				"supported via TCP/IP. Fallback to "
-				"cold-migration!\n");
-		mappings_to_be_transferred = guest_mem;
-	} else {
-		mappings_to_be_transferred = mem_mappings;
+	uint32_t mig_round = 0;
+	struct timeval begin;
+	size_t i;
+
+	open_streams();
+
+	if ((mig_params.type == MIG_TYPE_COLD) || (mig_params.type == MIG_TYPE_POSTCOPY)) {
+		mappings_to_be_transferred = mem_mappings.count ? mem_mappings : guest_mem;
+		return;
+	}
+
+	/* the following rounds send the pages modified from now on */
+	gettimeofday(&begin, NULL);
+	determine_dirty_pages(skip_page);
+	send_mappings(guest_mem);
+	drain_streams();
+
+	round_pages = round_bytes = 0;
+	for (i=0; i<guest_mem.count; ++i)
+		round_bytes += guest_mem.mem_chunks[i].size;
+	round_pages = round_bytes / MIG_POST_PAGE_SIZE;
+
+	while (!precopy_round_done(mig_round++, round_pages, round_bytes, &begin)) {
+		gettimeofday(&begin, NULL);
+		round_pages = round_bytes = 0;
+		determine_dirty_pages(send_page);
+		drain_streams();
 	}
 
 	return;
 }
 
+/**
+ * \brief The stop-and-copy phase of the migration
+ *
+ * The VCPUs are stopped. A live-migration and an incremental dump send the
+ * dirty pages, a complete dump sends all allocated memory regions.
+ * Post-copy only announces the pages, which postcopy_phase() sends later.
+ */
 void stop_and_copy_phase(void)
 {
-	/* determine migration mode */
-	switch (mig_params.mode) {
-	case MIG_MODE_INCREMENTAL_DUMP:
-		fprintf(stderr, "[WARNING] Incremental dumps currently not "
-				"supported via TCP/IP. Fallback to complete "
-				"dump!\n");
-	case MIG_MODE_COMPLETE_DUMP: {
-		size_t i = 0;
-		for (i=0; i<mappings_to_be_transferred.count; ++i) {
-			send_data(mappings_to_be_transferred.mem_chunks[i].ptr,
-				  mappings_to_be_transferred.mem_chunks[i].size);
-		}
+	size_t i;
+
+	round_pages = round_bytes = 0;
+
+	switch (mig_params.type) {
+	case MIG_TYPE_LIVE:
+		determine_dirty_pages(send_page);
+		break;
+	case MIG_TYPE_HYBRID:
+		determine_dirty_pages(defer_page);
+		break;
+	case MIG_TYPE_POSTCOPY:
+		for (i=0; i<mappings_to_be_transferred.count; ++i)
+			add_post_range((uint64_t)mappings_to_be_transferred.mem_chunks[i].ptr - (uint64_t)guest_mem,
+				       mappings_to_be_transferred.mem_chunks[i].size);
 		break;
-	}
 	default:
-		fprintf(stderr, "ERROR: Unknown migration mode. Abort!\n");
+		/* determine migration mode */
+		switch (mig_params.mode) {
+		case MIG_MODE_INCREMENTAL_DUMP:
+			determine_dirty_pages(send_page);
+			break;
+		case MIG_MODE_COMPLETE_DUMP:
+			send_mappings(mappings_to_be_transferred);
+			break;
+		default:
+			fprintf(stderr, "ERROR: Unknown migration mode. Abort!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* the VCPU states follow on the migration channel */
+	close_streams();
+
+	if (is_postcopy()) {
+		uint64_t count = post_range_count;
+		send_data(&count, sizeof(count));
+		send_data(post_ranges, post_range_count*sizeof(mig_range_t));
+		fprintf(stderr, "[INFO] %zu ranges are sent after the stop\n", post_range_count);
+	}
+
+	fprintf(stderr, "Guest memory sent! (%zu dirty pages in the last round)\n", round_pages);
+}
+
+/**
+ * \brief Answers the page requests of the destination
+ */
+static void *post_request_handler(void *arg)
+{
+	uint64_t gpa;
+
+	while (1) {
+		recv_data(&gpa, sizeof(gpa));
+		if (gpa == MIG_POST_DONE)
+			break;
+
+		gpa &= ~(MIG_POST_PAGE_SIZE-1);
+		if (gpa >= guest_size)
+			continue;
+
+		mig_frame_t frame = { gpa, MIG_POST_PAGE_SIZE, MIG_POST_PAGE_SIZE };
+		send_data(&frame, sizeof(frame));
+		send_data(guest_mem + gpa, MIG_POST_PAGE_SIZE);
+	}
+
+	/* the destination has all pages */
+	mig_frame_t end_frame = {0, 0, 0};
+	send_data(&end_frame, sizeof(end_frame));
+
+	return NULL;
+}
+
+/**
+ * \brief The post-copy phase at the source
+ *
+ * The destination is running already. Its page requests are answered on
+ * the migration channel, while all announced ranges are pushed on the
+ * streams. Returns, after the destination has received all pages.
+ */
+void postcopy_phase(void)
+{
+	pthread_t request_thread;
+	size_t i;
+
+	if (create_helper_thread(&request_thread, post_request_handler, NULL)) {
+		fprintf(stderr, "[ERROR] Could not create migration thread. Abort!\n");
 		exit(EXIT_FAILURE);
 	}
 
-	fprintf(stderr, "Guest memory sent!\n");
+	open_streams();
+	for (i=0; i<post_range_count; ++i)
+		send_frame(post_ranges[i].gpa, guest_mem + post_ranges[i].gpa, post_ranges[i].size);
+	close_streams();
+
+	pthread_join(request_thread, NULL);
+
+	free(post_ranges);
+	post_ranges = NULL;
+	post_range_count = post_range_max = 0;
+
+	fprintf(stderr, "Post-copy done!\n");
+}
+
+/**
+ * \brief Sends a message on the migration channel of the destination
+ */
+static void post_send(uint64_t msg)
+{
+	pthread_mutex_lock(&post_sock_lock);
+	send_data(&msg, sizeof(msg));
+	pthread_mutex_unlock(&post_sock_lock);
+}
+
+static inline bool post_test_bit(uint64_t *bitmap, size_t pfn)
+{
+	return (bitmap[pfn / 64] >> (pfn % 64)) & 1;
 }
 
+static inline bool post_test_and_set_bit(uint64_t *bitmap, size_t pfn)
+{
+	return (__sync_fetch_and_or(&bitmap[pfn / 64], 1ULL << (pfn % 64)) >> (pfn % 64)) & 1;
+}
+
+static inline bool post_test_and_clear_bit(uint64_t *bitmap, size_t pfn)
+{
+	return (__sync_fetch_and_and(&bitmap[pfn / 64], ~(1ULL << (pfn % 64))) >> (pfn % 64)) & 1;
+}
+
+/**
+ * \brief Stops the post-copy, after all pages are received
+ */
+static void post_finish(void)
+{
+	struct uffdio_range range = { .start = (uint64_t) guest_mem, .len = guest_size };
+
+	if (ioctl(post_uffd, UFFDIO_UNREGISTER, &range) < 0)
+		fprintf(stderr, "[WARNING] Could not unregister userfaultfd "
+				"- %d (%s)\n", errno, strerror(errno));
+
+	post_done = true;
+	post_send(MIG_POST_DONE);
+	fprintf(stderr, "[INFO] All pages received!\n");
+}
+
+/**
+ * \brief Marks count pages, which are present now, as received
+ */
+static void post_received(size_t pfn, size_t count)
+{
+	for (size_t i=pfn; i<pfn+count; ++i) {
+		if (post_test_and_clear_bit(post_pending, i)
+		    && (__sync_sub_and_fetch(&post_pending_count, 1) == 0))
+			post_finish();
+	}
+}
+
+/**
+ * \brief Installs the missing pages of a received frame
+ *
+ * The pages are copied atomically by userfaultfd, which wakes up the
+ * faulting threads. Pages, which are already present, are skipped.
+ */
+static void post_install(uint64_t gpa, uint8_t *buf, size_t size)
+{
+	size_t first = gpa / MIG_POST_PAGE_SIZE;
+	size_t last = (gpa + size) / MIG_POST_PAGE_SIZE;
+	size_t pfn = first;
+
+	while (pfn < last) {
+		size_t run = pfn;
+
+		while ((run < last) && post_test_bit(post_pending, run))
+			run++;
+
+		while (pfn < run) {
+			struct uffdio_copy copy = {
+				.dst = (uint64_t) guest_mem + pfn * MIG_POST_PAGE_SIZE,
+				.src = (uint64_t) buf + (pfn - first) * MIG_POST_PAGE_SIZE,
+				.len = (run - pfn) * MIG_POST_PAGE_SIZE,
+				.mode = 0,
+			};
+
+			if (ioctl(post_uffd, UFFDIO_COPY, &copy) == 0) {
+				post_received(pfn, run - pfn);
+				pfn = run;
+			} else if (copy.copy > 0) {
+				/* only the first copy.copy bytes are installed */
+				size_t copied = copy.copy / MIG_POST_PAGE_SIZE;
+
+				post_received(pfn, copied);
+				pfn += copied;
+			} else if (errno == EEXIST) {
+				/* a faulting thread has received the page in the meantime */
+				post_received(pfn, 1);
+				pfn++;
+			} else if (errno != EAGAIN) {
+				fprintf(stderr, "[ERROR] Could not install page (gpa 0x%zx) "
+						"- %d (%s). Abort!\n", pfn * MIG_POST_PAGE_SIZE,
+						errno, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		/* skip the pages, which are not missing */
+		while ((pfn < last) && !post_test_bit(post_pending, pfn))
+			pfn++;
+	}
+}
+
+/**
+ * \brief Handles the accesses to missing pages at the destination
+ */
+static void *post_fault_handler(void *arg)
+{
+	struct pollfd pfd = { .fd = post_uffd, .events = POLLIN };
+
+	while (!post_done) {
+		struct uffd_msg msg;
+
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+		if (read(post_uffd, &msg, sizeof(msg)) != sizeof(msg))
+			continue;
+		if (msg.event != UFFD_EVENT_PAGEFAULT)
+			continue;
+
+		uint64_t gpa = (msg.arg.pagefault.address - (uint64_t) guest_mem) & ~(MIG_POST_PAGE_SIZE-1);
+		size_t pfn = gpa / MIG_POST_PAGE_SIZE;
+
+		if (post_test_bit(post_pending, pfn)) {
+			/* the reply or the push wakes up the thread */
+			if (!post_test_and_set_bit(post_requested, pfn))
+				post_send(gpa);
+		} else if (post_test_bit(post_migrated, pfn)) {
+			/* the page has been installed after the fault */
+			struct uffdio_range range = { .start = (uint64_t) guest_mem + gpa, .len = MIG_POST_PAGE_SIZE };
+
+			ioctl(post_uffd, UFFDIO_WAKE, &range);
+		} else {
+			/* the page is not part of the migration */
+			struct uffdio_zeropage zero = {
+				.range = { .start = (uint64_t) guest_mem + gpa, .len = MIG_POST_PAGE_SIZE },
+				.mode = 0,
+			};
+
+			ioctl(post_uffd, UFFDIO_ZEROPAGE, &zero);
+		}
+	}
+
+	close(post_uffd);
+	post_uffd = -1;
+
+	return NULL;
+}
+
+/**
+ * \brief Receives the replies to page requests on the migration channel
+ */
+static void *post_reply_receiver(void *arg)
+{
+	uint8_t *buf = (uint8_t*) malloc(MIG_POST_PAGE_SIZE);
+	int sock = get_migration_socket();
+	mig_frame_t frame;
+
+	if (buf == NULL) {
+		fprintf(stderr, "[ERROR] Could not allocate receive buffer. Abort!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (1) {
+		recv_stream(sock, &frame, sizeof(frame));
+		if (frame.size == 0)
+			break;
+
+		if ((frame.size != MIG_POST_PAGE_SIZE) || (frame.len != frame.size) || (frame.gpa >= guest_size)) {
+			fprintf(stderr, "[ERROR] Invalid page reply (gpa 0x%zx). Abort!\n", (size_t)frame.gpa);
+			exit(EXIT_FAILURE);
+		}
+
+		recv_stream(sock, buf, MIG_POST_PAGE_SIZE);
+		post_install(frame.gpa, buf, MIG_POST_PAGE_SIZE);
+	}
+
+	free(buf);
+	close_migration_channel();
+
+	return NULL;
+}
+
+/**
+ * \brief Receiver thread of a stream
+ *
+ * Applies the frames in order. Later frames overwrite the pages of former
+ * rounds. Uncompressed memory is received directly into the guest memory,
+ * except during post-copy, where the pages are installed through
+ * userfaultfd.
+ */
+static void *stream_receiver(void *arg)
+{
+	int sock = (int) (size_t) arg;
+	mig_frame_t frame;
+	size_t frames_received = 0;
+	uint8_t *buf = NULL;
+	uint8_t *page_buf = NULL;
+	bool postcopy = (post_pending != NULL);
+
+	while (1) {
+		recv_stream(sock, &frame, sizeof(frame));
+		if (frame.size == 0)
+			break;
+
+		if ((frame.gpa >= guest_size) || (frame.size > guest_size - frame.gpa)
+		    || (frame.len > frame.size) || (frame.size > MIG_STRIPE_SIZE)) {
+			fprintf(stderr, "[ERROR] Invalid memory frame (gpa 0x%zx, "
+					"size 0x%x). Abort!\n", (size_t)frame.gpa, frame.size);
+			exit(EXIT_FAILURE);
+		}
+
+		uint8_t *dest = guest_mem + frame.gpa;
+		if (postcopy) {
+			if ((page_buf == NULL) && ((page_buf = (uint8_t*) malloc(MIG_STRIPE_SIZE)) == NULL)) {
+				fprintf(stderr, "[ERROR] Could not allocate receive buffer. Abort!\n");
+				exit(EXIT_FAILURE);
+			}
+			dest = page_buf;
+		}
+
+		if (frame.len == frame.size) {
+			recv_stream(sock, dest, frame.size);
+		} else {
+#ifdef HAVE_LZ4_H
+			if ((buf == NULL) && ((buf = (uint8_t*) malloc(MIG_STRIPE_SIZE)) == NULL)) {
+				fprintf(stderr, "[ERROR] Could not allocate receive buffer. Abort!\n");
+				exit(EXIT_FAILURE);
+			}
+
+			recv_stream(sock, buf, frame.len);
+			if (LZ4_decompress_safe((const char*) buf, (char*) dest,
+						frame.len, frame.size) != frame.size) {
+				fprintf(stderr, "[ERROR] Could not decompress memory frame "
+						"(gpa 0x%zx). Abort!\n", (size_t)frame.gpa);
+				exit(EXIT_FAILURE);
+			}
+#else
+			fprintf(stderr, "[ERROR] Received compressed memory, but LZ4 "
+					"is not available. Abort!\n");
+			exit(EXIT_FAILURE);
+#endif
+		}
+
+		if (postcopy)
+			post_install(frame.gpa, page_buf, frame.size);
+		frames_received++;
+	}
+
+	free(buf);
+	free(page_buf);
+
+	return (void*) frames_received;
+}
+
+/**
+ * \brief Receives the frames of all streams
+ */
+static size_t recv_streams(void)
+{
+	pthread_t threads[MIG_MAX_STREAMS];
+	int socks[MIG_MAX_STREAMS];
+	size_t frames_received = 0;
+	uint32_t i;
+
+	/* the first stream uses the migration channel, except for post-copy */
+	for (i=0; i<mig_params.streams; ++i) {
+		socks[i] = (i || is_postcopy()) ? accept_migration_stream() : get_migration_socket();
+		if (socks[i] < 0) {
+			fprintf(stderr, "[ERROR] Could not open migration stream %u. Abort!\n", i);
+			exit(EXIT_FAILURE);
+		}
+
+		if (create_helper_thread(&threads[i], stream_receiver, (void*) (size_t) socks[i])) {
+			fprintf(stderr, "[ERROR] Could not create migration thread. Abort!\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i=0; i<mig_params.streams; ++i) {
+		void *res = NULL;
+
+		pthread_join(threads[i], &res);
+		frames_received += (size_t) res;
+		if (i || is_postcopy())
+			close(socks[i]);
+	}
+
+	return frames_received;
+}
+
+/**
+ * \brief Receives the guest memory from the source
+ *
+ * With post-copy, the announced ranges are discarded. They are received
+ * after start_postcopy().
+ *
+ * \param mem_mappings the memory regions of the guest
+ */
 void recv_guest_mem(mem_mappings_t mem_mappings)
 {
-	size_t i = 0;
-	for (i=0; i<mem_mappings.count; ++i) {
-		recv_data(mem_mappings.mem_chunks[i].ptr, mem_mappings.mem_chunks[i].size);
+	size_t frames_received = recv_streams();
+
+	fprintf(stderr, "Guest memory received! (%zu frames on %u stream(s))\n",
+			frames_received, mig_params.streams);
+
+	if (!is_postcopy())
+		return;
+
+	uint64_t count = 0;
+	recv_data(&count, sizeof(count));
+
+	size_t words = (guest_size / MIG_POST_PAGE_SIZE + 63) / 64;
+	post_pending = (uint64_t*) calloc(words, sizeof(uint64_t));
+	post_migrated = (uint64_t*) calloc(words, sizeof(uint64_t));
+	post_requested = (uint64_t*) calloc(words, sizeof(uint64_t));
+	if ((post_pending == NULL) || (post_migrated == NULL) || (post_requested == NULL)) {
+		fprintf(stderr, "[ERROR] Could not allocate post-copy bitmaps. Abort!\n");
+		exit(EXIT_FAILURE);
 	}
-	fprintf(stderr, "Guest memory received!\n");
+
+	for (uint64_t i=0; i<count; ++i) {
+		mig_range_t range;
+
+		recv_data(&range, sizeof(range));
+		if ((range.gpa >= guest_size) || (range.size > guest_size - range.gpa)
+		    || ((range.gpa | range.size) & (MIG_POST_PAGE_SIZE-1))) {
+			fprintf(stderr, "[ERROR] Invalid post-copy range (gpa 0x%zx). Abort!\n", (size_t)range.gpa);
+			exit(EXIT_FAILURE);
+		}
+
+		/* outdated pages of the pre-copy are missing again */
+		madvise(guest_mem + range.gpa, range.size, MADV_DONTNEED);
+
+		for (size_t pfn=range.gpa/MIG_POST_PAGE_SIZE; pfn<(range.gpa+range.size)/MIG_POST_PAGE_SIZE; ++pfn) {
+			if (!post_test_and_set_bit(post_pending, pfn))
+				post_pending_count++;
+			post_test_and_set_bit(post_migrated, pfn);
+		}
+	}
+
+	fprintf(stderr, "[INFO] %zu pages are received after the start\n", (size_t) post_pending_count);
+}
+
+/**
+ * \brief Receives the pushed pages of the source
+ */
+static void *post_push_receiver(void *arg)
+{
+	size_t frames_received = recv_streams();
+
+	fprintf(stderr, "[INFO] Post-copy received %zu frames\n", frames_received);
+
+	return NULL;
+}
+
+/**
+ * \brief Starts the post-copy phase at the destination
+ *
+ * The missing pages are registered with userfaultfd. Accesses to them
+ * are resolved by requests to the source, while the pushed pages are
+ * received in background.
+ */
+void start_postcopy(void)
+{
+	pthread_t thread;
+	struct uffdio_api api = { .api = UFFD_API, .features = 0 };
+	struct uffdio_register reg = {
+		.range = { .start = (uint64_t) guest_mem, .len = guest_size },
+		.mode = UFFDIO_REGISTER_MODE_MISSING,
+	};
+
+	post_uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if ((post_uffd < 0) || (ioctl(post_uffd, UFFDIO_API, &api) < 0)
+	    || (ioctl(post_uffd, UFFDIO_REGISTER, &reg) < 0)) {
+		fprintf(stderr, "[ERROR] Could not register guest memory for "
+				"post-copy - %d (%s). Abort!\n", errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (create_helper_thread(&thread, post_fault_handler, NULL)
+	    || pthread_detach(thread)
+	    || create_helper_thread(&thread, post_reply_receiver, NULL)
+	    || pthread_detach(thread)
+	    || create_helper_thread(&thread, post_push_receiver, NULL)
+	    || pthread_detach(thread)) {
+		fprintf(stderr, "[ERROR] Could not create post-copy thread. Abort!\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* nothing is missing */
+	if (post_pending_count == 0)
+		post_finish();
 }
 #endif /* __RDMA_MIGRATION__ not defined */
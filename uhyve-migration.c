@@ -25,7 +25,6 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
-#ifdef __x86_64__
 #define _GNU_SOURCE
 
 #include <arpa/inet.h>
@@ -37,6 +36,7 @@
 #include <unistd.h>
 
 #include "uhyve-migration.h"
+#include "uhyve-stats.h"
 #include "uhyve.h"
 
 static struct sockaddr_in mig_server;
@@ -51,6 +51,11 @@ mig_params_t mig_params = {
 	.mode = MIG_MODE_COMPLETE_DUMP,
 	.use_odp = false,
 	.prefetch = false,
+	.streams = 1,
+	.zerocopy = false,
+	.compress = false,
+	.max_downtime = MIG_DEFAULT_DOWNTIME,
+	.auto_throttle = false,
 };
 
 extern mem_mappings_t mem_mappings;
@@ -112,9 +117,30 @@ print_migration_params(void)
 	printf("   TYPE     : %s\n", get_migration_type_str(mig_params.type));
 	printf("   USE ODP  : %u\n", mig_params.use_odp);
 	printf("   PREFETCH : %u\n", mig_params.prefetch);
+	printf("   STREAMS  : %u\n", mig_params.streams);
+	printf("   ZEROCOPY : %u\n", mig_params.zerocopy);
+	printf("   COMPRESS : %u\n", mig_params.compress);
+	printf("   DOWNTIME : %u ms\n", mig_params.max_downtime);
+	printf("   THROTTLE : %u\n", mig_params.auto_throttle);
 	printf("==========================================\n");
 }
 
+/**
+ * \brief Terminates uhyve if the transport does not support the parameters
+ */
+static void
+check_migration_params(void)
+{
+#ifdef __RDMA_MIGRATION__
+	if (is_postcopy()) {
+		fprintf(stderr, "[ERROR] Migration type '%s' is not supported "
+				"via RDMA. Abort!\n",
+				get_migration_type_str(mig_params.type));
+		exit(EXIT_FAILURE);
+	}
+#endif
+}
+
 /**
  * \brief Sets the migration parameters in accordance with a given file
  *
@@ -127,13 +153,117 @@ set_migration_params(const char *mig_param_filename)
 		return;
 
 	FILE *mig_param_file = fopen(mig_param_filename, "r");
+	if (mig_param_file == NULL) {
+		fprintf(stderr, "[WARNING] Could not open '%s' - %d (%s). "
+				"Fallback to default parameters!\n",
+				mig_param_filename, errno, strerror(errno));
+		return;
+	}
+
 	char tmp_str[MAX_PARAM_STR_LEN];
 	fscanf(mig_param_file, "mode: %s\n", tmp_str);
 	set_migration_mode(tmp_str);
 	fscanf(mig_param_file, "type: %s\n", tmp_str);
 	set_migration_type(tmp_str);
-	fscanf(mig_param_file, "use-odp: %u\n", (uint32_t*)&mig_params.use_odp);
-	fscanf(mig_param_file, "prefetch: %u\n", (uint32_t*)&mig_params.prefetch);
+	uint32_t tmp = 0;
+	if (fscanf(mig_param_file, "use-odp: %u\n", &tmp) == 1)
+		mig_params.use_odp = tmp;
+	if (fscanf(mig_param_file, "prefetch: %u\n", &tmp) == 1)
+		mig_params.prefetch = tmp;
+
+	/* optional parameters of the TCP transport */
+	if (fscanf(mig_param_file, "streams: %u\n", &tmp) == 1)
+		mig_params.streams = tmp;
+	if (fscanf(mig_param_file, "zero-copy: %u\n", &tmp) == 1)
+		mig_params.zerocopy = tmp;
+	if (fscanf(mig_param_file, "compress: %u\n", &tmp) == 1)
+		mig_params.compress = tmp;
+
+	/* convergence of the live-migration */
+	if (fscanf(mig_param_file, "max-downtime: %u\n", &tmp) == 1)
+		mig_params.max_downtime = tmp;
+	if (fscanf(mig_param_file, "auto-throttle: %u\n", &tmp) == 1)
+		mig_params.auto_throttle = tmp;
+
+	if ((mig_params.streams == 0) || (mig_params.streams > MIG_MAX_STREAMS)) {
+		fprintf(stderr, "[WARNING] Invalid number of migration streams "
+				"(%u). Fallback to %u!\n",
+				mig_params.streams, 1);
+		mig_params.streams = 1;
+	}
+
+	fclose(mig_param_file);
+
+	check_migration_params();
+}
+
+/**
+ * \brief Evaluates a pre-copy round
+ *
+ * \param mig_round the number of the round, starting with 0
+ * \param pages the number of pages sent in this round
+ * \param bytes the number of bytes sent in this round
+ * \param begin the start of the round
+ *
+ * The bandwidth is measured with the current round, the dirty rate with
+ * the amount of memory modified during the previous round. The pre-copy
+ * phase ends, if sending the pages dirtied during this round is predicted
+ * to take less than mig_params.max_downtime. If the guest dirties its
+ * memory faster than it is sent, the VCPUs are throttled.
+ *
+ * Returns true if the stop-and-copy phase should start.
+ */
+bool precopy_round_done(uint32_t mig_round, size_t pages, size_t bytes, const struct timeval *begin)
+{
+	static double last_seconds = 0.0;
+	static uint32_t throttle = 0;
+	struct timeval end;
+	bool done = false;
+
+	gettimeofday(&end, NULL);
+	double seconds = (end.tv_sec - begin->tv_sec) + (end.tv_usec - begin->tv_usec) / 1e6;
+	if (seconds < 1e-6)
+		seconds = 1e-6;
+	stats_phase(STATS_PHASE_PRECOPY_ROUND, (uint64_t) (seconds * 1e9));
+
+	double bandwidth = bytes / seconds;
+	double dirty_rate = ((mig_round > 0) && (last_seconds > 0.0)) ? bytes / last_seconds : 0.0;
+	double downtime_ms = -1.0;
+
+	// an empty round leaves nothing for the stop-and-copy phase
+	if (mig_round > 0)
+		downtime_ms = bytes ? (dirty_rate * seconds / bandwidth) * 1000.0 : 0.0;
+
+	fprintf(stderr, "[INFO] Pre-copy round %u: %zu pages, %.1f MiB in %.0f ms, "
+			"bandwidth %.1f MiB/s, dirty rate %.1f MiB/s, "
+			"predicted downtime %.0f ms, throttle %u%%\n",
+			mig_round, pages, bytes / 1048576.0, seconds * 1000.0,
+			bandwidth / 1048576.0, dirty_rate / 1048576.0,
+			downtime_ms, throttle);
+
+	if ((mig_round > 0) && (downtime_ms <= mig_params.max_downtime)) {
+		done = true;
+	} else if (mig_round + 1 >= MIG_MAX_ITERS) {
+		fprintf(stderr, "[WARNING] Live-migration does not converge "
+				"after %u rounds. Stop the guest!\n", mig_round + 1);
+		done = true;
+	} else if (mig_params.auto_throttle && (mig_round > 0) && (dirty_rate > 0.9 * bandwidth)) {
+		/* the memory is dirtied faster than the link is able to carry */
+		throttle = throttle ? throttle + MIG_THROTTLE_INCREMENT : MIG_THROTTLE_INITIAL;
+		if (throttle > MIG_THROTTLE_MAX)
+			throttle = MIG_THROTTLE_MAX;
+		vcpu_throttle(throttle);
+	}
+
+	last_seconds = seconds;
+
+	if (done) {
+		vcpu_throttle(0);
+		throttle = 0;
+		last_seconds = 0.0;
+	}
+
+	return done;
 }
 
 /**
@@ -202,6 +332,9 @@ int connect_to_server(void)
 		return -1;
 	}
 
+	int buf_size = MIG_SOCK_BUF_SIZE;
+	setsockopt(com_sock, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+
 	fprintf(stderr, "[INFO] Trying to connect to migration server: %s\n", buf);
 	if (connect(com_sock, (struct sockaddr *)&mig_server, sizeof(mig_server)) < 0) {
 		perror("connect");
@@ -239,7 +372,11 @@ void wait_for_client(uint16_t listen_portno)
 
 	bind(listen_sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
 
-	listen(listen_sock, 10);
+	/* accepted sockets inherit the buffer size */
+	int buf_size = MIG_SOCK_BUF_SIZE;
+	setsockopt(listen_sock, SOL_SOCKET, SO_RCVBUF, &buf_size, sizeof(buf_size));
+
+	listen(listen_sock, MIG_MAX_STREAMS);
 
 	client_addr_len = sizeof(struct sockaddr_in);
 	if ((com_sock = accept(listen_sock, &client_addr, &client_addr_len)) < 0) {
@@ -256,6 +393,7 @@ void wait_for_client(uint16_t listen_portno)
 	/* recv migration parameters */
 	res = recv_data(&mig_params, sizeof(mig_params_t));
 	print_migration_params();
+	check_migration_params();
 }
 
 /**
@@ -268,11 +406,21 @@ int recv_data(void *buffer, size_t length)
 {
 	size_t bytes_received = 0;
 	while(bytes_received < length) {
-		bytes_received += recv(
+		ssize_t res = recv(
 				com_sock,
 				(void*)((uint64_t)buffer+bytes_received),
 				length-bytes_received,
 			       	0);
+
+		if ((res < 0) && (errno == EINTR))
+			continue;
+		if (res <= 0) {
+			fprintf(stderr, "[ERROR] Could not receive migration data "
+					"- %d (%s). Abort!\n",
+					errno, res ? strerror(errno) : "connection closed");
+			exit(EXIT_FAILURE);
+		}
+		bytes_received += res;
 	}
 
 	return bytes_received;
@@ -288,16 +436,73 @@ int send_data(void *buffer, size_t length)
 {
 	size_t bytes_sent = 0;
 	while(bytes_sent < length) {
-		bytes_sent += send(
+		ssize_t res = send(
 				com_sock,
 				(void*)((uint64_t)buffer+bytes_sent),
 				length-bytes_sent,
 			       	0);
+
+		if ((res < 0) && (errno == EINTR))
+			continue;
+		if (res < 0) {
+			fprintf(stderr, "[ERROR] Could not send migration data "
+					"- %d (%s). Abort!\n",
+					errno, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		bytes_sent += res;
 	}
 
 	return bytes_sent;
 }
 
+/**
+ * \brief Opens an additional connection to the migration target
+ *
+ * Returns the socket or -1 on failure.
+ */
+int connect_migration_stream(void)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	int buf_size = MIG_SOCK_BUF_SIZE;
+	setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &buf_size, sizeof(buf_size));
+
+	if (connect(sock, (struct sockaddr *)&mig_server, sizeof(mig_server)) < 0) {
+		perror("connect");
+		close(sock);
+		return -1;
+	}
+
+	return sock;
+}
+
+/**
+ * \brief Accepts an additional connection of the migration source
+ *
+ * Returns the socket or -1 on failure.
+ */
+int accept_migration_stream(void)
+{
+	int sock = accept(listen_sock, NULL, NULL);
+	if (sock < 0)
+		perror("accept");
+
+	return sock;
+}
+
+/**
+ * \brief Returns the socket of the migration channel
+ */
+int get_migration_socket(void)
+{
+	return com_sock;
+}
+
 /**
  * \brief Closes the TCP connection
  */
@@ -345,18 +550,3 @@ void recv_mem_regions(mem_mappings_t *mem_mappings)
 	mem_mappings->mem_chunks = (mem_chunk_t*)malloc(recv_bytes);
 	recv_data(mem_mappings->mem_chunks, recv_bytes);
 }
-
-#else
-
-/* dummy implementation for aarch64 */
-
-void set_migration_target(const char *ip_str, int port)
-{
-}
-
-void set_migration_type(const char *mig_type_str)
-{
-}
-
-#endif
-
@@ -35,6 +35,8 @@
 #define __UHYVE_MIGRATION_H__
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/time.h>
 
 extern size_t guest_size;
 extern uint8_t* guest_mem;
@@ -42,6 +44,20 @@ extern uint8_t* guest_mem;
 #define MIGRATION_PORT 1337
 #define MAX_PARAM_STR_LEN 128
 
+/* parallel TCP connections of a migration */
+#define MIG_MAX_STREAMS 16
+/* socket buffer size of the migration connections */
+#define MIG_SOCK_BUF_SIZE (8 << 20)
+
+/* upper bound of the pre-copy rounds */
+#define MIG_MAX_ITERS 30
+/* default downtime target of the stop-and-copy phase in ms */
+#define MIG_DEFAULT_DOWNTIME 300
+/* VCPU throttling of non-converging live-migrations in percent */
+#define MIG_THROTTLE_INITIAL 20
+#define MIG_THROTTLE_INCREMENT 10
+#define MIG_THROTTLE_MAX 90
+
 typedef enum {
 	MIG_MODE_COMPLETE_DUMP = 0,
 	MIG_MODE_INCREMENTAL_DUMP,
@@ -59,6 +75,8 @@ const static struct {
 typedef enum {
 	MIG_TYPE_COLD = 0,
 	MIG_TYPE_LIVE,
+	MIG_TYPE_POSTCOPY,
+	MIG_TYPE_HYBRID,
 } mig_type_t;
 
 const static struct {
@@ -67,6 +85,8 @@ const static struct {
 } mig_type_conv [] = {
 	{MIG_TYPE_COLD, "cold"},
 	{MIG_TYPE_LIVE, "live"},
+	{MIG_TYPE_POSTCOPY, "post-copy"},
+	{MIG_TYPE_HYBRID, "pre-post-copy"},
 };
 
 
@@ -75,6 +95,11 @@ typedef struct _mig_params {
 	mig_mode_t mode;
 	bool use_odp;
 	bool prefetch;
+	uint32_t streams;
+	bool zerocopy;
+	bool compress;
+	uint32_t max_downtime;
+	bool auto_throttle;
 } mig_params_t;
 
 typedef struct _mem_chunk {
@@ -96,25 +121,40 @@ typedef struct _migration_metadata {
 } migration_metadata_t;
 
 
-mig_params_t mig_params;
+extern mig_params_t mig_params;
 
 void set_migration_params(const char *migration_param_filename);
 
 mig_type_t get_migration_type(void);
 
+/**
+ * \brief Returns true if the destination fetches pages after the start
+ */
+static inline bool is_postcopy(void)
+{
+	return (mig_params.type == MIG_TYPE_POSTCOPY) || (mig_params.type == MIG_TYPE_HYBRID);
+}
+
 void wait_for_client(uint16_t listen_portno);
 void set_migration_target(const char *ip_str, int port);
 int connect_to_server(void);
 void close_migration_channel(void);
+int connect_migration_stream(void);
+int accept_migration_stream(void);
 
 int recv_data(void *buffer, size_t length);
 int send_data(void *buffer, size_t length);
+int get_migration_socket(void);
 
 void send_mem_regions(mem_mappings_t guest_physical_memory, mem_mappings_t mem_mappings);
 void recv_mem_regions(mem_mappings_t *mem_mappings);
 
+bool precopy_round_done(uint32_t mig_round, size_t pages, size_t bytes, const struct timeval *begin);
+
 void precopy_phase(mem_mappings_t guest_mem, mem_mappings_t mem_mappings);
 void stop_and_copy_phase(void);
 void recv_guest_mem(mem_mappings_t mem_mappings);
+void postcopy_phase(void);
+void start_postcopy(void);
 #endif /* __UHYVE_MIGRATION_H__ */
 
@@ -29,12 +29,79 @@
  *            for HermitCore
  */
 
+#define _GNU_SOURCE
+
+#include "uhyve-common.h"
 #include "uhyve-net.h"
+#include "uhyve-stats.h"
+#include "uhyve.h"
 #include <time.h>
 #include <ctype.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <linux/virtio_config.h>
+#include <linux/virtio_ring.h>
+
+/* number of yields before the RX thread sleeps on a full queue */
+#define RX_SPIN_COUNT		64
+/* wake up periodically for guests, which do not kick UHYVE_PORT_NETREAD */
+#define RX_WAIT_TIMEOUT		1 // in ms
+
+/* virtio features, which the guest may negotiate with vhost-net */
+#define VHOST_NET_GUEST_FEATURES	((1ULL << VIRTIO_RING_F_EVENT_IDX) | \
+					 (1ULL << VIRTIO_RING_F_INDIRECT_DESC) | \
+					 (1ULL << VIRTIO_NET_F_MRG_RXBUF))
+
+extern uint8_t* guest_mem;
+extern size_t guest_size;
+extern uint32_t ncores;
+extern int vmfd, efd;
+
+/* an interface of HERMIT_NETIF */
+typedef struct {
+	unsigned index;
+	char mac[6];
 
-/* TODO: create an array or equal for more then one netif */
-static char guest_mac[6];
+	/* queues of the TAP device */
+	int tap_fds[UHYVE_MAX_NET_QUEUES];
+	unsigned tap_queues;
+	/* frames on the TAP device are prefixed by a struct virtio_net_hdr_v1 */
+	bool tap_vnet_hdr;
+
+	/* vhost-net instances, one per TAP queue (<tap>,vhost) */
+	bool use_vhost;
+	int vhost_fds[UHYVE_MAX_NET_QUEUES];
+	uint64_t vhost_features;
+
+	/* queue pairs, which are in use by the guest */
+	uhyve_netq_t netqs[UHYVE_MAX_NET_QUEUES];
+	unsigned num_netqs;
+	uhyve_netconfig_t netconfig;
+
+	/* first GSI of the queues, see netq_irq() */
+	unsigned irq_base;
+} uhyve_netif_t;
+
+static uhyve_netif_t netifs[UHYVE_MAX_NETIFS];
+static unsigned num_netifs = 0;
+static pthread_mutex_t net_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Next free GSI of the queues. Each queue gets its own line in the range
+ * UHYVE_IRQ_NET_QUEUE_BASE to UHYVE_IRQ_NET_QUEUE_END, the interfaces are
+ * limited to the remaining lines.
+ */
+static unsigned next_irq = UHYVE_IRQ_NET_QUEUE_BASE;
+/*
+ * KVM rejects a datamatch entry on a port, which already has an entry
+ * without datamatch. Hence, the legacy queue pair, which matches all
+ * kicks, gives way to the first queue pair with datamatch. Afterwards,
+ * its kicks are handled by uhyve_net_kick().
+ */
+static uhyve_netq_t* wildcard_netq = NULL;
+static unsigned datamatch_netqs = 0;
 
 static inline uint8_t dehex(char c)
 {
@@ -49,27 +116,23 @@ static inline uint8_t dehex(char c)
 }
 
 //-------------------------------------- ATTACH LINUX TAP -----------------------------------------//
-int attach_linux_tap(const char *dev)
+static int open_linux_tap(const char *dev, bool multi_queue)
 {
 	struct ifreq ifr;
 	int fd, err;
 
-	// @<number> indicates a pre-existing open fd onto the correct device.
-	if (dev[0] == '@') {
-		fd = atoi(&dev[1]);
-
-		if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
-			return -1;
-		return fd;
-	}
-
 	fd = open("/dev/net/tun", O_RDWR);
+	if (fd < 0)
+		return -1;
 
 	// Initialize interface request for TAP interface
 	memset(&ifr, 0x00, sizeof(ifr));
 
-	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+	ifr.ifr_flags = IFF_TAP | IFF_NO_PI | IFF_VNET_HDR;
+	if (multi_queue)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
 	if (strlen(dev) > IFNAMSIZ) {
+		close(fd);
 		errno = EINVAL;
 		return -1;
 	}
@@ -80,7 +143,7 @@ int attach_linux_tap(const char *dev)
 
 	// create before a tap device with these commands:
 	//
-	// sudo ip tuntap add <devname> mode tap user <user>
+	// sudo ip tuntap add <devname> mode tap user <user> [multi_queue]
 	// sudo ip addr add 10.0.5.1/24 broadcast 10.0.5.255
 	// sudo ip link set dev <devname> up
 	//
@@ -102,6 +165,45 @@ int attach_linux_tap(const char *dev)
 		return -1;
 	}
 
+	return fd;
+}
+
+/*
+ * Opens up to "queues" queues of the TAP device and stores the file
+ * descriptors in fds. vnet_hdr is set, if the frames carry a vnet header.
+ * Returns the number of opened queues or -1.
+ */
+int attach_linux_tap(const char *dev, int *fds, unsigned queues, bool *vnet_hdr)
+{
+	unsigned i;
+	int fd;
+
+	// @<number> indicates a pre-existing open fd onto the correct device.
+	if (dev[0] == '@') {
+		struct ifreq ifr;
+
+		fd = atoi(&dev[1]);
+
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+			return -1;
+		fds[0] = fd;
+
+		memset(&ifr, 0x00, sizeof(ifr));
+		if ((ioctl(fd, TUNGETIFF, (void *)&ifr) == 0) && (ifr.ifr_flags & IFF_VNET_HDR))
+			*vnet_hdr = true;
+		return 1;
+	}
+
+	fds[0] = open_linux_tap(dev, queues > 1);
+	if ((fds[0] < 0) && (queues > 1)) {
+		// the device may exist without multi_queue flag
+		warnx("Unable to open %s with %u queues, fall back to a single queue\n", dev, queues);
+		queues = 1;
+		fds[0] = open_linux_tap(dev, false);
+	}
+	if (fds[0] < 0)
+		return -1;
+
 	// Attempt a zero-sized write to the device. If the device was freshly created
 	// (as opposed to attached to an existing ine) this will fail with EIO. Ignore
 	// any other error return since that may indicate the device is up
@@ -110,29 +212,72 @@ int attach_linux_tap(const char *dev)
 	// fali with EIO, which is not great but at least we tried
 
 	char buf[1] = { 0 };
-	if (write(fd, buf, 0) == -1 && errno == EIO) {
-		close(fd);
+	if (write(fds[0], buf, 0) == -1 && errno == EIO) {
+		close(fds[0]);
 		errno = ENODEV;
 		return -1;
 	}
+	*vnet_hdr = true;
 
-	return fd;
+	for(i = 1; i < queues; i++) {
+		fds[i] = open_linux_tap(dev, true);
+		if (fds[i] < 0) {
+			warnx("Unable to open queue %u of %s\n", i, dev);
+			break;
+		}
+	}
+
+	// the data path drains each queue until EAGAIN
+	for(unsigned j = 0; j < i; j++) {
+		if (fcntl(fds[j], F_SETFL, O_NONBLOCK) == -1)
+			warn("Unable to set TAP queue to non-blocking mode");
+	}
+
+	return i;
+}
+
+/* Configures the vnet header and the offloads, which are passed to the guest */
+static void tap_set_offload(uhyve_netif_t* nif, uint32_t features)
+{
+	unsigned offload = 0;
+	int fd = nif->tap_fds[0];
+	int hdr_size = sizeof(struct virtio_net_hdr_v1);
+
+	if (!nif->tap_vnet_hdr)
+		return;
+
+	if (ioctl(fd, TUNSETVNETHDRSZ, &hdr_size) < 0)
+		warn("Unable to set the size of the vnet header");
+
+	if (features & UHYVE_NET_F_CSUM)
+		offload |= TUN_F_CSUM;
+	if (features & UHYVE_NET_F_TSO)
+		offload |= TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+
+	if (ioctl(fd, TUNSETOFFLOAD, offload) < 0)
+		warn("Unable to set the offloads of the TAP device");
 }
 
-//---------------------------------- GET MAC ----------------------------------------------//
-char* uhyve_get_mac(void)
+/* Unused queues have to be detached, otherwise the kernel steers packets to them */
+static void tap_detach_queue(int fd)
 {
-	return guest_mac;
+	struct ifreq ifr;
+
+	memset(&ifr, 0x00, sizeof(ifr));
+	ifr.ifr_flags = IFF_DETACH_QUEUE;
+	if (ioctl(fd, TUNSETQUEUE, (void *)&ifr) < 0)
+		warn("Unable to detach TAP queue");
 }
 
 //---------------------------------- SET MAC ----------------------------------------------//
 
-int uhyve_set_mac(void)
+/* str is the MAC address of the interface, a random one is used without it */
+static int uhyve_set_mac(uhyve_netif_t* nif, const char* str)
 {
+	char* guest_mac = nif->mac;
 	char guest_mac_str[20];
 	int mac_is_set = 0;
 
-	char* str = getenv("HERMIT_NETIF_MAC");
 	if (str)
 	{
 		const char *macptr = str;
@@ -170,9 +315,9 @@ int uhyve_set_mac(void)
 		if(rfd == -1)
 			err(1, "Could not open /dev/urandom\n");
 		int ret;
-		ret = read(rfd, guest_mac, sizeof(guest_mac));
+		ret = read(rfd, guest_mac, sizeof(nif->mac));
 		// compare the number of bytes read with the size of guest_mac
-		assert(ret == sizeof(guest_mac));
+		assert(ret == sizeof(nif->mac));
 		close(rfd);
 
 		guest_mac[0] &= 0xfe;	// creats a random MAC-address in the locally administered
@@ -193,21 +338,778 @@ int uhyve_set_mac(void)
 }
 
 //-------------------------------------- SETUP NETWORK ---------------------------------------------//
-int uhyve_net_init(const char *netif)
+/* Opens one vhost-net instance per TAP queue, returns false if vhost-net is not usable */
+static bool vhost_init(uhyve_netif_t* nif)
 {
-	if (netif == NULL) {
-		err(1, "ERROR: no netif defined\n");
-		return -1;
+	unsigned i;
+
+	for(i = 0; i < nif->tap_queues; i++) {
+		uint64_t features = 0;
+
+		nif->vhost_fds[i] = uhyve_vhost_net_open(&features);
+		if (nif->vhost_fds[i] < 0)
+			break;
+		nif->vhost_features = features;
+	}
+
+	if ((i < nif->tap_queues) || !nif->tap_vnet_hdr || !(nif->vhost_features & (1ULL << VIRTIO_F_VERSION_1))) {
+		fprintf(stderr, "[WARNING] vhost-net is not available - %d (%s)\n", errno, strerror(errno));
+		while (i-- > 0)
+			close(nif->vhost_fds[i]);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * spec names the TAP device, optionally followed by a comma-separated
+ * list of options, e.g. "tap0,vhost" or "tap1,queues=1"
+ */
+static void netif_init(uhyve_netif_t* nif, unsigned index, char* spec, unsigned queues, const char* mac)
+{
+	char* opts;
+	char* saveptr = NULL;
+
+	memset(nif, 0x00, sizeof(*nif));
+	nif->index = index;
+
+	opts = strchr(spec, ',');
+	if (opts) {
+		*opts++ = '\0';
+		for(char* opt = strtok_r(opts, ",", &saveptr); opt; opt = strtok_r(NULL, ",", &saveptr)) {
+			if (strcmp(opt, "vhost") == 0)
+				nif->use_vhost = true;
+			else if (strncmp(opt, "queues=", 7) == 0)
+				queues = (unsigned) atoi(opt + 7);
+			else
+				warnx("Unknown network option: %s\n", opt);
+		}
+	}
+
+	if (queues < 1)
+		queues = 1;
+	if (queues > UHYVE_MAX_NET_QUEUES)
+		queues = UHYVE_MAX_NET_QUEUES;
+
+	// queue 0 of the first interface raises UHYVE_IRQ_NET
+	unsigned lines = UHYVE_IRQ_NET_QUEUE_END - next_irq + (index ? 0 : 1);
+	if (lines == 0)
+		errx(1, "No interrupt line is left for interface %s, reduce HERMIT_NETIF_QUEUES", spec);
+	if (queues > lines) {
+		warnx("Interface %s is limited to %u queues by the interrupt lines", spec, lines);
+		queues = lines;
 	}
 
 	// attaching netif
-	netfd = attach_linux_tap(netif);
-	if (netfd < 0) {
-		err(1, "Could not attach interface: %s\n", netif);
+	int ret = attach_linux_tap(spec, nif->tap_fds, queues, &nif->tap_vnet_hdr);
+	if (ret < 0) {
+		err(1, "Could not attach interface: %s\n", spec);
 		exit(1);
 	}
+	nif->tap_queues = (unsigned) ret;
+
+	if (nif->use_vhost)
+		nif->use_vhost = vhost_init(nif);
+
+	uhyve_set_mac(nif, mac);
+
+	nif->irq_base = next_irq;
+	next_irq += index ? nif->tap_queues : nif->tap_queues - 1;
+}
+
+/*
+ * hermit_netif is a semicolon-separated list of interfaces, e.g.
+ * "tap0,vhost;tap1". HERMIT_NETIF_MAC lists their MAC addresses in the
+ * same way.
+ */
+int uhyve_net_init(const char *hermit_netif)
+{
+	unsigned queues = ncores;
+	char* specs;
+	char* macs = NULL;
+	char* saveptr = NULL;
+	char* mac_saveptr = NULL;
+
+	if (hermit_netif == NULL) {
+		err(1, "ERROR: no netif defined\n");
+		return -1;
+	}
+
+	specs = strdup(hermit_netif);
+	if (!specs)
+		err(1, "unable to allocate memory");
+
+	const char* str = getenv("HERMIT_NETIF_MAC");
+	if (str) {
+		macs = strdup(str);
+		if (!macs)
+			err(1, "unable to allocate memory");
+	}
 
-	uhyve_set_mac();
+	str = getenv("HERMIT_NETIF_QUEUES");
+	if (str)
+		queues = (unsigned) atoi(str);
+
+	char* mac = macs ? strtok_r(macs, ";", &mac_saveptr) : NULL;
+	for(char* spec = strtok_r(specs, ";", &saveptr); spec; spec = strtok_r(NULL, ";", &saveptr)) {
+		if (num_netifs >= UHYVE_MAX_NETIFS) {
+			warnx("Only %d network interfaces are supported\n", UHYVE_MAX_NETIFS);
+			break;
+		}
+
+		netif_init(&netifs[num_netifs], num_netifs, spec, queues, mac);
+		num_netifs++;
+
+		if (mac)
+			mac = strtok_r(NULL, ";", &mac_saveptr);
+	}
+
+	free(specs);
+	free(macs);
+
+	if (!num_netifs)
+		err(1, "Could not attach interface: %s\n", hermit_netif);
+
+	netfd = netifs[0].tap_fds[0];
 
 	return netfd;
 }
+
+//-------------------------------------- DATA PATH ------------------------------------------------//
+static inline uint64_t queue_fill(shared_queue_t* queue)
+{
+	return atomic_uint64_read(&queue->written) - atomic_uint64_read(&queue->read);
+}
+
+static void wait_for_rx_space(uhyve_netq_t* q)
+{
+	struct pollfd fds[2] = {
+		{ .fd = q->rx_space_efd, .events = POLLIN },
+		{ .fd = q->stop_efd, .events = POLLIN },
+	};
+	uint64_t event_counter;
+
+	for(int i = 0; i < RX_SPIN_COUNT; i++) {
+		if (queue_fill(q->rx) < q->size)
+			return;
+		sched_yield();
+	}
+
+	q->rx->waiting = 1;
+	__sync_synchronize();
+
+	// check again to catch a guest, which has not seen the flag
+	while (!q->stop && (queue_fill(q->rx) >= q->size)) {
+		if ((poll(fds, 2, RX_WAIT_TIMEOUT) > 0) && (fds[0].revents & POLLIN))
+			read(q->rx_space_efd, &event_counter, sizeof(event_counter));
+	}
+
+	q->rx->waiting = 0;
+}
+
+static inline uint8_t* netq_slot(uhyve_netq_t* q, shared_queue_t* queue, uint64_t counter)
+{
+	return (uint8_t*) queue->inner + (counter % q->size) * q->slot_bytes;
+}
+
+/* Reads one frame from the TAP device into slot */
+static ssize_t netq_recv(uhyve_netq_t* q, uint8_t* slot)
+{
+	const ssize_t hdr_size = sizeof(struct virtio_net_hdr_v1);
+	struct virtio_net_hdr_v1 hdr;
+	ssize_t ret;
+
+	if (q->ext) {
+		queue_inner_ext_t* inner = (queue_inner_ext_t*) slot;
+
+		ret = read(q->fd, &inner->hdr, hdr_size + q->frame_size);
+		if (ret < hdr_size)
+			return ret < 0 ? ret : 0;
+		inner->len = ret - hdr_size;
+		return inner->len;
+	}
+
+	queue_inner_t* inner = (queue_inner_t*) slot;
+
+	if (q->vnet_hdr) {
+		// the guest does not know the header => discard it
+		struct iovec iov[2] = {
+			{ .iov_base = &hdr, .iov_len = hdr_size },
+			{ .iov_base = inner->data, .iov_len = q->frame_size }
+		};
+
+		ret = readv(q->fd, iov, 2);
+		if (ret < hdr_size)
+			return ret < 0 ? ret : 0;
+		ret -= hdr_size;
+	} else {
+		ret = read(q->fd, inner->data, q->frame_size);
+		if (ret <= 0)
+			return ret;
+	}
+
+	inner->len = ret;
+	return ret;
+}
+
+/* Writes the frame in slot to the TAP device */
+static ssize_t netq_send(uhyve_netq_t* q, uint8_t* slot)
+{
+	const ssize_t hdr_size = sizeof(struct virtio_net_hdr_v1);
+	struct virtio_net_hdr_v1 hdr;
+
+	if (q->ext) {
+		queue_inner_ext_t* inner = (queue_inner_ext_t*) slot;
+
+		if (inner->len > q->frame_size) {
+			errno = EMSGSIZE;
+			return -1;
+		}
+		return write(q->fd, &inner->hdr, hdr_size + inner->len);
+	}
+
+	queue_inner_t* inner = (queue_inner_t*) slot;
+
+	if (inner->len > q->frame_size) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	if (q->vnet_hdr) {
+		// frames of the guest are complete => no offloads
+		struct iovec iov[2] = {
+			{ .iov_base = &hdr, .iov_len = hdr_size },
+			{ .iov_base = inner->data, .iov_len = inner->len }
+		};
+
+		memset(&hdr, 0x00, sizeof(hdr));
+		return writev(q->fd, iov, 2);
+	}
+
+	return write(q->fd, inner->data, inner->len);
+}
+
+static void* recieve_packets(void* arg)
+{
+	uhyve_netq_t* q = (uhyve_netq_t*) arg;
+	shared_queue_t* rx_queue = q->rx;
+	struct pollfd fds[2] = {
+		{ .fd = q->fd, .events = POLLIN },
+		{ .fd = q->stop_efd, .events = POLLIN },
+	};
+	uint64_t event_counter = 1;
+	ssize_t ret = 0;
+
+	while (!q->stop)
+	{
+		uint32_t batch = 0;
+
+		// move all pending frames into the queue, but raise only one interrupt
+		while (batch < q->size) {
+			if (queue_fill(rx_queue) >= q->size) {
+				if (batch)
+					break;
+				wait_for_rx_space(q);
+				if (q->stop)
+					return NULL;
+			}
+
+			ret = netq_recv(q, netq_slot(q, rx_queue, atomic_uint64_read(&rx_queue->written)));
+			if (ret <= 0)
+				break;
+
+			atomic_uint64_inc(&rx_queue->written);
+			batch++;
+		}
+
+		if (batch) {
+			stats_net(q->netif, q->index, false, batch, queue_fill(rx_queue));
+			write(q->irq_efd, &event_counter, sizeof(event_counter));
+		}
+		else if ((ret < 0) && (errno == EAGAIN))
+			poll(fds, 2, -1);
+	}
+
+	return NULL;
+}
+
+static void* transfer_packets(void* arg)
+{
+	uhyve_netq_t* q = (uhyve_netq_t*) arg;
+	shared_queue_t* tx_queue = q->tx;
+	struct pollfd fds[2] = {
+		{ .fd = q->fd, .events = POLLOUT },
+		{ .fd = q->stop_efd, .events = POLLIN },
+	};
+	struct pollfd kick[2] = {
+		{ .fd = q->tx_efd, .events = POLLIN },
+		{ .fd = q->stop_efd, .events = POLLIN },
+	};
+	uint64_t read_counter;
+	uint64_t event_counter;
+	ssize_t ret;
+
+	while (!q->stop) {
+		// wait for a kick of UHYVE_PORT_NETWRITE
+		if ((poll(kick, 2, -1) <= 0) || !(kick[0].revents & POLLIN))
+			continue;
+		if (read(q->tx_efd, &event_counter, sizeof(event_counter)) < 0)
+			continue;
+
+		// drain all pending slots
+		read_counter = atomic_uint64_read(&tx_queue->read);
+		uint64_t first = read_counter;
+		uint32_t pending = atomic_uint64_read(&tx_queue->written) - read_counter;
+		while (read_counter != atomic_uint64_read(&tx_queue->written)) {
+			uint8_t* slot = netq_slot(q, tx_queue, read_counter);
+
+			// the TAP device accepts only complete frames
+			while (((ret = netq_send(q, slot)) < 0) && (errno == EAGAIN)) {
+				if (q->stop)
+					return NULL;
+				poll(fds, 2, -1);
+			}
+			if ((ret < 0) && (errno == EMSGSIZE))
+				fprintf(stderr, "Drop message. Message is too large.\n");
+
+			read_counter = atomic_uint64_inc(&tx_queue->read);
+		}
+
+		stats_net(q->netif, q->index, true, read_counter - first, pending);
+	}
+
+	return NULL;
+}
+
+/*
+ * Let KVM signal fd directly on a guest write to port, so that the kick
+ * does not exit to userspace. With datamatch, only writes of value are
+ * matched, otherwise all writes to the port.
+ */
+static void register_ioeventfd(uint64_t port, int fd, bool datamatch, unsigned value)
+{
+	struct kvm_ioeventfd ioeventfd = {
+		.addr = port,
+		.len = datamatch ? 4 : 0,	// 0 matches all access sizes
+		.datamatch = value,
+		.fd = fd,
+#ifdef __x86_64__
+		.flags = KVM_IOEVENTFD_FLAG_PIO,
+#endif
+	};
+
+	if (datamatch)
+		ioeventfd.flags |= KVM_IOEVENTFD_FLAG_DATAMATCH;
+
+	if (ioctl(vmfd, KVM_IOEVENTFD, &ioeventfd) < 0)
+		err(1, "unable to register ioeventfd for port 0x%lx", (unsigned long) port);
+}
+
+/* Removes an ioeventfd of register_ioeventfd(), failures are ignored */
+static void unregister_ioeventfd(uint64_t port, int fd, bool datamatch, unsigned value)
+{
+	struct kvm_ioeventfd ioeventfd = {
+		.addr = port,
+		.len = datamatch ? 4 : 0,
+		.datamatch = value,
+		.fd = fd,
+		.flags = KVM_IOEVENTFD_FLAG_DEASSIGN,
+	};
+
+	if (datamatch)
+		ioeventfd.flags |= KVM_IOEVENTFD_FLAG_DATAMATCH;
+#ifdef __x86_64__
+	ioeventfd.flags |= KVM_IOEVENTFD_FLAG_PIO;
+#endif
+	ioctl(vmfd, KVM_IOEVENTFD, &ioeventfd);
+}
+
+static inline uint32_t netq_irq(const uhyve_netif_t* nif, unsigned queue)
+{
+	if (nif->index == 0)
+		return queue ? nif->irq_base + queue - 1 : UHYVE_IRQ_NET;
+
+	return nif->irq_base + queue;
+}
+
+/* Creates the irqfd and the ioeventfds of queue pair i */
+static uhyve_netq_t* netq_init(uhyve_netif_t* nif, unsigned i, uint32_t size, bool datamatch)
+{
+	uhyve_netq_t* q = &nif->netqs[i];
+	struct kvm_irqfd irqfd = {};
+
+	memset(q, 0x00, sizeof(*q));
+	q->netif = nif->index;
+	q->index = i;
+	q->size = size;
+	q->fd = nif->tap_fds[i];
+	q->vnet_hdr = nif->tap_vnet_hdr;
+	q->vhost_fd = -1;
+
+	q->irq_efd = eventfd(0, 0);
+	q->tx_efd = eventfd(0, 0);
+	q->rx_space_efd = eventfd(0, 0);
+	if ((q->irq_efd < 0) || (q->tx_efd < 0) || (q->rx_space_efd < 0))
+		err(1, "unable to create eventfd");
+
+	irqfd.fd = q->irq_efd;
+	irqfd.gsi = netq_irq(nif, i);
+	kvm_ioctl(vmfd, KVM_IRQFD, &irqfd);
+
+	if (datamatch && wildcard_netq) {
+		unregister_ioeventfd(UHYVE_PORT_NETWRITE, wildcard_netq->tx_efd, false, 0);
+		unregister_ioeventfd(UHYVE_PORT_NETREAD, wildcard_netq->rx_space_efd, false, 0);
+		wildcard_netq = NULL;
+	}
+
+	if (datamatch) {
+		register_ioeventfd(UHYVE_PORT_NETWRITE, q->tx_efd, true, UHYVE_NET_KICK(nif->index, i));
+		register_ioeventfd(UHYVE_PORT_NETREAD, q->rx_space_efd, true, UHYVE_NET_KICK(nif->index, i));
+		datamatch_netqs++;
+	} else if (!datamatch_netqs && !wildcard_netq) {
+		register_ioeventfd(UHYVE_PORT_NETWRITE, q->tx_efd, false, 0);
+		register_ioeventfd(UHYVE_PORT_NETREAD, q->rx_space_efd, false, 0);
+		wildcard_netq = q;
+	}
+
+	return q;
+}
+
+/* slot_size 0 selects the slot layout queue_inner_t */
+static void netq_start(uhyve_netif_t* nif, unsigned i, shared_queue_t* rx, shared_queue_t* tx, uint32_t size, uint32_t slot_size, bool datamatch)
+{
+	uhyve_netq_t* q = netq_init(nif, i, size, datamatch);
+
+	q->rx = rx;
+	q->tx = tx;
+	q->ext = slot_size > 0;
+	q->slot_bytes = q->ext ? SHAREDQUEUE_EXT_SLOT(slot_size) : sizeof(queue_inner_t);
+	q->frame_size = q->ext ? slot_size : UHYVE_NET_MTU;
+
+	q->stop_efd = eventfd(0, 0);
+	if (q->stop_efd < 0)
+		err(1, "unable to create eventfd");
+
+	if (create_helper_thread(&q->rx_thread, recieve_packets, q))
+		err(1, "unable to create thread");
+	if (create_helper_thread(&q->tx_thread, transfer_packets, q))
+		err(1, "unable to create thread");
+}
+
+/* Hands the virtqueues at rx_ring and tx_ring (guest-physical) over to vhost-net */
+static int netq_start_vhost(uhyve_netif_t* nif, unsigned i, uint64_t rx_ring, uint64_t tx_ring, uint32_t size, uint64_t features)
+{
+	uhyve_netq_t* q = netq_init(nif, i, size, true);
+
+	q->vhost = true;
+	q->vhost_fd = nif->vhost_fds[i];
+
+	return uhyve_vhost_net_start(q, rx_ring, tx_ring, features);
+}
+
+/* Stops a vhost-net queue pair and releases its eventfds */
+static void netq_release_vhost(uhyve_netif_t* nif, uhyve_netq_t* q)
+{
+	struct kvm_irqfd irqfd = {
+		.fd = q->irq_efd,
+		.gsi = netq_irq(nif, q->index),
+		.flags = KVM_IRQFD_FLAG_DEASSIGN,
+	};
+
+	uhyve_vhost_net_stop(q);
+
+	unregister_ioeventfd(UHYVE_PORT_NETWRITE, q->tx_efd, true, UHYVE_NET_KICK(nif->index, q->index));
+	unregister_ioeventfd(UHYVE_PORT_NETREAD, q->rx_space_efd, true, UHYVE_NET_KICK(nif->index, q->index));
+	datamatch_netqs--;
+	ioctl(vmfd, KVM_IRQFD, &irqfd);
+
+	close(q->irq_efd);
+	close(q->tx_efd);
+	close(q->rx_space_efd);
+	memset(q, 0x00, sizeof(*q));
+	q->vhost_fd = -1;
+}
+
+static inline uint64_t netq_stride(uint32_t size, uint32_t slot_bytes, bool virtqueue)
+{
+	if (virtqueue)
+		return (vring_size(size, UHYVE_VRING_ALIGN) + UHYVE_VRING_ALIGN - 1) & ~((uint64_t) UHYVE_VRING_ALIGN - 1);
+
+	return SHAREDQUEUE_BYTES(size, slot_bytes);
+}
+
+/* Starts a single queue pair of the first interface at SHAREDQUEUE_START (UHYVE_PORT_NETINFO) */
+int uhyve_net_start_legacy(void)
+{
+	uhyve_netif_t* nif = &netifs[0];
+
+	pthread_mutex_lock(&net_lock);
+
+	if (!num_netifs || nif->num_netqs) {
+		pthread_mutex_unlock(&net_lock);
+		return 0;
+	}
+
+	shared_queue_t* rx = (shared_queue_t*) (guest_mem+SHAREDQUEUE_START);
+	shared_queue_t* tx = (shared_queue_t*) (guest_mem+SHAREDQUEUE_START+SHAREDQUEUE_SIZE(UHYVE_QUEUE_SIZE));
+
+	// the guest services only one queue
+	for(unsigned i = 1; i < nif->tap_queues; i++)
+		tap_detach_queue(nif->tap_fds[i]);
+
+	tap_set_offload(nif, 0);
+	netq_start(nif, 0, rx, tx, UHYVE_QUEUE_SIZE, 0, false);
+	nif->num_netqs = 1;
+	efd = nif->netqs[0].irq_efd;
+
+	pthread_mutex_unlock(&net_lock);
+
+	return 0;
+}
+
+/* Features of UHYVE_PORT_NETCONFIG, which the interface is able to grant */
+static uint32_t netif_features(const uhyve_netif_t* nif)
+{
+	uint32_t features = 0;
+
+	if (nif->tap_vnet_hdr)
+		features |= UHYVE_NET_F_VNET_HDR | UHYVE_NET_F_CSUM | UHYVE_NET_F_TSO;
+	if (nif->use_vhost)
+		features |= UHYVE_NET_F_VIRTQUEUE;
+
+	return features;
+}
+
+/* Handles UHYVE_PORT_NETINFO, see uhyve_netinfo_t */
+void uhyve_net_info(void* arg)
+{
+	uhyve_netinfo_t* info = (uhyve_netinfo_t*) arg;
+
+	if (info->magic != UHYVE_NETINFO_MAGIC) {
+		// guest configure the ethernet device => start network thread
+		if (num_netifs)
+			memcpy(arg, netifs[0].mac, 6);
+		else
+			memset(arg, 0x00, 6);
+		uhyve_net_start_legacy();
+		return;
+	}
+
+	info->num_netifs = num_netifs;
+	memset(info->netif, 0x00, sizeof(info->netif));
+	for(unsigned i = 0; i < num_netifs; i++) {
+		memcpy(info->netif[i].mac, netifs[i].mac, 6);
+		info->netif[i].max_queues = netifs[i].tap_queues;
+		info->netif[i].features = netif_features(&netifs[i]);
+	}
+}
+
+/*
+ * Starts the queue pairs, which are requested by UHYVE_PORT_NETCONFIG.
+ * The interface is selected by UHYVE_NET_NETIF(config->features).
+ */
+int uhyve_net_start(uhyve_netconfig_t* config)
+{
+	uint64_t start = config->queue_start;
+	uint64_t area = config->queue_area_size;
+	uint32_t size = UHYVE_DEFAULT_QUEUE_SIZE;
+	uint32_t features = config->features & ~UHYVE_NET_NETIF_MASK;
+	uint32_t slot_size = 0, slot_bytes = sizeof(queue_inner_t);
+	uint64_t virtio_features = 0;
+	unsigned index = UHYVE_NET_NETIF(config->features);
+	unsigned queues;
+	bool virtqueue = false;
+	uhyve_netif_t* nif;
+
+	pthread_mutex_lock(&net_lock);
+
+	if (index >= num_netifs) {
+		config->num_queues = 0;
+		goto out;
+	}
+
+	nif = &netifs[index];
+	queues = nif->tap_queues;
+
+	if (nif->num_netqs) {
+		// already configured => only the area in use is reported
+		if ((nif->netconfig.queue_start != start) || (nif->netconfig.queue_area_size != area)) {
+			fprintf(stderr, "[ERROR] Network queues of interface %u are already configured at 0x%llx\n",
+				index, (unsigned long long) nif->netconfig.queue_start);
+			config->num_queues = 0;
+			goto out;
+		}
+		*config = nif->netconfig;
+		goto out;
+	}
+
+	const char* str = getenv("HERMIT_NETIF_QUEUE_SIZE");
+	if (str)
+		size = (uint32_t) atoi(str);
+	if (size < UHYVE_QUEUE_SIZE)
+		size = UHYVE_QUEUE_SIZE;
+	if (size > UHYVE_MAX_QUEUE_SIZE)
+		size = UHYVE_MAX_QUEUE_SIZE;
+
+	if (!nif->tap_vnet_hdr)
+		features = 0;
+	if (nif->use_vhost && (features & UHYVE_NET_F_VIRTQUEUE)) {
+		virtqueue = true;
+		virtio_features = (config->virtio_features & nif->vhost_features & VHOST_NET_GUEST_FEATURES)
+			| (1ULL << VIRTIO_F_VERSION_1);
+
+		// virtqueues consist of 2^n descriptors
+		while (size & (size - 1))
+			size &= size - 1;
+
+		if (start & (UHYVE_VRING_ALIGN - 1)) {
+			fprintf(stderr, "[ERROR] Virtqueues at 0x%llx are not page aligned\n",
+				(unsigned long long) start);
+			config->num_queues = 0;
+			goto out;
+		}
+
+		if ((features & UHYVE_NET_F_TSO) && !(features & UHYVE_NET_F_CSUM))
+			features &= ~UHYVE_NET_F_TSO;
+		features &= UHYVE_NET_F_VIRTQUEUE | UHYVE_NET_F_CSUM | UHYVE_NET_F_TSO;
+	} else if (features & UHYVE_NET_F_VNET_HDR) {
+		slot_size = config->slot_size ? config->slot_size : UHYVE_DEFAULT_SLOT_SIZE;
+		if (slot_size < UHYVE_MIN_SLOT_SIZE)
+			slot_size = UHYVE_MIN_SLOT_SIZE;
+		if (slot_size > UHYVE_MAX_SLOT_SIZE)
+			slot_size = UHYVE_MAX_SLOT_SIZE;
+		slot_bytes = SHAREDQUEUE_EXT_SLOT(slot_size);
+
+		// segments up to 64 KiB have to fit into one slot
+		if ((features & UHYVE_NET_F_TSO) && (!(features & UHYVE_NET_F_CSUM) || (slot_size < UHYVE_MAX_SLOT_SIZE)))
+			features &= ~UHYVE_NET_F_TSO;
+		features &= UHYVE_NET_F_VNET_HDR | UHYVE_NET_F_CSUM | UHYVE_NET_F_TSO;
+	} else {
+		features = 0;
+	}
+
+	if ((start >= guest_size) || (area > guest_size - start)) {
+		fprintf(stderr, "[ERROR] Invalid network queue area 0x%llx - 0x%llx\n",
+			(unsigned long long) start, (unsigned long long) (start + area));
+		config->num_queues = 0;
+		goto out;
+	}
+
+	// shrink the queues until they fit into the reserved area
+	while ((uint64_t) queues * 2 * netq_stride(size, slot_bytes, virtqueue) > area) {
+		if (size > UHYVE_QUEUE_SIZE)
+			size /= 2;
+		else if (queues > 1)
+			queues--;
+		else
+			break;
+	}
+
+	if ((uint64_t) queues * 2 * netq_stride(size, slot_bytes, virtqueue) > area) {
+		fprintf(stderr, "[ERROR] Network queue area of %llu bytes is too small\n",
+			(unsigned long long) area);
+		config->num_queues = 0;
+		goto out;
+	}
+
+	tap_set_offload(nif, features);
+
+	memcpy(config->mac, nif->mac, 6);
+	config->num_queues = queues;
+	config->queue_size = size;
+	config->queue_stride = netq_stride(size, slot_bytes, virtqueue);
+	config->features = features | (index << UHYVE_NET_NETIF_SHIFT);
+	config->slot_size = slot_size ? slot_size : sizeof(((queue_inner_t*) 0)->data);
+	config->virtio_features = virtio_features;
+	memset(config->irq, 0x00, sizeof(config->irq));
+
+	for(unsigned i = 0; i < queues; i++) {
+		uint64_t rx_start = start + 2 * i * config->queue_stride;
+		uint64_t tx_start = rx_start + config->queue_stride;
+
+		config->irq[i] = netq_irq(nif, i);
+		nif->num_netqs = i + 1;
+
+		if (virtqueue) {
+			memset(guest_mem + rx_start, 0x00, 2 * config->queue_stride);
+			if (netq_start_vhost(nif, i, rx_start, tx_start, size, virtio_features) < 0) {
+				// a later request starts from scratch
+				for(unsigned j = 0; j <= i; j++)
+					netq_release_vhost(nif, &nif->netqs[j]);
+				nif->num_netqs = 0;
+				config->num_queues = 0;
+				goto out;
+			}
+		} else {
+			shared_queue_t* rx = (shared_queue_t*) (guest_mem + rx_start);
+			shared_queue_t* tx = (shared_queue_t*) (guest_mem + tx_start);
+
+			memset(rx, 0x00, offsetof(shared_queue_t, inner));
+			memset(tx, 0x00, offsetof(shared_queue_t, inner));
+			netq_start(nif, i, rx, tx, size, slot_size, true);
+		}
+	}
+
+	for(unsigned i = queues; i < nif->tap_queues; i++)
+		tap_detach_queue(nif->tap_fds[i]);
+
+	if (index == 0)
+		efd = nif->netqs[0].irq_efd;
+	nif->netconfig = *config;
+
+out:
+	pthread_mutex_unlock(&net_lock);
+
+	return config->num_queues ? 0 : -1;
+}
+
+/* Fallback, if the kick is not handled by an ioeventfd; value is UHYVE_NET_KICK() */
+void uhyve_net_kick(uint64_t port, unsigned value)
+{
+	uint64_t event_counter = 1;
+	unsigned index = value >> UHYVE_NET_KICK_SHIFT;
+	unsigned queue = value & ((1U << UHYVE_NET_KICK_SHIFT) - 1);
+	uhyve_netif_t* nif;
+	int fd;
+
+	// legacy guests write arbitrary values
+	if ((index >= num_netifs) || !netifs[index].num_netqs)
+		index = 0;
+
+	nif = &netifs[index];
+	if (!nif->num_netqs)
+		return;
+
+	if (queue >= nif->num_netqs)
+		queue = 0;
+
+	fd = (port == UHYVE_PORT_NETWRITE) ? nif->netqs[queue].tx_efd : nif->netqs[queue].rx_space_efd;
+	if (write(fd, &event_counter, sizeof(event_counter)) < 0)
+		fprintf(stderr, "[WARNING] Unable to signal eventfd - %d (%s)\n", errno, strerror(errno));
+}
+
+void uhyve_net_stop(void)
+{
+	for(unsigned n = 0; n < num_netifs; n++) {
+		uhyve_netif_t* nif = &netifs[n];
+
+		for(unsigned i = 0; i < nif->num_netqs; i++) {
+			if (nif->netqs[i].vhost) {
+				uhyve_vhost_net_stop(&nif->netqs[i]);
+				continue;
+			}
+
+			uhyve_netq_t* q = &nif->netqs[i];
+			uint64_t event_counter = 1;
+
+			// the threads block all signals and watch stop_efd instead
+			q->stop = true;
+			if (write(q->stop_efd, &event_counter, sizeof(event_counter)) < 0)
+				fprintf(stderr, "[WARNING] Unable to signal eventfd - %d (%s)\n", errno, strerror(errno));
+			pthread_join(q->rx_thread, NULL);
+			pthread_join(q->tx_thread, NULL);
+			close(q->stop_efd);
+		}
+	}
+}
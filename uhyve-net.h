@@ -2,6 +2,9 @@
 #define __UHYVE_NET_H__
 
 #include <linux/kvm.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,6 +20,7 @@
 #include <sys/socket.h>
 #include <linux/if.h>
 #include <linux/if_tun.h>
+#include <linux/virtio_net.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
 #include <err.h>
@@ -25,6 +29,38 @@
 #define UHYVE_NET_MTU           1500
 #define UHYVE_QUEUE_SIZE        8
 
+/* interfaces of HERMIT_NETIF, see uhyve_netinfo_t */
+#define UHYVE_MAX_NETIFS		4
+
+/* limits of the queues configured by UHYVE_PORT_NETCONFIG */
+#define UHYVE_MAX_NET_QUEUES		8
+#define UHYVE_DEFAULT_QUEUE_SIZE	256
+#define UHYVE_MAX_QUEUE_SIZE		4096
+/* payload bytes per slot, if the slots carry a vnet header */
+#define UHYVE_MIN_SLOT_SIZE		(UHYVE_NET_MTU+34)
+#define UHYVE_DEFAULT_SLOT_SIZE		2048
+#define UHYVE_MAX_SLOT_SIZE		65536
+
+/* features of UHYVE_PORT_NETCONFIG */
+#define UHYVE_NET_F_VNET_HDR		(1 << 0)	// slots are queue_inner_ext_t
+#define UHYVE_NET_F_CSUM		(1 << 1)	// guest accepts frames with partial checksums
+#define UHYVE_NET_F_TSO			(1 << 2)	// guest accepts TCP segments up to 64 KiB
+#define UHYVE_NET_F_VIRTQUEUE		(1 << 3)	// split virtqueues serviced by vhost-net
+/* bits 24-31 of the features select the interface of UHYVE_PORT_NETCONFIG */
+#define UHYVE_NET_NETIF_SHIFT		24
+#define UHYVE_NET_NETIF_MASK		(0xffU << UHYVE_NET_NETIF_SHIFT)
+#define UHYVE_NET_NETIF(features)	(((features) & UHYVE_NET_NETIF_MASK) >> UHYVE_NET_NETIF_SHIFT)
+
+/* value, which kicks a queue pair by UHYVE_PORT_NETWRITE or UHYVE_PORT_NETREAD */
+#define UHYVE_NET_KICK_SHIFT		8
+#define UHYVE_NET_KICK(netif, queue)	(((netif) << UHYVE_NET_KICK_SHIFT) | (queue))
+
+/* marks a uhyve_netinfo_t, see UHYVE_PORT_NETINFO */
+#define UHYVE_NETINFO_MAGIC		0x4e455449	// "NETI"
+
+/* alignment of the used ring and of each virtqueue */
+#define UHYVE_VRING_ALIGN		4096
+
 #define SHAREDQUEUE_FLOOR(x)	((x) & !0x3f)
 #define SHAREDQUEUE_CEIL(x)		(((x) + 0x3f) & ~0x3f)
 
@@ -47,14 +83,140 @@ typedef struct queue_inner {
 	uint8_t data[UHYVE_NET_MTU+34];
 } queue_inner_t;
 
+/*
+ * Slot layout with UHYVE_NET_F_VNET_HDR. The header and the frame are
+ * contiguous, so that uhyve passes both with a single system call to the
+ * TAP device. "len" does not include the header.
+ */
+typedef struct queue_inner_ext {
+	uint32_t len;
+	struct virtio_net_hdr_v1 hdr;
+	uint8_t data[];
+} __attribute__((packed)) queue_inner_ext_t;
+
+/*
+ * If the RX queue is full, uhyve sets "waiting" and sleeps until the guest
+ * has consumed a packet and kicks UHYVE_PORT_NETREAD. The guest only has to
+ * kick if "waiting" is set.
+ */
 typedef struct shared_queue {
 	atomic_uint64_t read;
 	atomic_uint64_t written;
-	uint8_t reserved[64-8];
-	queue_inner_t inner[UHYVE_QUEUE_SIZE];
+	volatile uint32_t waiting;
+	uint8_t reserved[64-8-4];
+	queue_inner_t inner[];
 } shared_queue_t;
 
+/* size of a queue with the given number of slots */
+#define SHAREDQUEUE_BYTES(slots, slot_bytes)	SHAREDQUEUE_CEIL(offsetof(shared_queue_t, inner) + (slots) * (slot_bytes))
+#define SHAREDQUEUE_SIZE(slots)	SHAREDQUEUE_BYTES(slots, sizeof(queue_inner_t))
+/* bytes of a queue_inner_ext_t with the given payload size */
+#define SHAREDQUEUE_EXT_SLOT(slot_size)	SHAREDQUEUE_CEIL(offsetof(queue_inner_ext_t, data) + (slot_size))
+
+/*
+ * Argument of UHYVE_PORT_NETINFO, which enumerates the interfaces
+ *
+ * Legacy guests pass a buffer for the MAC address of the first interface
+ * and get its queues at SHAREDQUEUE_START. A guest, which sets magic to
+ * UHYVE_NETINFO_MAGIC, gets the list of interfaces instead and configures
+ * each of them by UHYVE_PORT_NETCONFIG.
+ */
+typedef struct {
+	uint8_t mac[6];
+	uint16_t max_queues;	// queue pairs of the TAP device
+	uint32_t features;	// UHYVE_NET_F_*, which the interface is able to grant
+} __attribute__((packed)) uhyve_netif_info_t;
+
+typedef struct {
+	/* in */
+	uint32_t magic;
+	/* out */
+	uint32_t num_netifs;
+	uhyve_netif_info_t netif[UHYVE_MAX_NETIFS];
+} __attribute__((packed)) uhyve_netinfo_t;
+
+/*
+ * Argument of UHYVE_PORT_NETCONFIG
+ *
+ * Guests, which use UHYVE_PORT_NETINFO, get a single pair of queues with
+ * UHYVE_QUEUE_SIZE slots at SHAREDQUEUE_START. With UHYVE_PORT_NETCONFIG
+ * the guest reserves an area for the queues and uhyve fills in the layout:
+ * the RX queue of pair i starts at queue_start + 2 * i * queue_stride, the
+ * TX queue directly follows it. Pair i raises irq[i] and is kicked by
+ * writing UHYVE_NET_KICK(netif, i) to UHYVE_PORT_NETWRITE (TX) or
+ * UHYVE_PORT_NETREAD (RX space).
+ *
+ * UHYVE_NET_NETIF(features) selects the interface, which is configured,
+ * the granted features keep the selection. Each interface has its own
+ * area. The queues of the first interface raise UHYVE_IRQ_NET and
+ * UHYVE_IRQ_NET_QUEUE_BASE+i-1, the queues of further interfaces get the
+ * following GSIs up to UHYVE_IRQ_NET_QUEUE_END. No line is shared, hence
+ * the number of queues is limited by the free lines.
+ *
+ * With UHYVE_NET_F_VNET_HDR, each slot is a queue_inner_ext_t of
+ * SHAREDQUEUE_EXT_SLOT(slot_size) bytes and carries a virtio-net header.
+ * The guest may then always hand over frames with partial checksums and
+ * GSO requests. UHYVE_NET_F_CSUM and UHYVE_NET_F_TSO enable the same for
+ * received frames. TSO is only granted with slots of UHYVE_MAX_SLOT_SIZE.
+ *
+ * If the interface is given as HERMIT_NETIF=<tap>,vhost, the guest may ask
+ * for UHYVE_NET_F_VIRTQUEUE instead. Each queue is then a split virtqueue
+ * (struct vring with UHYVE_VRING_ALIGN) of queue_size descriptors, every
+ * frame starts with a struct virtio_net_hdr_v1 and virtio_features holds
+ * the negotiated VIRTIO_F_* / VIRTIO_NET_F_* bits. queue_start has to be
+ * page aligned in this case.
+ */
+typedef struct {
+	/* in: guest-physical area, which is reserved for the queues */
+	uint64_t queue_start;
+	uint64_t queue_area_size;
+	/* in/out: requested and granted features */
+	uint32_t features;
+	/* in/out: payload bytes per slot (UHYVE_NET_F_VNET_HDR only) */
+	uint32_t slot_size;
+	/* in/out: virtio features (UHYVE_NET_F_VIRTQUEUE only) */
+	uint64_t virtio_features;
+	/* out */
+	uint8_t mac[6];
+	uint16_t num_queues;
+	uint32_t queue_size;	// slots per queue
+	uint32_t queue_stride;	// in bytes
+	uint8_t irq[UHYVE_MAX_NET_QUEUES];
+} __attribute__((packed)) uhyve_netconfig_t;
+
+/* host side of a queue pair */
+typedef struct {
+	unsigned netif;
+	unsigned index;
+	shared_queue_t* rx;
+	shared_queue_t* tx;
+	uint32_t size;		// slots per queue
+	uint32_t slot_bytes;	// distance between two slots
+	uint32_t frame_size;	// maximum frame length
+	bool ext;		// slots are queue_inner_ext_t
+	int fd;			// TAP queue
+	bool vnet_hdr;		// frames on fd are prefixed by a struct virtio_net_hdr_v1
+	int irq_efd;		// irqfd of this pair
+	int tx_efd;		// kicked by UHYVE_PORT_NETWRITE
+	int rx_space_efd;	// kicked by UHYVE_PORT_NETREAD
+	int stop_efd;		// wakes up the threads of the pair
+	volatile bool stop;	// set by uhyve_net_stop()
+	int vhost_fd;		// /dev/vhost-net, if the queues are virtqueues
+	bool vhost;
+	pthread_t rx_thread;
+	pthread_t tx_thread;
+} uhyve_netq_t;
+
 int uhyve_net_init(const char *hermit_netif);
-char* uhyve_get_mac(void);
+void uhyve_net_info(void* info);
+int uhyve_net_start_legacy(void);
+int uhyve_net_start(uhyve_netconfig_t* config);
+void uhyve_net_kick(uint64_t port, unsigned queue);
+void uhyve_net_stop(void);
+
+/* in-kernel data path, see uhyve-vhost-net.c */
+int uhyve_vhost_net_open(uint64_t* features);
+int uhyve_vhost_net_start(uhyve_netq_t* q, uint64_t rx_ring, uint64_t tx_ring, uint64_t features);
+void uhyve_vhost_net_stop(uhyve_netq_t* q);
 
 #endif
@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2018, RWTH Aachen University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Each vCPU thread updates its own counters without locks. The time
+ * between two KVM_RUN calls is accounted to the exit reason and, for I/O
+ * and MMIO exits, to the port. The export reads the counters while the
+ * guest runs, hence a dump is a consistent snapshot of each counter, but
+ * not of all counters together.
+ *
+ * Histograms use log2 buckets: bucket i counts the values in
+ * [2^i, 2^(i+1)), bucket 0 includes 0. Trailing empty buckets are omitted.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/kvm.h>
+
+#include "uhyve-common.h"
+#include "uhyve.h"
+#include "uhyve-net.h"
+#include "uhyve-stats.h"
+
+#define STATS_DEFAULT_INTERVAL	1
+#define MAX_FNAME		256
+
+typedef struct stats_netq {
+	stats_hist_t rx;	// fill level after a batch of received frames
+	stats_hist_t tx;	// pending frames at a kick of the sender
+	uint64_t rx_frames;
+	uint64_t tx_frames;
+} stats_netq_t;
+
+typedef struct stats_phase_entry {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t last_ns;
+} stats_phase_entry_t;
+
+static const char* exit_names[STATS_MAX_EXITS] = {
+	[KVM_EXIT_UNKNOWN] = "UNKNOWN",
+	[KVM_EXIT_EXCEPTION] = "EXCEPTION",
+	[KVM_EXIT_IO] = "IO",
+	[KVM_EXIT_HYPERCALL] = "HYPERCALL",
+	[KVM_EXIT_DEBUG] = "DEBUG",
+	[KVM_EXIT_HLT] = "HLT",
+	[KVM_EXIT_MMIO] = "MMIO",
+	[KVM_EXIT_IRQ_WINDOW_OPEN] = "IRQ_WINDOW_OPEN",
+	[KVM_EXIT_SHUTDOWN] = "SHUTDOWN",
+	[KVM_EXIT_FAIL_ENTRY] = "FAIL_ENTRY",
+	[KVM_EXIT_INTR] = "INTR",
+	[KVM_EXIT_NMI] = "NMI",
+	[KVM_EXIT_INTERNAL_ERROR] = "INTERNAL_ERROR",
+	[KVM_EXIT_SYSTEM_EVENT] = "SYSTEM_EVENT",
+#ifdef KVM_EXIT_DIRTY_RING_FULL
+	[KVM_EXIT_DIRTY_RING_FULL] = "DIRTY_RING_FULL",
+#endif
+	[STATS_EXIT_INTR] = "SIGNAL",
+};
+
+static const struct {
+	uint64_t port;
+	const char* name;
+} port_names[] = {
+	{UHYVE_PORT_WRITE, "WRITE"},
+	{UHYVE_PORT_OPEN, "OPEN"},
+	{UHYVE_PORT_CLOSE, "CLOSE"},
+	{UHYVE_PORT_READ, "READ"},
+	{UHYVE_PORT_EXIT, "EXIT"},
+	{UHYVE_PORT_LSEEK, "LSEEK"},
+	{UHYVE_PORT_NETINFO, "NETINFO"},
+	{UHYVE_PORT_NETWRITE, "NETWRITE"},
+	{UHYVE_PORT_NETREAD, "NETREAD"},
+	{UHYVE_PORT_NETSTAT, "NETSTAT"},
+	{UHYVE_PORT_FREELIST, "FREELIST"},
+	{UHYVE_PORT_CMDSIZE, "CMDSIZE"},
+	{UHYVE_PORT_CMDVAL, "CMDVAL"},
+	{UHYVE_UART_PORT, "UART"},
+	{UHYVE_PORT_UNLINK, "UNLINK"},
+	{UHYVE_PORT_HCALL_DOORBELL, "HCALL_DOORBELL"},
+	{UHYVE_PORT_PREAD, "PREAD"},
+	{UHYVE_PORT_PWRITE, "PWRITE"},
+	{UHYVE_PORT_READV, "READV"},
+	{UHYVE_PORT_WRITEV, "WRITEV"},
+	{UHYVE_PORT_NETCONFIG, "NETCONFIG"},
+	{UHYVE_PORT_SNAPSHOT, "SNAPSHOT"},
+};
+
+static const char* phase_names[STATS_PHASES] = {
+	"checkpoint", "checkpoint_stop", "restore", "precopy_round",
+	"precopy", "stop_and_copy", "snapshot"
+};
+
+__thread stats_vcpu_t* stats_vcpu = NULL;
+
+static bool enabled = false;
+static uint32_t stats_ncpus = 0;
+static stats_vcpu_t* vcpus = NULL;
+static stats_netq_t netqs[UHYVE_MAX_NETIFS][UHYVE_MAX_NET_QUEUES];
+static stats_phase_entry_t phases[STATS_PHASES];
+static pthread_mutex_t phase_lock = PTHREAD_MUTEX_INITIALIZER;
+static const char* stats_path = NULL;
+static bool stats_socket = false;
+static unsigned stats_interval = STATS_DEFAULT_INTERVAL;
+static uint64_t stats_start = 0;
+
+void stats_hist_add(stats_hist_t* hist, uint64_t value)
+{
+	unsigned bucket = value ? 63 - __builtin_clzll(value) : 0;
+
+	if (bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+
+	hist->count++;
+	hist->sum += value;
+	hist->buckets[bucket]++;
+}
+
+void stats_vcpu_enter(stats_vcpu_t* s)
+{
+	uint64_t now = stats_now();
+
+	// the first call starts the accounting
+	if (s->last) {
+		uint64_t ns = now - s->last;
+
+		stats_hist_add(&s->exits[s->reason], ns);
+		if (s->port)
+			stats_hist_add(&s->ports[s->port - 1], ns);
+	}
+	s->last = now;
+}
+
+/* Each direction of a queue pair is served by a single thread */
+void stats_net(unsigned netif, unsigned queue, bool tx, uint32_t frames, uint32_t fill)
+{
+	if (!enabled || (netif >= UHYVE_MAX_NETIFS) || (queue >= UHYVE_MAX_NET_QUEUES))
+		return;
+
+	stats_netq_t* n = &netqs[netif][queue];
+	if (tx) {
+		n->tx_frames += frames;
+		stats_hist_add(&n->tx, fill);
+	} else {
+		n->rx_frames += frames;
+		stats_hist_add(&n->rx, fill);
+	}
+}
+
+void stats_phase(stats_phase_t phase, uint64_t ns)
+{
+	if (!enabled || (phase >= STATS_PHASES))
+		return;
+
+	pthread_mutex_lock(&phase_lock);
+	phases[phase].count++;
+	phases[phase].total_ns += ns;
+	phases[phase].last_ns = ns;
+	if (ns > phases[phase].max_ns)
+		phases[phase].max_ns = ns;
+	pthread_mutex_unlock(&phase_lock);
+}
+
+static void dump_hist(FILE* f, const char* name, const stats_hist_t* hist, const char* unit)
+{
+	int last = STATS_BUCKETS - 1;
+
+	while ((last > 0) && !hist->buckets[last])
+		last--;
+
+	fprintf(f, "\"%s\":{\"count\":%lu,\"sum_%s\":%lu,\"hist\":[", name, hist->count, unit, hist->sum);
+	for(int i = 0; i <= last; i++)
+		fprintf(f, "%s%lu", i ? "," : "", hist->buckets[i]);
+	fprintf(f, "]}");
+}
+
+static void dump_port_name(char* buf, size_t len, unsigned slot)
+{
+	if (slot == STATS_MAX_PORTS - 1) {
+		snprintf(buf, len, "other");
+		return;
+	}
+
+	for(size_t i = 0; i < sizeof(port_names) / sizeof(port_names[0]); i++) {
+		if ((port_names[i].port >> 6) == slot) {
+			snprintf(buf, len, "%s", port_names[i].name);
+			return;
+		}
+	}
+
+	snprintf(buf, len, "0x%x", slot << 6);
+}
+
+static void dump_stats(FILE* f)
+{
+	char name[32];
+	bool first;
+
+	fprintf(f, "{\"uptime_ns\":%lu,\"vcpus\":[", stats_now() - stats_start);
+	for(uint32_t c = 0; c < stats_ncpus; c++) {
+		const stats_vcpu_t* s = &vcpus[c];
+
+		fprintf(f, "%s{\"id\":%u,\"run_ns\":%lu,\"exits\":{", c ? "," : "", c, s->run_ns);
+		first = true;
+		for(unsigned i = 0; i < STATS_MAX_EXITS; i++) {
+			if (!s->exits[i].count)
+				continue;
+			if (exit_names[i])
+				snprintf(name, sizeof(name), "%s", exit_names[i]);
+			else
+				snprintf(name, sizeof(name), "exit_%u", i);
+			fprintf(f, "%s", first ? "" : ",");
+			dump_hist(f, name, &s->exits[i], "ns");
+			first = false;
+		}
+
+		fprintf(f, "},\"ports\":{");
+		first = true;
+		for(unsigned i = 0; i < STATS_MAX_PORTS; i++) {
+			if (!s->ports[i].count)
+				continue;
+			dump_port_name(name, sizeof(name), i);
+			fprintf(f, "%s", first ? "" : ",");
+			dump_hist(f, name, &s->ports[i], "ns");
+			first = false;
+		}
+		fprintf(f, "}}");
+	}
+
+	fprintf(f, "],\"net\":[");
+	first = true;
+	for(unsigned i = 0; i < UHYVE_MAX_NETIFS * UHYVE_MAX_NET_QUEUES; i++) {
+		unsigned netif = i / UHYVE_MAX_NET_QUEUES, q = i % UHYVE_MAX_NET_QUEUES;
+		const stats_netq_t* n = &netqs[netif][q];
+
+		if (!n->rx.count && !n->tx.count)
+			continue;
+		fprintf(f, "%s{\"netif\":%u,\"queue\":%u,\"rx_frames\":%lu,\"tx_frames\":%lu,", first ? "" : ",", netif, q, n->rx_frames, n->tx_frames);
+		dump_hist(f, "rx_fill", &n->rx, "slots");
+		fprintf(f, ",");
+		dump_hist(f, "tx_fill", &n->tx, "slots");
+		fprintf(f, "}");
+		first = false;
+	}
+
+	fprintf(f, "],\"phases\":{");
+	first = true;
+	pthread_mutex_lock(&phase_lock);
+	for(unsigned p = 0; p < STATS_PHASES; p++) {
+		if (!phases[p].count)
+			continue;
+		fprintf(f, "%s\"%s\":{\"count\":%lu,\"total_ns\":%lu,\"max_ns\":%lu,\"last_ns\":%lu}",
+			first ? "" : ",", phase_names[p], phases[p].count,
+			phases[p].total_ns, phases[p].max_ns, phases[p].last_ns);
+		first = false;
+	}
+	pthread_mutex_unlock(&phase_lock);
+	fprintf(f, "}}\n");
+}
+
+/* Replaces the dump file, a reader sees either the old or the new one */
+static void dump_file(void)
+{
+	char tname[MAX_FNAME];
+
+	snprintf(tname, sizeof(tname), "%s.tmp", stats_path);
+	FILE* f = fopen(tname, "w");
+	if (!f) {
+		fprintf(stderr, "[WARNING] Unable to write statistics to %s - %d (%s)\n", tname, errno, strerror(errno));
+		return;
+	}
+
+	dump_stats(f);
+	fclose(f);
+
+	if (rename(tname, stats_path) < 0)
+		fprintf(stderr, "[WARNING] Unable to replace %s - %d (%s)\n", stats_path, errno, strerror(errno));
+}
+
+static void* stats_thread(void* arg)
+{
+	if (!stats_socket) {
+		while (1) {
+			sleep(stats_interval);
+			dump_file();
+		}
+	}
+
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		err(1, "Unable to create the statistics socket");
+
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", stats_path);
+	unlink(stats_path);
+	if ((bind(sock, (struct sockaddr*) &addr, sizeof(addr)) < 0) || (listen(sock, 4) < 0))
+		err(1, "Unable to listen on %s", stats_path);
+
+	while (1) {
+		int client = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+		if (client < 0)
+			continue;
+
+		FILE* f = fdopen(client, "w");
+		if (!f) {
+			close(client);
+			continue;
+		}
+		dump_stats(f);
+		fclose(f);
+	}
+
+	return NULL;
+}
+
+static void stats_atexit(void)
+{
+	if (!stats_socket)
+		dump_file();
+	else
+		unlink(stats_path);
+}
+
+void stats_init(uint32_t ncpus)
+{
+	const char* str = getenv("HERMIT_STATS");
+	if (!str || !strlen(str) || (strcmp(str, "0") == 0))
+		return;
+
+	if (strncmp(str, "unix:", 5) == 0) {
+		stats_socket = true;
+		stats_path = str + 5;
+	} else {
+		stats_path = str;
+	}
+
+	const char* interval = getenv("HERMIT_STATS_INTERVAL");
+	if (interval && (atoi(interval) > 0))
+		stats_interval = (unsigned) atoi(interval);
+
+	vcpus = (stats_vcpu_t*) aligned_alloc(64, ncpus * sizeof(stats_vcpu_t));
+	if (!vcpus)
+		err(1, "Not enough memory");
+	memset(vcpus, 0x00, ncpus * sizeof(stats_vcpu_t));
+	stats_ncpus = ncpus;
+	stats_start = stats_now();
+	enabled = true;
+
+	pthread_t thread;
+	if (create_helper_thread(&thread, stats_thread, NULL)) {
+		fprintf(stderr, "[WARNING] Unable to create statistics thread\n");
+	} else {
+		pthread_detach(thread);
+		atexit(stats_atexit);
+	}
+}
+
+bool stats_enabled(void)
+{
+	return enabled;
+}
+
+void stats_init_vcpu(uint32_t cpuid)
+{
+	if (enabled && (cpuid < stats_ncpus))
+		stats_vcpu = &vcpus[cpuid];
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright (c) 2018, RWTH Aachen University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file tools/uhyve-stats.h
+ * @brief Counters and latency histograms of the VM exits
+ */
+
+#ifndef __UHYVE_STATS_H__
+#define __UHYVE_STATS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/* exit reasons and ports, which are counted separately */
+#define STATS_MAX_EXITS		64
+#define STATS_MAX_PORTS		64
+/* log2 buckets of the latency and occupancy histograms */
+#define STATS_BUCKETS		32
+/* KVM_RUN was interrupted by a signal */
+#define STATS_EXIT_INTR		(STATS_MAX_EXITS - 1)
+
+typedef enum {
+	STATS_PHASE_CHECKPOINT = 0,	// timer_handler()
+	STATS_PHASE_CHECKPOINT_STOP,	// vCPUs are stopped for a checkpoint
+	STATS_PHASE_RESTORE,		// load_checkpoint()
+	STATS_PHASE_PRECOPY_ROUND,	// a round of the pre-copy phase
+	STATS_PHASE_PRECOPY,		// the whole pre-copy phase
+	STATS_PHASE_STOP_AND_COPY,	// vCPUs are stopped for the migration
+	STATS_PHASE_SNAPSHOT,		// create_snapshot()
+	STATS_PHASES
+} stats_phase_t;
+
+typedef struct stats_hist {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t buckets[STATS_BUCKETS];
+} stats_hist_t;
+
+typedef struct stats_vcpu {
+	uint64_t run_ns;		// time in the guest
+	uint64_t last;			// start of the current interval
+	uint32_t reason;		// exit reason, which is handled
+	uint32_t port;			// port slot plus one or 0
+	stats_hist_t exits[STATS_MAX_EXITS];
+	stats_hist_t ports[STATS_MAX_PORTS];
+} __attribute__ ((aligned (64))) stats_vcpu_t;
+
+extern __thread stats_vcpu_t* stats_vcpu;
+
+/**
+ * \brief Reads HERMIT_STATS and starts the export
+ *
+ * \param ncpus number of vCPUs
+ *
+ * With HERMIT_STATS=<file>, the counters are written as JSON every
+ * HERMIT_STATS_INTERVAL seconds (default 1) and at exit. With
+ * HERMIT_STATS=unix:<path>, each client of the UNIX socket receives the
+ * current counters. Without HERMIT_STATS, nothing is counted.
+ */
+void stats_init(uint32_t ncpus);
+
+/**
+ * \brief Returns true if the counters are collected
+ */
+bool stats_enabled(void);
+
+/**
+ * \brief Enables the counters of the calling vCPU thread
+ */
+void stats_init_vcpu(uint32_t cpuid);
+
+/**
+ * \brief Returns the monotonic time in ns
+ */
+static inline uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_hist_add(stats_hist_t* hist, uint64_t value);
+void stats_vcpu_enter(stats_vcpu_t* s);
+
+/**
+ * \brief Called before KVM_RUN, ends the handling of the last exit
+ */
+static inline void stats_vcpu_run(void)
+{
+	if (__builtin_expect(stats_vcpu != NULL, 0))
+		stats_vcpu_enter(stats_vcpu);
+}
+
+/**
+ * \brief Called after KVM_RUN with the exit reason or STATS_EXIT_INTR
+ */
+static inline void stats_vcpu_exit(uint32_t reason)
+{
+	stats_vcpu_t* s = stats_vcpu;
+
+	if (__builtin_expect(s != NULL, 0)) {
+		uint64_t now = stats_now();
+
+		s->run_ns += now - s->last;
+		s->last = now;
+		s->reason = reason < STATS_MAX_EXITS ? reason : STATS_EXIT_INTR;
+		s->port = 0;
+	}
+}
+
+/**
+ * \brief Assigns the handling time of the current exit to a port
+ */
+static inline void stats_vcpu_port(uint64_t port)
+{
+	stats_vcpu_t* s = stats_vcpu;
+
+	if (__builtin_expect(s != NULL, 0))
+		s->port = ((port >> 6) < STATS_MAX_PORTS - 1 ? (port >> 6) : STATS_MAX_PORTS - 1) + 1;
+}
+
+/**
+ * \brief Records the fill level of a network queue
+ *
+ * \param netif index of the interface
+ * \param queue index of the queue pair
+ * \param tx true for the transmit queue
+ * \param frames frames, which are moved at once
+ * \param fill occupied slots of the queue
+ */
+void stats_net(unsigned netif, unsigned queue, bool tx, uint32_t frames, uint32_t fill);
+
+/**
+ * \brief Records the duration of a checkpoint or migration phase
+ */
+void stats_phase(stats_phase_t phase, uint64_t ns);
+
+#endif
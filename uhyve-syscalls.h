@@ -20,6 +20,7 @@
 
 #include <unistd.h>
 #include <stddef.h>
+#include <stdint.h>
 
 typedef struct {
 	int fd;
@@ -57,10 +58,117 @@ typedef struct {
 	int whence;
 } __attribute__((packed)) uhyve_lseek_t;
 
+typedef struct {
+	int fd;
+	char* buf;
+	size_t len;
+	off_t offset;
+	ssize_t ret;
+} __attribute__((packed)) uhyve_pread_t;
+
+typedef struct {
+	int fd;
+	const char* buf;
+	size_t len;
+	off_t offset;
+	ssize_t ret;
+} __attribute__((packed)) uhyve_pwrite_t;
+
+/* guest layout of struct iovec */
+typedef struct {
+	void* iov_base;
+	size_t iov_len;
+} __attribute__((packed)) uhyve_iovec_t;
+
+/* an offset of -1 uses (and updates) the current file position */
+typedef struct {
+	int fd;
+	const uhyve_iovec_t* iov;
+	int iovcnt;
+	off_t offset;
+	ssize_t ret;
+} __attribute__((packed)) uhyve_readv_t;
+
+typedef struct {
+	int fd;
+	const uhyve_iovec_t* iov;
+	int iovcnt;
+	off_t offset;
+	ssize_t ret;
+} __attribute__((packed)) uhyve_writev_t;
+
 typedef struct {
 	uint64_t rip;
 	uint64_t addr;
 	int success;
 } __attribute__ ((packed)) uhyve_pfault_t;
 
+/*
+ * Free page reporting
+ *
+ * The guest negotiates the reporting by UHYVE_FREE_PAGES_NEGOTIATE first.
+ * If uhyve is started with HERMIT_FREE_PAGE_REPORTING=<interval>, it sets
+ * enabled and returns the interval (in s), at which the guest should
+ * report. Afterwards, the guest passes its free ranges by
+ * UHYVE_FREE_PAGES_REPORT. The content of a reported range is lost, it
+ * reads as zero until the guest writes to it again. Without a successful
+ * negotiation, reports are ignored.
+ */
+#define UHYVE_FREE_PAGES_NEGOTIATE	1
+#define UHYVE_FREE_PAGES_REPORT		2
+
+typedef struct {
+	uint64_t start;		// guest-physical
+	uint64_t size;
+} __attribute__((packed)) uhyve_free_range_t;
+
+typedef struct {
+	/* in */
+	uint32_t cmd;		// UHYVE_FREE_PAGES_*
+	uint32_t count;		// number of ranges
+	uint64_t ranges;	// guest-physical address of an uhyve_free_range_t array
+	/* out */
+	uint32_t enabled;
+	uint32_t interval;
+	uint64_t freed;		// bytes, which are returned to the host
+} __attribute__((packed)) uhyve_free_pages_t;
+
+/*
+ * Batched hypercalls
+ *
+ * Instead of one PIO exit per system call, the guest may place requests
+ * into a submission ring at HCALLQUEUE_START (guest-physical) and ring the
+ * doorbell (UHYVE_PORT_HCALL_DOORBELL). uhyve drains all pending entries
+ * and posts one completion per request into the completion ring. The
+ * argument structs are the same as for the single-exit ports and are
+ * updated in place, too.
+ *
+ * The guest owns sq_tail and cq_head, uhyve owns sq_head and cq_tail. The
+ * guest must never have more than UHYVE_HCALL_QUEUE_SIZE requests in
+ * flight, i.e. sq_tail - cq_head <= UHYVE_HCALL_QUEUE_SIZE.
+ */
+#define HCALLQUEUE_START	0x70000
+#define UHYVE_HCALL_QUEUE_SIZE	64
+
+typedef struct {
+	uint64_t user_data;	// returned unmodified in the completion
+	uint64_t args;		// guest-physical address of the argument struct
+	uint16_t port;		// e.g. UHYVE_PORT_WRITE
+	uint16_t reserved[3];
+} __attribute__((packed)) uhyve_hcall_sqe_t;
+
+typedef struct {
+	uint64_t user_data;
+	int64_t ret;
+} __attribute__((packed)) uhyve_hcall_cqe_t;
+
+typedef struct {
+	volatile uint64_t sq_head __attribute__ ((aligned (64)));
+	volatile uint64_t sq_tail __attribute__ ((aligned (64)));
+	volatile uint64_t cq_head __attribute__ ((aligned (64)));
+	volatile uint64_t cq_tail __attribute__ ((aligned (64)));
+	uhyve_hcall_sqe_t sqes[UHYVE_HCALL_QUEUE_SIZE];
+	uhyve_hcall_cqe_t cqes[UHYVE_HCALL_QUEUE_SIZE];
+} uhyve_hcall_queue_t;
+
 #endif // UHYVE_SYSCALLS_H
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2018, RWTH Aachen University
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *    * Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *    * Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *    * Neither the name of the University nor the names of its contributors
+ *      may be used to endorse or promote products derived from this
+ *      software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+ * @file tools/uhyve-vhost-net.c
+ * @brief In-kernel data path for the network interface (vhost-net)
+ *
+ * The guest places split virtqueues into the area, which it has reserved
+ * by UHYVE_PORT_NETCONFIG. vhost-net reads the kicks from the ioeventfds
+ * of UHYVE_PORT_NETWRITE / UHYVE_PORT_NETREAD, moves the frames between
+ * the TAP queue and the guest buffers and signals the irqfd of the queue
+ * pair. The frames never pass through uhyve.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <linux/vhost.h>
+#include <linux/virtio_ring.h>
+
+#include "uhyve-net.h"
+
+extern uint8_t* guest_mem;
+extern size_t guest_size;
+
+int uhyve_vhost_net_open(uint64_t* features)
+{
+	int fd, err;
+
+	fd = open("/dev/vhost-net", O_RDWR);
+	if (fd < 0)
+		return -1;
+
+	if ((ioctl(fd, VHOST_SET_OWNER, NULL) < 0) || (ioctl(fd, VHOST_GET_FEATURES, features) < 0)) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+
+	return fd;
+}
+
+/* uhyve maps the guest memory linearly, i.e. host address = guest_mem + guest-physical address */
+static int vhost_set_mem_table(int fd)
+{
+	struct vhost_memory* mem;
+	int ret;
+
+	mem = (struct vhost_memory*) calloc(1, sizeof(struct vhost_memory) + sizeof(struct vhost_memory_region));
+	if (!mem)
+		return -1;
+
+	mem->nregions = 1;
+	mem->regions[0].guest_phys_addr = 0;
+	mem->regions[0].memory_size = guest_size;
+	mem->regions[0].userspace_addr = (uint64_t) guest_mem;
+
+	ret = ioctl(fd, VHOST_SET_MEM_TABLE, mem);
+	free(mem);
+
+	return ret;
+}
+
+static int vhost_setup_vring(int fd, unsigned index, uint64_t ring, uint32_t num, int kick, int call, int backend)
+{
+	struct vring vr;
+	struct vhost_vring_state state = { .index = index, .num = num };
+	struct vhost_vring_file file = { .index = index };
+	struct vhost_vring_addr addr = { .index = index };
+
+	vring_init(&vr, num, guest_mem + ring, UHYVE_VRING_ALIGN);
+
+	if (ioctl(fd, VHOST_SET_VRING_NUM, &state) < 0)
+		return -1;
+
+	state.num = 0;
+	if (ioctl(fd, VHOST_SET_VRING_BASE, &state) < 0)
+		return -1;
+
+	addr.desc_user_addr = (uint64_t) vr.desc;
+	addr.avail_user_addr = (uint64_t) vr.avail;
+	addr.used_user_addr = (uint64_t) vr.used;
+	if (ioctl(fd, VHOST_SET_VRING_ADDR, &addr) < 0)
+		return -1;
+
+	file.fd = kick;
+	if (ioctl(fd, VHOST_SET_VRING_KICK, &file) < 0)
+		return -1;
+
+	file.fd = call;
+	if (ioctl(fd, VHOST_SET_VRING_CALL, &file) < 0)
+		return -1;
+
+	file.fd = backend;
+	if (ioctl(fd, VHOST_NET_SET_BACKEND, &file) < 0)
+		return -1;
+
+	return 0;
+}
+
+int uhyve_vhost_net_start(uhyve_netq_t* q, uint64_t rx_ring, uint64_t tx_ring, uint64_t features)
+{
+	if (ioctl(q->vhost_fd, VHOST_SET_FEATURES, &features) < 0)
+		goto error;
+
+	if (vhost_set_mem_table(q->vhost_fd) < 0)
+		goto error;
+
+	// vhost-net uses virtqueue 0 for RX and 1 for TX
+	if (vhost_setup_vring(q->vhost_fd, 0, rx_ring, q->size, q->rx_space_efd, q->irq_efd, q->fd) < 0)
+		goto error;
+	if (vhost_setup_vring(q->vhost_fd, 1, tx_ring, q->size, q->tx_efd, q->irq_efd, q->fd) < 0)
+		goto error;
+
+	return 0;
+
+error:
+	fprintf(stderr, "[ERROR] Unable to start vhost-net for queue %u - %d (%s)\n",
+		q->index, errno, strerror(errno));
+	return -1;
+}
+
+void uhyve_vhost_net_stop(uhyve_netq_t* q)
+{
+	struct vhost_vring_file file = { .fd = -1 };
+
+	if (q->vhost_fd < 0)
+		return;
+
+	for(file.index = 0; file.index < 2; file.index++)
+		ioctl(q->vhost_fd, VHOST_NET_SET_BACKEND, &file);
+}
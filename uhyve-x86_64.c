@@ -48,11 +48,15 @@
 #include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/procfs.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+/* <sys/procfs.h> defines the page size of the host, see below */
+#undef PAGE_SIZE
+#undef PAGE_MASK
 #ifdef HAVE_MSR_INDEX_H
 #include <asm/msr-index.h>
 #else
@@ -108,17 +112,19 @@
 #endif
 #include <asm/mman.h>
 
+#include "uhyve-aio.h"
+#include "uhyve-checkpoint.h"
 #include "uhyve-common.h"
+#include "uhyve-dirty-log.h"
 #include "uhyve-gdb.h"
+#include "uhyve-mem.h"
 #include "uhyve-migration.h"
 #include "uhyve-net.h"
+#include "uhyve-stats.h"
 #include "uhyve-syscalls.h"
 #include "uhyve-x86_64.h"
 #include "uhyve.h"
 
-// define this macro to create checkpoints with KVM's dirty log
-//#define USE_DIRTY_LOG
-
 #define MAX_FNAME       256
 
 #define GUEST_OFFSET		0x0
@@ -205,8 +211,6 @@ static bool cap_adjust_clock_stable = false;
 static bool cap_irqfd = false;
 static bool cap_vapic = false;
 
-FILE *chk_file = NULL;
-
 extern size_t guest_size;
 extern pthread_barrier_t barrier;
 extern pthread_barrier_t migration_barrier;
@@ -216,6 +220,7 @@ extern uint8_t* klog;
 extern bool verbose;
 extern bool full_checkpoint;
 extern uint32_t no_checkpoint;
+extern uint32_t chk_base;
 extern uint32_t ncores;
 extern uint8_t* guest_mem;
 extern size_t guest_size;
@@ -226,6 +231,7 @@ extern __thread int vcpufd;
 extern __thread uint32_t cpuid;
 
 extern vcpu_state_t *vcpu_thread_states;
+extern vcpu_state_t *snapshot_states;
 extern mem_mappings_t mem_mappings;
 extern mem_mappings_t guest_physical_memory;
 
@@ -652,105 +658,314 @@ void write_cpu_state(void)
 	fclose(f);
 }
 
-void scan_dirty_log(void (*save_page)(void*, size_t, void*, size_t))
+/* dirty page, which is captured by a scan thread or for a copy-on-write checkpoint */
+typedef struct {
+	uint64_t entry;
+	uint8_t* page;
+	size_t size;
+} dirty_page_t;
+
+/* work unit of the page table scan: SCAN_UNIT_ENTRIES entries of a page directory */
+#define SCAN_UNIT_ENTRIES	64
+/* upper bound of the threads, which walk the page tables */
+#define SCAN_MAX_THREADS	64
+
+typedef struct {
+	size_t* pgd;
+	size_t first;
+	// pages of this unit in the list of the scan thread
+	unsigned list;
+	size_t start, end;
+} scan_unit_t;
+
+/* pages, which a scan thread has found */
+typedef struct {
+	dirty_page_t* pages;
+	size_t count;
+	size_t max;
+} scan_list_t;
+
+typedef struct {
+	scan_unit_t* units;
+	size_t count;
+	volatile size_t next;
+	size_t flag;
+	void (*save_page)(void*, size_t, void*, size_t);
+	void (*finish)(void);
+	// per-thread lists, NULL => the workers call save_page themselves
+	scan_list_t* lists;
+} scan_job_t;
+
+/* threads of the page table scan, which are kept between the scans */
+static struct {
+	pid_t pid;
+	pthread_t threads[SCAN_MAX_THREADS];
+	unsigned count;
+	pthread_mutex_t lock;
+	pthread_cond_t start;
+	pthread_cond_t done;
+	unsigned generation;
+	unsigned active;
+	unsigned running;
+	scan_job_t* job;
+} scan_pool;
+
+static scan_list_t scan_lists[SCAN_MAX_THREADS];
+static __thread scan_list_t* scan_list = NULL;
+
+static void scan_pgd(size_t* pgd, size_t first, size_t last, size_t flag, void (*save_page)(void*, size_t, void*, size_t))
 {
-	size_t slot_offset = 0;
-	static struct kvm_dirty_log dlog = {
-		.slot = 0,
-		.dirty_bitmap = NULL
-	};
-	size_t dirty_log_size = (guest_size >> PAGE_BITS) / sizeof(size_t);
+	for(size_t k=first; k<last; k++) {
+		if ((pgd[k] & PG_PRESENT) != PG_PRESENT)
+			continue;
+		//printf("\t\tpgd[%zd] 0x%zx\n", k, pgd[k] & ~PG_XD);
+		if ((pgd[k] & PG_PSE) != PG_PSE) {
+			size_t* pgt = (size_t*) (guest_mem+(pgd[k] & PAGE_MASK));
+			for(size_t l=0; l<(1 << PAGE_MAP_BITS); l++) {
+				if ((pgt[l] & (PG_PRESENT|flag)) == (PG_PRESENT|flag)) {
+					//printf("\t\t\t*pgt[%zd] 0x%zx, 4KB\n", l, pgt[l] & ~PG_XD);
+					if (!full_checkpoint)
+						pgt[l] = pgt[l] & ~(PG_DIRTY|PG_ACCESSED);
+					size_t pgt_entry = pgt[l] & ~PG_PSE; // because PAT use the same bit as PSE
+
+					save_page(&pgt_entry, sizeof(size_t), (void*) (guest_mem + (pgt[l] & PAGE_MASK)), (1UL << PAGE_BITS));
+				}
+			}
+		} else if ((pgd[k] & flag) == flag) {
+			//printf("\t\t*pgd[%zd] 0x%zx, 2MB\n", k, pgd[k] & ~PG_XD);
+			if (!full_checkpoint)
+				pgd[k] = pgd[k] & ~(PG_DIRTY|PG_ACCESSED);
 
-	// do we create our first checkpoint
-	if (dlog.dirty_bitmap == NULL) {
-		// besure that all paddings are zero
-		memset(&dlog, 0x00, sizeof(dlog));
+				save_page(pgd+k, sizeof(size_t), (void*) (guest_mem + (pgd[k] & PAGE_2M_MASK)), (1UL << PAGE_2M_BITS));
+		}
+	}
+}
+
+/* Appends a page to the list of the current scan thread */
+static void record_page(void* entry, size_t entry_size, void* page, size_t page_size)
+{
+	if (scan_list->count >= scan_list->max) {
+		size_t max = scan_list->max ? 2 * scan_list->max : 4096;
 
-		dlog.dirty_bitmap = malloc(dirty_log_size * sizeof(size_t));
-		if (dlog.dirty_bitmap == NULL)
-			err(1, "malloc failed!\n");
+		scan_list->pages = (dirty_page_t*) realloc(scan_list->pages, max * sizeof(dirty_page_t));
+		if (!scan_list->pages)
+			err(1, "unable to allocate list of dirty pages");
+		scan_list->max = max;
 	}
-	memset(dlog.dirty_bitmap, 0x00, dirty_log_size * sizeof(size_t));
 
-	dlog.slot = 0;
-nextslot:
-	kvm_ioctl(vmfd, KVM_GET_DIRTY_LOG, &dlog);
+	dirty_page_t* p = scan_list->pages + scan_list->count++;
+	p->entry = 0;
+	memcpy(&p->entry, entry, entry_size);
+	p->page = (uint8_t*) page;
+	p->size = page_size;
+}
 
-	for(size_t i=0; i<dirty_log_size; i++) {
-		size_t value = ((size_t*) dlog.dirty_bitmap)[i];
+static void scan_worker(scan_job_t* job, unsigned id)
+{
+	size_t i;
 
-		if (value) {
-			for(size_t j=0; j<sizeof(size_t)*8; j++) {
-				size_t test = 1ULL << j;
+	if (job->lists) {
+		scan_list = job->lists + id;
+		scan_list->count = 0;
+	}
 
-				if ((value & test) == test) {
-					size_t addr = (i*sizeof(size_t)*8+j)*PAGE_SIZE + slot_offset;
+	while ((i = __sync_fetch_and_add(&job->next, 1)) < job->count) {
+		scan_unit_t* unit = job->units + i;
 
-					save_page(&addr, sizeof(size_t), (void*)((uint64_t)guest_mem+(uint64_t)addr), PAGE_SIZE);
-				}
-			}
+		if (job->lists) {
+			unit->list = id;
+			unit->start = scan_list->count;
+			scan_pgd(unit->pgd, unit->first, unit->first + SCAN_UNIT_ENTRIES, job->flag, record_page);
+			unit->end = scan_list->count;
+		} else {
+			scan_pgd(unit->pgd, unit->first, unit->first + SCAN_UNIT_ENTRIES, job->flag, job->save_page);
 		}
 	}
 
-	// do we have to check the second slot?
-	if ((dlog.slot == 0) && (guest_size > KVM_32BIT_GAP_START - GUEST_OFFSET)) {
-		slot_offset = KVM_32BIT_MAX_MEM_SIZE;
-		dlog.slot = 1;
-		memset(dlog.dirty_bitmap, 0x00, dirty_log_size * sizeof(size_t));
-		goto nextslot;
+	if (job->finish)
+		job->finish();
+}
+
+static void* scan_pool_thread(void* arg)
+{
+	unsigned id = (unsigned) (size_t) arg;
+	unsigned generation = 0;
+
+	// the pool is created by a pinned vCPU
+	mem_unpin_thread();
+
+	while (1) {
+		pthread_mutex_lock(&scan_pool.lock);
+		while (scan_pool.generation == generation)
+			pthread_cond_wait(&scan_pool.start, &scan_pool.lock);
+		generation = scan_pool.generation;
+		scan_job_t* job = scan_pool.job;
+		bool take = id <= scan_pool.active;
+		pthread_mutex_unlock(&scan_pool.lock);
+
+		if (!take)
+			continue;
+
+		scan_worker(job, id);
+
+		pthread_mutex_lock(&scan_pool.lock);
+		if (--scan_pool.running == 0)
+			pthread_cond_signal(&scan_pool.done);
+		pthread_mutex_unlock(&scan_pool.lock);
+	}
+
+	return NULL;
+}
+
+/* Runs a job with "threads" threads, the caller is the first one */
+static void scan_pool_run(scan_job_t* job, unsigned threads)
+{
+	// a forked process does not inherit the threads of the pool
+	if (scan_pool.pid != getpid()) {
+		scan_pool.pid = getpid();
+		scan_pool.count = 0;
+		scan_pool.generation = 0;
+		pthread_mutex_init(&scan_pool.lock, NULL);
+		pthread_cond_init(&scan_pool.start, NULL);
+		pthread_cond_init(&scan_pool.done, NULL);
+	}
+
+	while (scan_pool.count + 1 < threads) {
+		if (create_helper_thread(&scan_pool.threads[scan_pool.count], scan_pool_thread, (void*) (size_t) (scan_pool.count + 1)))
+			err(1, "unable to create thread");
+		scan_pool.count++;
+	}
+
+	if (threads > 1) {
+		pthread_mutex_lock(&scan_pool.lock);
+		scan_pool.job = job;
+		scan_pool.active = threads - 1;
+		scan_pool.running = threads - 1;
+		scan_pool.generation++;
+		pthread_cond_broadcast(&scan_pool.start);
+		pthread_mutex_unlock(&scan_pool.lock);
+	}
+
+	scan_worker(job, 0);
+
+	if (threads > 1) {
+		pthread_mutex_lock(&scan_pool.lock);
+		while (scan_pool.running)
+			pthread_cond_wait(&scan_pool.done, &scan_pool.lock);
+		pthread_mutex_unlock(&scan_pool.lock);
 	}
 }
 
-void scan_page_tables(void (*save_page)(void*, size_t, void*, size_t))
+/* Returns the number of threads, which walk the page tables */
+static unsigned scan_threads(void)
 {
-	const size_t flag = (!full_checkpoint && (no_checkpoint > 0)) ? PG_DIRTY : PG_ACCESSED;
+	static unsigned threads = 0;
+
+	if (!threads) {
+		long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+		const char* str = getenv("HERMIT_SCAN_THREADS");
+		if (str)
+			count = atoi(str);
+
+		if (count < 1)
+			count = 1;
+		if (count > SCAN_MAX_THREADS)
+			count = SCAN_MAX_THREADS;
+		threads = (unsigned) count;
+	}
+
+	return threads;
+}
+
+/*
+ * Walks the page tables with "threads" threads (including the caller).
+ * The page directories are split into units of SCAN_UNIT_ENTRIES entries,
+ * which the threads fetch one after another. If merge is false, the
+ * threads call save_page themselves and finish() after their last unit.
+ * Otherwise, each thread collects its pages in a list and the caller
+ * passes them to save_page in the order of a sequential walk.
+ */
+static void scan_page_tables_job(void (*save_page)(void*, size_t, void*, size_t), unsigned threads, void (*finish)(void), bool merge)
+{
+	scan_job_t job = {
+		.flag = (!full_checkpoint && (no_checkpoint > 0)) ? PG_DIRTY : PG_ACCESSED,
+		.save_page = save_page,
+		.finish = finish,
+		.lists = merge ? scan_lists : NULL,
+	};
+	size_t max_units = 0;
 
 	size_t* pml4 = (size_t*) (guest_mem+BOOT_PML4);
-	for(size_t i=0; i<(1 << PAGE_MAP_BITS); i++) {
-		if ((pml4[i] & PG_PRESENT) != PG_PRESENT)
-			continue;
-		//printf("pml[%zd] 0x%zx\n", i, pml4[i]);
-		size_t* pdpt = (size_t*) (guest_mem+(pml4[i] & PAGE_MASK));
-		for(size_t j=0; j<(1 << PAGE_MAP_BITS); j++) {
-			if ((pdpt[j] & PG_PRESENT) != PG_PRESENT)
+	for(int run = 0; run < 2; run++) {
+		// first run counts the units, the second one collects them
+		if (run) {
+			job.units = (scan_unit_t*) malloc(max_units * sizeof(scan_unit_t));
+			if (!job.units)
+				err(1, "malloc failed");
+		}
+
+		for(size_t i=0; i<(1 << PAGE_MAP_BITS); i++) {
+			if ((pml4[i] & PG_PRESENT) != PG_PRESENT)
 				continue;
-			//printf("\tpdpt[%zd] 0x%zx\n", j, pdpt[j]);
-			size_t* pgd = (size_t*) (guest_mem+(pdpt[j] & PAGE_MASK));
-			for(size_t k=0; k<(1 << PAGE_MAP_BITS); k++) {
-				if ((pgd[k] & PG_PRESENT) != PG_PRESENT)
+			//printf("pml[%zd] 0x%zx\n", i, pml4[i]);
+			size_t* pdpt = (size_t*) (guest_mem+(pml4[i] & PAGE_MASK));
+			for(size_t j=0; j<(1 << PAGE_MAP_BITS); j++) {
+				if ((pdpt[j] & PG_PRESENT) != PG_PRESENT)
 					continue;
-				//printf("\t\tpgd[%zd] 0x%zx\n", k, pgd[k] & ~PG_XD);
-				if ((pgd[k] & PG_PSE) != PG_PSE) {
-					size_t* pgt = (size_t*) (guest_mem+(pgd[k] & PAGE_MASK));
-					for(size_t l=0; l<(1 << PAGE_MAP_BITS); l++) {
-						if ((pgt[l] & (PG_PRESENT|flag)) == (PG_PRESENT|flag)) {
-							//printf("\t\t\t*pgt[%zd] 0x%zx, 4KB\n", l, pgt[l] & ~PG_XD);
-							if (!full_checkpoint)
-								pgt[l] = pgt[l] & ~(PG_DIRTY|PG_ACCESSED);
-							size_t pgt_entry = pgt[l] & ~PG_PSE; // because PAT use the same bit as PSE
-
-							save_page(&pgt_entry, sizeof(size_t), (void*) (guest_mem + (pgt[l] & PAGE_MASK)), (1UL << PAGE_BITS));
-						}
+				//printf("\tpdpt[%zd] 0x%zx\n", j, pdpt[j]);
+				size_t* pgd = (size_t*) (guest_mem+(pdpt[j] & PAGE_MASK));
+				for(size_t k=0; k<(1 << PAGE_MAP_BITS); k+=SCAN_UNIT_ENTRIES) {
+					if (run) {
+						job.units[job.count].pgd = pgd;
+						job.units[job.count].first = k;
+						job.count++;
+					} else {
+						max_units++;
 					}
-				} else if ((pgd[k] & flag) == flag) {
-					//printf("\t\t*pgd[%zd] 0x%zx, 2MB\n", k, pgd[k] & ~PG_XD);
-					if (!full_checkpoint)
-						pgd[k] = pgd[k] & ~(PG_DIRTY|PG_ACCESSED);
-
-						save_page(pgd+k, sizeof(size_t), (void*) (guest_mem + (pgd[k] & PAGE_2M_MASK)), (1UL << PAGE_2M_BITS));
 				}
 			}
 		}
 	}
+
+	if (threads > job.count)
+		threads = job.count ? job.count : 1;
+	if (threads > SCAN_MAX_THREADS)
+		threads = SCAN_MAX_THREADS;
+
+	scan_pool_run(&job, threads);
+
+	if (merge) {
+		for(size_t i = 0; i < job.count; i++) {
+			scan_unit_t* unit = job.units + i;
+			scan_list_t* list = scan_lists + unit->list;
+
+			for(size_t j = unit->start; j < unit->end; j++)
+				save_page(&list->pages[j].entry, sizeof(uint64_t), list->pages[j].page, list->pages[j].size);
+		}
+	}
+
+	free(job.units);
 }
-void open_chk_file(char *fname)
+
+void scan_page_tables_parallel(void (*save_page)(void*, size_t, void*, size_t), unsigned threads, void (*finish)(void))
 {
-	chk_file = fopen(fname, "w");
-	if (chk_file == NULL) {
-		err(1, "fopen: unable to open file");
-	}
+	scan_page_tables_job(save_page, threads, finish, false);
 }
 
+/*
+ * Walks the page tables with scan_threads() threads and calls save_page
+ * on the calling thread, so that the handler has not to be thread-safe.
+ */
+void scan_page_tables(void (*save_page)(void*, size_t, void*, size_t))
+{
+	unsigned threads = scan_threads();
+
+	if (threads > 1)
+		scan_page_tables_job(save_page, threads, NULL, true);
+	else
+		scan_page_tables_job(save_page, 1, NULL, false);
+}
 
 /* determine guests memory mappings based on its free list
  *
@@ -804,32 +1019,264 @@ void determine_mem_mappings(free_list_t *free_list)
 
 }
 
-void close_chk_file(void)
+/* true, after the guest has reported its free pages once */
+static bool free_pages_reported = false;
+
+size_t report_free_range(size_t start, size_t end)
 {
-	fclose(chk_file);
+	size_t freed = 0;
+
+	if (end > guest_size)
+		end = guest_size;
+	if (start >= end)
+		return 0;
+
+	// the IO gap is not backed by memory
+	if ((guest_size >= KVM_32BIT_GAP_END) && (start < KVM_32BIT_GAP_END) && (end > KVM_32BIT_GAP_START)) {
+		if (start < KVM_32BIT_GAP_START) {
+			mem_discard(guest_mem + start, KVM_32BIT_GAP_START - start);
+			freed += KVM_32BIT_GAP_START - start;
+		}
+		if (end > KVM_32BIT_GAP_END) {
+			mem_discard(guest_mem + KVM_32BIT_GAP_END, end - KVM_32BIT_GAP_END);
+			freed += end - KVM_32BIT_GAP_END;
+		}
+	} else {
+		mem_discard(guest_mem + start, end - start);
+		freed = end - start;
+	}
+
+	free_pages_reported = true;
+
+	return freed;
 }
 
-void write_chk_file(void *addr, size_t bytes)
+/* Pages, which are discarded by a free page report, are not saved */
+static void save_resident_page(void* entry, size_t entry_size, void* page, size_t page_size)
 {
-	if (fwrite(addr, bytes, 1, chk_file) != 1) {
-		err(1, "fwrite failed");
+	if (!mem_discarded(page, page_size))
+		chk_write_page(entry, entry_size, page, page_size);
+}
+
+void determine_dirty_pages(void (*save_page_handler)(void*, size_t, void*, size_t))
+{
+	if (dirty_log_enabled())
+		dirty_log_scan(save_page_handler);
+	else
+		scan_page_tables(save_page_handler);
+
+}
+
+static void skip_page(void* entry, size_t entry_size, void* page, size_t page_size)
+{
+}
+
+/*
+ * Passes all pages of the guest memory to save_page. The dirty state is
+ * reset, hence the following checkpoints build on this one.
+ */
+static void scan_all_pages(void (*save_page)(void*, size_t, void*, size_t))
+{
+	determine_dirty_pages(skip_page);
+
+	for(size_t addr = 0; addr < guest_size; addr += PAGE_SIZE) {
+		// the IO gap is not backed by memory
+		if ((guest_size >= KVM_32BIT_GAP_END) && (addr >= KVM_32BIT_GAP_START) && (addr < KVM_32BIT_GAP_END))
+			continue;
+
+		save_page(&addr, sizeof(size_t), (void*) (guest_mem + addr), PAGE_SIZE);
 	}
 }
 
-void write_mem_page_to_chk_file(void *entry, size_t entry_size, void *page, size_t page_size)
+/* Writes the dirty pages with chk_threads() threads to the checkpoint file */
+static void save_dirty_pages(void)
 {
-	write_chk_file(entry, entry_size);
-	write_chk_file(page, page_size);
+	if (dirty_log_enabled()) {
+		dirty_log_scan(save_resident_page);
+		chk_writer_flush();
+	} else {
+		scan_page_tables_parallel(save_resident_page, chk_threads(), chk_writer_flush);
+	}
 }
 
-void determine_dirty_pages(void (*save_page_handler)(void*, size_t, void*, size_t))
+/* number of pages, which a writer thread fetches at once */
+#define DIRTY_PAGES_CHUNK	256
+
+static dirty_page_t* dirty_pages = NULL;
+static size_t dirty_count = 0;
+static size_t dirty_max = 0;
+static volatile size_t dirty_next = 0;
+
+/* process, which writes the last copy-on-write checkpoint */
+static pid_t chk_child = -1;
+
+static void collect_dirty_page(void* entry, size_t entry_size, void* page, size_t page_size)
 {
-#ifdef USE_DIRTY_LOG
-	scan_dirty_log(save_page_handler);
-#else
-	scan_page_tables(save_page_handler);
-#endif
+	if (mem_discarded(page, page_size))
+		return;
+
+	if (dirty_count >= dirty_max) {
+		size_t max = dirty_max ? 2 * dirty_max : 4096;
+
+		dirty_pages = (dirty_page_t*) realloc(dirty_pages, max * sizeof(dirty_page_t));
+		if (!dirty_pages)
+			err(1, "unable to allocate list of dirty pages");
+		dirty_max = max;
+	}
+
+	dirty_pages[dirty_count].entry = 0;
+	memcpy(&dirty_pages[dirty_count].entry, entry, entry_size);
+	dirty_pages[dirty_count].page = (uint8_t*) page;
+	dirty_pages[dirty_count].size = page_size;
+	dirty_count++;
+}
+
+static void* dirty_pages_worker(void* arg)
+{
+	size_t i;
+
+	while ((i = __sync_fetch_and_add(&dirty_next, DIRTY_PAGES_CHUNK)) < dirty_count) {
+		size_t end = i + DIRTY_PAGES_CHUNK < dirty_count ? i + DIRTY_PAGES_CHUNK : dirty_count;
+
+		for(; i < end; i++)
+			chk_write_page(&dirty_pages[i].entry, sizeof(uint64_t), dirty_pages[i].page, dirty_pages[i].size);
+	}
+
+	chk_writer_flush();
+
+	return NULL;
+}
+
+/* Writes the pages of the list dirty_pages with chk_threads() threads */
+static void write_dirty_pages(void)
+{
+	unsigned threads = chk_threads();
+	pthread_t workers[CHK_MAX_THREADS];
+
+	dirty_next = 0;
+	for(unsigned t = 1; t < threads; t++) {
+		if (create_helper_thread(&workers[t], dirty_pages_worker, NULL))
+			err(1, "unable to create thread");
+	}
+
+	dirty_pages_worker(NULL);
+
+	for(unsigned t = 1; t < threads; t++)
+		pthread_join(workers[t], NULL);
+}
+
+/* Returns the destination of a page in a checkpoint file */
+static void* chk_locate_page(uint8_t* mem, uint64_t entry, size_t* page_size)
+{
+	*page_size = (entry & PG_PSE) ? (1UL << PAGE_2M_BITS) : (1UL << PAGE_BITS);
+
+	return mem + determine_dest_offset(entry);
+}
+
+static void write_chk_config(uint32_t no)
+{
+	// update configuration file, a restart sees either the old or the new one
+	FILE *f = fopen("checkpoint/chk_config.tmp", "w");
+	if (f == NULL) {
+		err(1, "fopen: unable to open file");
+	}
+
+	fprintf(f, "number of cores: %u\n", ncores);
+	fprintf(f, "memory size: 0x%zx\n", guest_size);
+	fprintf(f, "checkpoint number: %u\n", no);
+	fprintf(f, "entry point: 0x%zx\n", elf_entry);
+	if (full_checkpoint)
+		fprintf(f, "full checkpoint: 1");
+	else
+		fprintf(f, "full checkpoint: 0");
+	fprintf(f, "\nbase checkpoint: %u", chk_base);
+
+	fflush(f);
+	fsync(fileno(f));
+	fclose(f);
+
+	if (rename("checkpoint/chk_config.tmp", "checkpoint/chk_config.txt") < 0)
+		err(1, "rename: unable to update checkpoint configuration");
+}
+
+/*
+ * With HERMIT_CHECKPOINT_COMPACT=<n>, a chain of n incremental checkpoints
+ * is merged into its last checkpoint, which is the new base of the chain.
+ * Hence, a restore reads each page at most once.
+ */
+static pthread_t compact_thread;
+static bool compacting = false;
+static bool chk_child_compact = false;
+/* the previous checkpoint is incomplete => the next one contains all pages */
+static bool chk_force_full = false;
+
+static bool compact_due(uint32_t no)
+{
+	const char* str = getenv("HERMIT_CHECKPOINT_COMPACT");
+	uint32_t threshold = str ? (uint32_t) atoi(str) : 0;
+
+	return !full_checkpoint && (threshold > 1) && (no - chk_base + 1 >= threshold);
+}
+
+/*
+ * Merges the chain chk_base - last into checkpoint last. Returns 0, if the
+ * configuration refers to the new base, -1 if the chain is unchanged.
+ */
+static int compact_checkpoints(uint32_t last)
+{
+	uint32_t first = chk_base;
+	char fname[MAX_FNAME];
+	struct timeval begin, end;
+
+	if (verbose)
+		gettimeofday(&begin, NULL);
+
+	if (chk_compact(first, last, chk_locate_page) != 0) {
+		fprintf(stderr, "[WARNING] Unable to compact checkpoints %u - %u\n", first, last);
+		return -1;
+	}
 
+	chk_base = last;
+	write_chk_config(last);
+
+	// the configuration points to the new base => remove the old chain
+	for(uint32_t i = first; i < last; i++) {
+		snprintf(fname, MAX_FNAME, "checkpoint/chk%u_mem.dat", i);
+		unlink(fname);
+		for(uint32_t cpuid = 0; cpuid < ncores; cpuid++) {
+			snprintf(fname, MAX_FNAME, "checkpoint/chk%u_core%u.dat", i, cpuid);
+			unlink(fname);
+		}
+	}
+
+	if (verbose) {
+		gettimeofday(&end, NULL);
+		size_t msec = (end.tv_sec - begin.tv_sec) * 1000;
+		msec += (end.tv_usec - begin.tv_usec) / 1000;
+		fprintf(stderr, "Compact checkpoints %u - %u in %zd ms\n", first, last, msec);
+	}
+
+	return 0;
+}
+
+static void* compact_thread_func(void* arg)
+{
+	compact_checkpoints((uint32_t) (size_t) arg);
+
+	return NULL;
+}
+
+/*
+ * With HERMIT_CHECKPOINT_FORK=1, the vCPUs are only stopped until the
+ * dirty pages are determined. A child process inherits a copy-on-write
+ * snapshot of the guest memory and writes the checkpoint in background.
+ */
+static bool checkpoint_fork(void)
+{
+	const char* str = getenv("HERMIT_CHECKPOINT_FORK");
+
+	// a forked child shares the memory of a memfd with the guest
+	return str && (strcmp(str, "0") != 0) && !mem_shared();
 }
 
 void timer_handler(int signum)
@@ -838,13 +1285,41 @@ void timer_handler(int signum)
 	struct stat st = {0};
 	char fname[MAX_FNAME];
 	struct timeval begin, end;
+	bool cow = checkpoint_fork();
+
+	// all pages of a lazy restore have to be present
+	chk_restore_wait();
+
+	// the previous checkpoint has to be complete
+	if (chk_child > 0) {
+		int status = 0;
+
+		if ((waitpid(chk_child, &status, 0) == chk_child) && (!WIFEXITED(status) || WEXITSTATUS(status))) {
+			fprintf(stderr, "[ERROR] Checkpoint writer %u failed, the next checkpoint contains all pages\n", no_checkpoint - 1);
+			chk_force_full = true;
+		} else if (chk_child_compact) {
+			chk_base = no_checkpoint - 1;
+			// the child has removed the files, which the table may reference
+			chk_dedup_reset();
+		}
+		chk_child = -1;
+	}
+
+	if (compacting) {
+		pthread_join(compact_thread, NULL);
+		compacting = false;
+	}
 
 	if (verbose)
 		gettimeofday(&begin, NULL);
+	uint64_t begin_ns = stats_now();
 
 	if (stat("checkpoint", &st) == -1)
 		mkdir("checkpoint", 0700);
 
+	// the engine must not write into the guest memory, while it is captured
+	uhyve_aio_quiesce();
+
 	for(size_t i = 0; i < ncores; i++)
 		if (vcpu_threads[i] != pthread_self())
 			pthread_kill(vcpu_threads[i], SIGTHRCHKP);
@@ -855,8 +1330,6 @@ void timer_handler(int signum)
 
 	snprintf(fname, MAX_FNAME, "checkpoint/chk%u_mem.dat", no_checkpoint);
 
-	open_chk_file(fname);
-
 	/*struct kvm_irqchip irqchip = {};
 	if (cap_irqchip)
 		kvm_ioctl(vmfd, KVM_GET_IRQCHIP, &irqchip);
@@ -867,33 +1340,82 @@ void timer_handler(int signum)
 
 	struct kvm_clock_data clock = {};
 	kvm_ioctl(vmfd, KVM_GET_CLOCK, &clock);
-	write_chk_file(&clock, sizeof(clock));
 
-#if 0
-	if (fwrite(guest_mem, guest_size, 1, f) != 1)
-		err(1, "fwrite failed");
-#else
-	determine_dirty_pages(write_mem_page_to_chk_file);
-#endif
-	close_chk_file();
-	pthread_barrier_wait(&barrier);
+	// free pages, which the guest has not touched since the report, are skipped
+	if (free_pages_reported)
+		mem_update_discarded();
 
-	// update configuration file
-	FILE *f = fopen("checkpoint/chk_config.txt", "w");
-	if (f == NULL) {
-		err(1, "fopen: unable to open file");
+	// a full checkpoint has to be self-contained
+	bool full = chk_force_full && !full_checkpoint;
+	if (full_checkpoint || full)
+		chk_dedup_reset();
+
+	// a checkpoint with all pages starts a new chain
+	if (full) {
+		chk_base = no_checkpoint;
+		chk_force_full = false;
 	}
 
-	fprintf(f, "number of cores: %u\n", ncores);
-	fprintf(f, "memory size: 0x%zx\n", guest_size);
-	fprintf(f, "checkpoint number: %u\n", no_checkpoint);
-	fprintf(f, "entry point: 0x%zx\n", elf_entry);
-	if (full_checkpoint)
-		fprintf(f, "full checkpoint: 1");
-	else
-		fprintf(f, "full checkpoint: 0");
+	if (cow) {
+		dirty_count = 0;
+		if (full)
+			scan_all_pages(collect_dirty_page);
+		else
+			determine_dirty_pages(collect_dirty_page);
+
+		// the child sees the memory as it is now
+		chk_child_compact = compact_due(no_checkpoint);
+		chk_child = fork();
+		if (chk_child == 0) {
+			chk_writer_open(fname, no_checkpoint, &clock);
+			write_dirty_pages();
+			chk_writer_close();
+			write_chk_config(no_checkpoint);
+			// the parent moves chk_base only after a successful compaction
+			if (chk_child_compact && (compact_checkpoints(no_checkpoint) != 0))
+				_exit(EXIT_FAILURE);
+
+			if (verbose) {
+				gettimeofday(&end, NULL);
+				size_t msec = (end.tv_sec - begin.tv_sec) * 1000;
+				msec += (end.tv_usec - begin.tv_usec) / 1000;
+				fprintf(stderr, "Write checkpoint %u in %zd ms\n", no_checkpoint, msec);
+			}
 
-	fclose(f);
+			_exit(EXIT_SUCCESS);
+		} else if (chk_child < 0) {
+			fprintf(stderr, "[WARNING] Unable to fork checkpoint writer - %d (%s)\n", errno, strerror(errno));
+
+			chk_writer_open(fname, no_checkpoint, &clock);
+			write_dirty_pages();
+		}
+	} else {
+		chk_writer_open(fname, no_checkpoint, &clock);
+		if (full) {
+			scan_all_pages(save_resident_page);
+			chk_writer_flush();
+		} else {
+			save_dirty_pages();
+		}
+	}
+
+	// all pages are captured => the vCPUs are able to continue
+	pthread_barrier_wait(&barrier);
+	uhyve_aio_resume();
+	stats_phase(STATS_PHASE_CHECKPOINT_STOP, stats_now() - begin_ns);
+
+	if (chk_child < 0) {
+		chk_writer_close();
+		write_chk_config(no_checkpoint);
+
+		// compaction runs in parallel to the guest until the next checkpoint
+		if (compact_due(no_checkpoint)) {
+			if (create_helper_thread(&compact_thread, compact_thread_func, (void*) (size_t) no_checkpoint) == 0)
+				compacting = true;
+			else
+				fprintf(stderr, "[WARNING] Unable to create compaction thread\n");
+		}
+	}
 
 	if (verbose) {
 		gettimeofday(&end, NULL);
@@ -901,6 +1423,7 @@ void timer_handler(int signum)
 		msec += (end.tv_usec - begin.tv_usec) / 1000;
 		fprintf(stderr, "Create checkpoint %u in %zd ms\n", no_checkpoint, msec);
 	}
+	stats_phase(STATS_PHASE_CHECKPOINT, stats_now() - begin_ns);
 
 	no_checkpoint++;
 }
@@ -924,6 +1447,8 @@ void *migration_handler(void *arg)
 		}
 	}
 
+	chk_restore_wait();
+
 	/* send metadata */
 	migration_metadata_t metadata = {
 		ncores,
@@ -952,17 +1477,23 @@ void *migration_handler(void *arg)
 	convert_to_host_virt(&mem_mappings);
 
 	/* pre-copy phase */
+	uint64_t begin_ns = stats_now();
 	precopy_phase(guest_physical_memory, mem_mappings);
+	stats_phase(STATS_PHASE_PRECOPY, stats_now() - begin_ns);
 
 	/* synchronize VCPU threads */
+	begin_ns = stats_now();
 	assert(vcpu_thread_states == NULL);
 	vcpu_thread_states = (vcpu_state_t*)calloc(ncores, sizeof(vcpu_state_t));
+	// the guest continues with the completed requests at the destination
+	uhyve_aio_quiesce();
 	for(i = 0; i < ncores; i++)
 		pthread_kill(vcpu_threads[i], SIGTHRMIG);
 	pthread_barrier_wait(&migration_barrier);
 
 	/* send the final dump */
 	stop_and_copy_phase();
+	stats_phase(STATS_PHASE_STOP_AND_COPY, stats_now() - begin_ns);
 	fprintf(stderr, "Memory sent! (Guest size: %zu bytes)\n", guest_size);
 
 	/* free mem_mappings and guest_physical_memory info */
@@ -985,6 +1516,10 @@ void *migration_handler(void *arg)
 		fprintf(stderr, "Clock sent! (%d bytes)\n", res);
 	}
 
+	/* serve the remaining pages while the destination is running */
+	if (is_postcopy())
+		postcopy_phase();
+
 	/* close socket */
 	close_migration_channel();
 
@@ -1028,6 +1563,10 @@ void load_migration_data(uint8_t* mem)
 		data.clock = clock.clock;
 		kvm_ioctl(vmfd, KVM_SET_CLOCK, &data);
 	}
+
+	/* the missing pages are fetched on demand */
+	if (is_postcopy())
+		start_postcopy();
 }
 
 int load_checkpoint(uint8_t* mem, char* path)
@@ -1041,6 +1580,7 @@ int load_checkpoint(uint8_t* mem, char* path)
 
 	if (verbose)
 		gettimeofday(&begin, NULL);
+	uint64_t begin_ns = stats_now();
 
 	if (!klog)
 		klog = mem+paddr+0x5000-GUEST_OFFSET;
@@ -1048,19 +1588,44 @@ int load_checkpoint(uint8_t* mem, char* path)
 		kheader = (volatile kernel_header_t*) (mem+paddr-GUEST_OFFSET);
 
 
-#ifdef USE_DIRTY_LOG
 	/*
 	 * if we use KVM's dirty page logging, we have to load
 	 * the elf image because most parts are readonly sections
 	 * and aren't able to detect by KVM's dirty page logging
 	 * technique.
 	 */
-	ret = load_kernel(mem, path);
-	if (ret)
-		return ret;
-#endif
+	if (dirty_log_enabled()) {
+		ret = load_kernel(mem, path);
+		if (ret)
+			return ret;
+	}
+
+	i = full_checkpoint ? no_checkpoint : chk_base;
+
+	/*
+	 * Indexed checkpoints are restored at once, only the newest copy of
+	 * a page is read. Without the dirty log and with anonymous memory,
+	 * the pages are able to be loaded lazily on first access.
+	 */
+	bool lazy = false;
+	if (!dirty_log_enabled() && (mem_backing() == MEM_BACKING_ANONYMOUS)) {
+		const char* str = getenv("HERMIT_LAZY_RESTORE");
+		lazy = str && (strcmp(str, "0") != 0);
+	}
+	struct kvm_clock_data clock;
+	ret = chk_restore(mem, guest_size, i, no_checkpoint, lazy, chk_locate_page, &clock);
+	if (ret < 0)
+		err(1, "Unable to restore checkpoint %u", no_checkpoint);
+	if (ret == 0) {
+		if (cap_adjust_clock_stable) {
+			struct kvm_clock_data data = {};
+
+			data.clock = clock.clock;
+			kvm_ioctl(vmfd, KVM_SET_CLOCK, &data);
+		}
+		i = no_checkpoint + 1;
+	}
 
-	i = full_checkpoint ? no_checkpoint : 0;
 	for(; i<=no_checkpoint; i++)
 	{
 		snprintf(fname, MAX_FNAME, "checkpoint/chk%u_mem.dat", i);
@@ -1075,8 +1640,12 @@ int load_checkpoint(uint8_t* mem, char* path)
 		if (cap_irqchip && (i == no_checkpoint-1))
 			kvm_ioctl(vmfd, KVM_SET_IRQCHIP, &irqchip);*/
 
-		struct kvm_clock_data clock;
-		if (fread(&clock, sizeof(clock), 1, f) != 1)
+		chk_header_t header;
+		bool versioned = chk_read_header(f, &header);
+
+		if (versioned)
+			clock = header.clock;
+		else if (fread(&clock, sizeof(clock), 1, f) != 1)
 			err(1, "fread failed");
 		// only the last checkpoint has to set the clock
 		if (cap_adjust_clock_stable && (i == no_checkpoint)) {
@@ -1090,8 +1659,10 @@ int load_checkpoint(uint8_t* mem, char* path)
 		if (fread(guest_mem, guest_size, 1, f) != 1)
 			err(1, "fread failed");
 #else
-
-		while (fread(&location, sizeof(location), 1, f) == 1) {
+		if (versioned) {
+			if (chk_load_records(f, &header, mem, chk_locate_page) < 0)
+				err(1, "Unable to read checkpoint %s", fname);
+		} else while (fread(&location, sizeof(location), 1, f) == 1) {
 			//printf("location 0x%zx\n", location);
 			size_t *dest_addr = (size_t*) (mem + determine_dest_offset(location));
 			if (location & PG_PSE)
@@ -1115,10 +1686,452 @@ int load_checkpoint(uint8_t* mem, char* path)
 		msec += (end.tv_usec - begin.tv_usec) / 1000;
 		fprintf(stderr, "Load checkpoint %u in %zd ms\n", no_checkpoint, msec);
 	}
+	stats_phase(STATS_PHASE_RESTORE, stats_now() - begin_ns);
+
+	return 0;
+}
+
+/*
+ * A snapshot consists of the guest memory and a state file with the VCPU
+ * states. The memory image is mapped MAP_PRIVATE by the new instances, so
+ * that they share all pages, which they do not modify. Placed on a tmpfs
+ * (e.g. /dev/shm), the image lives in the page cache only.
+ */
+#define SNAPSHOT_MAGIC		0x50414E53	// "SNAP"
+#define SNAPSHOT_MEM		"snapshot_mem.img"
+#define SNAPSHOT_STATE		"snapshot_state.dat"
+
+typedef struct {
+	uint32_t magic;
+	uint32_t ncores;
+	// memory size without the 32-bit gap
+	uint64_t guest_size;
+	uint64_t elf_entry;
+	// offsets of the kernel header and the kernel log in the guest memory
+	uint64_t kheader;
+	uint64_t klog;
+	struct kvm_clock_data clock;
+} snapshot_header_t;
+
+static snapshot_header_t snapshot = {};
+static int snapshot_fd = -1;
+
+static bool snapshot_path(char* fname, const char* name)
+{
+	const char* dir = getenv("HERMIT_SNAPSHOT");
+
+	if (!dir)
+		return false;
+
+	snprintf(fname, MAX_FNAME, "%s/%s", dir, name);
+	return true;
+}
+
+/* Reads the state of an existing snapshot, returns false if there isn't any */
+bool open_snapshot(void)
+{
+	char fname[MAX_FNAME];
+
+	if (!snapshot_path(fname, SNAPSHOT_STATE))
+		return false;
+
+	FILE* f = fopen(fname, "r");
+	if (f == NULL)
+		return false;
+
+	if ((fread(&snapshot, sizeof(snapshot), 1, f) != 1) || (snapshot.magic != SNAPSHOT_MAGIC))
+		errx(1, "%s is not a valid snapshot", fname);
+
+	vcpu_thread_states = (vcpu_state_t*) calloc(snapshot.ncores, sizeof(vcpu_state_t));
+	if (!vcpu_thread_states)
+		err(1, "Not enough memory");
+
+	if (fread(vcpu_thread_states, sizeof(vcpu_state_t), snapshot.ncores, f) != snapshot.ncores)
+		err(1, "fread failed");
+	fclose(f);
+
+	snapshot_path(fname, SNAPSHOT_MEM);
+	snapshot_fd = open(fname, O_RDONLY | O_CLOEXEC);
+	if (snapshot_fd < 0)
+		err(1, "Unable to open %s", fname);
+
+	ncores = snapshot.ncores;
+	guest_size = snapshot.guest_size;
+	elf_entry = snapshot.elf_entry;
+
+	if (verbose)
+		fprintf(stderr, "Resume from snapshot %s (ncores %u, mem size 0x%zx)\n",
+			getenv("HERMIT_SNAPSHOT"), ncores, guest_size);
+
+	return true;
+}
+
+/* Called after init_kvm_arch() has mapped the memory image */
+int load_snapshot(uint8_t* mem)
+{
+	kheader = (volatile kernel_header_t*) (mem + snapshot.kheader);
+	klog = mem + snapshot.klog;
+
+	if (cap_adjust_clock_stable) {
+		struct kvm_clock_data data = {};
+
+		data.clock = snapshot.clock.clock;
+		kvm_ioctl(vmfd, KVM_SET_CLOCK, &data);
+	}
 
+	// vcpu_thread_states are restored by the VCPUs
 	return 0;
 }
 
+static bool page_is_zero(const uint8_t* page)
+{
+	const uint64_t* p = (const uint64_t*) page;
+
+	for(size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++)
+		if (p[i])
+			return false;
+
+	return true;
+}
+
+/* Writes the guest memory at "base" of a sparse file, zero pages remain holes */
+static void write_guest_mem(int fd, off_t base, const char* fname)
+{
+	if (ftruncate(fd, base + guest_size) < 0)
+		err(1, "ftruncate failed");
+
+	size_t start = 0, end = 0;
+	for(size_t addr = 0; addr <= guest_size; addr += PAGE_SIZE) {
+		bool data = addr < guest_size;
+
+		// the 32-bit gap is not accessible
+		if (data && (guest_size >= KVM_32BIT_GAP_END) && (addr >= KVM_32BIT_GAP_START) && (addr < KVM_32BIT_GAP_END))
+			data = false;
+		if (data && page_is_zero(guest_mem + addr))
+			data = false;
+
+		if (data) {
+			if (start == end)
+				start = addr;
+			end = addr + PAGE_SIZE;
+		} else if (start != end) {
+			if (pwrite_in_full(fd, guest_mem + start, end - start, base + start) < 0)
+				err(1, "Unable to write %s", fname);
+			start = end = 0;
+		}
+	}
+}
+
+static void write_snapshot_mem(const char* fname)
+{
+	int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		err(1, "Unable to create %s", fname);
+
+	write_guest_mem(fd, 0, fname);
+
+	fsync(fd);
+	close(fd);
+}
+
+/*
+ * Stops all VCPUs and writes a snapshot to HERMIT_SNAPSHOT. Afterwards,
+ * the guest continues. The calling VCPU repeats the port access after a
+ * resume, which is ignored since the instance runs from a snapshot.
+ */
+void create_snapshot(void)
+{
+	static bool created = false;
+	char fname[MAX_FNAME], tname[MAX_FNAME];
+	struct timeval begin, end;
+
+	if ((snapshot.magic == SNAPSHOT_MAGIC) || created || !getenv("HERMIT_SNAPSHOT"))
+		return;
+	created = true;
+
+	if (verbose)
+		gettimeofday(&begin, NULL);
+	uint64_t begin_ns = stats_now();
+
+	mkdir(getenv("HERMIT_SNAPSHOT"), 0700);
+
+	snapshot_states = (vcpu_state_t*) calloc(ncores, sizeof(vcpu_state_t));
+	if (!snapshot_states)
+		err(1, "Not enough memory");
+
+	uhyve_aio_quiesce();
+	for(size_t i = 0; i < ncores; i++)
+		if (vcpu_threads[i] != pthread_self())
+			pthread_kill(vcpu_threads[i], SIGTHRCHKP);
+
+	pthread_barrier_wait(&barrier);
+	snapshot_states[cpuid] = save_cpu_state();
+	// wait until all VCPUs have saved their state
+	pthread_barrier_wait(&barrier);
+
+	snapshot_header_t header = {
+		.magic = SNAPSHOT_MAGIC,
+		.ncores = ncores,
+		.guest_size = (guest_size >= KVM_32BIT_GAP_END) ? guest_size - KVM_32BIT_GAP_SIZE : guest_size,
+		.elf_entry = elf_entry,
+		.kheader = (uint8_t*) kheader - guest_mem,
+		.klog = klog - guest_mem,
+	};
+	kvm_ioctl(vmfd, KVM_GET_CLOCK, &header.clock);
+
+	snapshot_path(tname, SNAPSHOT_MEM ".tmp");
+	snapshot_path(fname, SNAPSHOT_MEM);
+	write_snapshot_mem(tname);
+	if (rename(tname, fname) < 0)
+		err(1, "Unable to rename %s", tname);
+
+	// the state file is written last, it marks a complete snapshot
+	snapshot_path(tname, SNAPSHOT_STATE ".tmp");
+	snapshot_path(fname, SNAPSHOT_STATE);
+	FILE* f = fopen(tname, "w");
+	if (f == NULL)
+		err(1, "Unable to create %s", tname);
+	if ((fwrite(&header, sizeof(header), 1, f) != 1)
+	    || (fwrite(snapshot_states, sizeof(vcpu_state_t), ncores, f) != ncores))
+		err(1, "fwrite failed");
+	fflush(f);
+	fsync(fileno(f));
+	fclose(f);
+	if (rename(tname, fname) < 0)
+		err(1, "Unable to rename %s", tname);
+
+	free(snapshot_states);
+	snapshot_states = NULL;
+
+	pthread_barrier_wait(&barrier);
+	uhyve_aio_resume();
+
+	if (verbose) {
+		gettimeofday(&end, NULL);
+		size_t msec = (end.tv_sec - begin.tv_sec) * 1000;
+		msec += (end.tv_usec - begin.tv_usec) / 1000;
+		fprintf(stderr, "Create snapshot in %zd ms\n", msec);
+	}
+	stats_phase(STATS_PHASE_SNAPSHOT, stats_now() - begin_ns);
+}
+
+/* virtually and physically contiguous mappings of the guest */
+typedef struct {
+	Elf64_Phdr* phdrs;
+	size_t count;
+	size_t max;
+	off_t base;
+} core_segments_t;
+
+static void core_add_segment(uint64_t virt, uint64_t phys, uint64_t size, void* arg)
+{
+	core_segments_t* segs = (core_segments_t*) arg;
+
+	if (segs->count == segs->max) {
+		size_t max = segs->max ? 2 * segs->max : 64;
+		Elf64_Phdr* phdrs = (Elf64_Phdr*) realloc(segs->phdrs, max * sizeof(Elf64_Phdr));
+		if (!phdrs)
+			err(1, "Not enough memory");
+		segs->phdrs = phdrs;
+		segs->max = max;
+	}
+
+	segs->phdrs[segs->count++] = (Elf64_Phdr) {
+		.p_type = PT_LOAD,
+		.p_flags = PF_R | PF_W | PF_X,
+		.p_offset = segs->base + phys,
+		.p_vaddr = virt,
+		.p_paddr = phys,
+		.p_filesz = size,
+		.p_memsz = size,
+		.p_align = PAGE_SIZE,
+	};
+}
+
+static size_t core_note(uint8_t* buf, uint32_t type, const void* desc, size_t size)
+{
+	Elf64_Nhdr nhdr = {
+		.n_namesz = 5,
+		.n_descsz = size,
+		.n_type = type,
+	};
+
+	memcpy(buf, &nhdr, sizeof(nhdr));
+	memcpy(buf + sizeof(nhdr), "CORE", 5);
+	memcpy(buf + sizeof(nhdr) + 8, desc, size);
+
+	return sizeof(nhdr) + 8 + ((size + 3) & ~3);
+}
+
+/* NT_PRSTATUS and NT_PRFPREG of a VCPU, which gdb shows as thread cpuid+1 */
+static size_t core_vcpu_notes(uint8_t* buf, uint32_t id, const vcpu_state_t* state)
+{
+	const struct kvm_regs* regs = &state->regs;
+	const struct kvm_sregs* sregs = &state->sregs;
+	const struct kvm_fpu* fpu = &state->fpu;
+	struct elf_prstatus prstatus;
+	struct user_regs_struct gregs;
+	struct user_fpregs_struct fpregs;
+
+	memset(&gregs, 0x00, sizeof(gregs));
+	gregs.r15 = regs->r15;
+	gregs.r14 = regs->r14;
+	gregs.r13 = regs->r13;
+	gregs.r12 = regs->r12;
+	gregs.rbp = regs->rbp;
+	gregs.rbx = regs->rbx;
+	gregs.r11 = regs->r11;
+	gregs.r10 = regs->r10;
+	gregs.r9 = regs->r9;
+	gregs.r8 = regs->r8;
+	gregs.rax = regs->rax;
+	gregs.rcx = regs->rcx;
+	gregs.rdx = regs->rdx;
+	gregs.rsi = regs->rsi;
+	gregs.rdi = regs->rdi;
+	gregs.orig_rax = ~0ULL;
+	gregs.rip = regs->rip;
+	gregs.eflags = regs->rflags;
+	gregs.rsp = regs->rsp;
+	gregs.cs = sregs->cs.selector;
+	gregs.ss = sregs->ss.selector;
+	gregs.ds = sregs->ds.selector;
+	gregs.es = sregs->es.selector;
+	gregs.fs = sregs->fs.selector;
+	gregs.gs = sregs->gs.selector;
+	gregs.fs_base = sregs->fs.base;
+	gregs.gs_base = sregs->gs.base;
+
+	memset(&prstatus, 0x00, sizeof(prstatus));
+	prstatus.pr_pid = id + 1;
+	memcpy(&prstatus.pr_reg, &gregs, sizeof(gregs));
+
+	// the FPU state of KVM has the layout of FXSAVE
+	memset(&fpregs, 0x00, sizeof(fpregs));
+	fpregs.cwd = fpu->fcw;
+	fpregs.swd = fpu->fsw;
+	fpregs.ftw = fpu->ftwx;
+	fpregs.fop = fpu->last_opcode;
+	fpregs.rip = fpu->last_ip;
+	fpregs.rdp = fpu->last_dp;
+	fpregs.mxcsr = fpu->mxcsr;
+	fpregs.mxcr_mask = 0xffff;
+	memcpy(fpregs.st_space, fpu->fpr, sizeof(fpu->fpr));
+	memcpy(fpregs.xmm_space, fpu->xmm, sizeof(fpu->xmm));
+
+	size_t len = core_note(buf, NT_PRSTATUS, &prstatus, sizeof(prstatus));
+	len += core_note(buf + len, NT_PRFPREG, &fpregs, sizeof(fpregs));
+
+	return len;
+}
+
+static void write_coredump(const char* fname)
+{
+	core_segments_t segs = { NULL, 0, 0, 0 };
+	size_t note_size = ncores * (2 * (sizeof(Elf64_Nhdr) + 8)
+		+ sizeof(struct elf_prstatus) + sizeof(struct user_fpregs_struct));
+	uint8_t* notes = (uint8_t*) calloc(1, note_size);
+	if (!notes)
+		err(1, "Not enough memory");
+
+	size_t note_len = 0;
+	for(uint32_t i = 0; i < ncores; i++)
+		note_len += core_vcpu_notes(notes + note_len, i, snapshot_states + i);
+
+	// the segments refer to the physical memory, which follows the headers
+	walk_guest_mappings(snapshot_states[cpuid].sregs.cr3, core_add_segment, &segs);
+	if (segs.count >= PN_XNUM - 1) {
+		fprintf(stderr, "[WARNING] Core dump is limited to %u of %zu mappings\n", PN_XNUM - 2, segs.count);
+		segs.count = PN_XNUM - 2;
+	}
+
+	size_t phnum = segs.count + 1;
+	off_t note_off = sizeof(Elf64_Ehdr) + phnum * sizeof(Elf64_Phdr);
+	off_t base = (note_off + note_len + PAGE_SIZE - 1) & PAGE_MASK;
+	for(size_t i = 0; i < segs.count; i++)
+		segs.phdrs[i].p_offset += base;
+
+	Elf64_Ehdr ehdr = {
+		.e_ident = { ELFMAG0, ELFMAG1, ELFMAG2, ELFMAG3, ELFCLASS64, ELFDATA2LSB, EV_CURRENT, ELFOSABI_NONE },
+		.e_type = ET_CORE,
+		.e_machine = EM_X86_64,
+		.e_version = EV_CURRENT,
+		.e_phoff = sizeof(Elf64_Ehdr),
+		.e_ehsize = sizeof(Elf64_Ehdr),
+		.e_phentsize = sizeof(Elf64_Phdr),
+		.e_phnum = phnum,
+	};
+	Elf64_Phdr note = {
+		.p_type = PT_NOTE,
+		.p_offset = note_off,
+		.p_filesz = note_len,
+		.p_align = 4,
+	};
+
+	int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		err(1, "Unable to create %s", fname);
+
+	write_guest_mem(fd, base, fname);
+	if ((pwrite_in_full(fd, &ehdr, sizeof(ehdr), 0) < 0)
+	    || (pwrite_in_full(fd, &note, sizeof(note), ehdr.e_phoff) < 0)
+	    || (pwrite_in_full(fd, segs.phdrs, segs.count * sizeof(Elf64_Phdr), ehdr.e_phoff + sizeof(note)) < 0)
+	    || (pwrite_in_full(fd, notes, note_len, note_off) < 0))
+		err(1, "Unable to write %s", fname);
+
+	close(fd);
+	free(segs.phdrs);
+	free(notes);
+}
+
+/*
+ * Stops all VCPUs and writes an ELF core file of the guest. Its segments
+ * describe the virtual address space of the guest, the notes the state of
+ * each VCPU. Afterwards, the guest continues.
+ */
+void create_coredump(const char* fname)
+{
+	static pthread_mutex_t coredump_lock = PTHREAD_MUTEX_INITIALIZER;
+	char tname[MAX_FNAME];
+	struct timeval begin, end;
+
+	// a VCPU, which waits here, still takes part in the core dump of another one
+	pthread_mutex_lock(&coredump_lock);
+	gettimeofday(&begin, NULL);
+
+	snapshot_states = (vcpu_state_t*) calloc(ncores, sizeof(vcpu_state_t));
+	if (!snapshot_states)
+		err(1, "Not enough memory");
+
+	uhyve_aio_quiesce();
+	for(size_t i = 0; i < ncores; i++)
+		if (vcpu_threads[i] != pthread_self())
+			pthread_kill(vcpu_threads[i], SIGTHRCHKP);
+
+	pthread_barrier_wait(&barrier);
+	snapshot_states[cpuid] = save_cpu_state();
+	// wait until all VCPUs have saved their state
+	pthread_barrier_wait(&barrier);
+
+	snprintf(tname, MAX_FNAME, "%s.tmp", fname);
+	write_coredump(tname);
+	if (rename(tname, fname) < 0)
+		err(1, "Unable to rename %s", tname);
+
+	free(snapshot_states);
+	snapshot_states = NULL;
+
+	pthread_barrier_wait(&barrier);
+	uhyve_aio_resume();
+
+	gettimeofday(&end, NULL);
+	size_t msec = (end.tv_sec - begin.tv_sec) * 1000;
+	msec += (end.tv_usec - begin.tv_usec) / 1000;
+	fprintf(stderr, "Core dump written to %s in %zd ms\n", fname, msec);
+
+	pthread_mutex_unlock(&coredump_lock);
+}
+
 void wait_for_incomming_migration(migration_metadata_t *metadata, uint16_t listen_portno)
 {
 	int res = 0, com_sock = 0;
@@ -1148,16 +2161,17 @@ void init_kvm_arch(void)
 	 *
 	 * TODO: support of huge pages
 	 */
-	if (guest_size < KVM_32BIT_GAP_START) {
-		guest_mem = mmap(NULL, guest_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		if (guest_mem == MAP_FAILED)
-			err(1, "mmap failed");
-	} else {
+	if (guest_size >= KVM_32BIT_GAP_START)
 		guest_size += KVM_32BIT_GAP_SIZE;
-		guest_mem = mmap(NULL, guest_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-		if (guest_mem == MAP_FAILED)
-			err(1, "mmap failed");
 
+	// a snapshot is mapped copy-on-write
+	guest_mem = mem_map_guest(guest_size, snapshot_fd);
+	if (snapshot_fd >= 0) {
+		close(snapshot_fd);
+		snapshot_fd = -1;
+	}
+
+	if (guest_size >= KVM_32BIT_GAP_END) {
 		/*
 		 * We mprotect the gap PROT_NONE so that if we accidently write to it, we will know.
 		 */
@@ -1176,8 +2190,13 @@ void init_kvm_arch(void)
 			fprintf(stderr, "Uhyve uses KSM feature \"mergeable\" to reduce the memory footprint.\n");
 	}
 
+	if (guest_size >= KVM_32BIT_GAP_END)
+		mem_place_guest(guest_mem, guest_size, KVM_32BIT_GAP_START, KVM_32BIT_GAP_END);
+	else
+		mem_place_guest(guest_mem, guest_size, 0, 0);
+
 	const char* hugepage = getenv("HERMIT_HUGEPAGE");
-	if (!(hugepage && (strcmp(hugepage, "0") == 0))) {
+	if ((mem_backing() != MEM_BACKING_HUGETLB) && !(hugepage && (strcmp(hugepage, "0") == 0))) {
 		madvise(guest_mem, guest_size, MADV_HUGEPAGE);
 		if (verbose)
 			fprintf(stderr, "Uhyve uses huge pages to improve the performance.\n");
@@ -1188,24 +2207,23 @@ void init_kvm_arch(void)
 		.guest_phys_addr = GUEST_OFFSET,
 		.memory_size = guest_size,
 		.userspace_addr = (uint64_t) guest_mem,
-#ifdef USE_DIRTY_LOG
-		.flags = KVM_MEM_LOG_DIRTY_PAGES,
-#else
-		.flags = 0,
-#endif
+		.flags = dirty_log_flags(),
 	};
 
 	if (guest_size <= KVM_32BIT_GAP_START - GUEST_OFFSET) {
 		kvm_ioctl(vmfd, KVM_SET_USER_MEMORY_REGION, &kvm_region);
+		dirty_log_add_slot(&kvm_region);
 	} else {
 		kvm_region.memory_size = KVM_32BIT_GAP_START - GUEST_OFFSET;
 		kvm_ioctl(vmfd, KVM_SET_USER_MEMORY_REGION, &kvm_region);
+		dirty_log_add_slot(&kvm_region);
 
 		kvm_region.slot = 1;
 		kvm_region.guest_phys_addr = KVM_32BIT_GAP_START + KVM_32BIT_GAP_SIZE;
 		kvm_region.userspace_addr = (uint64_t) guest_mem + KVM_32BIT_GAP_START + KVM_32BIT_GAP_SIZE;
 		kvm_region.memory_size = guest_size - KVM_32BIT_GAP_SIZE - KVM_32BIT_GAP_START + GUEST_OFFSET;
 		kvm_ioctl(vmfd, KVM_SET_USER_MEMORY_REGION, &kvm_region);
+		dirty_log_add_slot(&kvm_region);
 	}
 
 	kvm_ioctl(vmfd, KVM_CREATE_IRQCHIP, NULL);
@@ -1396,35 +2414,133 @@ out:
 	return ret;
 }
 
-static void virt_to_phys_for_table(
+/*
+ * Small per-vCPU cache of guest translations, keyed by the page tables and
+ * the virtual page. The vCPU invalidates its cache by virt_to_phys_flush()
+ * after each exit, so changes of the guest page tables (including a new
+ * CR3) are always visible to the next hypercall. Threads, which never call
+ * virt_to_phys_flush(), bypass the cache.
+ */
+#define TLB_ENTRIES	64
+
+typedef struct {
+	size_t root;
+	size_t vpage;
+	size_t ppage;
+	size_t shift;
+	uint64_t generation;
+} tlb_entry_t;
+
+static __thread tlb_entry_t tlb[TLB_ENTRIES];
+static __thread uint64_t tlb_generation = 0;	// 0 => cache disabled
+
+/* last-level page table of the previous 4 KiB translation */
+static __thread size_t* tlb_pgt = NULL;
+static __thread size_t tlb_pgt_root = 0;
+static __thread size_t tlb_pgt_vbase = 0;
+static __thread uint64_t tlb_pgt_generation = 0;
+
+void virt_to_phys_flush(void)
+{
+	tlb_generation++;
+}
+
+static inline tlb_entry_t* tlb_slot(size_t vpage, size_t shift)
+{
+	return &tlb[(vpage ^ shift) % TLB_ENTRIES];
+}
+
+static inline bool tlb_lookup(const size_t root, const size_t virtual_address,
+	size_t* const physical_address, size_t* const physical_address_page_end)
+{
+	static const size_t shifts[] = { PAGE_BITS, PAGE_2M_BITS, PAGE_2M_BITS + PAGE_MAP_BITS };
+
+	for(size_t i = 0; i < sizeof(shifts) / sizeof(shifts[0]); i++) {
+		const size_t shift = shifts[i];
+		const size_t vpage = virtual_address >> shift;
+		const tlb_entry_t* entry = tlb_slot(vpage, shift);
+
+		if ((entry->generation == tlb_generation) && (entry->shift == shift)
+		    && (entry->vpage == vpage) && (entry->root == root)) {
+			*physical_address = entry->ppage | (virtual_address & ((1UL << shift) - 1));
+			*physical_address_page_end = entry->ppage + (1UL << shift);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void virt_to_phys_root(
+	const size_t cr3,
 	const size_t virtual_address,
 	size_t* const physical_address,
-	size_t* const physical_address_page_end,
-	size_t* const table,
-	const size_t level
+	size_t* const physical_address_page_end
 )
 {
-	const size_t index = virtual_address >> PAGE_BITS >> level * PAGE_MAP_BITS & PAGE_MAP_MASK;
-	const size_t page_mask = ((~0UL) << PAGE_BITS << level * PAGE_MAP_BITS) & ~PG_XD;
-	const size_t page_size = PAGE_SIZE << level * PAGE_MAP_BITS;
+	const bool cached = tlb_generation != 0;
+	const size_t root = cr3 & PAGE_MASK;
+	size_t* table = (size_t*) (guest_mem+root);
+	size_t level = 3;
 
-	if (table[index] & PG_PRESENT)
-	{
-		if (level == 0 || (level < 3 && table[index] & PG_PSE))
+	*physical_address = 0;
+	*physical_address_page_end = 0;
+
+	if (root + PAGE_SIZE > guest_size)
+		return;
+
+	if (cached) {
+		if (tlb_lookup(root, virtual_address, physical_address, physical_address_page_end))
+			return;
+
+		// consecutive 4 KiB pages share their page table => skip the upper levels
+		if ((tlb_pgt_generation == tlb_generation) && (tlb_pgt_root == root)
+		    && (tlb_pgt_vbase == virtual_address >> PAGE_2M_BITS)) {
+			table = tlb_pgt;
+			level = 0;
+		}
+	}
+
+	while (1) {
+		const size_t index = virtual_address >> PAGE_BITS >> level * PAGE_MAP_BITS & PAGE_MAP_MASK;
+		const size_t page_mask = ((~0UL) << PAGE_BITS << level * PAGE_MAP_BITS) & ~PG_XD;
+		const size_t page_size = PAGE_SIZE << level * PAGE_MAP_BITS;
+		const size_t entry = table[index];
+
+		if (!(entry & PG_PRESENT))
+			return;
+
+		if (level == 0 || (level < 3 && entry & PG_PSE))
 		{
-			const size_t phy = table[index] & page_mask;
+			const size_t phy = entry & page_mask;
 			const size_t off = virtual_address & ~page_mask;
 
 			*physical_address = phy | off;
 			*physical_address_page_end = phy + page_size;
-		}
-		else
-		{
-			const size_t phy = table[index] & PAGE_MASK;
-			size_t* const subtable = (size_t*) (guest_mem+phy);
 
-			virt_to_phys_for_table(virtual_address, physical_address, physical_address_page_end, subtable, level - 1);
+			if (cached) {
+				const size_t shift = PAGE_BITS + level * PAGE_MAP_BITS;
+				tlb_entry_t* slot = tlb_slot(virtual_address >> shift, shift);
+
+				slot->root = root;
+				slot->vpage = virtual_address >> shift;
+				slot->ppage = phy;
+				slot->shift = shift;
+				slot->generation = tlb_generation;
+
+				if (level == 0) {
+					tlb_pgt = table;
+					tlb_pgt_root = root;
+					tlb_pgt_vbase = virtual_address >> PAGE_2M_BITS;
+					tlb_pgt_generation = tlb_generation;
+				}
+			}
+
+			return;
 		}
+
+		table = (size_t*) (guest_mem + (entry & PAGE_MASK));
+		level--;
 	}
 }
 
@@ -1434,11 +2550,69 @@ void virt_to_phys(
 	size_t* const physical_address_page_end
 )
 {
-	size_t* const pml4 = (size_t*) (guest_mem+BOOT_PML4);
+	virt_to_phys_root(BOOT_PML4, virtual_address, physical_address, physical_address_page_end);
+}
 
-	*physical_address = 0;
-	*physical_address_page_end = 0;
+typedef struct {
+	void (*handler)(uint64_t virt, uint64_t phys, uint64_t size, void* arg);
+	void* arg;
+	uint64_t virt;
+	uint64_t phys;
+	uint64_t size;
+} mapping_walk_t;
+
+static void walk_add(mapping_walk_t* walk, uint64_t virt, uint64_t phys, uint64_t size)
+{
+	if (walk->size && (walk->virt + walk->size == virt) && (walk->phys + walk->size == phys)) {
+		walk->size += size;
+		return;
+	}
+
+	if (walk->size)
+		walk->handler(walk->virt, walk->phys, walk->size, walk->arg);
+
+	walk->virt = virt;
+	walk->phys = phys;
+	walk->size = size;
+}
+
+static void walk_table(mapping_walk_t* walk, const size_t* table, size_t level, uint64_t vbase)
+{
+	const size_t page_mask = ((~0UL) << PAGE_BITS << level * PAGE_MAP_BITS) & ~PG_XD;
+	const size_t page_size = PAGE_SIZE << level * PAGE_MAP_BITS;
+
+	for(size_t index = 0; index <= PAGE_MAP_MASK; index++) {
+		const size_t entry = table[index];
+		uint64_t virt = vbase + index * page_size;
+
+		if (!(entry & PG_PRESENT))
+			continue;
+
+		if (level == PAGE_LEVELS - 1) {
+			// the last entry of the PML4 refers to itself
+			if (index == PAGE_MAP_MASK)
+				continue;
+			// canonical form of the upper half
+			if (virt & (1UL << (VIRT_BITS - 1)))
+				virt |= ~((1UL << VIRT_BITS) - 1);
+		}
+
+		if (level == 0 || (level < PAGE_LEVELS - 1 && entry & PG_PSE)) {
+			if ((entry & page_mask) + page_size <= guest_size)
+				walk_add(walk, virt, entry & page_mask, page_size);
+		} else if ((entry & PAGE_MASK) < guest_size) {
+			walk_table(walk, (const size_t*) (guest_mem + (entry & PAGE_MASK)), level - 1, virt);
+		}
+	}
+}
+
+void walk_guest_mappings(uint64_t root, void (*handler)(uint64_t virt, uint64_t phys, uint64_t size, void* arg), void* arg)
+{
+	mapping_walk_t walk = { handler, arg, 0, 0, 0 };
 
-	virt_to_phys_for_table(virtual_address, physical_address, physical_address_page_end, pml4, 3);
+	if ((root & PAGE_MASK) + PAGE_SIZE <= guest_size)
+		walk_table(&walk, (const size_t*) (guest_mem + (root & PAGE_MASK)), PAGE_LEVELS - 1, 0);
+	// reports the last mapping
+	walk_add(&walk, 0, 0, 0);
 }
 #endif
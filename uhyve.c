@@ -48,6 +48,7 @@
 #include <limits.h>
 #include <pthread.h>
 #include <semaphore.h>
+#include <time.h>
 #include <elf.h>
 #include <err.h>
 #include <poll.h>
@@ -60,6 +61,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/eventfd.h>
+#include <sys/uio.h>
 #include <linux/const.h>
 #include <linux/kvm.h>
 
@@ -68,6 +70,10 @@
 #include "uhyve-migration.h"
 #include "uhyve-net.h"
 #include "uhyve-gdb.h"
+#include "uhyve-aio.h"
+#include "uhyve-dirty-log.h"
+#include "uhyve-mem.h"
+#include "uhyve-stats.h"
 #ifdef __x86_64__
 #include "uhyve-x86_64.h"
 #endif
@@ -75,14 +81,17 @@
 
 static bool restart = false;
 static bool migration = false;
-static pthread_t rx_thread, tx_thread;
+static bool snapshot = false;
 static int* vcpu_fds = NULL;
 static pthread_mutex_t kvm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t hcall_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t hcall_cq_lock = PTHREAD_MUTEX_INITIALIZER;
+static int hcall_efd = -1;
 
 extern bool verbose;
 
-static char* guest_path = NULL;
 static bool uhyve_gdb_enabled = false;
+static const char* coredump_path = NULL;
 size_t guest_size = 0x20000000ULL;
 bool full_checkpoint = false;
 pthread_barrier_t barrier;
@@ -91,6 +100,7 @@ pthread_t* vcpu_threads = NULL;
 uint8_t* klog = NULL;
 uint8_t* guest_mem = NULL;
 uint32_t no_checkpoint = 0;
+uint32_t chk_base = 0;
 uint32_t ncores = 1;
 uint64_t elf_entry;
 int kvm = -1, vmfd = -1, netfd = -1, efd = -1, mig_efd = -1;
@@ -98,7 +108,6 @@ volatile kernel_header_t* kheader = NULL;
 __thread struct kvm_run *run = NULL;
 __thread int vcpufd = -1;
 __thread uint32_t cpuid = 0;
-static sem_t tx_sem;
 sem_t mig_sem;
 
 int uhyve_argc = -1;
@@ -108,10 +117,18 @@ extern char **environ;
 char **uhyve_envp = NULL;
 
 vcpu_state_t *vcpu_thread_states = NULL;
+/* VCPU states, which are collected for a snapshot */
+vcpu_state_t *snapshot_states = NULL;
 static sigset_t   signal_mask;
 
 mem_mappings_t mem_mappings = {NULL, 0};
 mem_mappings_t guest_physical_memory = {NULL, 0};
+/* the migration waits for the mappings of the next free list */
+static volatile bool freelist_requested = false;
+/* HERMIT_FREE_PAGE_REPORTING, interval of the free page reports in s */
+static unsigned free_page_interval = 0;
+/* the guest has negotiated UHYVE_PORT_FREE_PAGES */
+static bool free_pages_negotiated = false;
 
 typedef struct {
 	int argc;
@@ -194,10 +211,8 @@ static void uhyve_exit(void* arg)
 			pthread_kill(vcpu_threads[i], SIGTERM);
 		}
 
-		if (netfd > 0) {
-			pthread_kill(rx_thread, SIGTERM);
-			pthread_kill(tx_thread, SIGTERM);
-		}
+		if (netfd > 0)
+			uhyve_net_stop();
 	}
 
 	close_fd(&vcpufd);
@@ -225,88 +240,543 @@ static void uhyve_atexit(void)
 	close_fd(&kvm);
 }
 
-static void* recieve_packets(void* arg)
+static int64_t handle_write(uhyve_write_t* uhyve_write)
 {
-	shared_queue_t* rx_queue = (shared_queue_t*) (SHAREDQUEUE_START+guest_mem);
-	uint64_t read_counter, written_counter, distance, idx;
-	uint64_t event_counter = 1;
-	ssize_t ret;
+	size_t bytes_to_write = uhyve_write->len;
+	size_t bytes_written = 0;
 
-	while (1)
+	while (bytes_to_write > 0)
 	{
-		while (1) {
-			read_counter = atomic_uint64_read(&rx_queue->read);
-			written_counter = atomic_uint64_read(&rx_queue->written);
-			distance = written_counter - read_counter;
-			if (distance < UHYVE_QUEUE_SIZE)
-				break;
-			else
-				sched_yield();
+		size_t physical_address;
+		size_t physical_address_end;
+		virt_to_phys((size_t)uhyve_write->buf + bytes_written, &physical_address, &physical_address_end);
+
+		size_t bytes_to_write_step = min(physical_address_end - physical_address, bytes_to_write);
+		size_t bytes_written_step = write(uhyve_write->fd, guest_mem+physical_address, bytes_to_write_step);
+		bytes_written += bytes_written_step;
+		if (bytes_written_step < bytes_to_write_step)
+			break;
+
+		bytes_to_write -= bytes_to_write_step;
+	}
+
+	uhyve_write->len = bytes_written;
+
+	return uhyve_write->len;
+}
+
+static int64_t handle_read(uhyve_read_t* uhyve_read)
+{
+	size_t bytes_to_read = uhyve_read->len;
+	size_t bytes_read = 0;
+
+	while (bytes_to_read > 0)
+	{
+		size_t physical_address;
+		size_t physical_address_end;
+		virt_to_phys((size_t)uhyve_read->buf + bytes_read, &physical_address, &physical_address_end);
+
+		size_t bytes_to_read_step = min(physical_address_end - physical_address, bytes_to_read);
+		size_t bytes_read_step = read(uhyve_read->fd, guest_mem+physical_address, bytes_to_read_step);
+		bytes_read += bytes_read_step;
+		if (bytes_read_step < bytes_to_read_step)
+			break;
+
+		bytes_to_read -= bytes_to_read_step;
+	}
+
+	uhyve_read->ret = bytes_read;
+
+	return uhyve_read->ret;
+}
+
+static int64_t handle_unlink(uhyve_unlink_t* uhyve_unlink)
+{
+	uhyve_unlink->ret = unlink((const char*)guest_mem+(size_t)uhyve_unlink->name);
+
+	return uhyve_unlink->ret;
+}
+
+static int64_t handle_open(uhyve_open_t* uhyve_open)
+{
+	char rpath[PATH_MAX];
+
+	// forbid to open the kvm device
+	if (realpath((const char*)guest_mem+(size_t)uhyve_open->name, rpath) < 0)
+		uhyve_open->ret = -1;
+	else if (strcmp(rpath, "/dev/kvm") == 0)
+		uhyve_open->ret = -1;
+	else
+		uhyve_open->ret = open((const char*)guest_mem+(size_t)uhyve_open->name, uhyve_open->flags, uhyve_open->mode);
+
+	return uhyve_open->ret;
+}
+
+static int64_t handle_close(uhyve_close_t* uhyve_close)
+{
+	if (uhyve_close->fd > 2)
+		uhyve_close->ret = close(uhyve_close->fd);
+	else
+		uhyve_close->ret = 0;
+
+	return uhyve_close->ret;
+}
+
+static int64_t handle_lseek(uhyve_lseek_t* uhyve_lseek)
+{
+	uhyve_lseek->offset = lseek(uhyve_lseek->fd, uhyve_lseek->offset, uhyve_lseek->whence);
+
+	return uhyve_lseek->offset;
+}
+
+/* Copies an object, which may cross a page boundary, out of the guest */
+static int copy_from_guest(void* dst, size_t virtual_address, size_t len)
+{
+	size_t pos = 0;
+
+	while (pos < len) {
+		size_t physical_address, physical_address_end;
+
+		virt_to_phys(virtual_address + pos, &physical_address, &physical_address_end);
+		if (physical_address_end <= physical_address)
+			return -1;
+
+		size_t step = min(physical_address_end - physical_address, len - pos);
+		memcpy((uint8_t*) dst + pos, guest_mem + physical_address, step);
+		pos += step;
+	}
+
+	return 0;
+}
+
+/*
+ * Collects the physically contiguous host spans of one or more guest
+ * buffers. Adjacent spans are merged, so that one preadv/pwritev (or
+ * readv/writev if offset < 0) covers the whole request unless it exceeds
+ * IOV_MAX spans.
+ */
+typedef struct {
+	int fd;
+	off_t offset;
+	bool is_write;
+	bool stop;
+	ssize_t total;
+	size_t pending;
+	int cnt;
+	struct iovec iov[IOV_MAX];
+} iov_builder_t;
+
+static void iov_flush(iov_builder_t* b)
+{
+	ssize_t ret;
+
+	if (!b->cnt || b->stop)
+		return;
+
+	if (b->offset < 0)
+		ret = b->is_write ? writev(b->fd, b->iov, b->cnt) : readv(b->fd, b->iov, b->cnt);
+	else if (b->is_write)
+		ret = pwritev(b->fd, b->iov, b->cnt, b->offset + b->total);
+	else
+		ret = preadv(b->fd, b->iov, b->cnt, b->offset + b->total);
+
+	if (ret < 0) {
+		if (!b->total)
+			b->total = -1;
+		b->stop = true;
+	} else {
+		b->total += ret;
+		if ((size_t) ret < b->pending)
+			b->stop = true;
+	}
+
+	b->cnt = 0;
+	b->pending = 0;
+}
+
+static void iov_add(iov_builder_t* b, size_t virtual_address, size_t len)
+{
+	size_t pos = 0;
+
+	while ((pos < len) && !b->stop) {
+		size_t physical_address, physical_address_end;
+
+		virt_to_phys(virtual_address + pos, &physical_address, &physical_address_end);
+		if (physical_address_end <= physical_address) {
+			// invalid buffer => transfer what we have so far
+			iov_flush(b);
+			b->stop = true;
+			return;
 		}
 
-		idx = written_counter % UHYVE_QUEUE_SIZE;
-		ret = read(netfd, rx_queue->inner[idx].data, UHYVE_NET_MTU);
-		if (ret > 0) {
-			rx_queue->inner[idx].len = ret;
-			atomic_uint64_inc(&rx_queue->written);
-			write(efd, &event_counter, sizeof(event_counter));
+		size_t step = min(physical_address_end - physical_address, len - pos);
+		uint8_t* host = guest_mem + physical_address;
+
+		if (b->cnt && ((uint8_t*) b->iov[b->cnt-1].iov_base + b->iov[b->cnt-1].iov_len == host)) {
+			b->iov[b->cnt-1].iov_len += step;
+		} else {
+			if (b->cnt == IOV_MAX) {
+				iov_flush(b);
+				if (b->stop)
+					return;
+			}
+
+			b->iov[b->cnt].iov_base = host;
+			b->iov[b->cnt].iov_len = step;
+			b->cnt++;
 		}
+
+		b->pending += step;
+		pos += step;
 	}
+}
 
-	return NULL;
+static ssize_t iov_finish(iov_builder_t* b)
+{
+	iov_flush(b);
+
+	return b->total;
 }
 
-static void* transfer_packets(void* arg) {
-	shared_queue_t* tx_queue = (shared_queue_t*) (SHAREDQUEUE_START+guest_mem+SHAREDQUEUE_CEIL(sizeof(shared_queue_t)));
-	uint64_t read_counter, written_counter, distance, idx;
-	ssize_t ret;
+static void iov_init(iov_builder_t* b, int fd, off_t offset, bool is_write)
+{
+	b->fd = fd;
+	b->offset = offset;
+	b->is_write = is_write;
+	b->stop = false;
+	b->total = 0;
+	b->pending = 0;
+	b->cnt = 0;
+}
 
-	while (1) {
-		sem_wait(&tx_sem);
-
-		read_counter = atomic_uint64_read(&tx_queue->read);
-		written_counter = atomic_uint64_read(&tx_queue->written);
-		distance = written_counter - read_counter;
-
-		if (distance > 0) {
-			idx = read_counter % UHYVE_QUEUE_SIZE;
-			ssize_t len = tx_queue->inner[idx].len;
-
-			if (len >= UHYVE_NET_MTU) {
-				fprintf(stderr, "Drop message. Message is too large.\n");
-			} else {
-				for (ssize_t i = 0; i < len; ) {
-					ret = write(netfd, tx_queue->inner[idx].data+i, len-i);
-					if (ret > 0)
-						i += ret;
-				}
+/* guest_iov is the guest-virtual address of an uhyve_iovec_t array */
+static ssize_t transfer_iov(int fd, size_t guest_iov, int iovcnt, off_t offset, bool is_write)
+{
+	iov_builder_t b;
+
+	iov_init(&b, fd, offset, is_write);
+	for(int i = 0; (i < iovcnt) && !b.stop; i++) {
+		uhyve_iovec_t elem;
+
+		if (copy_from_guest(&elem, guest_iov + i * sizeof(uhyve_iovec_t), sizeof(elem)) < 0)
+			break;
+		iov_add(&b, (size_t) elem.iov_base, elem.iov_len);
+	}
+
+	return iov_finish(&b);
+}
+
+static ssize_t transfer_buf(int fd, size_t buf, size_t len, off_t offset, bool is_write)
+{
+	iov_builder_t b;
+
+	iov_init(&b, fd, offset, is_write);
+	iov_add(&b, buf, len);
+
+	return iov_finish(&b);
+}
+
+static int64_t handle_pread(uhyve_pread_t* uhyve_pread)
+{
+	// a negative offset would select the current file position
+	if (uhyve_pread->offset < 0)
+		return uhyve_pread->ret = -EINVAL;
+
+	uhyve_pread->ret = transfer_buf(uhyve_pread->fd, (size_t) uhyve_pread->buf,
+		uhyve_pread->len, uhyve_pread->offset, false);
+
+	return uhyve_pread->ret;
+}
+
+static int64_t handle_pwrite(uhyve_pwrite_t* uhyve_pwrite)
+{
+	if (uhyve_pwrite->offset < 0)
+		return uhyve_pwrite->ret = -EINVAL;
+
+	uhyve_pwrite->ret = transfer_buf(uhyve_pwrite->fd, (size_t) uhyve_pwrite->buf,
+		uhyve_pwrite->len, uhyve_pwrite->offset, true);
+
+	return uhyve_pwrite->ret;
+}
+
+static int64_t handle_readv(uhyve_readv_t* uhyve_readv)
+{
+	if (uhyve_readv->offset < -1)
+		return uhyve_readv->ret = -EINVAL;
+
+	uhyve_readv->ret = transfer_iov(uhyve_readv->fd, (size_t) uhyve_readv->iov,
+		uhyve_readv->iovcnt, uhyve_readv->offset, false);
+
+	return uhyve_readv->ret;
+}
+
+static int64_t handle_writev(uhyve_writev_t* uhyve_writev)
+{
+	if (uhyve_writev->offset < -1)
+		return uhyve_writev->ret = -EINVAL;
+
+	uhyve_writev->ret = transfer_iov(uhyve_writev->fd, (size_t) uhyve_writev->iov,
+		uhyve_writev->iovcnt, uhyve_writev->offset, true);
+
+	return uhyve_writev->ret;
+}
+
+/* Returns the size of the argument struct of a file hypercall or 0 */
+static size_t hcall_args_size(uint64_t port)
+{
+	switch (port) {
+	case UHYVE_PORT_WRITE:
+		return sizeof(uhyve_write_t);
+	case UHYVE_PORT_READ:
+		return sizeof(uhyve_read_t);
+	case UHYVE_PORT_UNLINK:
+		return sizeof(uhyve_unlink_t);
+	case UHYVE_PORT_OPEN:
+		return sizeof(uhyve_open_t);
+	case UHYVE_PORT_CLOSE:
+		return sizeof(uhyve_close_t);
+	case UHYVE_PORT_LSEEK:
+		return sizeof(uhyve_lseek_t);
+	case UHYVE_PORT_PREAD:
+		return sizeof(uhyve_pread_t);
+	case UHYVE_PORT_PWRITE:
+		return sizeof(uhyve_pwrite_t);
+	case UHYVE_PORT_READV:
+		return sizeof(uhyve_readv_t);
+	case UHYVE_PORT_WRITEV:
+		return sizeof(uhyve_writev_t);
+	default:
+		return 0;
+	}
+}
+
+/* Returns true if the guest-physical range lies completely inside of the guest memory */
+static inline bool guest_range_valid(size_t start, size_t size)
+{
+	return (start < guest_size) && (size <= guest_size - start);
+}
+
+/* The argument struct has to be completely inside of the guest memory */
+static inline bool hcall_args_valid(uint64_t port, size_t args)
+{
+	const size_t size = hcall_args_size(port);
+
+	return size && guest_range_valid(args, size);
+}
+
+/*
+ * Handles the file-related hypercalls, which are reachable through their
+ * own port as well as through the batched hypercall queue. args is the
+ * guest-physical address of the argument struct.
+ */
+static int handle_hcall(uint64_t port, size_t args, int64_t* ret)
+{
+	int64_t tmp;
+
+	if (!ret)
+		ret = &tmp;
+
+	if (hcall_args_size(port) && !hcall_args_valid(port, args)) {
+		fprintf(stderr, "KVM: invalid argument 0x%zx of hypercall 0x%x\n", args, (unsigned) port);
+		*ret = -EFAULT;
+		return 0;
+	}
+
+	switch (port) {
+	case UHYVE_PORT_WRITE:
+		*ret = handle_write((uhyve_write_t*) (guest_mem+args));
+		break;
+	case UHYVE_PORT_READ:
+		*ret = handle_read((uhyve_read_t*) (guest_mem+args));
+		break;
+	case UHYVE_PORT_UNLINK:
+		*ret = handle_unlink((uhyve_unlink_t*) (guest_mem+args));
+		break;
+	case UHYVE_PORT_OPEN:
+		*ret = handle_open((uhyve_open_t*) (guest_mem+args));
+		break;
+	case UHYVE_PORT_CLOSE:
+		*ret = handle_close((uhyve_close_t*) (guest_mem+args));
+		break;
+	case UHYVE_PORT_LSEEK:
+		*ret = handle_lseek((uhyve_lseek_t*) (guest_mem+args));
+		break;
+	case UHYVE_PORT_PREAD:
+		*ret = handle_pread((uhyve_pread_t*) (guest_mem+args));
+		break;
+	case UHYVE_PORT_PWRITE:
+		*ret = handle_pwrite((uhyve_pwrite_t*) (guest_mem+args));
+		break;
+	case UHYVE_PORT_READV:
+		*ret = handle_readv((uhyve_readv_t*) (guest_mem+args));
+		break;
+	case UHYVE_PORT_WRITEV:
+		*ret = handle_writev((uhyve_writev_t*) (guest_mem+args));
+		break;
+	default:
+		*ret = -EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void post_hcall_completion(uint64_t user_data, int64_t ret)
+{
+	uhyve_hcall_queue_t* queue = (uhyve_hcall_queue_t*) (guest_mem+HCALLQUEUE_START);
+
+	pthread_mutex_lock(&hcall_cq_lock);
+
+	uint64_t tail = queue->cq_tail;
+	uhyve_hcall_cqe_t* cqe = &queue->cqes[tail % UHYVE_HCALL_QUEUE_SIZE];
+
+	cqe->user_data = user_data;
+	cqe->ret = ret;
+
+	// publish the entry before the new tail
+	__atomic_store_n(&queue->cq_tail, tail + 1, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&hcall_cq_lock);
+}
+
+/*
+ * Called by the I/O engine for requests, which have been completed
+ * asynchronously. The guest is notified by UHYVE_IRQ_HCALL.
+ */
+static void complete_async_hcall(uint64_t user_data, int64_t ret)
+{
+	uint64_t event_counter = 1;
+
+	post_hcall_completion(user_data, ret);
+
+	if (write(hcall_efd, &event_counter, sizeof(event_counter)) < 0)
+		fprintf(stderr, "[WARNING] Unable to signal hypercall completion - %d (%s)\n",
+			errno, strerror(errno));
+}
+
+/* Processes a request, which is queued behind asynchronous I/O */
+static int64_t sync_async_hcall(uint64_t port, size_t args)
+{
+	int64_t ret;
+
+	handle_hcall(port, args, &ret);
+
+	return ret;
+}
+
+/* Handles UHYVE_PORT_FREE_PAGES, see uhyve_free_pages_t */
+static void handle_free_pages(uhyve_free_pages_t* arg)
+{
+	switch (arg->cmd) {
+	case UHYVE_FREE_PAGES_NEGOTIATE:
+		free_pages_negotiated = free_page_interval > 0;
+		arg->enabled = free_pages_negotiated;
+		arg->interval = free_page_interval;
+		break;
+	case UHYVE_FREE_PAGES_REPORT: {
+			const size_t count = arg->count;
+
+			arg->freed = 0;
+			if (!free_pages_negotiated)
+				break;
+			if (!guest_range_valid(arg->ranges, count * sizeof(uhyve_free_range_t))) {
+				fprintf(stderr, "KVM: invalid free page report at 0x%llx\n",
+					(unsigned long long) arg->ranges);
+				break;
 			}
 
-			atomic_uint64_inc(&tx_queue->read);
+			const uhyve_free_range_t* ranges = (const uhyve_free_range_t*) (guest_mem + arg->ranges);
+			for(size_t i = 0; i < count; i++) {
+				const size_t start = ranges[i].start;
+				const size_t size = ranges[i].size;
+
+				if (guest_range_valid(start, size))
+					arg->freed += report_free_range(start, start + size);
+			}
+
+			if (verbose)
+				fprintf(stderr, "Guest reports %llu MiB of free memory\n",
+					(unsigned long long) arg->freed >> 20);
+			break;
 		}
+	default:
+		arg->enabled = 0;
+		break;
 	}
+}
 
-	return NULL;
+static inline void check_aio(void)
+{
+	const char* hermit_io_uring = getenv("HERMIT_IO_URING");
+	struct kvm_irqfd irqfd = {};
+
+	if (!hermit_io_uring || (strcmp(hermit_io_uring, "0") == 0))
+		return;
+
+	hcall_efd = eventfd(0, 0);
+	if (hcall_efd < 0)
+		err(1, "unable to create eventfd");
+	irqfd.fd = hcall_efd;
+	irqfd.gsi = UHYVE_IRQ_HCALL;
+	kvm_ioctl(vmfd, KVM_IRQFD, &irqfd);
+
+	if (uhyve_aio_init(complete_async_hcall, sync_async_hcall) < 0)
+		fprintf(stderr, "[WARNING] Fall back to synchronous file hypercalls\n");
 }
 
-static inline void check_network(void)
+/*
+ * Processes all requests, which are pending in the batched hypercall
+ * queue. Called by the vCPU, which rings the doorbell.
+ */
+static void drain_hcall_queue(void)
 {
-	// should we start the network thread?
-	if ((efd < 0) && (getenv("HERMIT_NETIF"))) {
-		struct kvm_irqfd irqfd = {};
+	uhyve_hcall_queue_t* queue = (uhyve_hcall_queue_t*) (guest_mem+HCALLQUEUE_START);
+	uint64_t head, tail;
+	bool async = uhyve_aio_enabled();
+
+	if (guest_size < HCALLQUEUE_START + sizeof(uhyve_hcall_queue_t)) {
+		fprintf(stderr, "KVM: the hypercall queue is outside of the guest memory\n");
+		return;
+	}
+
+	pthread_mutex_lock(&hcall_lock);
 
-		efd = eventfd(0, 0);
-		irqfd.fd = efd;
-		irqfd.gsi = UHYVE_IRQ_NET;
-		kvm_ioctl(vmfd, KVM_IRQFD, &irqfd);
+	head = queue->sq_head;
+	tail = __atomic_load_n(&queue->sq_tail, __ATOMIC_ACQUIRE);
+	if (tail - head > UHYVE_HCALL_QUEUE_SIZE) {
+		fprintf(stderr, "KVM: invalid state of the hypercall queue (head %llu, tail %llu)\n",
+			(unsigned long long) head, (unsigned long long) tail);
+		tail = head + UHYVE_HCALL_QUEUE_SIZE;
+	}
+
+	for(; head != tail; head++) {
+		const uhyve_hcall_sqe_t* sqe = &queue->sqes[head % UHYVE_HCALL_QUEUE_SIZE];
+		// the guest may modify the entry in the meantime
+		const uint64_t user_data = sqe->user_data;
+		const size_t args = sqe->args;
+		const uint16_t port = sqe->port;
+		int64_t ret;
+
+		// completed later by complete_async_hcall()
+		if (async && hcall_args_valid(port, args) && (uhyve_aio_submit(port, args, user_data) == 0))
+			continue;
 
-		sem_init(&tx_sem, 0, 1);
+		if (handle_hcall(port, args, &ret) < 0)
+			fprintf(stderr, "KVM: unhandled batched hypercall at port 0x%x\n", port);
 
-		if (pthread_create(&rx_thread, NULL, recieve_packets, NULL))
-			err(1, "unable to create thread");
-		if (pthread_create(&tx_thread, NULL, transfer_packets, NULL))
-			err(1, "unable to create thread");
+		post_hcall_completion(user_data, ret);
 	}
+
+	__atomic_store_n(&queue->sq_head, head, __ATOMIC_RELEASE);
+
+	pthread_mutex_unlock(&hcall_lock);
+}
+
+/* writes a core dump of a crashed guest, if HERMIT_COREDUMP is set */
+static void crash_dump(void)
+{
+	if (coredump_path)
+		create_coredump(coredump_path);
 }
 
 static int vcpu_loop(void)
@@ -319,6 +789,9 @@ static int vcpu_loop(void)
 		vcpu_state_t cpu_state = read_cpu_state();
 		restore_cpu_state(cpu_state);
 
+		/* the VM-wide state is restored, before a VCPU runs */
+		pthread_barrier_wait(&barrier);
+
 		/* chkpt no. of the following checkpoint */
 		if (cpuid == 0)
 			no_checkpoint++;
@@ -345,7 +818,12 @@ static int vcpu_loop(void)
 	}
 
 	while (1) {
+		stats_vcpu_run();
 		ret = ioctl(vcpufd, KVM_RUN, NULL);
+		stats_vcpu_exit(ret == -1 ? STATS_EXIT_INTR : run->exit_reason);
+
+		// the guest may have changed its page tables
+		virt_to_phys_flush();
 
 		if(ret == -1) {
 			switch(errno) {
@@ -355,6 +833,7 @@ static int vcpu_loop(void)
 			case EFAULT: {
 				struct kvm_regs regs;
 				kvm_ioctl(vcpufd, KVM_GET_REGS, &regs);
+				crash_dump();
 #ifdef __x86_64__
 				err(1, "KVM: host/guest translation fault: rip=0x%llx", regs.rip);
 #else
@@ -390,6 +869,7 @@ static int vcpu_loop(void)
 				port = run->io.port;
 				raddr = *((unsigned*)((size_t)run+run->io.data_offset));
 			}
+			stats_vcpu_port(port);
 
 			//printf("port 0x%x\n", run->io.port);
 			switch (port) {
@@ -397,53 +877,25 @@ static int vcpu_loop(void)
 				if (verbose)
 					putc((unsigned char) raddr, stderr);
 				break;
-			case UHYVE_PORT_WRITE: {
-					uhyve_write_t* uhyve_write = (uhyve_write_t*) (guest_mem+raddr);
-					size_t bytes_to_write = uhyve_write->len;
-					size_t bytes_written = 0;
-
-					while (bytes_to_write > 0)
-					{
-						size_t physical_address;
-						size_t physical_address_end;
-						virt_to_phys((size_t)uhyve_write->buf + bytes_written, &physical_address, &physical_address_end);
-
-						size_t bytes_to_write_step = min(physical_address_end - physical_address, bytes_to_write);
-						size_t bytes_written_step = write(uhyve_write->fd, guest_mem+physical_address, bytes_to_write_step);
-						bytes_written += bytes_written_step;
-						if (bytes_written_step < bytes_to_write_step)
-							break;
-
-						bytes_to_write -= bytes_to_write_step;
-					}
-
-					uhyve_write->len = bytes_written;
-					break;
-				}
-
-			case UHYVE_PORT_READ: {
-					uhyve_read_t* uhyve_read = (uhyve_read_t*) (guest_mem+raddr);
-					size_t bytes_to_read = uhyve_read->len;
-					size_t bytes_read = 0;
-
-					while (bytes_to_read > 0)
-					{
-						size_t physical_address;
-						size_t physical_address_end;
-						virt_to_phys((size_t)uhyve_read->buf + bytes_read, &physical_address, &physical_address_end);
-
-						size_t bytes_to_read_step = min(physical_address_end - physical_address, bytes_to_read);
-						size_t bytes_read_step = read(uhyve_read->fd, guest_mem+physical_address, bytes_to_read_step);
-						bytes_read += bytes_read_step;
-						if (bytes_read_step < bytes_to_read_step)
-							break;
-
-						bytes_to_read -= bytes_to_read_step;
-					}
+			case UHYVE_PORT_WRITE:
+			case UHYVE_PORT_READ:
+			case UHYVE_PORT_UNLINK:
+			case UHYVE_PORT_OPEN:
+			case UHYVE_PORT_CLOSE:
+			case UHYVE_PORT_LSEEK:
+			case UHYVE_PORT_PREAD:
+			case UHYVE_PORT_PWRITE:
+			case UHYVE_PORT_READV:
+			case UHYVE_PORT_WRITEV:
+				// keep the order with asynchronous I/O on the same file
+				if (hcall_args_valid(port, raddr))
+					uhyve_aio_drain(port, raddr);
+				handle_hcall(port, raddr, NULL);
+				break;
 
-					uhyve_read->ret = bytes_read;
-					break;
-				}
+			case UHYVE_PORT_HCALL_DOORBELL:
+				drain_hcall_queue();
+				break;
 
 			case UHYVE_PORT_EXIT: {
 					if (cpuid)
@@ -453,55 +905,20 @@ static int vcpu_loop(void)
 					break;
 				}
 
-			case UHYVE_PORT_UNLINK: {
-				uhyve_unlink_t* uhyve_unlink = (uhyve_unlink_t*) (guest_mem+raddr);
-				uhyve_unlink->ret = unlink((const char*)guest_mem+(size_t)uhyve_unlink->name);
+			case UHYVE_PORT_NETINFO:
+				uhyve_net_info(guest_mem+raddr);
 				break;
-			}
-
-			case UHYVE_PORT_OPEN: {
-					uhyve_open_t* uhyve_open = (uhyve_open_t*) (guest_mem+raddr);
-					char rpath[PATH_MAX];
-
-					// forbid to open the kvm device
-					if (realpath((const char*)guest_mem+(size_t)uhyve_open->name, rpath) < 0)
-						uhyve_open->ret = -1;
-					else if (strcmp(rpath, "/dev/kvm") == 0)
-						uhyve_open->ret = -1;
-					else
-						uhyve_open->ret = open((const char*)guest_mem+(size_t)uhyve_open->name, uhyve_open->flags, uhyve_open->mode);
-					break;
-				}
 
-			case UHYVE_PORT_CLOSE: {
-					uhyve_close_t* uhyve_close = (uhyve_close_t*) (guest_mem+raddr);
-
-					if (uhyve_close->fd > 2)
-						uhyve_close->ret = close(uhyve_close->fd);
-					else
-						uhyve_close->ret = 0;
-					break;
-				}
-
-			case UHYVE_PORT_NETINFO: {
-					char* mac = (char*)(guest_mem+raddr);
-					memcpy(mac, uhyve_get_mac(), 6);
-					// guest configure the ethernet device => start network thread
-					check_network();
+			case UHYVE_PORT_NETCONFIG: {
+					uhyve_netconfig_t* config = (uhyve_netconfig_t*)(guest_mem+raddr);
+					uhyve_net_start(config);
 					break;
 				}
 
-			case UHYVE_PORT_NETWRITE: {
-					sem_post(&tx_sem);
-					break;
-				}
-
-			case UHYVE_PORT_LSEEK: {
-					uhyve_lseek_t* uhyve_lseek = (uhyve_lseek_t*) (guest_mem+raddr);
-
-					uhyve_lseek->offset = lseek(uhyve_lseek->fd, uhyve_lseek->offset, uhyve_lseek->whence);
-					break;
-				}
+			case UHYVE_PORT_NETWRITE:
+			case UHYVE_PORT_NETREAD:
+				uhyve_net_kick(port, raddr);
+				break;
 
 			case UHYVE_PORT_CMDSIZE: {
 					int i;
@@ -536,30 +953,49 @@ static int vcpu_loop(void)
 					break;
 				}
 
+			case UHYVE_PORT_SNAPSHOT:
+				create_snapshot();
+				break;
+
+			case UHYVE_PORT_FREE_PAGES:
+				if (guest_range_valid(raddr, sizeof(uhyve_free_pages_t)))
+					handle_free_pages((uhyve_free_pages_t*) (guest_mem+raddr));
+				break;
+
 			case UHYVE_PORT_FREELIST: {
+					bool requested = freelist_requested;
+
 					/* check if we received a valid list */
-					if (raddr == 0) {
-						sem_post(&mig_sem);
-						break;
+					if ((raddr != 0) && requested) {
+						/* this is arch specific */
+						determine_mem_mappings((free_list_t*)(guest_mem+raddr));
 					}
 
-					/* this is arch specific */
-					determine_mem_mappings((free_list_t*)(guest_mem+raddr));
-
 					/* wake up main thread */
-					sem_post(&mig_sem);
+					if (requested) {
+						freelist_requested = false;
+						sem_post(&mig_sem);
+					}
 					break;
 				}
 
 			default:
+				crash_dump();
 				err(1, "KVM: unhandled KVM_EXIT_IO / KVM_EXIT_MMIO at port 0x%lx\n", port);
 				break;
 			}
 			break;
 
+#ifdef KVM_EXIT_DIRTY_RING_FULL
+		case KVM_EXIT_DIRTY_RING_FULL:
+			dirty_log_ring_full(cpuid);
+			break;
+#endif
+
 		case KVM_EXIT_FAIL_ENTRY:
 			if (uhyve_gdb_enabled)
 				uhyve_gdb_handle_exception(vcpufd, GDB_SIGNAL_SEGV);
+			crash_dump();
 			err(1, "KVM: entry failure: hw_entry_failure_reason=0x%llx\n",
 				run->fail_entry.hardware_entry_failure_reason);
 			break;
@@ -567,6 +1003,7 @@ static int vcpu_loop(void)
 		case KVM_EXIT_INTERNAL_ERROR:
 			if (uhyve_gdb_enabled)
 				uhyve_gdb_handle_exception(vcpufd, GDB_SIGNAL_SEGV);
+			crash_dump();
 			err(1, "KVM: internal error exit: suberror = 0x%x\n", run->internal.suberror);
 			break;
 
@@ -578,10 +1015,12 @@ static int vcpu_loop(void)
 				uhyve_gdb_handle_exception(vcpufd, GDB_SIGNAL_TRAP);
 				break;
 			} else print_registers();
+			crash_dump();
 			exit(EXIT_FAILURE);
 
 		default:
 			fprintf(stderr, "KVM: unhandled exit: exit_reason = 0x%x\n", run->exit_reason);
+			crash_dump();
 			exit(EXIT_FAILURE);
 		}
 	}
@@ -606,13 +1045,22 @@ static int vcpu_init(void)
 	if (run == MAP_FAILED)
 		err(1, "KVM: VCPU mmap failed");
 
+	dirty_log_init_vcpu(vcpufd, cpuid);
+	stats_init_vcpu(cpuid);
+
 	return 0;
 }
 
 static void sigusr_handler(int signum)
 {
 	pthread_barrier_wait(&barrier);
-	write_cpu_state();
+	if (snapshot_states) {
+		/* the snapshot is written after all VCPUs have saved their state */
+		snapshot_states[cpuid] = save_cpu_state();
+		pthread_barrier_wait(&barrier);
+	} else {
+		write_cpu_state();
+	}
 
 	pthread_barrier_wait(&barrier);
 }
@@ -635,6 +1083,65 @@ static void vcpu_thread_mig_handler(int signum)
 	pthread_barrier_wait(&migration_barrier);
 }
 
+/*
+ * A throttled VCPU sleeps throttle_percent of each THROTTLE_PERIOD_US.
+ * Slows down guests, which dirty their memory faster than a live
+ * migration is able to send it.
+ */
+#define THROTTLE_PERIOD_US	10000
+
+static volatile uint32_t throttle_percent = 0;
+
+static void vcpu_throttle_handler(int signum)
+{
+	uint32_t percent = throttle_percent;
+	int saved_errno = errno;
+
+	// nanosleep is async-signal-safe, in contrast to usleep
+	if (percent) {
+		struct timespec ts = {
+			.tv_sec = 0,
+			.tv_nsec = (long) percent * THROTTLE_PERIOD_US / 100 * 1000,
+		};
+		nanosleep(&ts, NULL);
+	}
+
+	errno = saved_errno;
+}
+
+static void* throttle_thread(void* arg)
+{
+	while (1) {
+		if (throttle_percent) {
+			for(size_t i = 0; i < ncores; i++)
+				if (vcpu_threads[i])
+					pthread_kill(vcpu_threads[i], SIGTHRTHROTTLE);
+		}
+
+		usleep(THROTTLE_PERIOD_US);
+	}
+
+	return NULL;
+}
+
+void vcpu_throttle(uint32_t percent)
+{
+	static bool started = false;
+
+	throttle_percent = percent > 99 ? 99 : percent;
+
+	if (percent && !started) {
+		pthread_t thread;
+
+		if (create_helper_thread(&thread, throttle_thread, NULL) == 0) {
+			pthread_detach(thread);
+			started = true;
+		} else {
+			fprintf(stderr, "[WARNING] Unable to create throttle thread\n");
+		}
+	}
+}
+
 static void* uhyve_thread(void* arg)
 {
 	size_t ret;
@@ -643,6 +1150,7 @@ static void* uhyve_thread(void* arg)
 	pthread_cleanup_push(uhyve_exit, NULL);
 
 	cpuid = (size_t) arg;
+	mem_pin_vcpu(cpuid);
 
 	/* install signal handler for checkpoint */
 	memset(&sa, 0x00, sizeof(sa));
@@ -668,6 +1176,30 @@ static void* uhyve_thread(void* arg)
 }
 
 
+/*
+ * The guest sends its free list to UHYVE_PORT_FREELIST on each
+ * UHYVE_IRQ_MIGRATION.
+ */
+static void create_freelist_eventfd(void)
+{
+	struct kvm_irqfd irqfd = {};
+
+	if (mig_efd >= 0)
+		return;
+
+	fprintf(stderr, "[INFO] Creating eventfd for migration "
+			"requests\n");
+	if ((mig_efd = eventfd(0, 0)) < 0) {
+		fprintf(stderr, "[WARNING] Could create the migration "
+				"eventfd - %d (%s).\n",
+				errno,
+				strerror(errno));
+	}
+	irqfd.fd = mig_efd;
+	irqfd.gsi = UHYVE_IRQ_MIGRATION;
+	kvm_ioctl(vmfd, KVM_IRQFD, &irqfd);
+}
+
 /**
  * \brief Generates the guest's mem_mappings based on its free list
  */
@@ -677,6 +1209,7 @@ void determine_guest_allocations(void)
 	fprintf(stderr, "[INFO] Requsting guest's free list ...\n");
 	mem_mappings.mem_chunks = NULL;
 	mem_mappings.count = 0;
+	freelist_requested = true;
 	uint64_t event_counter = 1;
 	if (write(mig_efd, &event_counter, sizeof(event_counter)) < 0) {
 		fprintf(stderr, "[ERROR] Could not request the guest's free "
@@ -690,6 +1223,70 @@ void determine_guest_allocations(void)
 	sem_wait(&mig_sem);
 }
 
+/*
+ * An idle vCPU halts in KVM, which wakes it up by the in-kernel LAPIC.
+ * HERMIT_IDLE selects how long it polls before it sleeps:
+ * "sleep" never polls, "poll" polls up to HERMIT_HALT_POLL_NS (default
+ * IDLE_POLL_NS) and "spin" keeps HLT, MWAIT and PAUSE in the guest, which
+ * requires dedicated host CPUs (see HERMIT_CPU_AFFINITY). Without
+ * HERMIT_IDLE, KVM's module defaults apply. Has to be called before the
+ * vCPUs are created.
+ */
+#define IDLE_POLL_NS	200000
+
+static void init_idle(void)
+{
+	const char* idle = getenv("HERMIT_IDLE");
+	const char* poll_ns = getenv("HERMIT_HALT_POLL_NS");
+	long ns = -1;
+
+	if (idle && (strcmp(idle, "sleep") == 0)) {
+		ns = 0;
+	} else if (idle && (strcmp(idle, "poll") == 0)) {
+		ns = IDLE_POLL_NS;
+	} else if (idle && (strcmp(idle, "spin") == 0)) {
+#if defined(__x86_64__) && defined(KVM_CAP_X86_DISABLE_EXITS)
+		int supported = ioctl(vmfd, KVM_CHECK_EXTENSION, KVM_CAP_X86_DISABLE_EXITS);
+		struct kvm_enable_cap cap = {
+			.cap = KVM_CAP_X86_DISABLE_EXITS,
+			.args[0] = supported & (KVM_X86_DISABLE_EXITS_HLT | KVM_X86_DISABLE_EXITS_MWAIT | KVM_X86_DISABLE_EXITS_PAUSE),
+		};
+
+		if (supported <= 0)
+			fprintf(stderr, "[WARNING] KVM does not support idle VCPUs in the guest\n");
+		else if (ioctl(vmfd, KVM_ENABLE_CAP, &cap) < 0)
+			fprintf(stderr, "[WARNING] Unable to keep the idle loop in the guest - %d (%s)\n", errno, strerror(errno));
+		else if (verbose)
+			fprintf(stderr, "Idle VCPUs spin in the guest (exits 0x%llx disabled)\n", cap.args[0]);
+#else
+		fprintf(stderr, "[WARNING] Idle VCPUs are not able to spin in the guest\n");
+#endif
+	} else if (idle) {
+		fprintf(stderr, "[WARNING] Unknown idle model %s\n", idle);
+	}
+
+	if (poll_ns)
+		ns = atol(poll_ns);
+	if (ns < 0)
+		return;
+
+#ifdef KVM_CAP_HALT_POLL
+	struct kvm_enable_cap cap = {
+		.cap = KVM_CAP_HALT_POLL,
+		.args[0] = (uint64_t) ns,
+	};
+
+	if (ioctl(vmfd, KVM_CHECK_EXTENSION, KVM_CAP_HALT_POLL) <= 0)
+		fprintf(stderr, "[WARNING] KVM does not support the halt polling per VM\n");
+	else if (ioctl(vmfd, KVM_ENABLE_CAP, &cap) < 0)
+		fprintf(stderr, "[WARNING] Unable to set the halt polling of the VM - %d (%s)\n", errno, strerror(errno));
+	else if (verbose)
+		fprintf(stderr, "Halted VCPUs poll for %ld ns before they sleep\n", ns);
+#else
+	fprintf(stderr, "[WARNING] KVM_CAP_HALT_POLL is not supported by the kernel headers\n");
+#endif
+}
+
 void sigterm_handler(int signum)
 {
 	pthread_exit(0);
@@ -698,7 +1295,6 @@ void sigterm_handler(int signum)
 int uhyve_init(char *path)
 {
 	FILE *f = NULL;
-	guest_path = path;
 
 	signal(SIGTERM, sigterm_handler);
 
@@ -708,10 +1304,11 @@ int uhyve_init(char *path)
 	const char *start_mig_server = getenv("HERMIT_MIGRATION_SERVER");
 
 	/*
-	 * Three startups
+	 * Four startups
 	 * a) incoming migration
-	 * b) load existing checkpoint
-	 * c) normal run
+	 * b) resume from a snapshot
+	 * c) load existing checkpoint
+	 * d) normal run
 	 */
  	if (start_mig_server) {
 		migration = true;
@@ -722,6 +1319,8 @@ int uhyve_init(char *path)
 		guest_size = metadata.guest_size;
 		elf_entry = metadata.elf_entry;
 		full_checkpoint = metadata.full_checkpoint;
+	} else if (open_snapshot()) {
+		snapshot = true;
 	} else if ((f = fopen("checkpoint/chk_config.txt", "r")) != NULL) {
 		int tmp = 0;
 		restart = true;
@@ -732,6 +1331,8 @@ int uhyve_init(char *path)
 		fscanf(f, "entry point: 0x%zx", &elf_entry);
 		fscanf(f, "full checkpoint: %d", &tmp);
 		full_checkpoint = tmp ? true : false;
+		// older configurations start the chain at checkpoint 0
+		fscanf(f, "\nbase checkpoint: %u", &chk_base);
 
 		if (verbose)
 			fprintf(stderr,
@@ -773,19 +1374,33 @@ int uhyve_init(char *path)
 	/* Create the virtual machine */
 	vmfd = kvm_ioctl(kvm, KVM_CREATE_VM, 0);
 
-#ifdef __x86_64__
+	/* KVM's dirty log has to be set up before the memory slots */
+	dirty_log_init(vmfd, ncores);
+
+	/* post-copy populates the guest memory with a userfaultfd */
+	mem_init(migration && is_postcopy());
+
+	/* halt polling and disabled exits apply to the vCPUs created later */
+	init_idle();
+
+	stats_init(ncores);
+
 	init_kvm_arch();
 	if (restart) {
 		if (load_checkpoint(guest_mem, path) != 0)
 			exit(EXIT_FAILURE);
 	} else if (start_mig_server) {
 		load_migration_data(guest_mem);
-		close_migration_channel();
+		/* post-copy closes the channel, after all pages are received */
+		if (!is_postcopy())
+			close_migration_channel();
+	} else if (snapshot) {
+		if (load_snapshot(guest_mem) != 0)
+			exit(EXIT_FAILURE);
 	} else {
 		if (load_kernel(guest_mem, path) != 0)
 			exit(EXIT_FAILURE);
 	}
-#endif
 
 	pthread_barrier_init(&barrier, NULL, ncores);
 	pthread_barrier_init(&migration_barrier, NULL, ncores+1);
@@ -818,6 +1433,8 @@ int uhyve_loop(int argc, char **argv)
 	if (hermit_debug && (atoi(hermit_debug) != 0))
 		uhyve_gdb_enabled = true;
 
+	coredump_path = getenv("HERMIT_COREDUMP");
+
 	/* argv[0] is 'uhyve', do not count it */
 	uhyve_argc = argc-1;
 	uhyve_argv = &argv[1];
@@ -846,6 +1463,8 @@ int uhyve_loop(int argc, char **argv)
 	if (hermit_check)
 		ts = atoi(hermit_check);
 
+	check_aio();
+
 	if (hermit_mig_support) {
 		set_migration_target(hermit_mig_support, MIGRATION_PORT);
 		set_migration_params(hermit_mig_params);
@@ -865,23 +1484,21 @@ int uhyve_loop(int argc, char **argv)
 		sa.sa_handler = &vcpu_thread_mig_handler;
 		sigaction(SIGTHRMIG, &sa, NULL);
 
+		/* install signal handler for throttling during the pre-copy phase */
+		memset(&sa, 0x00, sizeof(sa));
+		sa.sa_handler = &vcpu_throttle_handler;
+		sigaction(SIGTHRTHROTTLE, &sa, NULL);
+
 		/* install eventfd and semaphore for memory mapping requests */
-		struct kvm_irqfd irqfd = {};
-
-		fprintf(stderr, "[INFO] Creating eventfd for migration "
-				"requests\n");
-		if ((mig_efd = eventfd(0, 0)) < 0) {
-			fprintf(stderr, "[WARNING] Could create the migration "
-					"eventfd - %d (%s).\n",
-					errno,
-					strerror(errno));
-		}
-		irqfd.fd = mig_efd;
-		irqfd.gsi = UHYVE_IRQ_MIGRATION;
-		kvm_ioctl(vmfd, KVM_IRQFD, &irqfd);
+		create_freelist_eventfd();
 		sem_init(&mig_sem, 0, 0);
 	}
 
+	const char* hermit_free_pages = getenv("HERMIT_FREE_PAGE_REPORTING");
+	// the guest reports at this interval, if it negotiates UHYVE_PORT_FREE_PAGES
+	if (hermit_free_pages && (atoi(hermit_free_pages) > 0))
+		free_page_interval = (unsigned) atoi(hermit_free_pages);
+
 
 	// First CPU is special because it will boot the system. Other CPUs will
 	// be booted linearily after the first one.
@@ -893,17 +1510,6 @@ int uhyve_loop(int argc, char **argv)
 
 	pthread_barrier_wait(&barrier);
 
-#ifdef __aarch64__
-	init_kvm_arch();
-	if (restart) {
-		if (load_checkpoint(guest_mem, guest_path) != 0)
-			exit(EXIT_FAILURE);
-	} else {
-		if (load_kernel(guest_mem, guest_path) != 0)
-			exit(EXIT_FAILURE);
-	}
-#endif
-
 	kheader->possible_cpus = ncores;
 
 	if (ts > 0)
@@ -926,6 +1532,7 @@ int uhyve_loop(int argc, char **argv)
 		setitimer(ITIMER_REAL, &timer, NULL);
 	}
 
-	// Run first CPU
+	// Run first CPU, threads created before keep the initial affinity
+	mem_pin_vcpu(0);
 	return vcpu_loop();
 }
@@ -29,6 +29,7 @@
 #define __UHYVE_H__
 
 #include <err.h>
+#include <stdbool.h>
 #include <linux/kvm.h>
 
 #define KERNEL_STACK_SIZE		32768
@@ -56,12 +57,36 @@
 #define UHYVE_UART_PORT			0x800
 #define UHYVE_PORT_UNLINK		0x840
 
+/* Doorbell for batched hypercalls, see HCALLQUEUE_START in uhyve-syscalls.h */
+#define UHYVE_PORT_HCALL_DOORBELL	0x880
+
+/* Positional and vectored file operations */
+#define UHYVE_PORT_PREAD		0x8C0
+#define UHYVE_PORT_PWRITE		0x900
+#define UHYVE_PORT_READV		0x940
+#define UHYVE_PORT_WRITEV		0x980
+
+/* Multi-queue network setup, see uhyve_netconfig_t in uhyve-net.h */
+#define UHYVE_PORT_NETCONFIG		0x9C0
+
+/* The guest has reached the point, from which new instances start */
+#define UHYVE_PORT_SNAPSHOT		0xA00
+
+/* Free page reporting, see uhyve_free_pages_t in uhyve-syscalls.h */
+#define UHYVE_PORT_FREE_PAGES		0xA40
+
 #define UHYVE_IRQ_BASE			11
 #define UHYVE_IRQ_NET			(UHYVE_IRQ_BASE+0)
 #define UHYVE_IRQ_MIGRATION		(UHYVE_IRQ_BASE+1)
+#define UHYVE_IRQ_HCALL			(UHYVE_IRQ_BASE+2)
+/* queue pair i > 0 raises UHYVE_IRQ_NET_QUEUE_BASE+i-1 */
+#define UHYVE_IRQ_NET_QUEUE_BASE	16
+/* GSIs up to this one are lines of the IOAPIC without a legacy device */
+#define UHYVE_IRQ_NET_QUEUE_END		24
 
 #define SIGTHRCHKP 	(SIGRTMIN+0)
 #define SIGTHRMIG 	(SIGRTMIN+1)
+#define SIGTHRTHROTTLE 	(SIGRTMIN+2)
 
 #define kvm_ioctl(fd, cmd, arg) ({ \
         const int ret = ioctl(fd, cmd, arg); \
@@ -88,6 +113,40 @@ typedef struct _vcpu_state {
 	struct kvm_vcpu_events events;
 	struct kvm_mp_state mp_state;
 } vcpu_state_t;
+#elif defined(__aarch64__)
+/* upper bound of the registers, which KVM_GET_REG_LIST reports for a vCPU */
+#define MAX_VCPU_REGS 512
+/* distributor (4 KiB) and CPU interface (256 bytes) registers of a GICv2 */
+#define MAX_VGIC_REGS ((0x1000 + 0x100) / 4)
+
+typedef struct _vcpu_reg {
+	uint64_t id;
+	// large enough for the 128-bit FP/SIMD registers
+	uint64_t data[2];
+} vcpu_reg_t;
+
+typedef struct _vgic_reg {
+	uint32_t group;
+	uint32_t offset;
+	uint32_t value;
+} vgic_reg_t;
+
+/*
+ * The core, FP/SIMD, system and timer registers are captured by their
+ * id, the registers of the vGIC with the banked view of the vCPU
+ */
+typedef struct _vcpu_state {
+	uint32_t nregs;
+	vcpu_reg_t regs[MAX_VCPU_REGS];
+	struct kvm_mp_state mp_state;
+	uint32_t nvgic_regs;
+	vgic_reg_t vgic_regs[MAX_VGIC_REGS];
+} vcpu_state_t;
+#else
+typedef struct _vcpu_state {
+	int dummy;
+} vcpu_state_t;
+#endif
 
 #define typeof __typeof__
 #define virt_to_phys_with_offset(virtual_address) ({ \
@@ -96,11 +155,6 @@ typedef struct _vcpu_state {
 	virt_to_phys((size_t)virtual_address, &physical_address, &physical_address_end); \
 	(typeof (virtual_address))(guest_mem+physical_address); \
 	})
-#else
-typedef struct _vcpu_state {
-	int dummy;
-} vcpu_state_t;
-#endif
 
 /* see also: arch/<type>/mm/memory.c */
 typedef struct free_list {
@@ -122,6 +176,10 @@ void write_cpu_state(void);
 void init_cpu_state(uint64_t elf_entry);
 int load_kernel(uint8_t* mem, char* path);
 int load_checkpoint(uint8_t* mem, char* path);
+bool open_snapshot(void);
+int load_snapshot(uint8_t* mem);
+void create_snapshot(void);
+void create_coredump(const char* fname);
 void load_migration_data(uint8_t* mem);
 void wait_for_incomming_migration(migration_metadata_t *metadata, uint16_t listen_portno);
 void init_kvm_arch(void);
@@ -129,6 +187,14 @@ int load_kernel(uint8_t* mem, char* path);
 size_t determine_dest_offset(size_t src_addr);
 void determine_dirty_pages(void (*save_page_handler)(void*, size_t, void*, size_t));
 void determine_mem_mappings(free_list_t *alloc_list);
+/* returns the free guest-physical range [start, end) to the host, see uhyve_free_pages_t */
+size_t report_free_range(size_t start, size_t end);
 void virt_to_phys(const size_t virtual_address, size_t* const physical_address, size_t* const physical_address_page_end);
+/* like virt_to_phys(), but with the page tables of a vCPU's CR3 */
+void virt_to_phys_root(const size_t cr3, const size_t virtual_address, size_t* const physical_address, size_t* const physical_address_page_end);
+void virt_to_phys_flush(void);
+/* reports the mappings of the page tables at root (the CR3 of a vCPU) */
+void walk_guest_mappings(uint64_t root, void (*handler)(uint64_t virt, uint64_t phys, uint64_t size, void* arg), void* arg);
+void vcpu_throttle(uint32_t percent);
 
 #endif
@@ -33,6 +33,8 @@
 #include <string.h>
 #include <errno.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "uhyve-common.h"
 
@@ -173,3 +175,50 @@ ssize_t pread_in_full(int fd, void *buf, size_t count, off_t offset)
 
 	return total;
 }
+
+ssize_t pwrite_in_full(int fd, const void *buf, size_t count, off_t offset)
+{
+	ssize_t total = 0;
+	const char *p = buf;
+
+	if (count > SSIZE_MAX) {
+		errno = E2BIG;
+		return -1;
+	}
+
+	while (count > 0) {
+		ssize_t nr;
+
+		nr = pwrite(fd, p, count, offset);
+		if (nr == -1 && errno == EINTR)
+			continue;
+		else if (nr == -1)
+			return -1;
+
+		count -= nr;
+		total += nr;
+		p += nr;
+		offset += nr;
+	}
+
+	return total;
+}
+
+/*
+ * Creates a thread, which blocks all signals. The checkpoint timer and
+ * the signals of the vCPUs are delivered to the vCPU threads, e.g.
+ * timer_handler() joins the compaction thread and must not run on it.
+ */
+int create_helper_thread(pthread_t *thread, void *(*start)(void *), void *arg)
+{
+	sigset_t signal_mask, old_mask;
+	int ret;
+
+	// the new thread inherits the signal mask of its creator
+	sigfillset(&signal_mask);
+	pthread_sigmask(SIG_BLOCK, &signal_mask, &old_mask);
+	ret = pthread_create(thread, NULL, start, arg);
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	return ret;
+}